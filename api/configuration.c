@@ -41,6 +41,12 @@ static_assert(
 static_assert(
     RTL_FIELD_SIZE(WG_IOCTL_INTERFACE, PeersCount) == RTL_FIELD_SIZE(WIREGUARD_INTERFACE, PeersCount),
     "Interface->PeersCount struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_INTERFACE, PeerHomeCpus) == offsetof(WIREGUARD_INTERFACE, PeerHomeCpus),
+    "Interface->PeerHomeCpus struct mismatch");
+static_assert(
+    RTL_FIELD_SIZE(WG_IOCTL_INTERFACE, PeerHomeCpus) == RTL_FIELD_SIZE(WIREGUARD_INTERFACE, PeerHomeCpus),
+    "Interface->PeerHomeCpus struct mismatch");
 static_assert(
     WG_IOCTL_INTERFACE_HAS_PUBLIC_KEY == WIREGUARD_INTERFACE_HAS_PUBLIC_KEY,
     "INTERFACE_HAS_PUBLIC_KEY flag mismatch");
@@ -53,6 +59,9 @@ static_assert(
 static_assert(
     WG_IOCTL_INTERFACE_REPLACE_PEERS == WIREGUARD_INTERFACE_REPLACE_PEERS,
     "INTERFACE_REPLACE_PEERS flag mismatch");
+static_assert(
+    WG_IOCTL_INTERFACE_HAS_PEER_HOME_CPUS == WIREGUARD_INTERFACE_HAS_PEER_HOME_CPUS,
+    "INTERFACE_HAS_PEER_HOME_CPUS flag mismatch");
 static_assert(sizeof(WG_IOCTL_PEER) == sizeof(WIREGUARD_PEER), "Peer struct mismatch");
 static_assert(offsetof(WG_IOCTL_PEER, Flags) == offsetof(WIREGUARD_PEER, Flags), "Peer->Flags struct mismatch");
 static_assert(
@@ -114,6 +123,10 @@ static_assert(
 static_assert(
     RTL_FIELD_SIZE(WG_IOCTL_PEER, ConstantPacketSize) == RTL_FIELD_SIZE(WIREGUARD_PEER, ConstantPacketSize),
     "Peer->ConstantPacketSize struct mismatch");
+static_assert(offsetof(WG_IOCTL_PEER, Weight) == offsetof(WIREGUARD_PEER, Weight), "Peer->Weight struct mismatch");
+static_assert(
+    RTL_FIELD_SIZE(WG_IOCTL_PEER, Weight) == RTL_FIELD_SIZE(WIREGUARD_PEER, Weight),
+    "Peer->Weight struct mismatch");
 static_assert(WG_IOCTL_PEER_HAS_PUBLIC_KEY == WIREGUARD_PEER_HAS_PUBLIC_KEY, "PEER_HAS_PUBLIC_KEY flag mismatch");
 static_assert(
     WG_IOCTL_PEER_HAS_PRESHARED_KEY == WIREGUARD_PEER_HAS_PRESHARED_KEY,
@@ -128,6 +141,7 @@ static_assert(
 static_assert(WG_IOCTL_PEER_REMOVE == WIREGUARD_PEER_REMOVE, "PEER_REMOVE flag mismatch");
 static_assert(WG_IOCTL_PEER_UPDATE == WIREGUARD_PEER_UPDATE, "PEER_UPDATE flag mismatch");
 static_assert(WG_IOCTL_PEER_HAS_CONSTANT_PACKET_SIZE == WIREGUARD_PEER_HAS_CONSTANT_PACKET_SIZE, "PEER_HAS_CONSTANT_PACKET_SIZE flag mismatch");
+static_assert(WG_IOCTL_PEER_HAS_WEIGHT == WIREGUARD_PEER_HAS_WEIGHT, "PEER_HAS_WEIGHT flag mismatch");
 static_assert(sizeof(WG_IOCTL_ALLOWED_IP) == sizeof(WIREGUARD_ALLOWED_IP), "Allowed IP struct mismatch");
 static_assert(
     offsetof(WG_IOCTL_ALLOWED_IP, AddressFamily) == offsetof(WIREGUARD_ALLOWED_IP, AddressFamily),
@@ -162,6 +176,42 @@ static_assert(
 static_assert(sizeof(WG_IOCTL_ADAPTER_STATE) == sizeof(WIREGUARD_ADAPTER_STATE), "Adapter state mismatch");
 static_assert(WG_IOCTL_ADAPTER_STATE_DOWN == WIREGUARD_ADAPTER_STATE_DOWN, "Adapter state down mismatch");
 static_assert(WG_IOCTL_ADAPTER_STATE_UP == WIREGUARD_ADAPTER_STATE_UP, "Adapter state up mismatch");
+static_assert(sizeof(WG_IOCTL_CRYPTO_PRIMITIVE) == sizeof(WIREGUARD_CRYPTO_PRIMITIVE), "Crypto struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_CRYPTO_PRIMITIVE, Override) == offsetof(WIREGUARD_CRYPTO_PRIMITIVE, Override),
+    "Crypto->Override struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_CRYPTO_PRIMITIVE, Active) == offsetof(WIREGUARD_CRYPTO_PRIMITIVE, Active),
+    "Crypto->Active struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_CRYPTO_PRIMITIVE, Bytes) == offsetof(WIREGUARD_CRYPTO_PRIMITIVE, Bytes),
+    "Crypto->Bytes struct mismatch");
+static_assert(WG_IOCTL_CRYPTO_PRIMITIVE_COUNT == WIREGUARD_CRYPTO_PRIMITIVE_COUNT, "CRYPTO_PRIMITIVE_COUNT mismatch");
+static_assert(WG_IOCTL_CRYPTO_CURVE25519 == WIREGUARD_CRYPTO_CURVE25519, "CRYPTO_CURVE25519 mismatch");
+static_assert(WG_IOCTL_CRYPTO_IMPL_COUNT == WIREGUARD_CRYPTO_IMPL_COUNT, "CRYPTO_IMPL_COUNT mismatch");
+static_assert(WG_IOCTL_CRYPTO_IMPL_BMI2 == WIREGUARD_CRYPTO_IMPL_BMI2, "CRYPTO_IMPL_BMI2 mismatch");
+static_assert(WG_IOCTL_CRYPTO_HAS_OVERRIDE == WIREGUARD_CRYPTO_HAS_OVERRIDE, "CRYPTO_HAS_OVERRIDE flag mismatch");
+static_assert(sizeof(WG_IOCTL_QUEUE_LIMITS) == sizeof(WIREGUARD_QUEUE_LIMITS), "Queue limits struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_QUEUE_LIMITS, AutoTune) == offsetof(WIREGUARD_QUEUE_LIMITS, AutoTune),
+    "QueueLimits->AutoTune struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_QUEUE_LIMITS, Limit) == offsetof(WIREGUARD_QUEUE_LIMITS, Limit),
+    "QueueLimits->Limit struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_QUEUE_LIMITS, XmitPacketsPerRound) == offsetof(WIREGUARD_QUEUE_LIMITS, XmitPacketsPerRound),
+    "QueueLimits->XmitPacketsPerRound struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_QUEUE_LIMITS, Drops) == offsetof(WIREGUARD_QUEUE_LIMITS, Drops),
+    "QueueLimits->Drops struct mismatch");
+static_assert(WG_IOCTL_QUEUE_KIND_COUNT == WIREGUARD_QUEUE_KIND_COUNT, "QUEUE_KIND_COUNT mismatch");
+static_assert(
+    WG_IOCTL_QUEUE_LIMITS_HAS_AUTO_TUNE == WIREGUARD_QUEUE_LIMITS_HAS_AUTO_TUNE,
+    "QUEUE_LIMITS_HAS_AUTO_TUNE flag mismatch");
+static_assert(sizeof(WG_IOCTL_PEER_STATS) == sizeof(WIREGUARD_PEER_STATS), "Peer stats struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, EndpointChanges) == offsetof(WIREGUARD_PEER_STATS, EndpointChanges),
+    "PeerStats->EndpointChanges struct mismatch");
 
 WIREGUARD_SET_ADAPTER_STATE_FUNC WireGuardSetAdapterState;
 _Use_decl_annotations_
@@ -251,3 +301,108 @@ WireGuardGetConfiguration(WIREGUARD_ADAPTER *Adapter, WIREGUARD_INTERFACE *Confi
     CloseHandle(ControlFile);
     return TRUE;
 }
+
+WIREGUARD_SET_PEER_TX_RATE_FUNC WireGuardSetPeerTxRate;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardSetPeerTxRate(WIREGUARD_ADAPTER *Adapter, const BYTE *PublicKey, DWORD64 BytesPerSecond)
+{
+    WG_IOCTL_PEER_TX_RATE Rate = { .Flags = WG_IOCTL_PEER_TX_RATE_HAS_LIMIT, .Limit = BytesPerSecond };
+    memcpy(Rate.PublicKey, PublicKey, sizeof(Rate.PublicKey));
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD Bytes;
+    if (!DeviceIoControl(ControlFile, WG_IOCTL_SET_PEER_TX_RATE, &Rate, sizeof(Rate), NULL, 0, &Bytes, NULL))
+    {
+        DWORD LastError = GetLastError();
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
+
+WIREGUARD_GET_PEER_STATS_FUNC WireGuardGetPeerStats;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardGetPeerStats(WIREGUARD_ADAPTER *Adapter, WIREGUARD_PEER_STATS *Stats)
+{
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD Bytes;
+    if (!DeviceIoControl(
+            ControlFile, WG_IOCTL_GET_PEER_STATS, Stats, sizeof(*Stats), Stats, sizeof(*Stats), &Bytes, NULL))
+    {
+        DWORD LastError = GetLastError();
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
+
+WIREGUARD_SET_CRYPTO_FUNC WireGuardSetCrypto;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardSetCrypto(
+    WIREGUARD_ADAPTER *Adapter,
+    const WIREGUARD_CRYPTO_PRIMITIVE *Primitives,
+    WIREGUARD_CRYPTO_PRIMITIVE *Result)
+{
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD Bytes;
+    if (!DeviceIoControl(
+            ControlFile,
+            WG_IOCTL_CRYPTO,
+            (VOID *)Primitives,
+            Primitives ? WIREGUARD_CRYPTO_PRIMITIVE_COUNT * sizeof(*Primitives) : 0,
+            Result,
+            Result ? WIREGUARD_CRYPTO_PRIMITIVE_COUNT * sizeof(*Result) : 0,
+            &Bytes,
+            NULL))
+    {
+        DWORD LastError = GetLastError();
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
+
+WIREGUARD_SET_QUEUE_LIMITS_FUNC WireGuardSetQueueLimits;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardSetQueueLimits(
+    WIREGUARD_ADAPTER *Adapter,
+    const WIREGUARD_QUEUE_LIMITS *Limits,
+    WIREGUARD_QUEUE_LIMITS *Result)
+{
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD Bytes;
+    if (!DeviceIoControl(
+            ControlFile,
+            WG_IOCTL_SET_QUEUE_LIMITS,
+            (VOID *)Limits,
+            Limits ? sizeof(*Limits) : 0,
+            Result,
+            Result ? sizeof(*Result) : 0,
+            &Bytes,
+            NULL))
+    {
+        DWORD LastError = GetLastError();
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
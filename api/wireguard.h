@@ -230,7 +230,8 @@ typedef enum
     WIREGUARD_PEER_REPLACE_ALLOWED_IPS = 1 << 5,      /**< Remove all allowed IPs before adding new ones */
     WIREGUARD_PEER_REMOVE = 1 << 6,                   /**< Remove specified peer */
     WIREGUARD_PEER_UPDATE = 1 << 7,                   /**< Do not add a new peer */
-    WIREGUARD_PEER_HAS_CONSTANT_PACKET_SIZE = 1 << 8  /**< The ConstantPacketSize field is set */
+    WIREGUARD_PEER_HAS_CONSTANT_PACKET_SIZE = 1 << 8, /**< The ConstantPacketSize field is set */
+    WIREGUARD_PEER_HAS_WEIGHT = 1 << 9                /**< The Weight field is set */
 } WIREGUARD_PEER_FLAG;
 
 typedef struct _WIREGUARD_PEER WIREGUARD_PEER;
@@ -247,14 +248,16 @@ struct ALIGNED(8) _WIREGUARD_PEER
     DWORD64 LastHandshake;                   /**< Time of the last handshake, in 100ns intervals since 1601-01-01 UTC */
     DWORD AllowedIPsCount;                   /**< Number of allowed IP structs following this struct */
     BOOLEAN ConstantPacketSize;              /**< Constant packet size. Smaller packets are padded up to the MTU */
+    WORD Weight;                             /**< Relative share of sending, not of encryption, 1 to 256 */
 };
 
 typedef enum
 {
-    WIREGUARD_INTERFACE_HAS_PUBLIC_KEY = (1 << 0),  /**< The PublicKey field is set */
-    WIREGUARD_INTERFACE_HAS_PRIVATE_KEY = (1 << 1), /**< The PrivateKey field is set */
-    WIREGUARD_INTERFACE_HAS_LISTEN_PORT = (1 << 2), /**< The ListenPort field is set */
-    WIREGUARD_INTERFACE_REPLACE_PEERS = (1 << 3)    /**< Remove all peers before adding new ones */
+    WIREGUARD_INTERFACE_HAS_PUBLIC_KEY = (1 << 0),    /**< The PublicKey field is set */
+    WIREGUARD_INTERFACE_HAS_PRIVATE_KEY = (1 << 1),   /**< The PrivateKey field is set */
+    WIREGUARD_INTERFACE_HAS_LISTEN_PORT = (1 << 2),   /**< The ListenPort field is set */
+    WIREGUARD_INTERFACE_REPLACE_PEERS = (1 << 3),     /**< Remove all peers before adding new ones */
+    WIREGUARD_INTERFACE_HAS_PEER_HOME_CPUS = (1 << 4) /**< The PeerHomeCpus field is set */
 } WIREGUARD_INTERFACE_FLAG;
 
 typedef struct _WIREGUARD_INTERFACE WIREGUARD_INTERFACE;
@@ -265,6 +268,7 @@ struct ALIGNED(8) _WIREGUARD_INTERFACE
     BYTE PrivateKey[WIREGUARD_KEY_LENGTH]; /**< Private key of interface */
     BYTE PublicKey[WIREGUARD_KEY_LENGTH];  /**< Corresponding public key of private key */
     DWORD PeersCount;                      /**< Number of peer structs following this struct */
+    BOOLEAN PeerHomeCpus;                  /**< Complete each peer's packets on a CPU picked by hashing the peer */
 };
 
 /**
@@ -303,6 +307,156 @@ BOOL(WINAPI WIREGUARD_GET_CONFIGURATION_FUNC)
  _Out_writes_bytes_all_(*Bytes) WIREGUARD_INTERFACE *Config,
  _Inout_ DWORD *Bytes);
 
+/**
+ * Sets the egress rate limit of a peer. The limit is kept by public key, so it may be set before the peer is added
+ * with WireGuardSetConfiguration, and stays when the peer is removed or replaced.
+ *
+ * @param Adapter         Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param PublicKey       Public key of the peer.
+ *
+ * @param BytesPerSecond  Limit in bytes per second, up to 2^40, or 0 for none.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_SET_PEER_TX_RATE_FUNC)
+(_In_ WIREGUARD_ADAPTER_HANDLE Adapter,
+ _In_reads_(WIREGUARD_KEY_LENGTH) const BYTE *PublicKey,
+ _In_ DWORD64 BytesPerSecond);
+
+/**
+ * Cryptographic primitives of which the implementation can be chosen.
+ */
+typedef enum
+{
+    WIREGUARD_CRYPTO_CHACHA20 = 0,
+    WIREGUARD_CRYPTO_POLY1305 = 1,
+    WIREGUARD_CRYPTO_BLAKE2S = 2,
+    WIREGUARD_CRYPTO_CURVE25519 = 3,
+    WIREGUARD_CRYPTO_PRIMITIVE_COUNT = 4
+} WIREGUARD_CRYPTO_PRIMITIVE_ID;
+
+/**
+ * Implementations of the cryptographic primitives. Each primitive has only some of them.
+ */
+typedef enum
+{
+    WIREGUARD_CRYPTO_IMPL_AUTO = 0, /**< Pick the fastest one the CPU supports */
+    WIREGUARD_CRYPTO_IMPL_GENERIC = 1,
+    WIREGUARD_CRYPTO_IMPL_ALU = 2,
+    WIREGUARD_CRYPTO_IMPL_SSSE3 = 3,
+    WIREGUARD_CRYPTO_IMPL_AVX = 4,
+    WIREGUARD_CRYPTO_IMPL_AVX2 = 5,
+    WIREGUARD_CRYPTO_IMPL_AVX512F = 6,
+    WIREGUARD_CRYPTO_IMPL_AVX512VL = 7,
+    WIREGUARD_CRYPTO_IMPL_AVX512IFMA = 8,
+    WIREGUARD_CRYPTO_IMPL_BMI2 = 9,
+    WIREGUARD_CRYPTO_IMPL_COUNT = 10
+} WIREGUARD_CRYPTO_IMPL;
+
+typedef enum
+{
+    WIREGUARD_CRYPTO_HAS_OVERRIDE = 1 << 0 /**< The Override field is set */
+} WIREGUARD_CRYPTO_FLAG;
+
+typedef struct _WIREGUARD_CRYPTO_PRIMITIVE WIREGUARD_CRYPTO_PRIMITIVE;
+struct ALIGNED(8) _WIREGUARD_CRYPTO_PRIMITIVE
+{
+    WIREGUARD_CRYPTO_FLAG Flags;                /**< Bitwise combination of flags */
+    WIREGUARD_CRYPTO_IMPL Override;             /**< Implementation forced, or WIREGUARD_CRYPTO_IMPL_AUTO */
+    WIREGUARD_CRYPTO_IMPL Active;               /**< Implementation used; ignored on input */
+    DWORD64 Bytes[WIREGUARD_CRYPTO_IMPL_COUNT]; /**< Bytes processed by each implementation; ignored on input */
+};
+
+/**
+ * Forces and gets the implementations of the cryptographic primitives. These are shared by all adapters. Before
+ * Windows 10, only the portable implementation of each primitive can be used.
+ *
+ * @param Adapter       Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param Primitives    WIREGUARD_CRYPTO_PRIMITIVE_COUNT primitives, indexed by WIREGUARD_CRYPTO_PRIMITIVE_ID, of
+ *                      which those with WIREGUARD_CRYPTO_HAS_OVERRIDE have their Override applied, or NULL to only
+ *                      get them.
+ *
+ * @param Result        Receives WIREGUARD_CRYPTO_PRIMITIVE_COUNT primitives with their resulting state, or NULL.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_SET_CRYPTO_FUNC)
+(_In_ WIREGUARD_ADAPTER_HANDLE Adapter,
+ _In_reads_opt_(WIREGUARD_CRYPTO_PRIMITIVE_COUNT) const WIREGUARD_CRYPTO_PRIMITIVE *Primitives,
+ _Out_writes_opt_(WIREGUARD_CRYPTO_PRIMITIVE_COUNT) WIREGUARD_CRYPTO_PRIMITIVE *Result);
+
+/**
+ * Kinds of queue of which the length is limited.
+ */
+typedef enum
+{
+    WIREGUARD_QUEUE_PACKETS = 0,    /**< Encrypt and decrypt rings, and each peer's in-order queues */
+    WIREGUARD_QUEUE_STAGED = 1,     /**< Each peer's queue of packets waiting for a session */
+    WIREGUARD_QUEUE_HANDSHAKES = 2, /**< Ring of incoming handshake messages */
+    WIREGUARD_QUEUE_KIND_COUNT = 3
+} WIREGUARD_QUEUE_KIND;
+
+typedef enum
+{
+    WIREGUARD_QUEUE_LIMITS_HAS_AUTO_TUNE = 1 << 0 /**< The AutoTune field is set */
+} WIREGUARD_QUEUE_LIMITS_FLAG;
+
+typedef struct _WIREGUARD_QUEUE_LIMITS WIREGUARD_QUEUE_LIMITS;
+struct ALIGNED(8) _WIREGUARD_QUEUE_LIMITS
+{
+    WIREGUARD_QUEUE_LIMITS_FLAG Flags;         /**< Bitwise combination of flags */
+    BOOLEAN AutoTune;                          /**< Grow limits of queues that drop, shrink those that stay short */
+    DWORD Limit[WIREGUARD_QUEUE_KIND_COUNT];   /**< In packets from 16 to 16384, or 0 to leave it as it is */
+    DWORD XmitPacketsPerRound;                 /**< Packets completed for a peer before the next, or 0 to leave it */
+    DWORD64 Drops[WIREGUARD_QUEUE_KIND_COUNT]; /**< Packets dropped because the queue was full; ignored on input */
+};
+
+/**
+ * Sets and gets the queue limits of the WireGuard adapter. AutoTune derives XmitPacketsPerRound from the packet limit
+ * until XmitPacketsPerRound is set.
+ *
+ * @param Adapter       Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param Limits        Limits to set, of which those that are zero are left as they are, or NULL to only get them.
+ *
+ * @param Result        Receives the resulting limits, or NULL.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_SET_QUEUE_LIMITS_FUNC)
+(_In_ WIREGUARD_ADAPTER_HANDLE Adapter,
+ _In_opt_ const WIREGUARD_QUEUE_LIMITS *Limits,
+ _Out_opt_ WIREGUARD_QUEUE_LIMITS *Result);
+
+typedef struct _WIREGUARD_PEER_STATS WIREGUARD_PEER_STATS;
+struct ALIGNED(8) _WIREGUARD_PEER_STATS
+{
+    BYTE PublicKey[WIREGUARD_KEY_LENGTH]; /**< Public key of the peer, filled in by the caller */
+    DWORD64 EndpointChanges;              /**< Number of times the endpoint has moved to a new address or source */
+};
+
+/**
+ * Gets statistics of a peer beyond those in WIREGUARD_PEER.
+ *
+ * @param Adapter       Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param Stats         Statistics of the peer named by Stats->PublicKey.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_GET_PEER_STATS_FUNC)(_In_ WIREGUARD_ADAPTER_HANDLE Adapter, _Inout_ WIREGUARD_PEER_STATS *Stats);
+
 /* Forward declare types defined in daita.h */
 struct _DAITA_ACTION;
 typedef struct _DAITA_ACTION DAITA_ACTION;
@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/*
+ * Host benchmark for the scalar and four-lane AVX2 HSipHash routines of driver/crypto.c, as used by
+ * RatelimiterAllowBatch. The routines are copied below with just enough of the kernel types to build them with gcc
+ * or clang on Linux, and have to be kept in step with the driver by hand. The driver's DBG self-test is what checks
+ * the real ones against each other; this checks the copies the same way before timing them.
+ *
+ *   cc -O2 -mavx2 -o hsiphash bench/hsiphash.c && ./hsiphash
+ */
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef uint32_t ULONG;
+typedef uintptr_t ULONG_PTR;
+#define CONST const
+#define VOID void
+#define min(A, B) ((A) < (B) ? (A) : (B))
+
+enum
+{
+    HSIPHASH_MAX_LANES = 4
+};
+typedef struct _HSIPHASH_KEY
+{
+    ULONG_PTR Key[2];
+} HSIPHASH_KEY;
+
+static inline UINT64
+Rol64(UINT64 Word, unsigned Shift)
+{
+    return (Word << (Shift & 63)) | (Word >> ((-Shift) & 63));
+}
+
+/* From driver/crypto.c: on 64-bit, HalfSiphash1-3 is Siphash1-3. */
+#define HSIPROUND \
+    do \
+    { \
+        V0 += V1; \
+        V1 = Rol64(V1, 13); \
+        V1 ^= V0; \
+        V0 = Rol64(V0, 32); \
+        V2 += V3; \
+        V3 = Rol64(V3, 16); \
+        V3 ^= V2; \
+        V0 += V3; \
+        V3 = Rol64(V3, 21); \
+        V3 ^= V0; \
+        V2 += V1; \
+        V1 = Rol64(V1, 17); \
+        V1 ^= V2; \
+        V2 = Rol64(V2, 32); \
+    } while (0)
+
+#define HPREAMBLE(Len) \
+    UINT64 V0 = 0x736f6d6570736575ULL; \
+    UINT64 V1 = 0x646f72616e646f6dULL; \
+    UINT64 V2 = 0x6c7967656e657261ULL; \
+    UINT64 V3 = 0x7465646279746573ULL; \
+    UINT64 B = ((UINT64)(Len)) << 56; \
+    V3 ^= Key->Key[1]; \
+    V2 ^= Key->Key[0]; \
+    V1 ^= Key->Key[1]; \
+    V0 ^= Key->Key[0];
+
+#define HPOSTAMBLE \
+    V3 ^= B; \
+    HSIPROUND; \
+    V0 ^= B; \
+    V2 ^= 0xff; \
+    HSIPROUND; \
+    HSIPROUND; \
+    HSIPROUND; \
+    return (UINT32)((V0 ^ V1) ^ (V2 ^ V3));
+
+static __attribute__((noinline)) UINT32
+Hsiphash1u32(CONST UINT32 First, CONST HSIPHASH_KEY *Key)
+{
+    HPREAMBLE(4)
+    B |= First;
+    HPOSTAMBLE
+}
+
+static __attribute__((noinline)) UINT32
+Hsiphash2u32(CONST UINT32 First, CONST UINT32 Second, CONST HSIPHASH_KEY *Key)
+{
+    UINT64 Combined = (UINT64)Second << 32 | First;
+    HPREAMBLE(8)
+    V3 ^= Combined;
+    HSIPROUND;
+    V0 ^= Combined;
+    HPOSTAMBLE
+}
+
+/* From driver/crypto.c. */
+static VOID
+HsiphashAVX2x4(UINT32 *Out, CONST UINT32 *First, CONST UINT32 *Second, CONST HSIPHASH_KEY *Key, CONST ULONG Lanes)
+{
+    __attribute__((aligned(32))) UINT64 Words[HSIPHASH_MAX_LANES];
+    __m256i V0, V1, V2, V3, M, B;
+    ULONG i;
+
+#define ROL(X, C) _mm256_or_si256(_mm256_slli_epi64((X), (C)), _mm256_srli_epi64((X), 64 - (C)))
+#define ROL32(X) _mm256_shuffle_epi32((X), _MM_SHUFFLE(2, 3, 0, 1))
+#define HSIPROUNDx4 \
+    do \
+    { \
+        V0 = _mm256_add_epi64(V0, V1); \
+        V1 = ROL(V1, 13); \
+        V1 = _mm256_xor_si256(V1, V0); \
+        V0 = ROL32(V0); \
+        V2 = _mm256_add_epi64(V2, V3); \
+        V3 = ROL(V3, 16); \
+        V3 = _mm256_xor_si256(V3, V2); \
+        V0 = _mm256_add_epi64(V0, V3); \
+        V3 = ROL(V3, 21); \
+        V3 = _mm256_xor_si256(V3, V0); \
+        V2 = _mm256_add_epi64(V2, V1); \
+        V1 = ROL(V1, 17); \
+        V1 = _mm256_xor_si256(V1, V2); \
+        V2 = ROL32(V2); \
+    } while (0)
+
+    if (Lanes == HSIPHASH_MAX_LANES)
+    {
+        CONST __m128i Lo = _mm_loadu_si128((CONST __m128i *)First);
+        CONST __m128i Hi = Second ? _mm_loadu_si128((CONST __m128i *)Second) : _mm_setzero_si128();
+        M = _mm256_set_m128i(_mm_unpackhi_epi32(Lo, Hi), _mm_unpacklo_epi32(Lo, Hi));
+    }
+    else
+    {
+        for (i = 0; i < HSIPHASH_MAX_LANES; ++i)
+        {
+            CONST ULONG Lane = i < Lanes ? i : 0;
+            Words[i] = Second ? (UINT64)Second[Lane] << 32 | First[Lane] : First[Lane];
+        }
+        M = _mm256_load_si256((CONST __m256i *)Words);
+    }
+
+    V0 = _mm256_set1_epi64x(0x736f6d6570736575ULL ^ Key->Key[0]);
+    V1 = _mm256_set1_epi64x(0x646f72616e646f6dULL ^ Key->Key[1]);
+    V2 = _mm256_set1_epi64x(0x6c7967656e657261ULL ^ Key->Key[0]);
+    V3 = _mm256_set1_epi64x(0x7465646279746573ULL ^ Key->Key[1]);
+    if (Second)
+    {
+        B = _mm256_set1_epi64x(8ULL << 56);
+        V3 = _mm256_xor_si256(V3, M);
+        HSIPROUNDx4;
+        V0 = _mm256_xor_si256(V0, M);
+    }
+    else
+        B = _mm256_or_si256(_mm256_set1_epi64x(4ULL << 56), M);
+
+    V3 = _mm256_xor_si256(V3, B);
+    HSIPROUNDx4;
+    V0 = _mm256_xor_si256(V0, B);
+    V2 = _mm256_xor_si256(V2, _mm256_set1_epi64x(0xff));
+    HSIPROUNDx4;
+    HSIPROUNDx4;
+    HSIPROUNDx4;
+    _mm256_store_si256((__m256i *)Words, _mm256_xor_si256(_mm256_xor_si256(V0, V1), _mm256_xor_si256(V2, V3)));
+    for (i = 0; i < Lanes; ++i)
+        Out[i] = (UINT32)Words[i];
+
+#undef HSIPROUNDx4
+#undef ROL32
+#undef ROL
+}
+
+#define BENCH_INPUTS 1024
+#define BENCH_ROUNDS 20000
+
+static double
+Now(VOID)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return Time.tv_sec + Time.tv_nsec * 1e-9;
+}
+
+/* Hashes BENCH_INPUTS first (and second) words BENCH_ROUNDS times, Lanes at a time, returning ns per hash. */
+static double
+Bench(UINT32 *Out, CONST UINT32 *A, CONST UINT32 *B, CONST HSIPHASH_KEY *Key, ULONG Lanes)
+{
+    volatile UINT32 Sink = 0;
+    double Start = Now();
+    for (ULONG Round = 0; Round < BENCH_ROUNDS; ++Round)
+    {
+        for (ULONG i = 0; i < BENCH_INPUTS; i += Lanes)
+        {
+            if (Lanes > 1)
+                HsiphashAVX2x4(Out + i, A + i, B ? B + i : NULL, Key, min(BENCH_INPUTS - i, Lanes));
+            else
+                Out[i] = B ? Hsiphash2u32(A[i], B[i], Key) : Hsiphash1u32(A[i], Key);
+        }
+        Sink += Out[Round % BENCH_INPUTS];
+    }
+    return (Now() - Start) / BENCH_ROUNDS / BENCH_INPUTS * 1e9;
+}
+
+int
+main(VOID)
+{
+    static UINT32 A[BENCH_INPUTS], B[BENCH_INPUTS], Out[BENCH_INPUTS];
+    CONST HSIPHASH_KEY Key = { { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL } };
+    ULONG Bad = 0;
+
+    if (!__builtin_cpu_supports("avx2"))
+    {
+        fprintf(stderr, "AVX2 is not supported on this CPU\n");
+        return 1;
+    }
+    srand(1);
+    for (ULONG i = 0; i < BENCH_INPUTS; ++i)
+    {
+        A[i] = (UINT32)rand();
+        B[i] = (UINT32)rand();
+    }
+    for (ULONG Lanes = 1; Lanes <= HSIPHASH_MAX_LANES; ++Lanes)
+    {
+        HsiphashAVX2x4(Out, A, NULL, &Key, Lanes);
+        for (ULONG i = 0; i < Lanes; ++i)
+            Bad += Out[i] != Hsiphash1u32(A[i], &Key);
+        HsiphashAVX2x4(Out, A, B, &Key, Lanes);
+        for (ULONG i = 0; i < Lanes; ++i)
+            Bad += Out[i] != Hsiphash2u32(A[i], B[i], &Key);
+    }
+    if (Bad)
+    {
+        fprintf(stderr, "%lu lanes disagree with the scalar hash\n", (unsigned long)Bad);
+        return 1;
+    }
+
+    /* Once to warm up, once to report. */
+    for (int Pass = 0; Pass < 2; ++Pass)
+    {
+        double Scalar1 = Bench(Out, A, NULL, &Key, 1), Avx21 = Bench(Out, A, NULL, &Key, HSIPHASH_MAX_LANES);
+        double Scalar2 = Bench(Out, A, B, &Key, 1), Avx22 = Bench(Out, A, B, &Key, HSIPHASH_MAX_LANES);
+        if (!Pass)
+            continue;
+        printf("Hsiphash1u32: scalar %.2f ns, avx2x4 %.2f ns per hash\n", Scalar1, Avx21);
+        printf("Hsiphash2u32: scalar %.2f ns, avx2x4 %.2f ns per hash\n", Scalar2, Avx22);
+    }
+    return 0;
+}
@@ -257,6 +257,27 @@ PtrRingConsume(_Inout_ PTR_RING *Ring)
     return Ptr;
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_lock_not_held_(Ring->ConsumerLock)
+_Must_inspect_result_
+static inline ULONG
+PtrRingConsumeBatched(_Inout_ PTR_RING *Ring, _Out_writes_to_(Count, return) VOID **Array, _In_ ULONG Count)
+{
+    KIRQL Irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Ring->ConsumerLock, &Irql);
+    for (i = 0; i < Count; ++i)
+    {
+        Array[i] = __PtrRingConsume(Ring);
+        if (!Array[i])
+            break;
+    }
+    KeReleaseSpinLock(&Ring->ConsumerLock, Irql);
+
+    return i;
+}
+
 static inline VOID
 __PtrRingSetSize(_Inout_ PTR_RING *Ring, _In_ LONG Size)
 {
@@ -283,6 +304,46 @@ PtrRingInit(_Inout_ PTR_RING *Ring, _In_ LONG Size)
     return STATUS_SUCCESS;
 }
 
+/* Moves what's queued to a new array of Size entries. Fails without losing anything if it doesn't fit. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_lock_not_held_(Ring->ProducerLock)
+_Requires_lock_not_held_(Ring->ConsumerLock)
+_Must_inspect_result_
+static inline NTSTATUS
+PtrRingResize(_Inout_ PTR_RING *Ring, _In_ LONG Size)
+{
+    VOID **Queue = MemAllocateArrayAndZero(Size, sizeof(VOID *)), **OldQueue;
+    if (!Queue)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    NTSTATUS Status = STATUS_BUFFER_TOO_SMALL;
+    KIRQL Irql;
+    KeAcquireSpinLock(&Ring->ConsumerLock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->ProducerLock);
+    /* The slot at the producer is only taken when the ring is full. */
+    LONG Count = Ring->Producer - Ring->ConsumerHead;
+    if (Count < 0)
+        Count += Ring->Size;
+    else if (!Count && Ring->Size && Ring->Queue[Ring->ConsumerHead])
+        Count = Ring->Size;
+    OldQueue = Queue;
+    if (Count > Size)
+        goto out;
+    for (LONG i = 0; i < Count; ++i)
+        Queue[i] = __PtrRingConsume(Ring);
+    OldQueue = Ring->Queue;
+    Ring->Queue = Queue;
+    __PtrRingSetSize(Ring, Size);
+    Ring->Producer = Count == Size ? 0 : Count;
+    Ring->ConsumerHead = Ring->ConsumerTail = 0;
+    Status = STATUS_SUCCESS;
+out:
+    KeReleaseSpinLockFromDpcLevel(&Ring->ProducerLock);
+    KeReleaseSpinLock(&Ring->ConsumerLock, Irql);
+    MemFree(OldQueue);
+    return Status;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static inline VOID
 PtrRingFree(_In_ PTR_RING *Ring)
@@ -398,3 +459,46 @@ NetBufferListInterlockedDequeue(NET_BUFFER_LIST_QUEUE *NblQueue)
     KeReleaseSpinLock(&NblQueue->Lock, Irql);
     return Nbl;
 }
+
+/* Pushes onto a lock-free stack, for any number of producers. Since the only way to pop is to take the whole stack
+ * at once with NetBufferListSpliceStack, there's no ABA to worry about.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+NetBufferListInterlockedPush(_Inout_ PNET_BUFFER_LIST volatile *Stack, __drv_aliasesMem _In_ PNET_BUFFER_LIST Nbl)
+{
+    for (PNET_BUFFER_LIST Top = ReadPointerNoFence(Stack), Old;; Top = Old)
+    {
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = Top;
+        Old = InterlockedCompareExchangePointer(Stack, Nbl, Top);
+        if (Old == Top)
+            return;
+    }
+}
+
+/* Takes everything pushed with NetBufferListInterlockedPush and appends it to NblQueue in the order it was pushed.
+ * Returns the number of NBLs appended.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_lock_held_(NblQueue->Lock)
+static inline ULONG
+NetBufferListSpliceStack(_Inout_ PNET_BUFFER_LIST volatile *Stack, _Inout_ NET_BUFFER_LIST_QUEUE *NblQueue)
+{
+    PNET_BUFFER_LIST Nbl = InterlockedExchangePointer(Stack, NULL), Reversed = NULL, Tail = Nbl;
+    ULONG Count = 0;
+
+    if (!Nbl)
+        return 0;
+    while (Nbl)
+    {
+        PNET_BUFFER_LIST Next = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = Reversed;
+        Reversed = Nbl;
+        Nbl = Next;
+        ++Count;
+    }
+    *(NblQueue->Tail ? &NET_BUFFER_LIST_NEXT_NBL(NblQueue->Tail) : &NblQueue->Head) = Reversed;
+    NblQueue->Tail = Tail;
+    NblQueue->Length += Count;
+    return Count;
+}
@@ -7,7 +7,6 @@
 #include "peer.h"
 #include "device.h"
 #include "messages.h"
-#include "ratelimiter.h"
 #include "timers.h"
 #include "crypto.h"
 #include "queueing.h"
@@ -138,9 +137,68 @@ MakeCookie(
     MuReleasePushLockShared(&Checker->SecretLock);
 }
 
+static inline BOOLEAN
+HasMacs(_In_ CONST NET_BUFFER_LIST *Nbl)
+{
+    return ((MESSAGE_HEADER *)MemGetValidatedNetBufferListData(Nbl))->Type !=
+           CpuToLe32(MESSAGE_TYPE_HANDSHAKE_COOKIE);
+}
+
+_Use_decl_annotations_
+VOID
+CookieCheckMac1Batch(
+    CONST COOKIE_CHECKER *Checker,
+    NET_BUFFER_LIST *CONST *Nbls,
+    ULONG Count,
+    BOOLEAN *Mac1Valid,
+    CONST SIMD_STATE *Simd)
+{
+    UINT8 ComputedMacs[BLAKE2S_MAX_LANES][COOKIE_LEN];
+    UINT8 *Out[BLAKE2S_MAX_LANES];
+    CONST UINT8 *In[BLAKE2S_MAX_LANES];
+    ULONG Lane[BLAKE2S_MAX_LANES];
+    BOOLEAN Done[BLAKE2S_MAX_LANES] = { 0 };
+    ULONG i, j, Lanes, NblLen;
+
+    NT_ASSERT(Count <= BLAKE2S_MAX_LANES);
+    for (i = 0; i < BLAKE2S_MAX_LANES; ++i)
+        Out[i] = ComputedMacs[i];
+
+    /* Initiations and responses have different lengths, so gather each length into its own multi-lane hash. */
+    for (i = 0; i < Count; ++i)
+    {
+        Mac1Valid[i] = FALSE;
+        if (Done[i] || !HasMacs(Nbls[i]))
+            continue;
+        NblLen = NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(Nbls[i]));
+        for (j = i, Lanes = 0; j < Count; ++j)
+        {
+            if (Done[j] || !HasMacs(Nbls[j]) || NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(Nbls[j])) != NblLen)
+                continue;
+            Done[j] = TRUE;
+            In[Lanes] = MemGetValidatedNetBufferListData(Nbls[j]);
+            Lane[Lanes++] = j;
+        }
+        Blake2sMulti(
+            Out,
+            In,
+            Checker->MessageMac1Key,
+            COOKIE_LEN,
+            NblLen - sizeof(MESSAGE_MACS) + FIELD_OFFSET(MESSAGE_MACS, Mac1),
+            NOISE_SYMMETRIC_KEY_LEN,
+            Lanes,
+            Simd);
+        for (j = 0; j < Lanes; ++j)
+        {
+            CONST MESSAGE_MACS *Macs = (CONST MESSAGE_MACS *)(In[j] + NblLen - sizeof(*Macs));
+            Mac1Valid[Lane[j]] = CryptoEqualMemory16(ComputedMacs[j], Macs->Mac1);
+        }
+    }
+}
+
 _Use_decl_annotations_
 COOKIE_MAC_STATE
-CookieValidatePacket(COOKIE_CHECKER *Checker, NET_BUFFER_LIST *Nbl, BOOLEAN CheckCookie)
+CookieValidatePacket(COOKIE_CHECKER *Checker, NET_BUFFER_LIST *Nbl, BOOLEAN Mac1Valid, BOOLEAN CheckCookie)
 {
     CONST ULONG NblLen = NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(Nbl));
     UCHAR *NblData = MemGetValidatedNetBufferListData(Nbl);
@@ -149,9 +207,9 @@ CookieValidatePacket(COOKIE_CHECKER *Checker, NET_BUFFER_LIST *Nbl, BOOLEAN Chec
     UINT8 ComputedMac[COOKIE_LEN];
     UINT8 Cookie[COOKIE_LEN];
 
+    /* MAC1 is checked up front for a whole batch by CookieCheckMac1Batch. */
     Ret = INVALID_MAC;
-    ComputeMac1(ComputedMac, NblData, NblLen, Checker->MessageMac1Key);
-    if (!CryptoEqualMemory16(ComputedMac, Macs->Mac1))
+    if (!Mac1Valid)
         goto out;
 
     Ret = VALID_MAC_BUT_NO_COOKIE;
@@ -165,10 +223,7 @@ CookieValidatePacket(COOKIE_CHECKER *Checker, NET_BUFFER_LIST *Nbl, BOOLEAN Chec
     if (!CryptoEqualMemory16(ComputedMac, Macs->Mac2))
         goto out;
 
-    Ret = VALID_MAC_WITH_COOKIE_BUT_RATELIMITED;
-    if (!RatelimiterAllow(NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl)->RemoteAddress))
-        goto out;
-
+    /* The caller applies the ratelimiter to a whole batch with RatelimiterAllowBatch. */
     Ret = VALID_MAC_WITH_COOKIE;
 
 out:
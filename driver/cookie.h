@@ -55,9 +55,21 @@ _IRQL_requires_max_(APC_LEVEL)
 VOID
 CookieInit(_Out_ COOKIE *Cookie);
 
+VOID
+CookieCheckMac1Batch(
+    _In_ CONST COOKIE_CHECKER *Checker,
+    _In_reads_(Count) NET_BUFFER_LIST *CONST *Nbls,
+    _In_ ULONG Count,
+    _Out_writes_all_(Count) BOOLEAN *Mac1Valid,
+    _In_opt_ CONST SIMD_STATE *Simd);
+
 _Must_inspect_result_
 COOKIE_MAC_STATE
-CookieValidatePacket(_Inout_ COOKIE_CHECKER *Checker, _In_ NET_BUFFER_LIST *Nbl, _In_ BOOLEAN CheckCookie);
+CookieValidatePacket(
+    _Inout_ COOKIE_CHECKER *Checker,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_ BOOLEAN Mac1Valid,
+    _In_ BOOLEAN CheckCookie);
 
 _IRQL_requires_max_(APC_LEVEL)
 VOID
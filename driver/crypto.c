@@ -5,6 +5,7 @@
 
 #include "crypto.h"
 #include "arithmetic.h"
+#include "interlocked.h"
 #include "memory.h"
 
 #pragma warning(disable : 4244)  /* '=': conversion from 'UINT32' to 'UINT8', possible loss of data */
@@ -16,13 +17,135 @@
                                     result to a 8 byte value. Cast the value to the wider type before calling operator \
                                     '*' to avoid overflow (io.2). */
 
+typedef _Function_class_(CURVE25519_FN)
+_Must_inspect_result_
+BOOLEAN
+CURVE25519_FN(
+    _Out_writes_bytes_all_(CURVE25519_KEY_SIZE) UINT8 Out[CURVE25519_KEY_SIZE],
+    _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
+    _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Point[CURVE25519_KEY_SIZE]);
+static CURVE25519_FN Curve25519Generic;
+
+/* Bytes that went through each implementation. These are spread over a few cache lines so that every CPU doesn't
+ * write to the same one, and like the other statistics, they're plain unlocked adds.
+ */
+#define CRYPTO_STATS_SLOTS 64
+typedef struct _CRYPTO_STATS
+{
+    DECLSPEC_CACHEALIGN ULONG64 Bytes[CRYPTO_PRIMITIVE_COUNT][CRYPTO_IMPL_COUNT];
+    ULONG64 XStateSaves;
+    ULONG64 XStatePackets;
+} CRYPTO_STATS;
+static CRYPTO_STATS CryptoStats[CRYPTO_STATS_SLOTS];
+static EX_PUSH_LOCK CryptoDispatchLock;
+
+static FORCEINLINE CRYPTO_STATS *
+CryptoStatsSlot(VOID)
+{
+    return &CryptoStats[KeGetCurrentProcessorIndex() % CRYPTO_STATS_SLOTS];
+}
+
+static FORCEINLINE VOID
+CryptoAccount(_In_ CRYPTO_PRIMITIVE Primitive, _In_ CRYPTO_IMPL Impl, _In_ SIZE_T Bytes)
+{
+    CryptoStatsSlot()->Bytes[Primitive][Impl] += Bytes;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+CryptoReadOverrides(_In_ UNICODE_STRING *RegistryPath);
+#if defined(_M_AMD64)
+static BOOLEAN
+CryptoDetectCpuFeatures(VOID);
+#endif
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, CryptoDriverEntry)
+#    pragma alloc_text(INIT, CryptoReadOverrides)
+#    if defined(_M_AMD64)
+#        pragma alloc_text(INIT, CryptoDetectCpuFeatures)
+#    endif
 #endif
 #if defined(_M_AMD64)
 #    include <intrin.h>
 
 static CPU_FEATURE CpuFeatures;
+static CURVE25519_FN Curve25519Fe51Mul, Curve25519Fe51Mulx;
+
+#    define CPU_FEATURE_SETS (CPU_FEATURE_BMI2 << 1)
+
+typedef struct _CRYPTO_CANDIDATE
+{
+    CRYPTO_IMPL Impl;
+    CPU_FEATURE Requires;
+} CRYPTO_CANDIDATE;
+
+/* Each primitive has a list of implementations, fastest first, with the last one needing nothing special, and a
+ * parallel table of function pointers next to the primitive itself. The choice between them is made up front for
+ * every possible set of CPU features, so that call sites only have to index by the features of their SIMD_STATE,
+ * which might have fewer than CpuFeatures if saving the extended state failed.
+ */
+typedef struct _CRYPTO_DISPATCH
+{
+    CONST CRYPTO_CANDIDATE *Candidates;
+    ULONG NumCandidates;
+    CRYPTO_IMPL Override;
+    UINT8 Choice[CPU_FEATURE_SETS];
+} CRYPTO_DISPATCH;
+
+/* Set on kernels older than Windows 10, which are kept to the last, portable, candidate of every primitive. */
+static BOOLEAN CryptoPortableOnly;
+
+static CONST CRYPTO_CANDIDATE ChaCha20Candidates[] = { { CRYPTO_IMPL_AVX512F, CPU_FEATURE_AVX512F },
+                                                       { CRYPTO_IMPL_AVX512VL, CPU_FEATURE_AVX512VL },
+                                                       { CRYPTO_IMPL_AVX2, CPU_FEATURE_AVX2 },
+                                                       { CRYPTO_IMPL_SSSE3, CPU_FEATURE_SSSE3 },
+                                                       { CRYPTO_IMPL_ALU, 0 } };
+static CONST CRYPTO_CANDIDATE Poly1305Candidates[] = { { CRYPTO_IMPL_AVX512IFMA, CPU_FEATURE_AVX512IFMA },
+                                                       { CRYPTO_IMPL_AVX2, CPU_FEATURE_AVX2 },
+                                                       { CRYPTO_IMPL_AVX, CPU_FEATURE_AVX },
+                                                       { CRYPTO_IMPL_ALU, 0 } };
+static CONST CRYPTO_CANDIDATE Blake2sCandidates[] = { { CRYPTO_IMPL_SSSE3, CPU_FEATURE_SSSE3 },
+                                                      { CRYPTO_IMPL_GENERIC, 0 } };
+static CONST CRYPTO_CANDIDATE Curve25519Candidates[] = { { CRYPTO_IMPL_BMI2, CPU_FEATURE_BMI2 },
+                                                         { CRYPTO_IMPL_ALU, 0 },
+                                                         { CRYPTO_IMPL_GENERIC, 0 } };
+
+static CRYPTO_DISPATCH CryptoDispatch[CRYPTO_PRIMITIVE_COUNT] = {
+    [CRYPTO_PRIMITIVE_CHACHA20] = { ChaCha20Candidates, ARRAYSIZE(ChaCha20Candidates) },
+    [CRYPTO_PRIMITIVE_POLY1305] = { Poly1305Candidates, ARRAYSIZE(Poly1305Candidates) },
+    [CRYPTO_PRIMITIVE_BLAKE2S] = { Blake2sCandidates, ARRAYSIZE(Blake2sCandidates) },
+    [CRYPTO_PRIMITIVE_CURVE25519] = { Curve25519Candidates, ARRAYSIZE(Curve25519Candidates) }
+};
+
+static FORCEINLINE ULONG
+CryptoChoose(_In_ CRYPTO_PRIMITIVE Primitive, _In_ CPU_FEATURE Features)
+{
+    return CryptoDispatch[Primitive].Choice[Features & (CPU_FEATURE_SETS - 1)];
+}
+
+_Requires_lock_held_(CryptoDispatchLock)
+static VOID
+CryptoResolve(_Inout_ CRYPTO_DISPATCH *Dispatch)
+{
+    ULONG First = 0, Features, i;
+
+    if (Dispatch->Override != CRYPTO_IMPL_AUTO)
+    {
+        while (Dispatch->Candidates[First].Impl != Dispatch->Override)
+            ++First;
+    }
+    /* Readers might see a mix of the old and new choices for a moment, which is fine, since any is correct. */
+    for (Features = 0; Features < CPU_FEATURE_SETS; ++Features)
+    {
+        for (i = First; i < Dispatch->NumCandidates - 1; ++i)
+        {
+            if ((Dispatch->Candidates[i].Requires & Features) == Dispatch->Candidates[i].Requires)
+                break;
+        }
+        WriteUCharNoFence(&Dispatch->Choice[Features], (UCHAR)i);
+    }
+}
 
 #    define CPUID_1_ECX_SSSE3_BIT 9
 #    define CPUID_1_ECX_SSSE3_BIT 9
@@ -32,6 +155,7 @@ static CPU_FEATURE CpuFeatures;
 #    define CPUID_1_ECX_AVX_BIT 28
 #    define CPUID_1_ECX_OSXSAVE_BIT 27
 #    define CPUID_70_EBX_AVX2_BIT 5
+#    define CPUID_70_EBX_BMI2_BIT 8
 #    define CPUID_70_EBX_AVX512F_BIT 16
 #    define CPUID_70_EBX_AVX512IFMA_BIT 21
 #    define CPUID_70_EBX_AVX512VL_BIT 31
@@ -55,12 +179,14 @@ static CONST CPUID_BIT_INFO CpuidBitInfo[] = {
     { 1, WORD_ECX, CPUID_1_ECX_SSSE3_BIT, CPU_FEATURE_SSSE3 },
     { 1, WORD_ECX, CPUID_1_ECX_AVX_BIT, CPU_FEATURE_AVX },
     { 7, WORD_EBX, CPUID_70_EBX_AVX2_BIT, CPU_FEATURE_AVX2 },
+    { 7, WORD_EBX, CPUID_70_EBX_BMI2_BIT, CPU_FEATURE_BMI2 },
     { 7, WORD_EBX, CPUID_70_EBX_AVX512F_BIT, CPU_FEATURE_AVX512F },
     { 7, WORD_EBX, CPUID_70_EBX_AVX512IFMA_BIT, CPU_FEATURE_AVX512IFMA },
     { 7, WORD_EBX, CPUID_70_EBX_AVX512VL_BIT, CPU_FEATURE_AVX512VL },
 };
 
-VOID CryptoDriverEntry(VOID)
+static BOOLEAN
+CryptoDetectCpuFeatures(VOID)
 {
     /* It's not like it's exactly hard or complicated to support Windows 7, 8, or 8.1 kernels here,
      * but it also means more testing, and given how poorly suited those old network stacks are for
@@ -69,11 +195,11 @@ VOID CryptoDriverEntry(VOID)
      */
     RTL_OSVERSIONINFOW OsVersionInfo = { .dwOSVersionInfoSize = sizeof(OsVersionInfo) };
     if (!NT_SUCCESS(RtlGetVersion(&OsVersionInfo)) || OsVersionInfo.dwMajorVersion < 10)
-        return;
+        return FALSE;
 
     CPU_FEATURE DisabledCpuFeatures =
         ~(CPU_FEATURE_SSSE3 | CPU_FEATURE_AVX | CPU_FEATURE_AVX2 | CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512VL |
-          CPU_FEATURE_AVX512IFMA);
+          CPU_FEATURE_AVX512IFMA | CPU_FEATURE_BMI2);
     int CpuInfo[4], InfoType, MaxInfoType;
     BOOLEAN IsIntel, IsSkylakeX, HasOSXSAVE;
 
@@ -115,6 +241,7 @@ VOID CryptoDriverEntry(VOID)
         DisabledCpuFeatures |= CPU_FEATURE_AVX512F;
 
     CpuFeatures = ~DisabledCpuFeatures;
+    return TRUE;
 }
 
 _Use_decl_annotations_
@@ -128,7 +255,10 @@ SimdGet(SIMD_STATE *State)
         State->HasSavedXState =
             NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX | XSTATE_MASK_AVX512, &State->XState));
         if (State->HasSavedXState)
+        {
+            ++CryptoStatsSlot()->XStateSaves;
             return;
+        }
         State->CpuFeatures &= ~(CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512VL | CPU_FEATURE_AVX512IFMA);
     }
 
@@ -136,7 +266,10 @@ SimdGet(SIMD_STATE *State)
     {
         State->HasSavedXState = NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &State->XState));
         if (State->HasSavedXState)
+        {
+            ++CryptoStatsSlot()->XStateSaves;
             return;
+        }
         State->CpuFeatures &= ~(CPU_FEATURE_AVX2 | CPU_FEATURE_AVX);
     }
 
@@ -158,9 +291,166 @@ SimdPut(SIMD_STATE *State)
     KeRestoreExtendedProcessorState(&State->XState);
     RtlSecureZeroMemory(State, sizeof(*State));
 }
+
+_Use_decl_annotations_
+VOID
+SimdAccountPackets(CONST SIMD_STATE *State, ULONG Packets)
+{
+    if (State->HasSavedXState)
+        CryptoStatsSlot()->XStatePackets += Packets;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+CryptoSetImplementation(CRYPTO_PRIMITIVE Primitive, CRYPTO_IMPL Impl)
+{
+    CRYPTO_DISPATCH *Dispatch;
+    ULONG i;
+
+    if ((ULONG)Primitive >= CRYPTO_PRIMITIVE_COUNT || (ULONG)Impl >= CRYPTO_IMPL_COUNT)
+        return STATUS_INVALID_PARAMETER;
+    Dispatch = &CryptoDispatch[Primitive];
+    for (i = 0; Impl != CRYPTO_IMPL_AUTO && i < Dispatch->NumCandidates; ++i)
+    {
+        if (Dispatch->Candidates[i].Impl == Impl)
+            break;
+    }
+    if (i == Dispatch->NumCandidates)
+        return STATUS_NOT_SUPPORTED;
+    if (CryptoPortableOnly)
+    {
+        CRYPTO_IMPL Portable = Dispatch->Candidates[Dispatch->NumCandidates - 1].Impl;
+        if (Impl != CRYPTO_IMPL_AUTO && Impl != Portable)
+            return STATUS_NOT_SUPPORTED;
+        Impl = Portable;
+    }
+    MuAcquirePushLockExclusive(&CryptoDispatchLock);
+    Dispatch->Override = Impl;
+    CryptoResolve(Dispatch);
+    MuReleasePushLockExclusive(&CryptoDispatchLock);
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+CryptoGetImplementation(CRYPTO_PRIMITIVE Primitive, CRYPTO_IMPL *Override, CRYPTO_IMPL *Active, ULONG64 Bytes[])
+{
+    CONST CRYPTO_DISPATCH *Dispatch = &CryptoDispatch[Primitive];
+    ULONG i, j;
+
+    MuAcquirePushLockShared(&CryptoDispatchLock);
+    *Override = Dispatch->Override;
+    *Active = Dispatch->Candidates[CryptoChoose(Primitive, CpuFeatures)].Impl;
+    MuReleasePushLockShared(&CryptoDispatchLock);
+    for (i = 0; i < CRYPTO_IMPL_COUNT; ++i)
+    {
+        Bytes[i] = 0;
+        for (j = 0; j < CRYPTO_STATS_SLOTS; ++j)
+            Bytes[i] += ReadULong64NoFence(&CryptoStats[j].Bytes[Primitive][i]);
+    }
+}
 #else
-VOID CryptoDriverEntry(VOID) {}
+static CRYPTO_IMPL CryptoOverride[CRYPTO_PRIMITIVE_COUNT];
+
+_Use_decl_annotations_
+NTSTATUS
+CryptoSetImplementation(CRYPTO_PRIMITIVE Primitive, CRYPTO_IMPL Impl)
+{
+    if ((ULONG)Primitive >= CRYPTO_PRIMITIVE_COUNT || (ULONG)Impl >= CRYPTO_IMPL_COUNT)
+        return STATUS_INVALID_PARAMETER;
+    if (Impl != CRYPTO_IMPL_AUTO && Impl != CRYPTO_IMPL_GENERIC)
+        return STATUS_NOT_SUPPORTED;
+    WriteNoFence((LONG *)&CryptoOverride[Primitive], Impl);
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+CryptoGetImplementation(CRYPTO_PRIMITIVE Primitive, CRYPTO_IMPL *Override, CRYPTO_IMPL *Active, ULONG64 Bytes[])
+{
+    ULONG i, j;
+
+    *Override = ReadNoFence((LONG *)&CryptoOverride[Primitive]);
+    *Active = CRYPTO_IMPL_GENERIC;
+    for (i = 0; i < CRYPTO_IMPL_COUNT; ++i)
+    {
+        Bytes[i] = 0;
+        for (j = 0; j < CRYPTO_STATS_SLOTS; ++j)
+            Bytes[i] += ReadULong64NoFence(&CryptoStats[j].Bytes[Primitive][i]);
+    }
+}
+#endif
+
+_Use_decl_annotations_
+VOID
+CryptoGetSimdStats(ULONG64 *XStateSaves, ULONG64 *XStatePackets)
+{
+    *XStateSaves = *XStatePackets = 0;
+    for (ULONG i = 0; i < CRYPTO_STATS_SLOTS; ++i)
+    {
+        *XStateSaves += ReadULong64NoFence(&CryptoStats[i].XStateSaves);
+        *XStatePackets += ReadULong64NoFence(&CryptoStats[i].XStatePackets);
+    }
+}
+
+/* Overrides can be given as REG_DWORDs holding a CRYPTO_IMPL under the Parameters subkey of the service key. */
+_Use_decl_annotations_
+static VOID
+CryptoReadOverrides(UNICODE_STRING *RegistryPath)
+{
+    static CONST PWSTR ValueNames[CRYPTO_PRIMITIVE_COUNT] = { [CRYPTO_PRIMITIVE_CHACHA20] = L"ChaCha20Implementation",
+                                                              [CRYPTO_PRIMITIVE_POLY1305] = L"Poly1305Implementation",
+                                                              [CRYPTO_PRIMITIVE_BLAKE2S] = L"Blake2sImplementation",
+                                                              [CRYPTO_PRIMITIVE_CURVE25519] =
+                                                                  L"Curve25519Implementation" };
+    RTL_QUERY_REGISTRY_TABLE Table[CRYPTO_PRIMITIVE_COUNT + 2] = { 0 };
+    ULONG Impl[CRYPTO_PRIMITIVE_COUNT] = { 0 };
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    HANDLE Key;
+    ULONG i;
+
+    InitializeObjectAttributes(&ObjectAttributes, RegistryPath, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+    if (!NT_SUCCESS(ZwOpenKey(&Key, KEY_READ, &ObjectAttributes)))
+        return;
+    Table[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+    Table[0].Name = L"Parameters";
+    for (i = 0; i < CRYPTO_PRIMITIVE_COUNT; ++i)
+    {
+        Table[i + 1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+        Table[i + 1].Name = ValueNames[i];
+        Table[i + 1].EntryContext = &Impl[i];
+        Table[i + 1].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    }
+    if (NT_SUCCESS(RtlQueryRegistryValues(RTL_REGISTRY_HANDLE, (PCWSTR)Key, Table, NULL, NULL)))
+    {
+        for (i = 0; i < CRYPTO_PRIMITIVE_COUNT; ++i)
+        {
+            if (Impl[i] != CRYPTO_IMPL_AUTO)
+                (VOID) CryptoSetImplementation(i, Impl[i]);
+        }
+    }
+    ZwClose(Key);
+}
+
+_Use_decl_annotations_
+VOID
+CryptoDriverEntry(UNICODE_STRING *RegistryPath)
+{
+    MuInitializePushLock(&CryptoDispatchLock);
+#if defined(_M_AMD64)
+    CryptoPortableOnly = !CryptoDetectCpuFeatures();
+    MuAcquirePushLockExclusive(&CryptoDispatchLock);
+    for (ULONG i = 0; i < CRYPTO_PRIMITIVE_COUNT; ++i)
+    {
+        /* Old kernels get the portable implementations of everything, which CryptoSetImplementation keeps to. */
+        if (CryptoPortableOnly)
+            CryptoDispatch[i].Override = CryptoDispatch[i].Candidates[CryptoDispatch[i].NumCandidates - 1].Impl;
+        CryptoResolve(&CryptoDispatch[i]);
+    }
+    MuReleasePushLockExclusive(&CryptoDispatchLock);
 #endif
+    CryptoReadOverrides(RegistryPath);
+}
 
 static inline UINT32
 Rol32(_In_ UINT32 Word, _In_ LONG Shift)
@@ -207,6 +497,13 @@ PutUnalignedLe32(_In_ UINT32 S, _Out_writes_bytes_all_(4) UINT8 *D)
     RtlCopyMemory(D, &L, sizeof(L));
 }
 
+static inline VOID
+PutUnalignedLe64(_In_ UINT64 S, _Out_writes_bytes_all_(8) UINT8 *D)
+{
+    UINT64 L = CpuToLe64(S);
+    RtlCopyMemory(D, &L, sizeof(L));
+}
+
 static inline VOID
 CpuToLe32Array(_Inout_updates_(Words) UINT32 *Buf, _In_ SIZE_T Words)
 {
@@ -331,41 +628,21 @@ ChaCha20Init(_Out_ CHACHA20_CTX *Ctx, _In_ CONST UINT8 Key[CHACHA20_KEY_SIZE], _
 }
 
 #if defined(_M_AMD64)
+typedef _Function_class_(CHACHA20_FN)
 VOID
-ChaCha20ALU(
-    _Out_writes_bytes_all_(Len) UINT8 *Dst,
-    _In_reads_bytes_(Len) CONST UINT8 *Src,
-    _In_ SIZE_T Len,
-    _In_ CONST UINT32 Key[8],
-    _In_ CONST UINT32 Counter[4]);
-VOID
-ChaCha20SSSE3(
-    _Out_writes_bytes_all_(Len) UINT8 *Dst,
-    _In_reads_bytes_(Len) CONST UINT8 *Src,
-    _In_ SIZE_T Len,
-    _In_ CONST UINT32 Key[8],
-    _In_ CONST UINT32 Counter[4]);
-VOID
-ChaCha20AVX2(
-    _Out_writes_bytes_all_(Len) UINT8 *Dst,
-    _In_reads_bytes_(Len) CONST UINT8 *Src,
-    _In_ SIZE_T Len,
-    _In_ CONST UINT32 Key[8],
-    _In_ CONST UINT32 Counter[4]);
-VOID
-ChaCha20AVX512(
-    _Out_writes_bytes_all_(Len) UINT8 *Dst,
-    _In_reads_bytes_(Len) CONST UINT8 *Src,
-    _In_ SIZE_T Len,
-    _In_ CONST UINT32 Key[8],
-    _In_ CONST UINT32 Counter[4]);
-VOID
-ChaCha20AVX512VL(
+CHACHA20_FN(
     _Out_writes_bytes_all_(Len) UINT8 *Dst,
     _In_reads_bytes_(Len) CONST UINT8 *Src,
     _In_ SIZE_T Len,
     _In_ CONST UINT32 Key[8],
     _In_ CONST UINT32 Counter[4]);
+CHACHA20_FN ChaCha20ALU, ChaCha20SSSE3, ChaCha20AVX2, ChaCha20AVX512, ChaCha20AVX512VL;
+
+/* In the same order as ChaCha20Candidates. */
+static CHACHA20_FN *CONST ChaCha20Impls[] = {
+    ChaCha20AVX512, ChaCha20AVX512VL, ChaCha20AVX2, ChaCha20SSSE3, ChaCha20ALU
+};
+static_assert(ARRAYSIZE(ChaCha20Impls) == ARRAYSIZE(ChaCha20Candidates), "ChaCha20 tables out of sync");
 
 static VOID
 ChaCha20(
@@ -377,16 +654,9 @@ ChaCha20(
 {
     if (!Len)
         return;
-    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX512F))
-        ChaCha20AVX512(Out, In, Len, Ctx->Key, Ctx->Counter);
-    else if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX512VL))
-        ChaCha20AVX512VL(Out, In, Len, Ctx->Key, Ctx->Counter);
-    else if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX2))
-        ChaCha20AVX2(Out, In, Len, Ctx->Key, Ctx->Counter);
-    else if ((Simd && (Simd->CpuFeatures & CPU_FEATURE_SSSE3)) || (!Simd && (CpuFeatures & CPU_FEATURE_SSSE3)))
-        ChaCha20SSSE3(Out, In, Len, Ctx->Key, Ctx->Counter);
-    else
-        ChaCha20ALU(Out, In, Len, Ctx->Key, Ctx->Counter);
+    ULONG Choice = CryptoChoose(CRYPTO_PRIMITIVE_CHACHA20, Simd ? Simd->CpuFeatures : CpuFeatures & CPU_FEATURE_SSSE3);
+    ChaCha20Impls[Choice](Out, In, Len, Ctx->Key, Ctx->Counter);
+    CryptoAccount(CRYPTO_PRIMITIVE_CHACHA20, ChaCha20Candidates[Choice].Impl, Len);
     Ctx->Counter[0] += (Len + 63) / 64;
 }
 
@@ -430,6 +700,7 @@ ChaCha20(
 {
     UINT32 Buf[CHACHA20_BLOCK_WORDS];
 
+    CryptoAccount(CRYPTO_PRIMITIVE_CHACHA20, CRYPTO_IMPL_GENERIC, Len);
     while (Len >= CHACHA20_BLOCK_SIZE)
     {
         ChaCha20Block(Ctx, Buf, Simd);
@@ -542,13 +813,41 @@ Poly1305EmitAVX512IFMA(
     _Out_writes_bytes_all_(POLY1305_MAC_SIZE) UINT8 Mac[POLY1305_MAC_SIZE],
     _In_ CONST UINT32 Nonce[4]);
 
+typedef struct _POLY1305_IMPL
+{
+    VOID (*Init)(_Out_ POLY1305_INTERNAL *Ctx, _In_ CONST UINT8 Key[POLY1305_BLOCK_SIZE]);
+    VOID (*Blocks)(
+        _Inout_ POLY1305_INTERNAL *Ctx,
+        _In_reads_bytes_(Len) CONST UINT8 *In,
+        _In_ CONST SIZE_T Len,
+        _In_ CONST UINT32 PadBit);
+    VOID (*Emit)(
+        _In_ CONST POLY1305_INTERNAL *Ctx,
+        _Out_writes_bytes_all_(POLY1305_MAC_SIZE) UINT8 Mac[POLY1305_MAC_SIZE],
+        _In_ CONST UINT32 Nonce[4]);
+} POLY1305_IMPL;
+
+/* In the same order as Poly1305Candidates. Only IFMA has its own state layout, so everything else shares the ALU
+ * Init and Emit, with the vector Blocks functions converting the state as needed.
+ */
+static CONST POLY1305_IMPL Poly1305Impls[] = {
+    { Poly1305InitAVX512IFMA, Poly1305BlocksAVX512IFMA, Poly1305EmitAVX512IFMA },
+    { Poly1305InitALU, Poly1305BlocksAVX2, Poly1305EmitALU },
+    { Poly1305InitALU, Poly1305BlocksAVX, Poly1305EmitALU },
+    { Poly1305InitALU, Poly1305BlocksALU, Poly1305EmitALU }
+};
+static_assert(ARRAYSIZE(Poly1305Impls) == ARRAYSIZE(Poly1305Candidates), "Poly1305 tables out of sync");
+
+static FORCEINLINE ULONG
+Poly1305Choose(_In_opt_ CONST SIMD_STATE *Simd)
+{
+    return CryptoChoose(CRYPTO_PRIMITIVE_POLY1305, Simd ? Simd->CpuFeatures : 0);
+}
+
 static VOID
-Poly1305InitCore(_Out_ POLY1305_INTERNAL *St, _In_ CONST UINT8 Key[16], _In_opt_ CONST SIMD_STATE *Simd)
+Poly1305InitCore(_Out_ POLY1305_INTERNAL *St, _In_ CONST UINT8 Key[16], _In_ ULONG Impl)
 {
-    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX512IFMA))
-        Poly1305InitAVX512IFMA(St, Key);
-    else
-        Poly1305InitALU(St, Key);
+    Poly1305Impls[Impl].Init(St, Key);
 }
 
 static VOID
@@ -557,16 +856,10 @@ Poly1305BlocksCore(
     _In_reads_bytes_(Len) CONST UINT8 *Input,
     _In_ SIZE_T Len,
     _In_ CONST UINT32 PadBit,
-    _In_opt_ CONST SIMD_STATE *Simd)
+    _In_ ULONG Impl)
 {
-    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX512IFMA))
-        Poly1305BlocksAVX512IFMA(St, Input, Len, PadBit);
-    else if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX2))
-        Poly1305BlocksAVX2(St, Input, Len, PadBit);
-    else if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX))
-        Poly1305BlocksAVX(St, Input, Len, PadBit);
-    else
-        Poly1305BlocksALU(St, Input, Len, PadBit);
+    Poly1305Impls[Impl].Blocks(St, Input, Len, PadBit);
+    CryptoAccount(CRYPTO_PRIMITIVE_POLY1305, Poly1305Candidates[Impl].Impl, Len);
 }
 
 static VOID
@@ -574,12 +867,9 @@ Poly1305EmitCore(
     _In_ CONST POLY1305_INTERNAL *St,
     _Out_writes_bytes_all_(16) UINT8 Mac[16],
     _In_ CONST UINT32 Nonce[4],
-    _In_opt_ CONST SIMD_STATE *Simd)
+    _In_ ULONG Impl)
 {
-    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX512IFMA))
-        Poly1305EmitAVX512IFMA(St, Mac, Nonce);
-    else
-        Poly1305EmitALU(St, Mac, Nonce);
+    Poly1305Impls[Impl].Emit(St, Mac, Nonce);
 }
 #else
 typedef struct _POLY1305_INTERNAL
@@ -589,8 +879,14 @@ typedef struct _POLY1305_INTERNAL
     UINT32 S[4];
 } POLY1305_INTERNAL;
 
+static FORCEINLINE ULONG
+Poly1305Choose(_In_opt_ CONST SIMD_STATE *Simd)
+{
+    return 0;
+}
+
 static VOID
-Poly1305InitCore(_Out_ POLY1305_INTERNAL *St, _In_ CONST UINT8 Key[16], _In_opt_ CONST SIMD_STATE *Simd)
+Poly1305InitCore(_Out_ POLY1305_INTERNAL *St, _In_ CONST UINT8 Key[16], _In_ ULONG Impl)
 {
     /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
     St->R[0] = (GetUnalignedLe32(&Key[0])) & 0x3ffffff;
@@ -619,7 +915,7 @@ Poly1305BlocksCore(
     _In_reads_bytes_(Len) CONST UINT8 *Input,
     _In_ SIZE_T Len,
     _In_ CONST UINT32 PadBit,
-    _In_opt_ CONST SIMD_STATE *Simd)
+    _In_ ULONG Impl)
 {
     CONST UINT32 Hibit = PadBit << 24;
     UINT32 R0, R1, R2, R3, R4;
@@ -628,6 +924,8 @@ Poly1305BlocksCore(
     UINT64 D0, D1, D2, D3, D4;
     UINT32 C;
 
+    CryptoAccount(CRYPTO_PRIMITIVE_POLY1305, CRYPTO_IMPL_GENERIC, Len);
+
     R0 = St->R[0];
     R1 = St->R[1];
     R2 = St->R[2];
@@ -697,7 +995,7 @@ Poly1305EmitCore(
     _In_ CONST POLY1305_INTERNAL *St,
     _Out_writes_bytes_all_(16) UINT8 Mac[16],
     _In_ CONST UINT32 Nonce[4],
-    _In_opt_ CONST SIMD_STATE *Simd)
+    _In_ ULONG Impl)
 {
     UINT32 H0, H1, H2, H3, H4, C;
     UINT32 G0, G1, G2, G3, G4;
@@ -786,7 +1084,7 @@ typedef struct _POLY1305_CTX
     UINT32 Nonce[4];
     UINT8 Data[POLY1305_BLOCK_SIZE];
     SIZE_T Num;
-    CONST SIMD_STATE *Simd;
+    ULONG Impl;
 } POLY1305_CTX;
 
 static VOID
@@ -796,9 +1094,9 @@ Poly1305Init(_Out_ POLY1305_CTX *Ctx, _In_ CONST UINT8 Key[POLY1305_KEY_SIZE], _
     Ctx->Nonce[1] = GetUnalignedLe32(&Key[20]);
     Ctx->Nonce[2] = GetUnalignedLe32(&Key[24]);
     Ctx->Nonce[3] = GetUnalignedLe32(&Key[28]);
-    Ctx->Simd = Simd;
+    Ctx->Impl = Poly1305Choose(Simd);
 
-    Poly1305InitCore(&Ctx->State, Key, Ctx->Simd);
+    Poly1305InitCore(&Ctx->State, Key, Ctx->Impl);
 
     Ctx->Num = 0;
 }
@@ -819,7 +1117,7 @@ Poly1305Update(_Inout_ POLY1305_CTX *Ctx, _In_reads_bytes_(Len) CONST UINT8 *Inp
             return;
         }
         RtlCopyMemory(Ctx->Data + Num, Input, Rem);
-        Poly1305BlocksCore(&Ctx->State, Ctx->Data, POLY1305_BLOCK_SIZE, 1, Ctx->Simd);
+        Poly1305BlocksCore(&Ctx->State, Ctx->Data, POLY1305_BLOCK_SIZE, 1, Ctx->Impl);
         Input += Rem;
         Len -= Rem;
     }
@@ -829,7 +1127,7 @@ Poly1305Update(_Inout_ POLY1305_CTX *Ctx, _In_reads_bytes_(Len) CONST UINT8 *Inp
 
     if (Len >= POLY1305_BLOCK_SIZE)
     {
-        Poly1305BlocksCore(&Ctx->State, Input, Len, 1, Ctx->Simd);
+        Poly1305BlocksCore(&Ctx->State, Input, Len, 1, Ctx->Impl);
         Input += Len;
     }
 
@@ -849,10 +1147,10 @@ Poly1305Final(_Inout_ POLY1305_CTX *Ctx, _Out_writes_bytes_all_(16) UINT8 Mac[PO
         Ctx->Data[Num++] = 1;
         while (Num < POLY1305_BLOCK_SIZE)
             Ctx->Data[Num++] = 0;
-        Poly1305BlocksCore(&Ctx->State, Ctx->Data, POLY1305_BLOCK_SIZE, 0, Ctx->Simd);
+        Poly1305BlocksCore(&Ctx->State, Ctx->Data, POLY1305_BLOCK_SIZE, 0, Ctx->Impl);
     }
 
-    Poly1305EmitCore(&Ctx->State, Mac, Ctx->Nonce, Ctx->Simd);
+    Poly1305EmitCore(&Ctx->State, Mac, Ctx->Nonce, Ctx->Impl);
 
     RtlSecureZeroMemory(Ctx, sizeof(*Ctx));
 }
@@ -1258,7 +1556,7 @@ Blake2sInitKey(BLAKE2S_STATE *State, CONST SIZE_T OutLen, CONST UINT8 *Key, CONS
 }
 
 static inline VOID
-Blake2sCompress(
+Blake2sCompressGeneric(
     _Inout_ BLAKE2S_STATE *State,
     _In_reads_bytes_(BLAKE2S_BLOCK_SIZE *Nblocks) CONST UINT8 *Block,
     _In_ SIZE_T Nblocks,
@@ -1330,6 +1628,252 @@ Blake2sCompress(
     }
 }
 
+#if defined(_M_AMD64)
+/* One message, with the 4x4 state held as four row vectors and diagonalized between half-rounds. SSSE3 doesn't need
+ * any XSTATE saved, so this is usable from every caller, not just the ones holding a SIMD_STATE.
+ */
+static VOID
+Blake2sCompressSSSE3(
+    _Inout_ BLAKE2S_STATE *State,
+    _In_reads_bytes_(BLAKE2S_BLOCK_SIZE *Nblocks) CONST UINT8 *Block,
+    _In_ SIZE_T Nblocks,
+    _In_ CONST UINT32 Inc)
+{
+    CONST __m128i Rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    CONST __m128i Rot8 = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    CONST __m128i Iv0 = _mm_loadu_si128((CONST __m128i *)&Blake2sIv[0]);
+    CONST __m128i Iv1 = _mm_loadu_si128((CONST __m128i *)&Blake2sIv[4]);
+    __m128i H0 = _mm_loadu_si128((CONST __m128i *)&State->H[0]);
+    __m128i H1 = _mm_loadu_si128((CONST __m128i *)&State->H[4]);
+    __m128i A, B, C, D;
+    UINT32 M[16];
+    LONG R;
+
+    while (Nblocks > 0)
+    {
+        Blake2sIncrementCounter(State, Inc);
+        RtlCopyMemory(M, Block, BLAKE2S_BLOCK_SIZE);
+        Le32ToCpuArray(M, ARRAYSIZE(M));
+        A = H0;
+        B = H1;
+        C = Iv0;
+        D = _mm_xor_si128(Iv1, _mm_setr_epi32(State->T[0], State->T[1], State->F[0], State->F[1]));
+
+#define G(M0, M1) \
+    do \
+    { \
+        A = _mm_add_epi32(_mm_add_epi32(A, B), (M0)); \
+        D = _mm_shuffle_epi8(_mm_xor_si128(D, A), Rot16); \
+        C = _mm_add_epi32(C, D); \
+        B = _mm_xor_si128(B, C); \
+        B = _mm_or_si128(_mm_srli_epi32(B, 12), _mm_slli_epi32(B, 20)); \
+        A = _mm_add_epi32(_mm_add_epi32(A, B), (M1)); \
+        D = _mm_shuffle_epi8(_mm_xor_si128(D, A), Rot8); \
+        C = _mm_add_epi32(C, D); \
+        B = _mm_xor_si128(B, C); \
+        B = _mm_or_si128(_mm_srli_epi32(B, 7), _mm_slli_epi32(B, 25)); \
+    } while (0)
+
+        for (R = 0; R < 10; ++R)
+        {
+            CONST UINT8 *S = Blake2sSigma[R];
+
+            G(_mm_setr_epi32(M[S[0]], M[S[2]], M[S[4]], M[S[6]]), _mm_setr_epi32(M[S[1]], M[S[3]], M[S[5]], M[S[7]]));
+            B = _mm_shuffle_epi32(B, _MM_SHUFFLE(0, 3, 2, 1));
+            C = _mm_shuffle_epi32(C, _MM_SHUFFLE(1, 0, 3, 2));
+            D = _mm_shuffle_epi32(D, _MM_SHUFFLE(2, 1, 0, 3));
+            G(_mm_setr_epi32(M[S[8]], M[S[10]], M[S[12]], M[S[14]]),
+              _mm_setr_epi32(M[S[9]], M[S[11]], M[S[13]], M[S[15]]));
+            B = _mm_shuffle_epi32(B, _MM_SHUFFLE(2, 1, 0, 3));
+            C = _mm_shuffle_epi32(C, _MM_SHUFFLE(1, 0, 3, 2));
+            D = _mm_shuffle_epi32(D, _MM_SHUFFLE(0, 3, 2, 1));
+        }
+
+#undef G
+
+        H0 = _mm_xor_si128(H0, _mm_xor_si128(A, C));
+        H1 = _mm_xor_si128(H1, _mm_xor_si128(B, D));
+
+        Block += BLAKE2S_BLOCK_SIZE;
+        --Nblocks;
+    }
+    _mm_storeu_si128((__m128i *)&State->H[0], H0);
+    _mm_storeu_si128((__m128i *)&State->H[4], H1);
+}
+
+/* In the same order as Blake2sCandidates. */
+static VOID (*CONST Blake2sImpls[])(
+    _Inout_ BLAKE2S_STATE *State,
+    _In_reads_bytes_(BLAKE2S_BLOCK_SIZE *Nblocks) CONST UINT8 *Block,
+    _In_ SIZE_T Nblocks,
+    _In_ CONST UINT32 Inc) = { Blake2sCompressSSSE3, Blake2sCompressGeneric };
+static_assert(ARRAYSIZE(Blake2sImpls) == ARRAYSIZE(Blake2sCandidates), "BLAKE2s tables out of sync");
+#endif
+
+static inline VOID
+Blake2sCompress(
+    _Inout_ BLAKE2S_STATE *State,
+    _In_reads_bytes_(BLAKE2S_BLOCK_SIZE *Nblocks) CONST UINT8 *Block,
+    _In_ SIZE_T Nblocks,
+    _In_ CONST UINT32 Inc)
+{
+#if defined(_M_AMD64)
+    ULONG Choice = CryptoChoose(CRYPTO_PRIMITIVE_BLAKE2S, CpuFeatures);
+    Blake2sImpls[Choice](State, Block, Nblocks, Inc);
+    CryptoAccount(CRYPTO_PRIMITIVE_BLAKE2S, Blake2sCandidates[Choice].Impl, Nblocks * BLAKE2S_BLOCK_SIZE);
+#else
+    Blake2sCompressGeneric(State, Block, Nblocks, Inc);
+    CryptoAccount(CRYPTO_PRIMITIVE_BLAKE2S, CRYPTO_IMPL_GENERIC, Nblocks * BLAKE2S_BLOCK_SIZE);
+#endif
+}
+
+#if defined(_M_AMD64)
+/* Eight independent messages, one per 32-bit lane, so there is no diagonalization shuffling at all. AVX-512VL gives us
+ * a native rotate for the 12 and 7 rotations; the 16 and 8 ones are a byte shuffle either way.
+ */
+static FORCEINLINE VOID
+Blake2sRoundsAVX2x8(_Inout_updates_(16) __m256i V[16], _In_reads_(16) CONST __m256i M[16], _In_ CONST BOOLEAN UseVL)
+{
+    CONST __m256i Rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    CONST __m256i Rot8 = _mm256_setr_epi8(
+        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12, 1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    LONG R;
+
+#define ROR(X, C) \
+    (UseVL ? _mm256_ror_epi32((X), (C)) : _mm256_or_si256(_mm256_srli_epi32((X), (C)), _mm256_slli_epi32((X), 32 - (C))))
+#define G(R, i, A, B, C, D) \
+    do \
+    { \
+        A = _mm256_add_epi32(_mm256_add_epi32(A, B), M[Blake2sSigma[R][2 * i + 0]]); \
+        D = _mm256_shuffle_epi8(_mm256_xor_si256(D, A), Rot16); \
+        C = _mm256_add_epi32(C, D); \
+        B = ROR(_mm256_xor_si256(B, C), 12); \
+        A = _mm256_add_epi32(_mm256_add_epi32(A, B), M[Blake2sSigma[R][2 * i + 1]]); \
+        D = _mm256_shuffle_epi8(_mm256_xor_si256(D, A), Rot8); \
+        C = _mm256_add_epi32(C, D); \
+        B = ROR(_mm256_xor_si256(B, C), 7); \
+    } while (0)
+
+    for (R = 0; R < 10; ++R)
+    {
+        G(R, 0, V[0], V[4], V[8], V[12]);
+        G(R, 1, V[1], V[5], V[9], V[13]);
+        G(R, 2, V[2], V[6], V[10], V[14]);
+        G(R, 3, V[3], V[7], V[11], V[15]);
+        G(R, 4, V[0], V[5], V[10], V[15]);
+        G(R, 5, V[1], V[6], V[11], V[12]);
+        G(R, 6, V[2], V[7], V[8], V[13]);
+        G(R, 7, V[3], V[4], V[9], V[14]);
+    }
+
+#undef G
+#undef ROR
+}
+
+static VOID
+Blake2sAVX2x8(
+    _Out_writes_(Lanes) UINT8 *CONST Out[],
+    _In_reads_(Lanes) CONST UINT8 *CONST In[],
+    _In_reads_bytes_(KeyLen) CONST UINT8 *Key,
+    _In_ CONST SIZE_T OutLen,
+    _In_ CONST SIZE_T InLen,
+    _In_ CONST SIZE_T KeyLen,
+    _In_ CONST ULONG Lanes,
+    _In_ CONST BOOLEAN UseVL)
+{
+    CONST SIZE_T Nblocks = DIV_ROUND_UP(InLen, BLAKE2S_BLOCK_SIZE);
+    CONST SIZE_T LastLen = InLen - BLAKE2S_BLOCK_SIZE * (Nblocks - 1);
+    __declspec(align(32)) UINT32 Digest[8][BLAKE2S_MAX_LANES];
+    UINT8 LastBlock[BLAKE2S_MAX_LANES][BLAKE2S_BLOCK_SIZE];
+    CONST UINT8 *Src[BLAKE2S_MAX_LANES];
+    BLAKE2S_STATE Common;
+    __m256i H[8], V[16], M[16];
+    SIZE_T i, j;
+
+    /* Every lane starts from the same parameter block and key block, and every lane has the same length, so the
+     * counter and finalization flags are shared too. Compress the key block once, just like Blake2sUpdate would when
+     * fed the first byte of input, and then fan out.
+     */
+    if (KeyLen)
+        Blake2sInitKey(&Common, OutLen, Key, KeyLen);
+    else
+        Blake2sInit(&Common, OutLen);
+    if (Common.BufLen)
+    {
+        Blake2sCompress(&Common, Common.Buf, 1, BLAKE2S_BLOCK_SIZE);
+        Common.BufLen = 0;
+    }
+    for (i = 0; i < 8; ++i)
+        H[i] = _mm256_set1_epi32(Common.H[i]);
+
+    for (i = 0; i < Nblocks; ++i)
+    {
+        if (i == Nblocks - 1)
+        {
+            Blake2sIncrementCounter(&Common, (UINT32)LastLen);
+            Blake2sSetLastblock(&Common);
+            for (j = 0; j < BLAKE2S_MAX_LANES; ++j)
+            {
+                RtlZeroMemory(LastBlock[j], BLAKE2S_BLOCK_SIZE);
+                RtlCopyMemory(LastBlock[j], In[j < Lanes ? j : 0] + BLAKE2S_BLOCK_SIZE * i, LastLen);
+                Src[j] = LastBlock[j];
+            }
+        }
+        else
+        {
+            Blake2sIncrementCounter(&Common, BLAKE2S_BLOCK_SIZE);
+            /* Unused lanes just redo lane 0, and are never written out. */
+            for (j = 0; j < BLAKE2S_MAX_LANES; ++j)
+                Src[j] = In[j < Lanes ? j : 0] + BLAKE2S_BLOCK_SIZE * i;
+        }
+
+        for (j = 0; j < 16; ++j)
+            M[j] = _mm256_setr_epi32(
+                GetUnalignedLe32(Src[0] + 4 * j),
+                GetUnalignedLe32(Src[1] + 4 * j),
+                GetUnalignedLe32(Src[2] + 4 * j),
+                GetUnalignedLe32(Src[3] + 4 * j),
+                GetUnalignedLe32(Src[4] + 4 * j),
+                GetUnalignedLe32(Src[5] + 4 * j),
+                GetUnalignedLe32(Src[6] + 4 * j),
+                GetUnalignedLe32(Src[7] + 4 * j));
+        for (j = 0; j < 8; ++j)
+            V[j] = H[j];
+        V[8] = _mm256_set1_epi32(Blake2sIv[0]);
+        V[9] = _mm256_set1_epi32(Blake2sIv[1]);
+        V[10] = _mm256_set1_epi32(Blake2sIv[2]);
+        V[11] = _mm256_set1_epi32(Blake2sIv[3]);
+        V[12] = _mm256_set1_epi32(Blake2sIv[4] ^ Common.T[0]);
+        V[13] = _mm256_set1_epi32(Blake2sIv[5] ^ Common.T[1]);
+        V[14] = _mm256_set1_epi32(Blake2sIv[6] ^ Common.F[0]);
+        V[15] = _mm256_set1_epi32(Blake2sIv[7] ^ Common.F[1]);
+
+        if (UseVL)
+            Blake2sRoundsAVX2x8(V, M, TRUE);
+        else
+            Blake2sRoundsAVX2x8(V, M, FALSE);
+
+        for (j = 0; j < 8; ++j)
+            H[j] = _mm256_xor_si256(H[j], _mm256_xor_si256(V[j], V[j + 8]));
+    }
+
+    for (i = 0; i < 8; ++i)
+        _mm256_store_si256((__m256i *)Digest[i], H[i]);
+    for (j = 0; j < Lanes; ++j)
+    {
+        for (i = 0; i < OutLen; ++i)
+            Out[j][i] = (UINT8)(Digest[i / 4][j] >> (8 * (i % 4)));
+    }
+
+    RtlSecureZeroMemory(&Common, sizeof(Common));
+    RtlSecureZeroMemory(Digest, sizeof(Digest));
+    RtlSecureZeroMemory(LastBlock, sizeof(LastBlock));
+    RtlSecureZeroMemory(M, sizeof(M));
+    RtlSecureZeroMemory(V, sizeof(V));
+}
+#endif
+
 _Use_decl_annotations_
 VOID
 Blake2sUpdate(BLAKE2S_STATE *State, CONST UINT8 *In, SIZE_T InLen)
@@ -1385,6 +1929,43 @@ Blake2s(UINT8 *Out, CONST UINT8 *In, CONST UINT8 *Key, CONST SIZE_T OutLen, CONS
     Blake2sFinal(&State, Out);
 }
 
+_Use_decl_annotations_
+VOID
+Blake2sMulti(
+    UINT8 *CONST Out[],
+    CONST UINT8 *CONST In[],
+    CONST UINT8 *Key,
+    CONST SIZE_T OutLen,
+    CONST SIZE_T InLen,
+    CONST SIZE_T KeyLen,
+    CONST ULONG Lanes,
+    CONST SIMD_STATE *Simd)
+{
+    ULONG i;
+
+#if defined(_M_AMD64)
+    /* The lanes are only for the automatic choice, so that forcing an implementation covers every message. */
+    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX2) && InLen && Lanes > 1 &&
+        ReadNoFence((LONG *)&CryptoDispatch[CRYPTO_PRIMITIVE_BLAKE2S].Override) == CRYPTO_IMPL_AUTO)
+    {
+        CryptoAccount(CRYPTO_PRIMITIVE_BLAKE2S, CRYPTO_IMPL_AVX2, InLen * Lanes);
+        for (i = 0; i < Lanes; i += BLAKE2S_MAX_LANES)
+            Blake2sAVX2x8(
+                Out + i,
+                In + i,
+                Key,
+                OutLen,
+                InLen,
+                KeyLen,
+                min(Lanes - i, BLAKE2S_MAX_LANES),
+                !!(Simd->CpuFeatures & CPU_FEATURE_AVX512VL));
+        return;
+    }
+#endif
+    for (i = 0; i < Lanes; ++i)
+        Blake2s(Out[i], In[i], Key, OutLen, InLen, KeyLen);
+}
+
 _Use_decl_annotations_
 VOID
 Blake2s256Hmac(UINT8 *Out, CONST UINT8 *In, CONST UINT8 *Key, CONST SIZE_T InLen, CONST SIZE_T KeyLen)
@@ -1843,6 +2424,133 @@ Hsiphash4u32(CONST UINT32 First, CONST UINT32 Second, CONST UINT32 Third, CONST
 }
 #endif
 
+#if defined(_M_AMD64)
+/* On amd64 HalfSiphash1-3 is really Siphash1-3, so each ymm register holds one state word for four inputs. The 32-bit
+ * rotations are just a dword swap.
+ */
+static VOID
+HsiphashAVX2x4(
+    _Out_writes_all_(Lanes) UINT32 *Out,
+    _In_reads_(Lanes) CONST UINT32 *First,
+    _In_reads_opt_(Lanes) CONST UINT32 *Second,
+    _In_ CONST HSIPHASH_KEY *Key,
+    _In_ CONST ULONG Lanes)
+{
+    __declspec(align(32)) UINT64 Words[HSIPHASH_MAX_LANES];
+    __m256i V0, V1, V2, V3, M, B;
+    ULONG i;
+
+#define ROL(X, C) _mm256_or_si256(_mm256_slli_epi64((X), (C)), _mm256_srli_epi64((X), 64 - (C)))
+#define ROL32(X) _mm256_shuffle_epi32((X), _MM_SHUFFLE(2, 3, 0, 1))
+#define HSIPROUNDx4 \
+    do \
+    { \
+        V0 = _mm256_add_epi64(V0, V1); \
+        V1 = ROL(V1, 13); \
+        V1 = _mm256_xor_si256(V1, V0); \
+        V0 = ROL32(V0); \
+        V2 = _mm256_add_epi64(V2, V3); \
+        V3 = ROL(V3, 16); \
+        V3 = _mm256_xor_si256(V3, V2); \
+        V0 = _mm256_add_epi64(V0, V3); \
+        V3 = ROL(V3, 21); \
+        V3 = _mm256_xor_si256(V3, V0); \
+        V2 = _mm256_add_epi64(V2, V1); \
+        V1 = ROL(V1, 17); \
+        V1 = _mm256_xor_si256(V1, V2); \
+        V2 = ROL32(V2); \
+    } while (0)
+
+    if (Lanes == HSIPHASH_MAX_LANES)
+    {
+        CONST __m128i Lo = _mm_loadu_si128((CONST __m128i *)First);
+        CONST __m128i Hi = Second ? _mm_loadu_si128((CONST __m128i *)Second) : _mm_setzero_si128();
+        M = _mm256_set_m128i(_mm_unpackhi_epi32(Lo, Hi), _mm_unpacklo_epi32(Lo, Hi));
+    }
+    else
+    {
+        /* Unused lanes just redo lane 0, and are never written out. */
+        for (i = 0; i < HSIPHASH_MAX_LANES; ++i)
+        {
+            CONST ULONG Lane = i < Lanes ? i : 0;
+            Words[i] = Second ? (UINT64)Second[Lane] << 32 | First[Lane] : First[Lane];
+        }
+        M = _mm256_load_si256((CONST __m256i *)Words);
+    }
+
+    V0 = _mm256_set1_epi64x(0x736f6d6570736575ULL ^ Key->Key[0]);
+    V1 = _mm256_set1_epi64x(0x646f72616e646f6dULL ^ Key->Key[1]);
+    V2 = _mm256_set1_epi64x(0x6c7967656e657261ULL ^ Key->Key[0]);
+    V3 = _mm256_set1_epi64x(0x7465646279746573ULL ^ Key->Key[1]);
+    if (Second)
+    {
+        B = _mm256_set1_epi64x(8ULL << 56);
+        V3 = _mm256_xor_si256(V3, M);
+        HSIPROUNDx4;
+        V0 = _mm256_xor_si256(V0, M);
+    }
+    else
+        B = _mm256_or_si256(_mm256_set1_epi64x(4ULL << 56), M);
+
+    V3 = _mm256_xor_si256(V3, B);
+    HSIPROUNDx4;
+    V0 = _mm256_xor_si256(V0, B);
+    V2 = _mm256_xor_si256(V2, _mm256_set1_epi64x(0xff));
+    HSIPROUNDx4;
+    HSIPROUNDx4;
+    HSIPROUNDx4;
+    _mm256_store_si256((__m256i *)Words, _mm256_xor_si256(_mm256_xor_si256(V0, V1), _mm256_xor_si256(V2, V3)));
+    for (i = 0; i < Lanes; ++i)
+        Out[i] = (UINT32)Words[i];
+
+#undef HSIPROUNDx4
+#undef ROL32
+#undef ROL
+}
+#endif
+
+_Use_decl_annotations_
+VOID
+Hsiphash1u32Multi(UINT32 *Out, CONST UINT32 *A, CONST HSIPHASH_KEY *Key, CONST ULONG Lanes, CONST SIMD_STATE *Simd)
+{
+    ULONG i;
+
+#if defined(_M_AMD64)
+    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX2) && Lanes > 1)
+    {
+        for (i = 0; i < Lanes; i += HSIPHASH_MAX_LANES)
+            HsiphashAVX2x4(Out + i, A + i, NULL, Key, min(Lanes - i, HSIPHASH_MAX_LANES));
+        return;
+    }
+#endif
+    for (i = 0; i < Lanes; ++i)
+        Out[i] = Hsiphash1u32(A[i], Key);
+}
+
+_Use_decl_annotations_
+VOID
+Hsiphash2u32Multi(
+    UINT32 *Out,
+    CONST UINT32 *A,
+    CONST UINT32 *B,
+    CONST HSIPHASH_KEY *Key,
+    CONST ULONG Lanes,
+    CONST SIMD_STATE *Simd)
+{
+    ULONG i;
+
+#if defined(_M_AMD64)
+    if (Simd && (Simd->CpuFeatures & CPU_FEATURE_AVX2) && Lanes > 1)
+    {
+        for (i = 0; i < Lanes; i += HSIPHASH_MAX_LANES)
+            HsiphashAVX2x4(Out + i, A + i, B + i, Key, min(Lanes - i, HSIPHASH_MAX_LANES));
+        return;
+    }
+#endif
+    for (i = 0; i < Lanes; ++i)
+        Out[i] = Hsiphash2u32(A[i], B[i], Key);
+}
+
 /* Below here is fiat's implementation of x25519.
  *
  * Copyright (C) 2015-2016 The fiat-crypto Authors.
@@ -2741,8 +3449,8 @@ FeMul121666(_Out_ Fe *H, _In_ CONST FeLoose *F)
 }
 
 _Use_decl_annotations_
-BOOLEAN
-Curve25519(
+static BOOLEAN
+Curve25519Generic(
     UINT8 Out[CURVE25519_KEY_SIZE],
     CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
     CONST UINT8 Point[CURVE25519_KEY_SIZE])
@@ -2858,8 +3566,490 @@ Curve25519(
     return !CryptoIsZero32(Out);
 }
 
+#if defined(_M_AMD64)
+/* Below here is the same ladder in radix 2^51, with five 64-bit limbs and 64x64->128 multiplies, which is what amd64
+ * is actually good at. An element t represents t[0]+2^51 t[1]+2^102 t[2]+2^153 t[3]+2^204 t[4]. Tight limbs, coming
+ * out of a multiplication, are bounded by 2^51+2^13; loose limbs, coming out of an addition or subtraction of tight
+ * ones, by 2^53. Products of loose limbs, times 19, summed five times, still fit comfortably in 128 bits.
+ */
+typedef struct _FE51
+{
+    UINT64 V[5];
+} FE51;
+
+typedef struct _FE51_ACC
+{
+    UINT64 Lo, Hi;
+} FE51_ACC;
+
+#    define FE51_MASK ((1ULL << 51) - 1)
+
+static FORCEINLINE VOID
+Fe51MulAdd(_Inout_ FE51_ACC *Acc, _In_ UINT64 A, _In_ UINT64 B, _In_ CONST BOOLEAN UseMulx)
+{
+    UINT64 Lo, Hi;
+
+    Lo = UseMulx ? _mulx_u64(A, B, &Hi) : _umul128(A, B, &Hi);
+    _addcarry_u64(_addcarry_u64(0, Acc->Lo, Lo, &Acc->Lo), Acc->Hi, Hi, &Acc->Hi);
+}
+
+static FORCEINLINE VOID
+Fe51Mul1(_Out_ FE51_ACC *Acc, _In_ UINT64 A, _In_ UINT64 B, _In_ CONST BOOLEAN UseMulx)
+{
+    Acc->Lo = UseMulx ? _mulx_u64(A, B, &Acc->Hi) : _umul128(A, B, &Acc->Hi);
+}
+
+static FORCEINLINE VOID
+Fe51Carry(_Out_ FE51 *H, _Inout_updates_(5) FE51_ACC R[5])
+{
+    UINT64 C;
+    LONG i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        C = (R[i].Lo >> 51) | (R[i].Hi << 13);
+        H->V[i] = R[i].Lo & FE51_MASK;
+        _addcarry_u64(_addcarry_u64(0, R[i + 1].Lo, C, &R[i + 1].Lo), R[i + 1].Hi, 0, &R[i + 1].Hi);
+    }
+    C = (R[4].Lo >> 51) | (R[4].Hi << 13);
+    H->V[4] = R[4].Lo & FE51_MASK;
+    H->V[0] += C * 19;
+    H->V[1] += H->V[0] >> 51;
+    H->V[0] &= FE51_MASK;
+}
+
+static FORCEINLINE VOID
+Fe51Mul(_Out_ FE51 *H, _In_ CONST FE51 *F, _In_ CONST FE51 *G, _In_ CONST BOOLEAN UseMulx)
+{
+    CONST UINT64 F0 = F->V[0], F1 = F->V[1], F2 = F->V[2], F3 = F->V[3], F4 = F->V[4];
+    CONST UINT64 G0 = G->V[0], G1 = G->V[1], G2 = G->V[2], G3 = G->V[3], G4 = G->V[4];
+    CONST UINT64 G1_19 = G1 * 19, G2_19 = G2 * 19, G3_19 = G3 * 19, G4_19 = G4 * 19;
+    FE51_ACC R[5];
+
+    Fe51Mul1(&R[0], F0, G0, UseMulx);
+    Fe51MulAdd(&R[0], F1, G4_19, UseMulx);
+    Fe51MulAdd(&R[0], F2, G3_19, UseMulx);
+    Fe51MulAdd(&R[0], F3, G2_19, UseMulx);
+    Fe51MulAdd(&R[0], F4, G1_19, UseMulx);
+
+    Fe51Mul1(&R[1], F0, G1, UseMulx);
+    Fe51MulAdd(&R[1], F1, G0, UseMulx);
+    Fe51MulAdd(&R[1], F2, G4_19, UseMulx);
+    Fe51MulAdd(&R[1], F3, G3_19, UseMulx);
+    Fe51MulAdd(&R[1], F4, G2_19, UseMulx);
+
+    Fe51Mul1(&R[2], F0, G2, UseMulx);
+    Fe51MulAdd(&R[2], F1, G1, UseMulx);
+    Fe51MulAdd(&R[2], F2, G0, UseMulx);
+    Fe51MulAdd(&R[2], F3, G4_19, UseMulx);
+    Fe51MulAdd(&R[2], F4, G3_19, UseMulx);
+
+    Fe51Mul1(&R[3], F0, G3, UseMulx);
+    Fe51MulAdd(&R[3], F1, G2, UseMulx);
+    Fe51MulAdd(&R[3], F2, G1, UseMulx);
+    Fe51MulAdd(&R[3], F3, G0, UseMulx);
+    Fe51MulAdd(&R[3], F4, G4_19, UseMulx);
+
+    Fe51Mul1(&R[4], F0, G4, UseMulx);
+    Fe51MulAdd(&R[4], F1, G3, UseMulx);
+    Fe51MulAdd(&R[4], F2, G2, UseMulx);
+    Fe51MulAdd(&R[4], F3, G1, UseMulx);
+    Fe51MulAdd(&R[4], F4, G0, UseMulx);
+
+    Fe51Carry(H, R);
+}
+
+static FORCEINLINE VOID
+Fe51Sq(_Out_ FE51 *H, _In_ CONST FE51 *F, _In_ CONST BOOLEAN UseMulx)
+{
+    CONST UINT64 F0 = F->V[0], F1 = F->V[1], F2 = F->V[2], F3 = F->V[3], F4 = F->V[4];
+    CONST UINT64 F0_2 = F0 * 2, F1_2 = F1 * 2;
+    CONST UINT64 F1_38 = F1 * 38, F2_38 = F2 * 38, F3_38 = F3 * 38;
+    CONST UINT64 F3_19 = F3 * 19, F4_19 = F4 * 19;
+    FE51_ACC R[5];
+
+    Fe51Mul1(&R[0], F0, F0, UseMulx);
+    Fe51MulAdd(&R[0], F1_38, F4, UseMulx);
+    Fe51MulAdd(&R[0], F2_38, F3, UseMulx);
+
+    Fe51Mul1(&R[1], F0_2, F1, UseMulx);
+    Fe51MulAdd(&R[1], F2_38, F4, UseMulx);
+    Fe51MulAdd(&R[1], F3_19, F3, UseMulx);
+
+    Fe51Mul1(&R[2], F0_2, F2, UseMulx);
+    Fe51MulAdd(&R[2], F1, F1, UseMulx);
+    Fe51MulAdd(&R[2], F3_38, F4, UseMulx);
+
+    Fe51Mul1(&R[3], F0_2, F3, UseMulx);
+    Fe51MulAdd(&R[3], F1_2, F2, UseMulx);
+    Fe51MulAdd(&R[3], F4_19, F4, UseMulx);
+
+    Fe51Mul1(&R[4], F0_2, F4, UseMulx);
+    Fe51MulAdd(&R[4], F1_2, F3, UseMulx);
+    Fe51MulAdd(&R[4], F2, F2, UseMulx);
+
+    Fe51Carry(H, R);
+}
+
+static FORCEINLINE VOID
+Fe51SqTimes(_Out_ FE51 *H, _In_ CONST FE51 *F, _In_ LONG N, _In_ CONST BOOLEAN UseMulx)
+{
+    Fe51Sq(H, F, UseMulx);
+    while (--N > 0)
+        Fe51Sq(H, H, UseMulx);
+}
+
+static FORCEINLINE VOID
+Fe51Mul121666(_Out_ FE51 *H, _In_ CONST FE51 *F, _In_ CONST BOOLEAN UseMulx)
+{
+    FE51_ACC R[5];
+    LONG i;
+
+    for (i = 0; i < 5; ++i)
+        Fe51Mul1(&R[i], F->V[i], 121666, UseMulx);
+    Fe51Carry(H, R);
+}
+
+static FORCEINLINE VOID
+Fe51Add(_Out_ FE51 *H, _In_ CONST FE51 *F, _In_ CONST FE51 *G)
+{
+    LONG i;
+
+    for (i = 0; i < 5; ++i)
+        H->V[i] = F->V[i] + G->V[i];
+}
+
+static FORCEINLINE VOID
+Fe51Sub(_Out_ FE51 *H, _In_ CONST FE51 *F, _In_ CONST FE51 *G)
+{
+    /* Add 2p first, so that tight inputs never go negative. */
+    H->V[0] = F->V[0] + 0xfffffffffffdaULL - G->V[0];
+    H->V[1] = F->V[1] + 0xffffffffffffeULL - G->V[1];
+    H->V[2] = F->V[2] + 0xffffffffffffeULL - G->V[2];
+    H->V[3] = F->V[3] + 0xffffffffffffeULL - G->V[3];
+    H->V[4] = F->V[4] + 0xffffffffffffeULL - G->V[4];
+}
+
+static FORCEINLINE VOID
+Fe51Cswap(_Inout_ FE51 *F, _Inout_ FE51 *G, _In_ UINT64 B)
+{
+    LONG i;
+
+    B = 0 - B;
+    for (i = 0; i < 5; ++i)
+    {
+        UINT64 X = (F->V[i] ^ G->V[i]) & B;
+        F->V[i] ^= X;
+        G->V[i] ^= X;
+    }
+}
+
+static FORCEINLINE VOID
+Fe51Frombytes(_Out_ FE51 *H, _In_reads_bytes_(32) CONST UINT8 *S)
+{
+    CONST UINT64 W0 = GetUnalignedLe64(S), W1 = GetUnalignedLe64(S + 8);
+    CONST UINT64 W2 = GetUnalignedLe64(S + 16), W3 = GetUnalignedLe64(S + 24);
+
+    H->V[0] = W0 & FE51_MASK;
+    H->V[1] = ((W0 >> 51) | (W1 << 13)) & FE51_MASK;
+    H->V[2] = ((W1 >> 38) | (W2 << 26)) & FE51_MASK;
+    H->V[3] = ((W2 >> 25) | (W3 << 39)) & FE51_MASK;
+    H->V[4] = (W3 >> 12) & FE51_MASK;
+}
+
+static FORCEINLINE VOID
+Fe51Tobytes(_Out_writes_bytes_all_(32) UINT8 S[32], _In_ CONST FE51 *F)
+{
+    UINT64 T[5], Q;
+    LONG i;
+
+    /* Fully carry, so every limb is below 2^51, then subtract p if we're at or above it. */
+    for (i = 0; i < 5; ++i)
+        T[i] = F->V[i];
+    for (i = 0; i < 4; ++i)
+    {
+        T[i + 1] += T[i] >> 51;
+        T[i] &= FE51_MASK;
+    }
+    T[0] += 19 * (T[4] >> 51);
+    T[4] &= FE51_MASK;
+    for (i = 0; i < 4; ++i)
+    {
+        T[i + 1] += T[i] >> 51;
+        T[i] &= FE51_MASK;
+    }
+    Q = (T[0] + 19) >> 51;
+    for (i = 1; i < 5; ++i)
+        Q = (T[i] + Q) >> 51;
+    T[0] += 19 * Q;
+    for (i = 0; i < 4; ++i)
+    {
+        T[i + 1] += T[i] >> 51;
+        T[i] &= FE51_MASK;
+    }
+    T[4] &= FE51_MASK;
+
+    PutUnalignedLe64(T[0] | (T[1] << 51), S);
+    PutUnalignedLe64((T[1] >> 13) | (T[2] << 38), S + 8);
+    PutUnalignedLe64((T[2] >> 26) | (T[3] << 25), S + 16);
+    PutUnalignedLe64((T[3] >> 39) | (T[4] << 12), S + 24);
+    RtlSecureZeroMemory(T, sizeof(T));
+}
+
+static FORCEINLINE VOID
+Fe51Invert(_Out_ FE51 *Out, _In_ CONST FE51 *Z, _In_ CONST BOOLEAN UseMulx)
+{
+    FE51 Z2, Z9, Z11, Z2_5_0, Z2_10_0, Z2_20_0, Z2_50_0, Z2_100_0, T;
+
+    Fe51Sq(&Z2, Z, UseMulx);
+    Fe51SqTimes(&T, &Z2, 2, UseMulx);
+    Fe51Mul(&Z9, &T, Z, UseMulx);
+    Fe51Mul(&Z11, &Z9, &Z2, UseMulx);
+    Fe51Sq(&T, &Z11, UseMulx);
+    Fe51Mul(&Z2_5_0, &T, &Z9, UseMulx);
+    Fe51SqTimes(&T, &Z2_5_0, 5, UseMulx);
+    Fe51Mul(&Z2_10_0, &T, &Z2_5_0, UseMulx);
+    Fe51SqTimes(&T, &Z2_10_0, 10, UseMulx);
+    Fe51Mul(&Z2_20_0, &T, &Z2_10_0, UseMulx);
+    Fe51SqTimes(&T, &Z2_20_0, 20, UseMulx);
+    Fe51Mul(&T, &T, &Z2_20_0, UseMulx);
+    Fe51SqTimes(&T, &T, 10, UseMulx);
+    Fe51Mul(&Z2_50_0, &T, &Z2_10_0, UseMulx);
+    Fe51SqTimes(&T, &Z2_50_0, 50, UseMulx);
+    Fe51Mul(&Z2_100_0, &T, &Z2_50_0, UseMulx);
+    Fe51SqTimes(&T, &Z2_100_0, 100, UseMulx);
+    Fe51Mul(&T, &T, &Z2_100_0, UseMulx);
+    Fe51SqTimes(&T, &T, 50, UseMulx);
+    Fe51Mul(&T, &T, &Z2_50_0, UseMulx);
+    Fe51SqTimes(&T, &T, 5, UseMulx);
+    Fe51Mul(Out, &T, &Z11, UseMulx);
+}
+
+/* This is the same ladder as Curve25519Generic above, step for step, so the same proof sketch applies. It stops
+ * short of the final inversion, so that batches can share one.
+ */
+static FORCEINLINE VOID
+Curve25519Fe51Ladder(
+    _Out_ FE51 *X2,
+    _Out_ FE51 *Z2,
+    _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
+    _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Point[CURVE25519_KEY_SIZE],
+    _In_ CONST BOOLEAN UseMulx)
+{
+    FE51 X1, X3, Z3, Tmp0, Tmp1, X2l, Z2l, X3l, Tmp0l, Tmp1l;
+    UINT64 Swap = 0;
+    LONG Pos;
+    UINT8 E[32];
+
+    RtlCopyMemory(E, Scalar, 32);
+    Curve25519ClampSecret(E);
+
+    Fe51Frombytes(&X1, Point);
+    RtlZeroMemory(X2, sizeof(*X2));
+    X2->V[0] = 1;
+    RtlZeroMemory(Z2, sizeof(*Z2));
+    X3 = X1;
+    RtlZeroMemory(&Z3, sizeof(Z3));
+    Z3.V[0] = 1;
+
+    for (Pos = 254; Pos >= 0; --Pos)
+    {
+        UINT64 B = 1 & (E[Pos / 8] >> (Pos & 7));
+        Swap ^= B;
+        Fe51Cswap(X2, &X3, Swap);
+        Fe51Cswap(Z2, &Z3, Swap);
+        Swap = B;
+        Fe51Sub(&Tmp0l, &X3, &Z3);
+        Fe51Sub(&Tmp1l, X2, Z2);
+        Fe51Add(&X2l, X2, Z2);
+        Fe51Add(&Z2l, &X3, &Z3);
+        Fe51Mul(&Z3, &Tmp0l, &X2l, UseMulx);
+        Fe51Mul(Z2, &Z2l, &Tmp1l, UseMulx);
+        Fe51Sq(&Tmp0, &Tmp1l, UseMulx);
+        Fe51Sq(&Tmp1, &X2l, UseMulx);
+        Fe51Add(&X3l, &Z3, Z2);
+        Fe51Sub(&Z2l, &Z3, Z2);
+        Fe51Mul(X2, &Tmp1, &Tmp0, UseMulx);
+        Fe51Sub(&Tmp1l, &Tmp1, &Tmp0);
+        Fe51Sq(Z2, &Z2l, UseMulx);
+        Fe51Mul121666(&Z3, &Tmp1l, UseMulx);
+        Fe51Sq(&X3, &X3l, UseMulx);
+        Fe51Add(&Tmp0l, &Tmp0, &Z3);
+        Fe51Mul(&Z3, &X1, Z2, UseMulx);
+        Fe51Mul(Z2, &Tmp1l, &Tmp0l, UseMulx);
+    }
+    Fe51Cswap(X2, &X3, Swap);
+    Fe51Cswap(Z2, &Z3, Swap);
+
+    RtlSecureZeroMemory(&X1, sizeof(X1));
+    RtlSecureZeroMemory(&X3, sizeof(X3));
+    RtlSecureZeroMemory(&Z3, sizeof(Z3));
+    RtlSecureZeroMemory(&Tmp0, sizeof(Tmp0));
+    RtlSecureZeroMemory(&Tmp1, sizeof(Tmp1));
+    RtlSecureZeroMemory(&X2l, sizeof(X2l));
+    RtlSecureZeroMemory(&Z2l, sizeof(Z2l));
+    RtlSecureZeroMemory(&X3l, sizeof(X3l));
+    RtlSecureZeroMemory(&Tmp0l, sizeof(Tmp0l));
+    RtlSecureZeroMemory(&Tmp1l, sizeof(Tmp1l));
+    RtlSecureZeroMemory(&E, sizeof(E));
+}
+
+static FORCEINLINE BOOLEAN
+Curve25519Fe51(
+    _Out_writes_bytes_all_(CURVE25519_KEY_SIZE) UINT8 Out[CURVE25519_KEY_SIZE],
+    _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
+    _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Point[CURVE25519_KEY_SIZE],
+    _In_ CONST BOOLEAN UseMulx)
+{
+    FE51 X2, Z2;
+
+    Curve25519Fe51Ladder(&X2, &Z2, Scalar, Point, UseMulx);
+    Fe51Invert(&Z2, &Z2, UseMulx);
+    Fe51Mul(&X2, &X2, &Z2, UseMulx);
+    Fe51Tobytes(Out, &X2);
+
+    RtlSecureZeroMemory(&X2, sizeof(X2));
+    RtlSecureZeroMemory(&Z2, sizeof(Z2));
+
+    return !CryptoIsZero32(Out);
+}
+
+/* Runs Count ladders, and then shares a single inversion between all of them with Montgomery's trick, trading
+ * Count - 1 inversions for 3 * (Count - 1) multiplications.
+ */
+static FORCEINLINE VOID
+Curve25519Fe51Batch(
+    _Out_writes_(Count) UINT8 *CONST Out[],
+    _In_reads_(Count) CONST UINT8 *CONST Scalar[],
+    _In_reads_(Count) CONST UINT8 *CONST Point[],
+    _Out_writes_all_(Count) BOOLEAN *Ret,
+    _In_ ULONG Count,
+    _In_ CONST BOOLEAN UseMulx)
+{
+    FE51 X[CURVE25519_MAX_BATCH], Z[CURVE25519_MAX_BATCH], Prefix[CURVE25519_MAX_BATCH], Inv, ZInv;
+    UINT8 Bytes[CURVE25519_KEY_SIZE];
+    LONG i;
+
+    for (i = 0; i < (LONG)Count; ++i)
+    {
+        Curve25519Fe51Ladder(&X[i], &Z[i], Scalar[i], Point[i], UseMulx);
+        /* A zero Z, from a low order point, would zero out the whole product. Its result is going to be zero and
+         * rejected anyway, which the caller learns regardless, so it's fine to branch on it here.
+         */
+        Fe51Tobytes(Bytes, &Z[i]);
+        if (CryptoIsZero32(Bytes))
+        {
+            RtlZeroMemory(&X[i], sizeof(X[i]));
+            RtlZeroMemory(&Z[i], sizeof(Z[i]));
+            Z[i].V[0] = 1;
+        }
+        if (i)
+            Fe51Mul(&Prefix[i], &Prefix[i - 1], &Z[i], UseMulx);
+        else
+            Prefix[0] = Z[0];
+    }
+
+    Fe51Invert(&Inv, &Prefix[Count - 1], UseMulx);
+    for (i = Count - 1; i > 0; --i)
+    {
+        Fe51Mul(&ZInv, &Inv, &Prefix[i - 1], UseMulx);
+        Fe51Mul(&Inv, &Inv, &Z[i], UseMulx);
+        Fe51Mul(&X[i], &X[i], &ZInv, UseMulx);
+    }
+    Fe51Mul(&X[0], &X[0], &Inv, UseMulx);
+
+    for (i = 0; i < (LONG)Count; ++i)
+    {
+        Fe51Tobytes(Out[i], &X[i]);
+        Ret[i] = !CryptoIsZero32(Out[i]);
+    }
+
+    RtlSecureZeroMemory(X, sizeof(X));
+    RtlSecureZeroMemory(Z, sizeof(Z));
+    RtlSecureZeroMemory(Prefix, sizeof(Prefix));
+    RtlSecureZeroMemory(&Inv, sizeof(Inv));
+    RtlSecureZeroMemory(&ZInv, sizeof(ZInv));
+    RtlSecureZeroMemory(Bytes, sizeof(Bytes));
+}
+
+_Use_decl_annotations_
+static BOOLEAN
+Curve25519Fe51Mul(
+    UINT8 Out[CURVE25519_KEY_SIZE],
+    CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
+    CONST UINT8 Point[CURVE25519_KEY_SIZE])
+{
+    return Curve25519Fe51(Out, Scalar, Point, FALSE);
+}
+
+_Use_decl_annotations_
+static BOOLEAN
+Curve25519Fe51Mulx(
+    UINT8 Out[CURVE25519_KEY_SIZE],
+    CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
+    CONST UINT8 Point[CURVE25519_KEY_SIZE])
+{
+    return Curve25519Fe51(Out, Scalar, Point, TRUE);
+}
+
+/* In the same order as Curve25519Candidates. */
+static CURVE25519_FN *CONST Curve25519Impls[] = { Curve25519Fe51Mulx, Curve25519Fe51Mul, Curve25519Generic };
+static_assert(ARRAYSIZE(Curve25519Impls) == ARRAYSIZE(Curve25519Candidates), "Curve25519 tables out of sync");
+#endif
+
+_Use_decl_annotations_
+BOOLEAN
+Curve25519(
+    UINT8 Out[CURVE25519_KEY_SIZE],
+    CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
+    CONST UINT8 Point[CURVE25519_KEY_SIZE])
+{
+#if defined(_M_AMD64)
+    ULONG Choice = CryptoChoose(CRYPTO_PRIMITIVE_CURVE25519, CpuFeatures);
+    CryptoAccount(CRYPTO_PRIMITIVE_CURVE25519, Curve25519Candidates[Choice].Impl, CURVE25519_KEY_SIZE);
+    return Curve25519Impls[Choice](Out, Scalar, Point);
+#else
+    CryptoAccount(CRYPTO_PRIMITIVE_CURVE25519, CRYPTO_IMPL_GENERIC, CURVE25519_KEY_SIZE);
+    return Curve25519Generic(Out, Scalar, Point);
+#endif
+}
+
+_Use_decl_annotations_
+VOID
+Curve25519Batch(
+    UINT8 *CONST Out[],
+    CONST UINT8 *CONST Scalar[],
+    CONST UINT8 *CONST Point[],
+    BOOLEAN *Ret,
+    ULONG Count)
+{
+    ULONG i;
+
+#if defined(_M_AMD64)
+    ULONG Choice = CryptoChoose(CRYPTO_PRIMITIVE_CURVE25519, CpuFeatures);
+    if (Curve25519Impls[Choice] != Curve25519Generic)
+    {
+        CryptoAccount(CRYPTO_PRIMITIVE_CURVE25519, Curve25519Candidates[Choice].Impl, Count * CURVE25519_KEY_SIZE);
+        for (i = 0; i < Count; i += CURVE25519_MAX_BATCH)
+            Curve25519Fe51Batch(
+                Out + i,
+                Scalar + i,
+                Point + i,
+                Ret + i,
+                min(Count - i, CURVE25519_MAX_BATCH),
+                Curve25519Impls[Choice] == Curve25519Fe51Mulx);
+        return;
+    }
+#endif
+    for (i = 0; i < Count; ++i)
+        Ret[i] = Curve25519(Out[i], Scalar[i], Point[i]);
+}
+
 #ifdef DBG
+#    include "selftest/blake2s.c"
 #    include "selftest/chacha20poly1305.c"
+#    include "selftest/curve25519.c"
+#    include "selftest/siphash.c"
 #    ifdef ALLOC_PRAGMA
 #        pragma alloc_text(INIT, CryptoSelftest)
 #    endif
@@ -2878,9 +4068,40 @@ BOOLEAN CryptoSelftest(VOID)
             LogDebug("chacha20poly1305 self-test combination 0x%lx: FAIL", Simd.CpuFeatures);
             Success = FALSE;
         }
+        if (!Blake2sSelftest(&Simd))
+        {
+            LogDebug("blake2s self-test combination 0x%lx: FAIL", Simd.CpuFeatures);
+            Success = FALSE;
+        }
+        if (!HsiphashSelftest(&Simd))
+        {
+            LogDebug("hsiphash self-test combination 0x%lx: FAIL", Simd.CpuFeatures);
+            Success = FALSE;
+        }
         Simd.CpuFeatures = ((ULONG)Simd.CpuFeatures - FullSet) & FullSet;
     } while (Simd.CpuFeatures);
+    Simd.CpuFeatures = FullSet;
+    for (ULONG Primitive = 0; Primitive < CRYPTO_PRIMITIVE_COUNT; ++Primitive)
+    {
+        CRYPTO_IMPL Saved, Active;
+        ULONG64 Bytes[CRYPTO_IMPL_COUNT];
+        CryptoGetImplementation(Primitive, &Saved, &Active, Bytes);
+        for (ULONG Impl = CRYPTO_IMPL_GENERIC; Impl < CRYPTO_IMPL_COUNT; ++Impl)
+        {
+            if (!NT_SUCCESS(CryptoSetImplementation(Primitive, Impl)))
+                continue;
+            if (Primitive == CRYPTO_PRIMITIVE_CURVE25519 ? !Curve25519Selftest()
+                                                         : !ChaCha20Poly1305Selftest(&Simd) || !Blake2sSelftest(&Simd))
+            {
+                LogDebug("crypto self-test primitive %lu forced to implementation %lu: FAIL", Primitive, Impl);
+                Success = FALSE;
+            }
+        }
+        (VOID) CryptoSetImplementation(Primitive, Saved);
+    }
     SimdPut(&Simd);
+    if (!Curve25519Selftest())
+        Success = FALSE;
     if (Success)
         LogDebug("crypto self-tests: pass");
     return Success;
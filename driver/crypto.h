@@ -17,6 +17,7 @@ typedef enum
     CPU_FEATURE_AVX512F = 1 << 3,
     CPU_FEATURE_AVX512VL = 1 << 4,
     CPU_FEATURE_AVX512IFMA = 1 << 5,
+    CPU_FEATURE_BMI2 = 1 << 6,
 } CPU_FEATURE;
 
 typedef struct _SIMD_STATE
@@ -39,6 +40,13 @@ _At_(
     _When_(State->HasSavedXState, _Kernel_requires_resource_held_(FloatState) _Kernel_releases_resource_(FloatState)))
 VOID
 SimdPut(_Inout_ SIMD_STATE *State);
+
+/* Workers hold one SIMD_STATE across many packets, and report how many here, so that the number of extended state
+ * saves per packet can be seen. Packets processed without a saved state aren't counted.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SimdAccountPackets(_In_ CONST SIMD_STATE *State, _In_ ULONG Packets);
 #else
 typedef struct _SIMD_STATE
 {
@@ -57,6 +65,12 @@ static inline VOID
 SimdPut(_Inout_ SIMD_STATE *State)
 {
 }
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+SimdAccountPackets(_In_ CONST SIMD_STATE *State, _In_ ULONG Packets)
+{
+}
 #endif
 
 _Must_inspect_result_
@@ -216,7 +230,8 @@ enum BLAKE2S_LENGTHS
 {
     BLAKE2S_BLOCK_SIZE = 64,
     BLAKE2S_HASH_SIZE = 32,
-    BLAKE2S_KEY_SIZE = 32
+    BLAKE2S_KEY_SIZE = 32,
+    BLAKE2S_MAX_LANES = 8
 };
 
 typedef struct _BLAKE2S_STATE
@@ -254,6 +269,18 @@ Blake2s(
     _In_ CONST SIZE_T InLen,
     _In_ CONST SIZE_T KeyLen);
 
+/* Hashes Lanes independent messages of equal length under the same key, eight at a time when AVX2 is available. */
+VOID
+Blake2sMulti(
+    _Out_writes_(Lanes) UINT8 *CONST Out[],
+    _In_reads_(Lanes) CONST UINT8 *CONST In[],
+    _In_reads_bytes_(KeyLen) CONST UINT8 *Key,
+    _In_ CONST SIZE_T OutLen,
+    _In_ CONST SIZE_T InLen,
+    _In_ CONST SIZE_T KeyLen,
+    _In_ CONST ULONG Lanes,
+    _In_opt_ CONST SIMD_STATE *Simd);
+
 VOID
 Blake2s256Hmac(
     _Out_writes_bytes_all_(BLAKE2S_HASH_SIZE) UINT8 *Out,
@@ -324,9 +351,32 @@ Hsiphash4u32(
     _In_ CONST UINT32 D,
     _In_ CONST HSIPHASH_KEY *Key);
 
+enum HSIPHASH_LENGTHS
+{
+    HSIPHASH_MAX_LANES = 4
+};
+
+/* Hashes Lanes independent inputs under the same key, four at a time when AVX2 is available. */
+VOID
+Hsiphash1u32Multi(
+    _Out_writes_all_(Lanes) UINT32 *Out,
+    _In_reads_(Lanes) CONST UINT32 *A,
+    _In_ CONST HSIPHASH_KEY *Key,
+    _In_ CONST ULONG Lanes,
+    _In_opt_ CONST SIMD_STATE *Simd);
+VOID
+Hsiphash2u32Multi(
+    _Out_writes_all_(Lanes) UINT32 *Out,
+    _In_reads_(Lanes) CONST UINT32 *A,
+    _In_reads_(Lanes) CONST UINT32 *B,
+    _In_ CONST HSIPHASH_KEY *Key,
+    _In_ CONST ULONG Lanes,
+    _In_opt_ CONST SIMD_STATE *Simd);
+
 enum CURVE25519_LENGTHS
 {
-    CURVE25519_KEY_SIZE = 32
+    CURVE25519_KEY_SIZE = 32,
+    CURVE25519_MAX_BATCH = 8
 };
 
 _Must_inspect_result_
@@ -336,6 +386,15 @@ Curve25519(
     _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Scalar[CURVE25519_KEY_SIZE],
     _In_reads_bytes_(CURVE25519_KEY_SIZE) CONST UINT8 Point[CURVE25519_KEY_SIZE]);
 
+/* Computes Count independent scalar multiplications, sharing the work that can be shared between them. */
+VOID
+Curve25519Batch(
+    _Out_writes_(Count) UINT8 *CONST Out[],
+    _In_reads_(Count) CONST UINT8 *CONST Scalar[],
+    _In_reads_(Count) CONST UINT8 *CONST Point[],
+    _Out_writes_all_(Count) BOOLEAN *Ret,
+    _In_ ULONG Count);
+
 _Must_inspect_result_
 static inline BOOLEAN
 Curve25519GeneratePublic(
@@ -360,7 +419,55 @@ Curve25519GenerateSecret(_Out_writes_bytes_all_(CURVE25519_KEY_SIZE) UINT8 Secre
     Curve25519ClampSecret(Secret);
 }
 
-VOID CryptoDriverEntry(VOID);
+typedef enum
+{
+    CRYPTO_PRIMITIVE_CHACHA20,
+    CRYPTO_PRIMITIVE_POLY1305,
+    CRYPTO_PRIMITIVE_BLAKE2S,
+    CRYPTO_PRIMITIVE_CURVE25519,
+    CRYPTO_PRIMITIVE_COUNT
+} CRYPTO_PRIMITIVE;
+
+/* These have the same values as WG_IOCTL_CRYPTO_IMPL. */
+typedef enum
+{
+    CRYPTO_IMPL_AUTO,
+    CRYPTO_IMPL_GENERIC,
+    CRYPTO_IMPL_ALU,
+    CRYPTO_IMPL_SSSE3,
+    CRYPTO_IMPL_AVX,
+    CRYPTO_IMPL_AVX2,
+    CRYPTO_IMPL_AVX512F,
+    CRYPTO_IMPL_AVX512VL,
+    CRYPTO_IMPL_AVX512IFMA,
+    CRYPTO_IMPL_BMI2,
+    CRYPTO_IMPL_COUNT
+} CRYPTO_IMPL;
+
+/* Forces Primitive to use Impl, or whatever is next best when Impl can't be used at the time, or with
+ * CRYPTO_IMPL_AUTO goes back to picking the fastest one. Kernels older than Windows 10 only take their portable
+ * implementation, to which CRYPTO_IMPL_AUTO keeps them.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS
+CryptoSetImplementation(_In_ CRYPTO_PRIMITIVE Primitive, _In_ CRYPTO_IMPL Impl);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CryptoGetImplementation(
+    _In_ CRYPTO_PRIMITIVE Primitive,
+    _Out_ CRYPTO_IMPL *Override,
+    _Out_ CRYPTO_IMPL *Active,
+    _Out_writes_all_(CRYPTO_IMPL_COUNT) ULONG64 Bytes[CRYPTO_IMPL_COUNT]);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CryptoGetSimdStats(_Out_ ULONG64 *XStateSaves, _Out_ ULONG64 *XStatePackets);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CryptoDriverEntry(_In_ UNICODE_STRING *RegistryPath);
 
 #ifdef DBG
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -9,6 +9,7 @@
 #include "device.h"
 #include "peer.h"
 #include "queueing.h"
+#include "socket.h"
 #include <ntddk.h>
 
 static DRIVER_DISPATCH *NdisDispatchDeviceControl;
@@ -134,6 +135,7 @@ HasPacketQueued(_In_ WG_PEER *Peer, ULONG HeaderLength)
 {
     KIRQL Irql;
     KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
+    PacketStagedCollect(Peer);
 
     for (PNET_BUFFER_LIST Nbl = Peer->StagedPacketQueue.Head; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
@@ -174,7 +176,7 @@ SendPaddingPacket(_Inout_ WG_PEER *Peer, USHORT PaddingSize, BOOLEAN Replace, SI
         return;
     }
 
-    ADDRESS_FAMILY Family = ReadUShortNoFence(&Peer->Endpoint.Addr.si_family);
+    ADDRESS_FAMILY Family = SocketGetPeerEndpointFamily(Peer);
     ULONG Mtu;
 
     if (Family == AF_INET)
@@ -223,7 +225,7 @@ SendPaddingPacket(_Inout_ WG_PEER *Peer, USHORT PaddingSize, BOOLEAN Replace, SI
 
     NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
 
-    NetBufferListInterlockedEnqueue(&Peer->StagedPacketQueue, Nbl);
+    PacketStage(Peer, Nbl);
 
     DaitaPaddingSent(Peer, PaddingSize, UserContext);
 
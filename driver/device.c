@@ -200,7 +200,7 @@ SendNetBufferLists(
             goto returnNbl;
         }
 
-        ADDRESS_FAMILY Family = ReadUShortNoFence(&Peer->Endpoint.Addr.si_family);
+        ADDRESS_FAMILY Family = SocketGetPeerEndpointFamily(Peer);
         if (Family != AF_INET && Family != AF_INET6)
         {
             LogInfoRatelimited(
@@ -240,24 +240,8 @@ SendNetBufferLists(
             DaitaNonpaddingSent(Peer, NET_BUFFER_DATA_LENGTH(Nb));
         }
 
-        KIRQL Irql;
-        KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
-        /* If the queue is getting too big, we start removing the oldest packets
-         * until it's small again. We do this before adding the new packet, so
-         * we don't remove GSO segments that are in excess.
-         */
-        while (NetBufferListQueueLength(&Peer->StagedPacketQueue) > MAX_STAGED_PACKETS)
-        {
-            NET_BUFFER_LIST *NblToDiscard = NetBufferListDequeue(&Peer->StagedPacketQueue);
-            _Analysis_assume_(NblToDiscard); /* NetBufferListQueueLength() > MAX_STAGED_PACKETS implies
-                                                NetBufferListDequeue() returns a NBL. */
-            NET_BUFFER_LIST_STATUS(NblToDiscard) = NDIS_STATUS_FAILURE;
-            ++Wg->Statistics.ifOutDiscards;
-            FreeSendNetBufferList(Wg, NblToDiscard, CompleteFlags | NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-        }
-        NetBufferListEnqueue(&Peer->StagedPacketQueue, Nbl);
-        KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
-
+        /* The staged queue is trimmed to its limit when PacketSendStagedPackets collects what was staged. */
+        PacketStage(Peer, Nbl);
         PacketSendStagedPackets(Peer);
         PeerPut(Peer);
         continue;
@@ -416,15 +400,24 @@ HaltEx(NDIS_HANDLE MiniportAdapterContext, NDIS_HALT_ACTION HaltAction)
     MulticoreWorkQueueDestroy(&Wg->EncryptThreads);
     MulticoreWorkQueueDestroy(&Wg->HandshakeRxThreads);
     MulticoreWorkQueueDestroy(&Wg->HandshakeTxThreads);
-    PtrRingFree(&Wg->DecryptQueue);
+    for (ULONG i = 0; i < Wg->NumDecryptQueues; ++i)
+        PtrRingFree(&Wg->DecryptQueues[i]);
+    MemFree(Wg->DecryptQueues);
     PtrRingFree(&Wg->EncryptQueue);
+    MemFree(Wg->RxHomeQueues);
+    MemFree(Wg->TxHomeQueues);
+    MemFree(Wg->RouteCache4.Entries);
+    MemFree(Wg->RouteCache6.Entries);
     RcuBarrier();
     NoiseStaticIdentityClear(&Wg->StaticIdentity);
     FreeIncomingHandshakes(Wg);
     PtrRingFree(&Wg->HandshakeRxQueue);
     MemFree(Wg->IndexHashtable);
     MemFree(Wg->PeerHashtable);
+    PeerTxRateLimitsFree(&Wg->TxRateLimits);
     MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+    /* Every datagram it received has been returned by now, so give back the memory they were received into. */
+    MemTrimReceiveNetBufferListCaches();
 
     WritePointerNoFence(&Wg->MiniportAdapterHandle, NULL);
     LogInfo(Wg, "Interface destroyed");
@@ -571,7 +564,7 @@ InitializeEx(
     PNDIS_MINIPORT_INIT_PARAMETERS MiniportInitParameters)
 {
     NTSTATUS Status;
-    WG_DEVICE *Wg = MemAllocateAndZero(sizeof(*Wg));
+    WG_DEVICE *Wg = MemAllocateCacheAlignedAndZero(sizeof(*Wg));
     if (!Wg)
         return NDIS_STATUS_RESOURCES;
     Wg->MiniportAdapterHandle = MiniportAdapterHandle;
@@ -599,9 +592,13 @@ InitializeEx(
     MuInitializePushLock(&Wg->StaticIdentity.Lock);
     MuInitializePushLock(&Wg->SocketUpdateLock);
     MuInitializePushLock(&Wg->DeviceUpdateLock);
+    MuInitializePushLock(&Wg->RouteCache4.Lock);
+    MuInitializePushLock(&Wg->RouteCache6.Lock);
     PeerSerialInit(&Wg->TxQueue);
     PeerSerialInit(&Wg->RxQueue);
     PeerSerialInit(&Wg->HandshakeTxQueue);
+    QueueLimitsInit(&Wg->QueueLimits);
+    PeerTxRateLimitsInit(&Wg->TxRateLimits);
     AllowedIpsInit(&Wg->PeerAllowedIps);
     CookieCheckerInit(&Wg->CookieChecker, Wg);
     InitializeListHead(&Wg->PeerList);
@@ -630,15 +627,40 @@ InitializeEx(
         NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_XMIT |
         NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_XMIT;
 
-    Status = PtrRingInit(&Wg->EncryptQueue, MAX_QUEUED_PACKETS);
-    if (!NT_SUCCESS(Status))
+    ULONG MaxProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Wg->TxHomeQueues = MemAllocateCacheAlignedArrayAndZero(MaxProcessors, sizeof(*Wg->TxHomeQueues));
+    if (!Wg->TxHomeQueues)
         goto cleanupIndexHashtable;
+    Wg->RxHomeQueues = MemAllocateCacheAlignedArrayAndZero(MaxProcessors, sizeof(*Wg->RxHomeQueues));
+    if (!Wg->RxHomeQueues)
+        goto cleanupTxHomeQueues;
+    for (ULONG i = 0; i < MaxProcessors; ++i)
+    {
+        PeerSerialInit(&Wg->TxHomeQueues[i]);
+        PeerSerialInit(&Wg->RxHomeQueues[i]);
+    }
 
-    Status = PtrRingInit(&Wg->DecryptQueue, MAX_QUEUED_PACKETS);
+    Status = PtrRingInit(&Wg->EncryptQueue, Wg->QueueLimits.Limit[QUEUE_PACKETS]);
     if (!NT_SUCCESS(Status))
+        goto cleanupRxHomeQueues;
+
+    /* Datagrams are indicated on whichever processor RSS steered them to. Give groups of processors their own decrypt
+     * ring, so that they don't all contend on one producer lock.
+     */
+    Status = STATUS_INSUFFICIENT_RESOURCES;
+    Wg->NumDecryptQueues = min(MaxProcessors, MAX_DECRYPT_QUEUES);
+    Wg->DecryptQueues = MemAllocateCacheAlignedArrayAndZero(Wg->NumDecryptQueues, sizeof(*Wg->DecryptQueues));
+    if (!Wg->DecryptQueues)
         goto cleanupEncryptQueue;
+    for (ULONG i = 0; i < Wg->NumDecryptQueues; ++i)
+    {
+        Status = PtrRingInit(
+            &Wg->DecryptQueues[i], QueueLimitsDecryptRingSize(Wg, Wg->QueueLimits.Limit[QUEUE_PACKETS]));
+        if (!NT_SUCCESS(Status))
+            goto cleanupDecryptQueue;
+    }
 
-    Status = PtrRingInit(&Wg->HandshakeRxQueue, MAX_QUEUED_INCOMING_HANDSHAKES);
+    Status = PtrRingInit(&Wg->HandshakeRxQueue, Wg->QueueLimits.Limit[QUEUE_HANDSHAKES]);
     if (!NT_SUCCESS(Status))
         goto cleanupDecryptQueue;
 
@@ -681,9 +703,15 @@ cleanupEncryptThreads:
 cleanupHandshakeRxQueue:
     PtrRingFree(&Wg->HandshakeRxQueue);
 cleanupDecryptQueue:
-    PtrRingFree(&Wg->DecryptQueue);
+    for (ULONG i = 0; i < Wg->NumDecryptQueues; ++i)
+        PtrRingFree(&Wg->DecryptQueues[i]);
+    MemFree(Wg->DecryptQueues);
 cleanupEncryptQueue:
     PtrRingFree(&Wg->EncryptQueue);
+cleanupRxHomeQueues:
+    MemFree(Wg->RxHomeQueues);
+cleanupTxHomeQueues:
+    MemFree(Wg->TxHomeQueues);
 cleanupIndexHashtable:
     MemFree(Wg->IndexHashtable);
 cleanupPeerHashtable:
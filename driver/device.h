@@ -38,6 +38,8 @@ struct _MULTICORE_WORKTHREAD
     SLIST_ENTRY Entry;
     PKTHREAD Thread;
     PROCESSOR_NUMBER Processor;
+    ULONG ProcessorIndex;
+    KEVENT NewLocalWork;
     MULTICORE_WORKTHREAD *NextThread;
     MULTICORE_WORKQUEUE *WorkQueue;
 };
@@ -45,6 +47,8 @@ struct _MULTICORE_WORKTHREAD
 struct _MULTICORE_WORKQUEUE
 {
     MULTICORE_WORKTHREAD *FirstThread;
+    MULTICORE_WORKTHREAD **ThreadsByIndex;
+    ULONG MaxProcessors;
     KEVENT NewWork, NewCpus, Dead;
     PMULTICORE_WORKQUEUE_ROUTINE Func;
     PVOID NewCpuNotifier;
@@ -57,23 +61,101 @@ typedef struct _PEER_SERIAL_ENTRY PEER_SERIAL_ENTRY;
 struct _PEER_SERIAL_ENTRY
 {
     PEER_SERIAL_ENTRY *Next;
-    SHORT Requeue;
+    LONG State;
+    LONG64 Deficit; /* Bytes the peer may still send this round, only touched by the worker holding the entry. */
 };
 
 typedef struct _PEER_SERIAL
 {
-    PEER_SERIAL_ENTRY *First, **Last;
-    KSPIN_LOCK Lock;
+    DECLSPEC_CACHEALIGN PEER_SERIAL_ENTRY *Head;
+    DECLSPEC_CACHEALIGN PEER_SERIAL_ENTRY *Tail;
+    LONG Consuming;
+    PEER_SERIAL_ENTRY Stub;
 } PEER_SERIAL;
 
+typedef enum
+{
+    QUEUE_PACKETS,    /* The encrypt ring, each decrypt ring, and each peer's in-order queues. */
+    QUEUE_STAGED,     /* Each peer's queue of packets waiting for a session. */
+    QUEUE_HANDSHAKES, /* The ring of incoming handshake messages. */
+    QUEUE_KIND_COUNT
+} QUEUE_KIND;
+
+typedef struct _QUEUE_LIMITS
+{
+    ULONG Limit[QUEUE_KIND_COUNT];
+    ULONG XmitPacketsPerRound;
+    BOOLEAN XmitPacketsPerRoundSet; /* Set by the user, so not derived from the packet limit while tuning. */
+    BOOLEAN AutoTune;
+    EX_PUSH_LOCK Lock;
+    /* Written from the data path when a queue drops or gets past half full. */
+    DECLSPEC_CACHEALIGN LONG64 Drops[QUEUE_KIND_COUNT];
+    BOOLEAN HighWater[QUEUE_KIND_COUNT];
+    /* Tuner state, under Lock. */
+    DECLSPEC_CACHEALIGN LONG64 LastTune;
+    LONG64 LastDrops[QUEUE_KIND_COUNT];
+    ULONG QuietRounds[QUEUE_KIND_COUNT];
+} QUEUE_LIMITS;
+
+/* TX rate limits set through WG_IOCTL_SET_PEER_TX_RATE, kept by public key rather than on the peer, so that they
+ * outlive the peer being removed and added again, as WG_IOCTL_SET does when replacing peers. Protected by
+ * DeviceUpdateLock.
+ */
+typedef struct _PEER_TX_RATE_LIMITS
+{
+    DECLARE_HASHTABLE(Hashtable, 8);
+    SIPHASH_KEY Key;
+    ULONG Count;
+} PEER_TX_RATE_LIMITS;
+
+/* A route that could carry packets to peers, with the prefix masked to its length and the interface's metric added. */
+typedef struct _ROUTE_CACHE_ENTRY
+{
+    union
+    {
+        IN_ADDR V4;
+        IN6_ADDR V6;
+    } Prefix;
+    ULONG Metric;
+    NET_IFINDEX InterfaceIndex;
+    NET_LUID InterfaceLuid;
+    UCHAR Cidr;
+} ROUTE_CACHE_ENTRY;
+
+/* Routes of one address family, as of routing generation Generation, sorted by longest prefix, then by prefix, then
+ * by lowest metric. Groups[] has where each prefix length starts, so that the longest match is found by a binary
+ * search per prefix length in use.
+ */
+typedef struct _ROUTE_CACHE
+{
+    EX_PUSH_LOCK Lock;
+    LONG Generation;
+    ULONG Count, NumGroups;
+    ROUTE_CACHE_ENTRY *Entries;
+    struct
+    {
+        ULONG Start, Count;
+        UCHAR Cidr;
+    } Groups[129];
+} ROUTE_CACHE;
+
 typedef struct _WG_DEVICE
 {
     NDIS_HANDLE MiniportAdapterHandle; /* This is actually a pointer to NDIS_MINIPORT_BLOCK struct. */
     DEVICE_OBJECT *FunctionalDeviceObject;
     NDIS_STATISTICS_INFO Statistics;
+    struct
+    {
+        ULONG64 Sends;     /* WskSendMessages calls carrying data packets. */
+        ULONG64 Datagrams; /* Datagrams that those carried. */
+    } SendStats;
     EX_RUNDOWN_REF ItemsInFlight;
-    PTR_RING EncryptQueue, DecryptQueue, HandshakeRxQueue;
+    PTR_RING EncryptQueue, HandshakeRxQueue;
+    /* Decrypt rings, each fed from the processors whose index modulo NumDecryptQueues picks it. */
+    PTR_RING *DecryptQueues;
+    ULONG NumDecryptQueues;
     PEER_SERIAL TxQueue, RxQueue, HandshakeTxQueue;
+    PEER_SERIAL *TxHomeQueues, *RxHomeQueues;
     MULTICORE_WORKQUEUE EncryptThreads, DecryptThreads;
     MULTICORE_WORKQUEUE HandshakeTxThreads, HandshakeRxThreads;
     SOCKET __rcu *Sock4, *Sock6;
@@ -87,11 +169,14 @@ typedef struct _WG_DEVICE
     ULONG NumPeers;
     NET_IFINDEX InterfaceIndex;
     NET_LUID InterfaceLuid;
+    ROUTE_CACHE RouteCache4, RouteCache6;
     PEPROCESS SocketOwnerProcess;
     UINT16 IncomingPort;
-    BOOLEAN IsUp, IsDeviceRemoving;
+    BOOLEAN IsUp, IsDeviceRemoving, PeerHomeCpus;
     ULONG Mtu4, Mtu6;
     ULONG HandshakeRxQueueLen;
+    QUEUE_LIMITS QueueLimits;
+    PEER_TX_RATE_LIMITS TxRateLimits;
     LOG_RING Log;
     LIST_ENTRY DeviceList;
     KEVENT DeviceRemoved;
@@ -116,8 +116,9 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
     ULONG64 FinalSize = sizeof(WG_IOCTL_INTERFACE);
     if (OutSize >= FinalSize)
     {
-        IoctlInterface->Flags = 0;
+        IoctlInterface->Flags = WG_IOCTL_INTERFACE_HAS_PEER_HOME_CPUS;
         IoctlInterface->PeersCount = 0;
+        IoctlInterface->PeerHomeCpus = Wg->PeerHomeCpus;
         if (Wg->IncomingPort != 0)
         {
             IoctlInterface->ListenPort = Wg->IncomingPort;
@@ -141,11 +142,11 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
         if (OutSize >= FinalSize)
         {
             ++IoctlInterface->PeersCount;
-            IoctlPeer->Flags = WG_IOCTL_PEER_HAS_PERSISTENT_KEEPALIVE;
+            IoctlPeer->Flags = WG_IOCTL_PEER_HAS_PERSISTENT_KEEPALIVE | WG_IOCTL_PEER_HAS_WEIGHT;
             IoctlPeer->ProtocolVersion = 1;
             IoctlPeer->PersistentKeepalive = Peer->PersistentKeepaliveInterval;
-            IoctlPeer->RxBytes = Peer->RxBytes;
-            IoctlPeer->TxBytes = Peer->TxBytes;
+            IoctlPeer->Weight = (USHORT)Peer->TxWeight;
+            PeerReadStats(Peer, &IoctlPeer->RxBytes, &IoctlPeer->TxBytes);
             IoctlPeer->LastHandshake = Peer->WalltimeLastHandshake.QuadPart;
             IoctlPeer->AllowedIPsCount = 0;
             if (Peer->ConstantPacketSize)
@@ -162,19 +163,18 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
                 IoctlPeer->Flags |= WG_IOCTL_PEER_HAS_PRESHARED_KEY;
             }
             MuReleasePushLockShared(&Peer->Handshake.Lock);
-            KIRQL Irql;
-            Irql = ExAcquireSpinLockShared(&Peer->EndpointLock);
-            if (Peer->Endpoint.Addr.si_family == AF_INET)
+            SOCKADDR_INET Endpoint;
+            SocketGetPeerEndpointAddr(Peer, &Endpoint);
+            if (Endpoint.si_family == AF_INET)
             {
-                IoctlPeer->Endpoint.Ipv4 = Peer->Endpoint.Addr.Ipv4;
+                IoctlPeer->Endpoint.Ipv4 = Endpoint.Ipv4;
                 IoctlPeer->Flags |= WG_IOCTL_PEER_HAS_ENDPOINT;
             }
-            else if (Peer->Endpoint.Addr.si_family == AF_INET6)
+            else if (Endpoint.si_family == AF_INET6)
             {
-                IoctlPeer->Endpoint.Ipv6 = Peer->Endpoint.Addr.Ipv6;
+                IoctlPeer->Endpoint.Ipv6 = Endpoint.Ipv6;
                 IoctlPeer->Flags |= WG_IOCTL_PEER_HAS_ENDPOINT;
             }
-            ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
         }
 
         WG_IOCTL_ALLOWED_IP *IoctlAllowedIp = (WG_IOCTL_ALLOWED_IP *)((UCHAR *)IoctlPeer + sizeof(WG_IOCTL_PEER));
@@ -375,6 +375,16 @@ SetPeer(_Inout_ WG_DEVICE *Wg, _Inout_ CONST volatile WG_IOCTL_PEER **UnsafeIoct
     if (IoctlPeer.Flags & WG_IOCTL_PEER_HAS_CONSTANT_PACKET_SIZE)
         WriteBooleanRelease(&Peer->ConstantPacketSize, IoctlPeer.ConstantPacketSize);
 
+    if (IoctlPeer.Flags & WG_IOCTL_PEER_HAS_WEIGHT)
+    {
+        if (!IoctlPeer.Weight || IoctlPeer.Weight > PEER_TX_WEIGHT_MAX)
+        {
+            Status = STATUS_INVALID_PARAMETER;
+            goto cleanupPeer;
+        }
+        WriteULongNoFence(&Peer->TxWeight, IoctlPeer.Weight);
+    }
+
     BOOLEAN IsUp = ReadBooleanNoFence(&Wg->IsUp);
     if (IoctlPeer.Flags & WG_IOCTL_PEER_HAS_PERSISTENT_KEEPALIVE)
     {
@@ -421,6 +431,9 @@ SetInterface(
     if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_REPLACE_PEERS)
         PeerRemoveAll(Wg);
 
+    if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_HAS_PEER_HOME_CPUS)
+        WriteBooleanNoFence(&Wg->PeerHomeCpus, !!IoctlInterface.PeerHomeCpus);
+
     if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_HAS_PRIVATE_KEY)
     {
         Status = SetPrivateKey(Wg, IoctlInterface.PrivateKey);
@@ -593,6 +606,253 @@ ReadLogLine(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
         Irp->IoStatus.Information = sizeof(WG_IOCTL_LOG_ENTRY);
 }
 
+static_assert(
+    WG_IOCTL_CRYPTO_PRIMITIVE_COUNT == CRYPTO_PRIMITIVE_COUNT &&
+        WG_IOCTL_CRYPTO_CHACHA20 == CRYPTO_PRIMITIVE_CHACHA20 &&
+        WG_IOCTL_CRYPTO_POLY1305 == CRYPTO_PRIMITIVE_POLY1305 && WG_IOCTL_CRYPTO_BLAKE2S == CRYPTO_PRIMITIVE_BLAKE2S &&
+        WG_IOCTL_CRYPTO_CURVE25519 == CRYPTO_PRIMITIVE_CURVE25519,
+    "Crypto primitive mismatch");
+static_assert(
+    WG_IOCTL_CRYPTO_IMPL_COUNT == CRYPTO_IMPL_COUNT && WG_IOCTL_CRYPTO_IMPL_AUTO == CRYPTO_IMPL_AUTO &&
+        WG_IOCTL_CRYPTO_IMPL_GENERIC == CRYPTO_IMPL_GENERIC && WG_IOCTL_CRYPTO_IMPL_ALU == CRYPTO_IMPL_ALU &&
+        WG_IOCTL_CRYPTO_IMPL_SSSE3 == CRYPTO_IMPL_SSSE3 && WG_IOCTL_CRYPTO_IMPL_AVX == CRYPTO_IMPL_AVX &&
+        WG_IOCTL_CRYPTO_IMPL_AVX2 == CRYPTO_IMPL_AVX2 && WG_IOCTL_CRYPTO_IMPL_AVX512F == CRYPTO_IMPL_AVX512F &&
+        WG_IOCTL_CRYPTO_IMPL_AVX512VL == CRYPTO_IMPL_AVX512VL &&
+        WG_IOCTL_CRYPTO_IMPL_AVX512IFMA == CRYPTO_IMPL_AVX512IFMA && WG_IOCTL_CRYPTO_IMPL_BMI2 == CRYPTO_IMPL_BMI2,
+    "Crypto implementation mismatch");
+static_assert(
+    WG_IOCTL_QUEUE_PACKETS == QUEUE_PACKETS && WG_IOCTL_QUEUE_STAGED == QUEUE_STAGED &&
+        WG_IOCTL_QUEUE_HANDSHAKES == QUEUE_HANDSHAKES && WG_IOCTL_QUEUE_KIND_COUNT == QUEUE_KIND_COUNT,
+    "Queue kind mismatch");
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+Crypto(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    WG_IOCTL_CRYPTO_PRIMITIVE Primitives[WG_IOCTL_CRYPTO_PRIMITIVE_COUNT];
+
+    Irp->IoStatus.Information = 0;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG InSize = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG OutSize = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+    if (!HasAccess(InSize ? FILE_WRITE_DATA : FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    if ((InSize && InSize != sizeof(Primitives)) || (OutSize && OutSize < sizeof(Primitives)))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    if (InSize)
+    {
+        RtlCopyMemory(Primitives, Irp->AssociatedIrp.SystemBuffer, sizeof(Primitives));
+        for (ULONG i = 0; i < WG_IOCTL_CRYPTO_PRIMITIVE_COUNT; ++i)
+        {
+            if (!(Primitives[i].Flags & WG_IOCTL_CRYPTO_HAS_OVERRIDE))
+                continue;
+            NTSTATUS Status = CryptoSetImplementation(i, (CRYPTO_IMPL)Primitives[i].Override);
+            if (!NT_SUCCESS(Status))
+            {
+                Irp->IoStatus.Status = Status;
+                return;
+            }
+            LogInfo(Wg, "Crypto primitive %u forced to implementation %u", i, Primitives[i].Override);
+        }
+    }
+    if (!OutSize)
+        return;
+    for (ULONG i = 0; i < WG_IOCTL_CRYPTO_PRIMITIVE_COUNT; ++i)
+    {
+        CRYPTO_IMPL Override, Active;
+        Primitives[i].Flags = 0;
+        CryptoGetImplementation(i, &Override, &Active, Primitives[i].Bytes);
+        if (Override != CRYPTO_IMPL_AUTO)
+            Primitives[i].Flags |= WG_IOCTL_CRYPTO_HAS_OVERRIDE;
+        Primitives[i].Override = (WG_IOCTL_CRYPTO_IMPL)Override;
+        Primitives[i].Active = (WG_IOCTL_CRYPTO_IMPL)Active;
+    }
+    RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, Primitives, sizeof(Primitives));
+    Irp->IoStatus.Information = sizeof(Primitives);
+    if (OutSize >= sizeof(Primitives) + sizeof(WG_IOCTL_CRYPTO_SIMD))
+    {
+        WG_IOCTL_CRYPTO_SIMD Simd;
+        CryptoGetSimdStats(&Simd.XStateSaves, &Simd.XStatePackets);
+        RtlCopyMemory((UCHAR *)Irp->AssociatedIrp.SystemBuffer + sizeof(Primitives), &Simd, sizeof(Simd));
+        Irp->IoStatus.Information += sizeof(Simd);
+    }
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+QueueLimits(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    WG_IOCTL_QUEUE_LIMITS IoctlLimits;
+
+    Irp->IoStatus.Information = 0;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG InSize = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG OutSize = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+    if (!HasAccess(InSize ? FILE_WRITE_DATA : FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    if ((InSize && InSize != sizeof(IoctlLimits)) || (OutSize && OutSize < sizeof(IoctlLimits)))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    /* Keeps the rings from being freed under us. */
+    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    if (InSize)
+    {
+        RtlCopyMemory(&IoctlLimits, Irp->AssociatedIrp.SystemBuffer, sizeof(IoctlLimits));
+        BOOLEAN AutoTune = IoctlLimits.Flags & WG_IOCTL_QUEUE_LIMITS_HAS_AUTO_TUNE
+                               ? !!IoctlLimits.AutoTune
+                               : ReadBooleanNoFence(&Wg->QueueLimits.AutoTune);
+        Irp->IoStatus.Status = QueueLimitsSet(Wg, IoctlLimits.Limit, IoctlLimits.XmitPacketsPerRound, AutoTune);
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+            goto cleanupLock;
+        LogInfo(
+            Wg,
+            "Queue limits set to %u/%u/%u, %u per round, auto-tuning %s",
+            Wg->QueueLimits.Limit[QUEUE_PACKETS],
+            Wg->QueueLimits.Limit[QUEUE_STAGED],
+            Wg->QueueLimits.Limit[QUEUE_HANDSHAKES],
+            Wg->QueueLimits.XmitPacketsPerRound,
+            AutoTune ? "on" : "off");
+    }
+    if (!OutSize)
+        goto cleanupLock;
+    RtlZeroMemory(&IoctlLimits, sizeof(IoctlLimits));
+    MuAcquirePushLockShared(&Wg->QueueLimits.Lock);
+    IoctlLimits.Flags = WG_IOCTL_QUEUE_LIMITS_HAS_AUTO_TUNE;
+    IoctlLimits.AutoTune = Wg->QueueLimits.AutoTune;
+    for (ULONG i = 0; i < WG_IOCTL_QUEUE_KIND_COUNT; ++i)
+    {
+        IoctlLimits.Limit[i] = Wg->QueueLimits.Limit[i];
+        IoctlLimits.Drops[i] = (ULONG64)ReadNoFence64(&Wg->QueueLimits.Drops[i]);
+    }
+    IoctlLimits.XmitPacketsPerRound = Wg->QueueLimits.XmitPacketsPerRound;
+    MuReleasePushLockShared(&Wg->QueueLimits.Lock);
+    RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, &IoctlLimits, sizeof(IoctlLimits));
+    Irp->IoStatus.Information = sizeof(IoctlLimits);
+    if (OutSize >= sizeof(IoctlLimits) + sizeof(WG_IOCTL_SEND_STATS))
+    {
+        WG_IOCTL_SEND_STATS SendStats = { .Sends = Wg->SendStats.Sends, .Datagrams = Wg->SendStats.Datagrams };
+        RtlCopyMemory((UCHAR *)Irp->AssociatedIrp.SystemBuffer + sizeof(IoctlLimits), &SendStats, sizeof(SendStats));
+        Irp->IoStatus.Information += sizeof(SendStats);
+    }
+cleanupLock:
+    MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+PeerTxRate(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    WG_IOCTL_PEER_TX_RATE IoctlRate;
+
+    Irp->IoStatus.Information = 0;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG InSize = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG OutSize = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+    if (InSize != sizeof(IoctlRate) || (OutSize && OutSize < sizeof(IoctlRate)))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+    RtlCopyMemory(&IoctlRate, Irp->AssociatedIrp.SystemBuffer, sizeof(IoctlRate));
+    BOOLEAN Setting = !!(IoctlRate.Flags & WG_IOCTL_PEER_TX_RATE_HAS_LIMIT);
+    if (!HasAccess(Setting ? FILE_WRITE_DATA : FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    if (Setting && IoctlRate.Limit > PEER_TX_RATE_MAX)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+    if (Setting)
+    {
+        Irp->IoStatus.Status = PeerSetTxRateLimit(Wg, IoctlRate.PublicKey, IoctlRate.Limit);
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+            goto cleanupLock;
+    }
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    if (OutSize)
+    {
+        IoctlRate.Flags = WG_IOCTL_PEER_TX_RATE_HAS_LIMIT;
+        IoctlRate.Limit = PeerGetTxRateLimit(Wg, IoctlRate.PublicKey);
+        RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, &IoctlRate, sizeof(IoctlRate));
+        Irp->IoStatus.Information = sizeof(IoctlRate);
+    }
+cleanupLock:
+    MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+PeerStats(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    WG_IOCTL_PEER_STATS IoctlStats;
+
+    Irp->IoStatus.Information = 0;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    if (Stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(IoctlStats) ||
+        Stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(IoctlStats))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+    if (!HasAccess(FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    RtlCopyMemory(&IoctlStats, Irp->AssociatedIrp.SystemBuffer, sizeof(IoctlStats));
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    MuAcquirePushLockShared(&Wg->DeviceUpdateLock);
+    WG_PEER *Peer = PubkeyHashtableLookup(Wg->PeerHashtable, IoctlStats.PublicKey);
+    if (!Peer)
+    {
+        Irp->IoStatus.Status = STATUS_NOT_FOUND;
+        goto cleanupLock;
+    }
+    IoctlStats.EndpointChanges = ReadULong64NoFence(&Peer->EndpointChanges);
+    PeerPut(Peer);
+    RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, &IoctlStats, sizeof(IoctlStats));
+    Irp->IoStatus.Information = sizeof(IoctlStats);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+cleanupLock:
+    MuReleasePushLockShared(&Wg->DeviceUpdateLock);
+}
+
 _Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
 static DRIVER_DISPATCH_PAGED DispatchDeviceControl;
 _Use_decl_annotations_
@@ -614,6 +874,18 @@ DispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
     case WG_IOCTL_READ_LOG_LINE:
         ReadLogLine(DeviceObject, Irp);
         break;
+    case WG_IOCTL_CRYPTO:
+        Crypto(DeviceObject, Irp);
+        break;
+    case WG_IOCTL_SET_QUEUE_LIMITS:
+        QueueLimits(DeviceObject, Irp);
+        break;
+    case WG_IOCTL_SET_PEER_TX_RATE:
+        PeerTxRate(DeviceObject, Irp);
+        break;
+    case WG_IOCTL_GET_PEER_STATS:
+        PeerStats(DeviceObject, Irp);
+        break;
     default:
         return NdisDispatchDeviceControl(DeviceObject, Irp);
     }
@@ -43,7 +43,8 @@ typedef enum
     WG_IOCTL_PEER_REPLACE_ALLOWED_IPS = 1 << 5,
     WG_IOCTL_PEER_REMOVE = 1 << 6,
     WG_IOCTL_PEER_UPDATE = 1 << 7,
-    WG_IOCTL_PEER_HAS_CONSTANT_PACKET_SIZE = 1 << 8
+    WG_IOCTL_PEER_HAS_CONSTANT_PACKET_SIZE = 1 << 8,
+    WG_IOCTL_PEER_HAS_WEIGHT = 1 << 9
 } WG_IOCTL_PEER_FLAG;
 
 typedef __declspec(align(8)) struct _WG_IOCTL_PEER
@@ -59,6 +60,7 @@ typedef __declspec(align(8)) struct _WG_IOCTL_PEER
     ULONG64 LastHandshake;
     ULONG AllowedIPsCount;
     BOOLEAN ConstantPacketSize;
+    USHORT Weight; /* Share of sending, though not of encryption, relative to other peers, from 1 to 256. */
 } WG_IOCTL_PEER;
 
 typedef enum
@@ -66,7 +68,8 @@ typedef enum
     WG_IOCTL_INTERFACE_HAS_PUBLIC_KEY = 1 << 0,
     WG_IOCTL_INTERFACE_HAS_PRIVATE_KEY = 1 << 1,
     WG_IOCTL_INTERFACE_HAS_LISTEN_PORT = 1 << 2,
-    WG_IOCTL_INTERFACE_REPLACE_PEERS = 1 << 3
+    WG_IOCTL_INTERFACE_REPLACE_PEERS = 1 << 3,
+    WG_IOCTL_INTERFACE_HAS_PEER_HOME_CPUS = 1 << 4
 } WG_IOCTL_INTERFACE_FLAG;
 
 typedef __declspec(align(8)) struct _WG_IOCTL_INTERFACE
@@ -76,6 +79,7 @@ typedef __declspec(align(8)) struct _WG_IOCTL_INTERFACE
     UCHAR PrivateKey[WG_KEY_LEN];
     UCHAR PublicKey[WG_KEY_LEN];
     ULONG PeersCount;
+    BOOLEAN PeerHomeCpus;
 } WG_IOCTL_INTERFACE;
 
 typedef enum
@@ -91,6 +95,95 @@ typedef __declspec(align(8)) struct _WG_IOCTL_LOG_ENTRY
     CHAR Msg[120];
 } WG_IOCTL_LOG_ENTRY;
 
+typedef enum
+{
+    WG_IOCTL_CRYPTO_CHACHA20 = 0,
+    WG_IOCTL_CRYPTO_POLY1305 = 1,
+    WG_IOCTL_CRYPTO_BLAKE2S = 2,
+    WG_IOCTL_CRYPTO_CURVE25519 = 3,
+    WG_IOCTL_CRYPTO_PRIMITIVE_COUNT = 4
+} WG_IOCTL_CRYPTO_PRIMITIVE_ID;
+
+typedef enum
+{
+    WG_IOCTL_CRYPTO_IMPL_AUTO = 0,
+    WG_IOCTL_CRYPTO_IMPL_GENERIC = 1,
+    WG_IOCTL_CRYPTO_IMPL_ALU = 2,
+    WG_IOCTL_CRYPTO_IMPL_SSSE3 = 3,
+    WG_IOCTL_CRYPTO_IMPL_AVX = 4,
+    WG_IOCTL_CRYPTO_IMPL_AVX2 = 5,
+    WG_IOCTL_CRYPTO_IMPL_AVX512F = 6,
+    WG_IOCTL_CRYPTO_IMPL_AVX512VL = 7,
+    WG_IOCTL_CRYPTO_IMPL_AVX512IFMA = 8,
+    WG_IOCTL_CRYPTO_IMPL_BMI2 = 9,
+    WG_IOCTL_CRYPTO_IMPL_COUNT = 10
+} WG_IOCTL_CRYPTO_IMPL;
+
+typedef enum
+{
+    WG_IOCTL_CRYPTO_HAS_OVERRIDE = 1 << 0
+} WG_IOCTL_CRYPTO_FLAG;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_CRYPTO_PRIMITIVE
+{
+    WG_IOCTL_CRYPTO_FLAG Flags;
+    WG_IOCTL_CRYPTO_IMPL Override; /* WG_IOCTL_CRYPTO_IMPL_AUTO = pick the fastest one. */
+    WG_IOCTL_CRYPTO_IMPL Active;   /* What's used when all of the CPU's features are available. */
+    ULONG64 Bytes[WG_IOCTL_CRYPTO_IMPL_COUNT];
+} WG_IOCTL_CRYPTO_PRIMITIVE;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_CRYPTO_SIMD
+{
+    ULONG64 XStateSaves;   /* Times the AVX or AVX-512 state was saved to use it. */
+    ULONG64 XStatePackets; /* Packets processed while holding such a saved state. */
+} WG_IOCTL_CRYPTO_SIMD;
+
+typedef enum
+{
+    WG_IOCTL_QUEUE_PACKETS = 0,    /* Encrypt and decrypt rings, and each peer's in-order queues. */
+    WG_IOCTL_QUEUE_STAGED = 1,     /* Each peer's queue of packets waiting for a session. */
+    WG_IOCTL_QUEUE_HANDSHAKES = 2, /* Ring of incoming handshake messages. */
+    WG_IOCTL_QUEUE_KIND_COUNT = 3
+} WG_IOCTL_QUEUE_KIND;
+
+typedef enum
+{
+    WG_IOCTL_QUEUE_LIMITS_HAS_AUTO_TUNE = 1 << 0
+} WG_IOCTL_QUEUE_LIMITS_FLAG;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_QUEUE_LIMITS
+{
+    WG_IOCTL_QUEUE_LIMITS_FLAG Flags;
+    BOOLEAN AutoTune;                         /* Grow limits of queues that drop, shrink those that stay short. */
+    ULONG Limit[WG_IOCTL_QUEUE_KIND_COUNT];   /* In packets, or 0 to leave it as it is. */
+    ULONG XmitPacketsPerRound;                /* Packets completed for a peer before the next, or 0 to leave it. */
+    ULONG64 Drops[WG_IOCTL_QUEUE_KIND_COUNT]; /* Packets dropped because the queue was full. Ignored on input. */
+} WG_IOCTL_QUEUE_LIMITS;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_SEND_STATS
+{
+    ULONG64 Sends;     /* Calls handing data packets to the socket. */
+    ULONG64 Datagrams; /* Datagrams that those carried, so Datagrams / Sends of them per call. */
+} WG_IOCTL_SEND_STATS;
+
+typedef enum
+{
+    WG_IOCTL_PEER_TX_RATE_HAS_LIMIT = 1 << 0
+} WG_IOCTL_PEER_TX_RATE_FLAG;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_PEER_TX_RATE
+{
+    WG_IOCTL_PEER_TX_RATE_FLAG Flags;
+    UCHAR PublicKey[WG_KEY_LEN];
+    ULONG64 Limit; /* Bytes per second sent to the peer at most, or 0 for no limit. */
+} WG_IOCTL_PEER_TX_RATE;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_PEER_STATS
+{
+    UCHAR PublicKey[WG_KEY_LEN];
+    ULONG64 EndpointChanges; /* Times the endpoint has moved to a new address or source. */
+} WG_IOCTL_PEER_STATS;
+
 /* Get adapter properties.
  *
  * The lpOutBuffer and nOutBufferSize parameters of DeviceIoControl() must describe an user allocated buffer
@@ -113,6 +206,43 @@ typedef __declspec(align(8)) struct _WG_IOCTL_LOG_ENTRY
 /* Read the next line in the adapter log. */
 #define WG_IOCTL_READ_LOG_LINE CTL_CODE(45208U, 324, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 
+/* Query or force the crypto implementations. These are driver-wide, so it doesn't matter which adapter is used.
+ *
+ * The input buffer is either empty or WG_IOCTL_CRYPTO_PRIMITIVE_COUNT WG_IOCTL_CRYPTO_PRIMITIVE structs, indexed by
+ * WG_IOCTL_CRYPTO_PRIMITIVE_ID, of which those with WG_IOCTL_CRYPTO_HAS_OVERRIDE have their Override applied. The
+ * output buffer receives the same array with the resulting state of each primitive, followed by a
+ * WG_IOCTL_CRYPTO_SIMD struct if there's room for it.
+ */
+#define WG_IOCTL_CRYPTO CTL_CODE(45208U, 326, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Query or set the adapter's queue limits.
+ *
+ * The input buffer is either empty or a WG_IOCTL_QUEUE_LIMITS struct, of which the non-zero limits are applied, as
+ * is AutoTune if WG_IOCTL_QUEUE_LIMITS_HAS_AUTO_TUNE is set. Limits range from 16 to 16384. The output buffer
+ * receives a WG_IOCTL_QUEUE_LIMITS struct with the resulting limits, which change by themselves with AutoTune,
+ * followed by a WG_IOCTL_SEND_STATS struct if there's room for it. AutoTune also derives XmitPacketsPerRound from the
+ * packet limit, but not once XmitPacketsPerRound has been set here.
+ */
+#define WG_IOCTL_SET_QUEUE_LIMITS CTL_CODE(45208U, 327, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Query or set a peer's egress rate limit.
+ *
+ * The input buffer is a WG_IOCTL_PEER_TX_RATE struct naming the peer by its PublicKey, of which the Limit is applied
+ * if WG_IOCTL_PEER_TX_RATE_HAS_LIMIT is set. Limits go up to 2^40 bytes per second, and 0 removes the limit. The
+ * output buffer is either empty or receives a WG_IOCTL_PEER_TX_RATE struct with the resulting limit. Limits are kept
+ * by public key, so they may be set before the peer is added, and stay when WG_IOCTL_SET removes or replaces it. This
+ * is kept out of WG_IOCTL_PEER, which has no room left for it, so that the layout of WG_IOCTL_GET and WG_IOCTL_SET
+ * stays as it was.
+ */
+#define WG_IOCTL_SET_PEER_TX_RATE CTL_CODE(45208U, 328, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Query a peer's statistics beyond those in WG_IOCTL_PEER.
+ *
+ * The input buffer is a WG_IOCTL_PEER_STATS struct naming the peer by its PublicKey, and the output buffer receives
+ * the same struct filled in.
+ */
+#define WG_IOCTL_GET_PEER_STATS CTL_CODE(45208U, 329, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
 #ifdef _KERNEL_MODE
 
 typedef struct _WG_DEVICE WG_DEVICE;
@@ -26,7 +26,7 @@ DriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
 
     ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
 
-    CryptoDriverEntry();
+    CryptoDriverEntry(RegistryPath);
     NoiseDriverEntry();
 
     Ret = MemDriverEntry();
@@ -54,7 +54,8 @@ DriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
         goto cleanupPeer;
 
 #ifdef DBG
-    if (!CryptoSelftest() || !AllowedIpsSelftest() || !PacketCounterSelftest() || !RatelimiterSelftest())
+    if (!CryptoSelftest() || !AllowedIpsSelftest() || !PacketCounterSelftest() || !RatelimiterSelftest() ||
+        !PeerSerialSelftest() || !RouteCacheSelftest())
     {
         Ret = STATUS_INTERNAL_ERROR;
         goto cleanupDevice;
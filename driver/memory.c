@@ -10,6 +10,26 @@ static CONST ULONG PacketCacheSizes[] = { 192, 512, 1024, 1500, 9000 };
 static NDIS_HANDLE LooseNbPool, LooseNblPool;
 static NDIS_HANDLE NbDataPools[ARRAYSIZE(PacketCacheSizes)], NblDataPools[ARRAYSIZE(PacketCacheSizes)];
 
+/* Received datagrams up to this many bytes, which is nearly all of them, get their NBL from the per processor caches
+ * below, and once returned put it back there instead of into its pool, so that steady state receiving allocates
+ * nothing and decrypts into buffers that are still warm in cache. Each cache holds up to RX_NBL_CACHE_DEPTH NBLs, fewer
+ * on machines with many processors, so that all of them together never hold more than RX_NBL_CACHE_TOTAL, about 6 MiB
+ * of buffers, and they are emptied whenever an adapter halts.
+ */
+#define RX_NBL_CACHE_SIZE_CLASS 3
+#define RX_NBL_CACHE_DEPTH 256
+#define RX_NBL_CACHE_TOTAL 4096
+static_assert(RX_NBL_CACHE_SIZE_CLASS < ARRAYSIZE(PacketCacheSizes), "Receive cache size class out of range");
+
+/* Only touched at DISPATCH_LEVEL by the processor it belongs to, so needs no lock. */
+typedef struct _RX_NBL_CACHE
+{
+    DECLSPEC_CACHEALIGN NET_BUFFER_LIST *Head;
+    ULONG Count;
+} RX_NBL_CACHE;
+static RX_NBL_CACHE *RxNblCaches;
+static ULONG NumRxNblCaches, RxNblCacheDepth;
+
 #pragma warning(suppress : 28195) /* IoAllocateMdl allocates, even if missing the SAL annotation. */
 _Use_decl_annotations_
 MDL *
@@ -104,6 +124,63 @@ MemFreeNetBufferList(NET_BUFFER_LIST *Nbl)
     NdisFreeNetBufferList(Nbl);
 }
 
+_Use_decl_annotations_
+NET_BUFFER_LIST *
+MemAllocateReceiveNetBufferList(ULONG Size)
+{
+    if (Size > PacketCacheSizes[RX_NBL_CACHE_SIZE_CLASS])
+        return MemAllocateNetBufferList(0, Size, 0);
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    RX_NBL_CACHE *Cache = &RxNblCaches[KeGetCurrentProcessorIndex() % NumRxNblCaches];
+    NET_BUFFER_LIST *Nbl = Cache->Head;
+    if (Nbl)
+    {
+        Cache->Head = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+        --Cache->Count;
+    }
+    KeLowerIrql(Irql);
+    if (!Nbl)
+    {
+        Nbl = NdisAllocateNetBufferList(NblDataPools[RX_NBL_CACHE_SIZE_CLASS], 0, 0);
+        if (!Nbl)
+            return NULL;
+    }
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    NET_BUFFER_CURRENT_MDL(Nb) = NET_BUFFER_FIRST_MDL(Nb);
+    NET_BUFFER_DATA_OFFSET(Nb) = NET_BUFFER_CURRENT_MDL_OFFSET(Nb) = 0;
+    NET_BUFFER_DATA_LENGTH(Nb) = Size;
+    return Nbl;
+}
+
+_Use_decl_annotations_
+VOID
+MemFreeReceiveNetBufferList(NET_BUFFER_LIST *Nbl)
+{
+    if (Nbl->NdisPoolHandle != NblDataPools[RX_NBL_CACHE_SIZE_CLASS])
+    {
+        MemFreeNetBufferList(Nbl);
+        return;
+    }
+    /* Undo what PacketConsumeDataDone set up for indicating it, so that the next datagram starts from scratch. */
+    Nbl->SourceHandle = NULL;
+    Nbl->Status = NDIS_STATUS_SUCCESS;
+    NdisClearNblFlag(Nbl, NDIS_NBL_FLAGS_IS_IPV4 | NDIS_NBL_FLAGS_IS_IPV6);
+    RtlZeroMemory(Nbl->NetBufferListInfo, sizeof(Nbl->NetBufferListInfo));
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    RX_NBL_CACHE *Cache = &RxNblCaches[KeGetCurrentProcessorIndex() % NumRxNblCaches];
+    if (Cache->Count < RxNblCacheDepth)
+    {
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = Cache->Head;
+        Cache->Head = Nbl;
+        ++Cache->Count;
+        Nbl = NULL;
+    }
+    KeLowerIrql(Irql);
+    if (Nbl)
+        NdisFreeNetBufferList(Nbl);
+}
+
 #pragma warning(suppress : 28195) /* NdisAllocateNetBufferList & co allocate. */
 _Use_decl_annotations_
 NET_BUFFER_LIST *
@@ -271,8 +348,15 @@ MemDriverEntry(VOID)
     LooseNbPool = NdisAllocateNetBufferPool(NULL, &LooseNbPoolParameters);
     if (!LooseNbPool)
         goto cleanupLooseNblPool;
+    NumRxNblCaches = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    RxNblCacheDepth = min(RX_NBL_CACHE_DEPTH, RX_NBL_CACHE_TOTAL / NumRxNblCaches);
+    RxNblCaches = MemAllocateCacheAlignedArrayAndZero(NumRxNblCaches, sizeof(*RxNblCaches));
+    if (!RxNblCaches)
+        goto cleanupLooseNbPool;
     return STATUS_SUCCESS;
 
+cleanupLooseNbPool:
+    NdisFreeNetBufferPool(LooseNbPool);
 cleanupLooseNblPool:
     NdisFreeNetBufferListPool(LooseNblPool);
 cleanupNbDataPools:
@@ -285,9 +369,45 @@ cleanup:
     return STATUS_INSUFFICIENT_RESOURCES;
 }
 
+_Use_decl_annotations_
+VOID
+MemTrimReceiveNetBufferListCaches(VOID)
+{
+    ULONG Processors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    for (ULONG i = 0; i < Processors && i < NumRxNblCaches; ++i)
+    {
+        PROCESSOR_NUMBER Processor;
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &Processor)))
+            continue;
+        /* The caches have no lock, so each one is taken apart from the processor it belongs to. */
+        GROUP_AFFINITY Affinity = { .Mask = (KAFFINITY)1 << Processor.Number, .Group = Processor.Group }, OldAffinity;
+        KeSetSystemGroupAffinityThread(&Affinity, &OldAffinity);
+        KIRQL Irql = KeRaiseIrqlToDpcLevel();
+        NET_BUFFER_LIST *Nbl = RxNblCaches[i].Head;
+        RxNblCaches[i].Head = NULL;
+        RxNblCaches[i].Count = 0;
+        KeLowerIrql(Irql);
+        KeRevertToUserGroupAffinityThread(&OldAffinity);
+        for (NET_BUFFER_LIST *NextNbl; Nbl; Nbl = NextNbl)
+        {
+            NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+            NdisFreeNetBufferList(Nbl);
+        }
+    }
+}
+
 _Use_decl_annotations_
 VOID MemUnload(VOID)
 {
+    for (ULONG i = 0; i < NumRxNblCaches; ++i)
+    {
+        for (NET_BUFFER_LIST *Nbl = RxNblCaches[i].Head, *NextNbl; Nbl; Nbl = NextNbl)
+        {
+            NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+            NdisFreeNetBufferList(Nbl);
+        }
+    }
+    MemFree(RxNblCaches);
     NdisFreeNetBufferPool(LooseNbPool);
     NdisFreeNetBufferListPool(LooseNblPool);
     for (ULONG i = 0; i < ARRAYSIZE(PacketCacheSizes); ++i)
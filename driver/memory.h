@@ -77,6 +77,48 @@ MemAllocateArrayAndZero(_In_ SIZE_T NumberOfElements, _In_ SIZE_T SizeOfOneEleme
     return ExAllocatePoolZero(NonPagedPool, Size, MEMORY_TAG);
 }
 
+/* Small pool allocations are only aligned to 16 bytes, which is not enough for structures whose DECLSPEC_CACHEALIGN
+ * members are meant to keep processors off each other's cache lines. With POOL_NX_OPTIN, this becomes
+ * NonPagedPoolNxCacheAligned.
+ */
+#define MEM_CACHE_ALIGNED_POOL ((POOL_TYPE)(NonPagedPool | CACHE_ALIGNED_POOL_MASK))
+#define MEM_IS_CACHE_ALIGNED(Ptr) ((((ULONG_PTR)(Ptr)) & (SYSTEM_CACHE_ALIGNMENT_SIZE - 1)) == 0)
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Post_maybenull_
+_Must_inspect_result_
+_Post_writable_byte_size_(NumberOfBytes)
+_Return_type_success_(return != NULL)
+_At_buffer_((UCHAR *)return, _Iter_, NumberOfBytes, _Post_satisfies_(((UCHAR *)return )[_Iter_] == 0))
+static inline __drv_allocatesMem(Mem)
+VOID *
+MemAllocateCacheAlignedAndZero(_In_ SIZE_T NumberOfBytes)
+{
+    VOID *Ptr = ExAllocatePoolZero(MEM_CACHE_ALIGNED_POOL, NumberOfBytes, MEMORY_TAG);
+    NT_ASSERT(MEM_IS_CACHE_ALIGNED(Ptr));
+    return Ptr;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Post_maybenull_
+_Must_inspect_result_
+_Post_writable_byte_size_((NumberOfElements) * (SizeOfOneElement))
+_Return_type_success_(return != NULL)
+_At_buffer_(
+    (UCHAR *)return,
+    _Iter_,
+    NumberOfElements *SizeOfOneElement,
+    _Post_satisfies_(((UCHAR *)return )[_Iter_] == 0))
+static inline __drv_allocatesMem(Mem)
+VOID *
+MemAllocateCacheAlignedArrayAndZero(_In_ SIZE_T NumberOfElements, _In_ SIZE_T SizeOfOneElement)
+{
+    SIZE_T Size;
+    if (!NT_SUCCESS(RtlSIZETMult(NumberOfElements, SizeOfOneElement, &Size)))
+        return NULL;
+    return MemAllocateCacheAlignedAndZero(Size);
+}
+
 #pragma warning(pop)
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -119,6 +161,25 @@ MemAllocateNetBufferList(
     _In_ ULONG Size,
     _In_ ULONG SpaceAfter);
 
+/* The same as MemAllocateNetBufferList(0, Size, 0), but for received datagrams, which are recycled rather than freed
+ * when given to MemFreeReceiveNetBufferList.
+ */
+_Must_inspect_result_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Return_type_success_(return != NULL)
+__drv_allocatesMem(mem)
+NET_BUFFER_LIST *
+MemAllocateReceiveNetBufferList(_In_ ULONG Size);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+MemFreeReceiveNetBufferList(__drv_freesMem(mem) _In_ NET_BUFFER_LIST *Nbl);
+
+/* Frees the NBLs that MemFreeReceiveNetBufferList has been holding on to. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+MemTrimReceiveNetBufferListCaches(VOID);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 __drv_allocatesMem(mem)
 NET_BUFFER_LIST *
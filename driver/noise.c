@@ -104,7 +104,7 @@ _Return_type_success_(return != NULL)
 static __drv_allocatesMem(Mem) NOISE_KEYPAIR *
 KeypairCreate(_In_ WG_PEER *Peer)
 {
-    NOISE_KEYPAIR *Keypair = MemAllocateAndZero(sizeof(*Keypair));
+    NOISE_KEYPAIR *Keypair = MemAllocateCacheAlignedAndZero(sizeof(*Keypair));
 
     if (!Keypair)
         return NULL;
@@ -608,9 +608,40 @@ out:
     return Ret;
 }
 
+_Use_decl_annotations_
+VOID
+NoiseHandshakePrecomputeInitiations(
+    WG_DEVICE *Wg,
+    CONST MESSAGE_HANDSHAKE_INITIATION *CONST Srcs[],
+    ULONG Count,
+    UINT8 (*Es)[NOISE_PUBLIC_KEY_LEN])
+{
+    UINT8 *Out[CURVE25519_MAX_BATCH];
+    CONST UINT8 *Scalar[CURVE25519_MAX_BATCH];
+    CONST UINT8 *Point[CURVE25519_MAX_BATCH];
+    BOOLEAN Ret[CURVE25519_MAX_BATCH];
+    ULONG i;
+
+    NT_ASSERT(Count <= CURVE25519_MAX_BATCH);
+    MuAcquirePushLockShared(&Wg->StaticIdentity.Lock);
+    if (Wg->StaticIdentity.HasIdentity && Count)
+    {
+        for (i = 0; i < Count; ++i)
+        {
+            Out[i] = Es[i];
+            Scalar[i] = Wg->StaticIdentity.StaticPrivate;
+            Point[i] = Srcs[i]->UnencryptedEphemeral;
+        }
+        Curve25519Batch(Out, Scalar, Point, Ret, Count);
+    }
+    else
+        RtlZeroMemory(Es, Count * NOISE_PUBLIC_KEY_LEN);
+    MuReleasePushLockShared(&Wg->StaticIdentity.Lock);
+}
+
 _Use_decl_annotations_
 WG_PEER *
-NoiseHandshakeConsumeInitiation(CONST MESSAGE_HANDSHAKE_INITIATION *Src, WG_DEVICE *Wg)
+NoiseHandshakeConsumeInitiation(CONST MESSAGE_HANDSHAKE_INITIATION *Src, WG_DEVICE *Wg, CONST UINT8 *PrecomputedEs)
 {
     WG_PEER *Peer = NULL, *RetPeer = NULL;
     NOISE_HANDSHAKE *Handshake;
@@ -632,8 +663,11 @@ NoiseHandshakeConsumeInitiation(CONST MESSAGE_HANDSHAKE_INITIATION *Src, WG_DEVI
     /* e */
     MessageEphemeral(E, Src->UnencryptedEphemeral, ChainingKey, Hash);
 
-    /* es */
-    if (!MixDh(ChainingKey, Key, Wg->StaticIdentity.StaticPrivate, E))
+    /* es
+     * If the static identity changed since this was precomputed, the static decryption below simply fails.
+     */
+    if (PrecomputedEs ? !MixPrecomputedDh(ChainingKey, Key, PrecomputedEs)
+                      : !MixDh(ChainingKey, Key, Wg->StaticIdentity.StaticPrivate, E))
         goto out;
 
     /* s */
@@ -27,16 +27,18 @@ typedef struct _NOISE_SYMMETRIC_KEY
 
 typedef struct _NOISE_KEYPAIR
 {
+    /* Read by every packet. */
     INDEX_HASHTABLE_ENTRY Entry;
     NOISE_SYMMETRIC_KEY Sending;
-    LONG64 SendingCounter;
     NOISE_SYMMETRIC_KEY Receiving;
-    NOISE_REPLAY_COUNTER ReceivingCounter;
     UINT32_LE RemoteIndex;
     BOOLEAN IAmTheInitiator;
-    KREF Refcount;
-    RCU_CALLBACK Rcu;
     UINT64 InternalId;
+    RCU_CALLBACK Rcu;
+    /* Written by every packet, each by different CPUs, so keep them away from the keys and from each other. */
+    DECLSPEC_CACHEALIGN KREF Refcount;
+    DECLSPEC_CACHEALIGN NOISE_REPLAY_COUNTER ReceivingCounter;
+    DECLSPEC_CACHEALIGN LONG64 SendingCounter;
 } NOISE_KEYPAIR;
 
 typedef struct _NOISE_KEYPAIRS
@@ -166,12 +168,24 @@ _Return_type_success_(return != FALSE)
 BOOLEAN
 NoiseHandshakeCreateInitiation(_Out_ MESSAGE_HANDSHAKE_INITIATION *Dst, _Inout_ NOISE_HANDSHAKE *Handshake);
 
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_not_held_(Wg->StaticIdentity.Lock)
+VOID
+NoiseHandshakePrecomputeInitiations(
+    _In_ WG_DEVICE *Wg,
+    _In_reads_(Count) CONST MESSAGE_HANDSHAKE_INITIATION *CONST Srcs[],
+    _In_ ULONG Count,
+    _Out_writes_all_(Count) UINT8 (*Es)[NOISE_PUBLIC_KEY_LEN]);
+
 _IRQL_requires_max_(APC_LEVEL)
 _Requires_lock_not_held_(Wg->StaticIdentity.Lock)
 _Must_inspect_result_
 _Return_type_success_(return != NULL)
 WG_PEER *
-NoiseHandshakeConsumeInitiation(_In_ CONST MESSAGE_HANDSHAKE_INITIATION *Src, _Inout_ WG_DEVICE *Wg);
+NoiseHandshakeConsumeInitiation(
+    _In_ CONST MESSAGE_HANDSHAKE_INITIATION *Src,
+    _Inout_ WG_DEVICE *Wg,
+    _In_reads_bytes_opt_(NOISE_PUBLIC_KEY_LEN) CONST UINT8 *PrecomputedEs);
 
 _IRQL_requires_max_(APC_LEVEL)
 _Requires_lock_not_held_(Handshake->StaticIdentity->Lock)
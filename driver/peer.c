@@ -10,12 +10,40 @@
 #include "peer.h"
 #include "peerlookup.h"
 #include "queueing.h"
+#include "socket.h"
 #include "timers.h"
 #include "logging.h"
 
 static LOOKASIDE_ALIGN LOOKASIDE_LIST_EX PeerCache;
 static LONG64 PeerCounter = 0;
 
+typedef struct _PEER_TX_RATE_LIMIT
+{
+    HLIST_NODE Hash;
+    UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN];
+    UINT64 BytesPerSecond;
+} PEER_TX_RATE_LIMIT;
+
+/* Keep WG_PEER's sections, laid out in peer.h, apart from each other. */
+#define IN_SECTION(Field, Start, End) \
+    (FIELD_OFFSET(WG_PEER, Field) >= FIELD_OFFSET(WG_PEER, Start) && \
+     FIELD_OFFSET(WG_PEER, Field) + RTL_FIELD_SIZE(WG_PEER, Field) <= FIELD_OFFSET(WG_PEER, End))
+#define IS_CACHE_ALIGNED(Field) (FIELD_OFFSET(WG_PEER, Field) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0)
+static_assert(IN_SECTION(Keypairs, Device, InUse), "Peer->Keypairs must be with read-mostly fields");
+static_assert(IN_SECTION(Endpoint, Device, InUse), "Peer->Endpoint must be with read-mostly fields");
+static_assert(IN_SECTION(TxQueue, StagedPacketsIncoming, RxQueue), "Peer->TxQueue must be with TX fields");
+static_assert(IN_SECTION(TxSerialEntry, StagedPacketsIncoming, RxQueue), "Peer->TxSerialEntry must be with TX fields");
+static_assert(IN_SECTION(TxRate, StagedPacketsIncoming, RxQueue), "Peer->TxRate must be with TX fields");
+static_assert(IN_SECTION(TxLimit, StagedPacketsIncoming, RxQueue), "Peer->TxLimit must be with TX fields");
+static_assert(IN_SECTION(RxSerialEntry, RxQueue, Handshake), "Peer->RxSerialEntry must be with RX fields");
+static_assert(IS_CACHE_ALIGNED(InUse), "Peer section must be cache aligned");
+static_assert(IS_CACHE_ALIGNED(StagedPacketsIncoming), "Peer section must be cache aligned");
+static_assert(IS_CACHE_ALIGNED(RxQueue), "Peer section must be cache aligned");
+static_assert(IS_CACHE_ALIGNED(Handshake), "Peer section must be cache aligned");
+static_assert(sizeof(PEER_STATS) == SYSTEM_CACHE_ALIGNMENT_SIZE, "Peer stats must be a cache line per processor");
+#undef IS_CACHE_ALIGNED
+#undef IN_SECTION
+
 _Use_decl_annotations_
 NTSTATUS
 PeerCreate(
@@ -30,11 +58,24 @@ PeerCreate(
     *Peer = ExAllocateFromLookasideListEx(&PeerCache);
     if (!*Peer)
         return STATUS_INSUFFICIENT_RESOURCES;
+    NT_ASSERT(MEM_IS_CACHE_ALIGNED(*Peer));
     RtlZeroMemory(*Peer, sizeof(**Peer));
+    (*Peer)->Stats = MemAllocateCacheAlignedArrayAndZero(
+        KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS), sizeof(*(*Peer)->Stats));
+    if (!(*Peer)->Stats)
+    {
+        ExFreeToLookasideListEx(&PeerCache, *Peer);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     (*Peer)->Device = Wg;
     NoiseHandshakeInit(&(*Peer)->Handshake, &Wg->StaticIdentity, PublicKey, PresharedKey, *Peer);
     (*Peer)->InternalId = InterlockedIncrement64(&PeerCounter);
+    /* Fibonacci hashing, so that consecutive ids land on different CPUs. */
+    (*Peer)->HomeCpu = (ULONG)(((*Peer)->InternalId * 0x9E3779B97F4A7C15ULL) >> 32) %
+                       KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Peer)->TxWeight = PEER_TX_WEIGHT_DEFAULT;
+    (*Peer)->TxRate.BytesPerSecond = PeerGetTxRateLimit(Wg, PublicKey);
     CookieInit(&(*Peer)->LatestCookie);
     TimersInit(*Peer);
     CookieCheckerPrecomputePeerKeys(*Peer);
@@ -43,6 +84,7 @@ PeerCreate(
     PrevQueueInit(&(*Peer)->RxQueue);
     KrefInit(&(*Peer)->Refcount);
     NetBufferListInitQueue(&(*Peer)->StagedPacketQueue);
+    PacketTxLimitInit(&(*Peer)->TxLimit);
     ExInitializeRundownProtection(&(*Peer)->InUse);
     NoiseResetLastSentHandshake(&(*Peer)->LastSentHandshake);
     InsertTailList(&Wg->PeerList, &(*Peer)->PeerList);
@@ -113,6 +155,8 @@ RcuRelease(RCU_CALLBACK *Rcu)
     WG_PEER *Peer = CONTAINING_RECORD(Rcu, WG_PEER, Rcu);
 
     NT_ASSERT(!PrevQueuePeek(&Peer->TxQueue) && !PrevQueuePeek(&Peer->RxQueue));
+    MemFree(Peer->Stats);
+    MemFree(RcuAccessPointer(Peer->Endpoint));
 
     /* The final zeroing takes care of clearing any remaining handshake key
      * material and other potentially sensitive information.
@@ -127,7 +171,7 @@ KrefRelease(_In_ KREF *Refcount)
     WG_PEER *Peer = CONTAINING_RECORD(Refcount, WG_PEER, Refcount);
 
     CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     LogInfo(Peer->Device, "Peer %llu (%s) destroyed", Peer->InternalId, EndpointName);
 
     /* Remove ourself from dynamic runtime lookup structures, now that the
@@ -144,6 +188,18 @@ KrefRelease(_In_ KREF *Refcount)
     RcuCall(&Peer->Rcu, RcuRelease);
 }
 
+_Use_decl_annotations_
+VOID
+PeerReadStats(CONST WG_PEER *Peer, UINT64 *RxBytes, UINT64 *TxBytes)
+{
+    *RxBytes = *TxBytes = 0;
+    for (ULONG i = 0, Count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS); i < Count; ++i)
+    {
+        *RxBytes += ReadULong64NoFence(&Peer->Stats[i].RxBytes);
+        *TxBytes += ReadULong64NoFence(&Peer->Stats[i].TxBytes);
+    }
+}
+
 _Use_decl_annotations_
 VOID
 PeerPut(WG_PEER *Peer)
@@ -153,6 +209,101 @@ PeerPut(WG_PEER *Peer)
     KrefPut(&Peer->Refcount, KrefRelease);
 }
 
+_Post_notnull_
+static HLIST_HEAD *
+TxRateLimitBucket(_In_ PEER_TX_RATE_LIMITS *Limits, _In_ CONST UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN])
+{
+    CONST UINT64 Hash = Siphash(PublicKey, NOISE_PUBLIC_KEY_LEN, &Limits->Key);
+    return &Limits->Hashtable[Hash & (HASH_SIZE(Limits->Hashtable) - 1)];
+}
+
+_Requires_lock_held_(Wg->DeviceUpdateLock)
+_Must_inspect_result_
+_Post_maybenull_
+static PEER_TX_RATE_LIMIT *
+TxRateLimitFind(_In_ WG_DEVICE *Wg, _In_ CONST UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN])
+{
+    PEER_TX_RATE_LIMIT *Limit, *Temp;
+    HLIST_FOR_EACH_ENTRY_SAFE (Limit, Temp, TxRateLimitBucket(&Wg->TxRateLimits, PublicKey), PEER_TX_RATE_LIMIT, Hash)
+    {
+        if (RtlEqualMemory(PublicKey, Limit->PublicKey, NOISE_PUBLIC_KEY_LEN))
+            return Limit;
+    }
+    return NULL;
+}
+
+_Use_decl_annotations_
+VOID
+PeerTxRateLimitsInit(PEER_TX_RATE_LIMITS *Limits)
+{
+    HashInit(Limits->Hashtable);
+    CryptoRandom(&Limits->Key, sizeof(Limits->Key));
+    Limits->Count = 0;
+}
+
+_Use_decl_annotations_
+VOID
+PeerTxRateLimitsFree(PEER_TX_RATE_LIMITS *Limits)
+{
+    for (ULONG i = 0; i < HASH_SIZE(Limits->Hashtable); ++i)
+    {
+        PEER_TX_RATE_LIMIT *Limit, *Temp;
+        HLIST_FOR_EACH_ENTRY_SAFE (Limit, Temp, &Limits->Hashtable[i], PEER_TX_RATE_LIMIT, Hash)
+            MemFree(Limit);
+        HlistHeadInit(&Limits->Hashtable[i]);
+    }
+    Limits->Count = 0;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+PeerSetTxRateLimit(WG_DEVICE *Wg, CONST UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN], UINT64 BytesPerSecond)
+{
+    PEER_TX_RATE_LIMIT *Limit = TxRateLimitFind(Wg, PublicKey);
+    if (!BytesPerSecond && Limit)
+    {
+        HlistDelRcu(&Limit->Hash);
+        MemFree(Limit);
+        --Wg->TxRateLimits.Count;
+    }
+    else if (BytesPerSecond && !Limit)
+    {
+        if (Wg->TxRateLimits.Count >= MAX_PEERS_PER_DEVICE)
+            return STATUS_TOO_MANY_NODES;
+        Limit = MemAllocate(sizeof(*Limit));
+        if (!Limit)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        RtlCopyMemory(Limit->PublicKey, PublicKey, NOISE_PUBLIC_KEY_LEN);
+        HlistAddHeadRcu(&Limit->Hash, TxRateLimitBucket(&Wg->TxRateLimits, PublicKey));
+        ++Wg->TxRateLimits.Count;
+    }
+    if (Limit && BytesPerSecond)
+        Limit->BytesPerSecond = BytesPerSecond;
+
+    WG_PEER *Peer = PubkeyHashtableLookup(Wg->PeerHashtable, PublicKey);
+    if (!Peer)
+        return STATUS_SUCCESS;
+    KIRQL Irql;
+    KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
+    /* Start afresh with a full bucket, as after a long idle spell. Anything held back is sent below. */
+    Peer->TxRate.BytesPerSecond = BytesPerSecond;
+    Peer->TxRate.Tokens = 0;
+    Peer->TxRate.LastRefill = 0;
+    KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
+    if (ReadBooleanNoFence(&Wg->IsUp))
+        PacketSendStagedPackets(Peer);
+    PeerPut(Peer);
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+UINT64
+PeerGetTxRateLimit(WG_DEVICE *Wg, CONST UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN])
+{
+    PEER_TX_RATE_LIMIT *Limit = TxRateLimitFind(Wg, PublicKey);
+    return Limit ? Limit->BytesPerSecond : 0;
+}
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, PeerDriverEntry)
 #endif
@@ -160,7 +311,8 @@ _Use_decl_annotations_
 NTSTATUS
 PeerDriverEntry(VOID)
 {
-    return ExInitializeLookasideListEx(&PeerCache, NULL, NULL, NonPagedPool, 0, sizeof(WG_PEER), MEMORY_TAG, 0);
+    return ExInitializeLookasideListEx(
+        &PeerCache, NULL, NULL, MEM_CACHE_ALIGNED_POOL, 0, sizeof(WG_PEER), MEMORY_TAG, 0);
 }
 
 _Use_decl_annotations_
@@ -34,6 +34,7 @@ typedef struct _ENDPOINT
     };
     UINT32 RoutingGeneration;
     UINT32 UpdateGeneration;
+    RCU_CALLBACK Rcu; /* Only for the copies published as a peer's endpoint. */
 } ENDPOINT;
 
 typedef enum _HANDSHAKE_TX_ACTION
@@ -43,38 +44,115 @@ typedef enum _HANDSHAKE_TX_ACTION
     HANDSHAKE_TX_SEND
 } HANDSHAKE_TX_ACTION;
 
+/* Byte limit on what a peer has handed to encryption and the socket but WSK hasn't completed yet, adjusted from
+ * completions in the spirit of Linux's BQL. What doesn't fit waits in the staged queue.
+ */
+typedef struct _PEER_TX_LIMIT
+{
+    DECLSPEC_CACHEALIGN LONG64 InFlight;
+    LONG Limit;
+    BOOLEAN Throttled; /* Packets are waiting in the staged queue for InFlight to drop below Limit. */
+    KSPIN_LOCK Lock;   /* Serializes updates to Limit and to the fields below. */
+    LONG64 MinSlack;   /* Least headroom seen at completions since SlackStart. */
+    UINT64 SlackStart;
+} PEER_TX_LIMIT;
+
+/* Token bucket capping the rate at which a peer's staged packets go out, protected by StagedPacketQueue.Lock. */
+typedef struct _PEER_TX_RATE
+{
+    UINT64 BytesPerSecond; /* 0 = unlimited. */
+    LONG64 Tokens;         /* Goes negative when a packet is let through on credit. */
+    UINT64 LastRefill;
+} PEER_TX_RATE;
+
+/* Byte counters of a peer, one per processor so that CPUs sending and receiving for the same peer don't fight over
+ * them. Read by summing them all up.
+ */
+typedef struct _PEER_STATS
+{
+    DECLSPEC_CACHEALIGN UINT64 RxBytes;
+    UINT64 TxBytes;
+} PEER_STATS;
+
+/* The fields are grouped by who touches them, each group starting on its own cache line: what every packet reads but
+ * rarely changes, what every packet writes no matter its direction, what only the TX path writes, what only the RX
+ * path writes, and finally what's only needed for handshakes, timers and configuration. The layout is checked in
+ * peer.c, so keep to it when adding fields.
+ */
 typedef struct _WG_PEER
 {
     WG_DEVICE *Device;
-    PREV_QUEUE TxQueue, RxQueue;
-    PEER_SERIAL_ENTRY TxSerialEntry, RxSerialEntry, HandshakeTxSerialEntry;
-    NET_BUFFER_LIST_QUEUE StagedPacketQueue;
-    EX_RUNDOWN_REF InUse;
+    PEER_STATS *Stats;
     NOISE_KEYPAIRS Keypairs;
-    ENDPOINT Endpoint;
+    UINT64 InternalId;
+    ULONG HomeCpu;
+    /* Multiple of PEER_TX_QUANTUM_BYTES that the peer gets each round of the TX scheduler. Only sending is weighted:
+     * the encryption ring is shared first come, first served.
+     */
+    ULONG TxWeight;
+    BOOLEAN ConstantPacketSize;
+    /* Never changed once published, but replaced as a whole under EndpointLock, so that sending and receiving read it
+     * under the RCU read lock alone.
+     */
+    ENDPOINT __rcu *Endpoint;
+
+    DECLSPEC_CACHEALIGN EX_RUNDOWN_REF InUse;
+    KREF Refcount;
     EX_SPIN_LOCK EndpointLock;
-    NOISE_HANDSHAKE Handshake;
+    UINT64 EndpointChanges; /* Protected by EndpointLock. */
+
+    /* Packets waiting for a session are pushed to StagedPacketsIncoming without a lock, and moved in order to
+     * StagedPacketQueue by PacketStagedCollect, under the queue's lock, on their way out.
+     */
+    DECLSPEC_CACHEALIGN PNET_BUFFER_LIST volatile StagedPacketsIncoming;
+    NET_BUFFER_LIST_QUEUE StagedPacketQueue;
+    LONG StagedSendRequests; /* Calls to PacketSendStagedPackets that the CPU sending hasn't caught up with yet. */
+    PREV_QUEUE TxQueue;
+    PEER_SERIAL_ENTRY TxSerialEntry;
+    PEER_TX_RATE TxRate;
+    PEER_TX_LIMIT TxLimit;
+
+    DECLSPEC_CACHEALIGN PREV_QUEUE RxQueue;
+    PEER_SERIAL_ENTRY RxSerialEntry;
+
+    DECLSPEC_CACHEALIGN NOISE_HANDSHAKE Handshake;
+    PEER_SERIAL_ENTRY HandshakeTxSerialEntry;
     LONG64 LastSentHandshake;
     COOKIE LatestCookie;
     HLIST_NODE PubkeyHash;
-    UINT64 RxBytes, TxBytes;
     TIMER TimerRetransmitHandshake, TimerSendKeepalive;
     TIMER TimerNewHandshake, TimerZeroKeyMaterial;
-    TIMER TimerPersistentKeepalive;
+    TIMER TimerPersistentKeepalive, TimerTxRate;
     ULONG TimerHandshakeAttempts;
     UINT16 PersistentKeepaliveInterval;
     SHORT HandshakeTxAction;
     BOOLEAN TimerNeedAnotherKeepalive;
     BOOLEAN SentLastminuteHandshake;
     LARGE_INTEGER WalltimeLastHandshake;
-    KREF Refcount;
     RCU_CALLBACK Rcu;
     LIST_ENTRY PeerList;
     LIST_ENTRY AllowedIpsList;
-    UINT64 InternalId;
-    BOOLEAN ConstantPacketSize;
 } WG_PEER;
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+PeerAddRxBytes(_Inout_ WG_PEER *Peer, _In_ ULONG64 Bytes)
+{
+    /* Interlocked, in case we're preempted at passive level by another thread on the same processor. */
+    InterlockedAddNoFence64((LONG64 *)&Peer->Stats[KeGetCurrentProcessorIndex()].RxBytes, (LONG64)Bytes);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+PeerAddTxBytes(_Inout_ WG_PEER *Peer, _In_ ULONG64 Bytes)
+{
+    InterlockedAddNoFence64((LONG64 *)&Peer->Stats[KeGetCurrentProcessorIndex()].TxBytes, (LONG64)Bytes);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PeerReadStats(_In_ CONST WG_PEER *Peer, _Out_ UINT64 *RxBytes, _Out_ UINT64 *TxBytes);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Requires_lock_held_(Wg->DeviceUpdateLock)
 _Must_inspect_result_
@@ -111,6 +189,28 @@ _Requires_lock_held_(Wg->DeviceUpdateLock)
 VOID
 PeerRemoveAll(_Inout_ WG_DEVICE *Wg);
 
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+PeerTxRateLimitsInit(_Out_ PEER_TX_RATE_LIMITS *Limits);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+PeerTxRateLimitsFree(_Inout_ PEER_TX_RATE_LIMITS *Limits);
+
+/* Sets the TX rate limit, in bytes per second or 0 for none, of the peer with PublicKey, now if there is one, and
+ * whenever one is added later.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Wg->DeviceUpdateLock)
+_Must_inspect_result_
+NTSTATUS
+PeerSetTxRateLimit(_Inout_ WG_DEVICE *Wg, _In_ CONST UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN], _In_ UINT64 BytesPerSecond);
+
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Wg->DeviceUpdateLock)
+UINT64
+PeerGetTxRateLimit(_In_ WG_DEVICE *Wg, _In_ CONST UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN]);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS
 PeerDriverEntry(VOID);
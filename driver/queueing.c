@@ -5,6 +5,7 @@
 
 #include "interlocked.h"
 #include "queueing.h"
+#include "logging.h"
 
 static KSTART_ROUTINE WorkerThread;
 _Use_decl_annotations_
@@ -17,11 +18,11 @@ WorkerThread(PVOID StartContext)
     GROUP_AFFINITY Affinity = { .Mask = (KAFFINITY)1 << WorkThread->Processor.Number,
                                 .Group = WorkThread->Processor.Group };
     KeSetSystemGroupAffinityThread(&Affinity, NULL);
-    PVOID Handles[] = { &WorkQueue->NewWork, &WorkQueue->Dead };
+    PVOID Handles[] = { &WorkQueue->NewWork, &WorkThread->NewLocalWork, &WorkQueue->Dead };
     for (;;)
     {
-        if (KeWaitForMultipleObjects(ARRAYSIZE(Handles), Handles, WaitAny, Executive, KernelMode, FALSE, NULL, NULL) !=
-            STATUS_WAIT_0)
+        if (KeWaitForMultipleObjects(ARRAYSIZE(Handles), Handles, WaitAny, Executive, KernelMode, FALSE, NULL, NULL) ==
+            STATUS_WAIT_2)
             break;
         Func(WorkQueue);
     }
@@ -66,9 +67,13 @@ NewCpuArrival(PVOID CallbackContext, PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT ChangeC
     if (!WorkThread)
         return;
     WorkThread->Processor = ChangeContext->ProcNumber;
+    WorkThread->ProcessorIndex = ChangeContext->NtNumber;
+    KeInitializeEvent(&WorkThread->NewLocalWork, SynchronizationEvent, FALSE);
     WorkThread->NextThread = WorkQueue->FirstThread;
     WorkThread->WorkQueue = WorkQueue;
     WritePointerRelease(&WorkQueue->FirstThread, WorkThread);
+    if (WorkThread->ProcessorIndex < WorkQueue->MaxProcessors)
+        WritePointerRelease(&WorkQueue->ThreadsByIndex[WorkThread->ProcessorIndex], WorkThread);
     KeSetEvent(&WorkQueue->NewCpus, IO_NETWORK_INCREMENT, FALSE);
 }
 
@@ -80,14 +85,23 @@ MulticoreWorkQueueInit(MULTICORE_WORKQUEUE *WorkQueue, PMULTICORE_WORKQUEUE_ROUT
     KeInitializeEvent(&WorkQueue->NewCpus, SynchronizationEvent, FALSE);
     KeInitializeEvent(&WorkQueue->Dead, NotificationEvent, FALSE);
     WorkQueue->FirstThread = NULL;
+    WorkQueue->NewCpuNotifier = NULL;
     WorkQueue->Func = Func;
+    WorkQueue->MaxProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    WorkQueue->ThreadsByIndex =
+        MemAllocateArrayAndZero(WorkQueue->MaxProcessors, sizeof(*WorkQueue->ThreadsByIndex));
+    if (!WorkQueue->ThreadsByIndex)
+        return STATUS_INSUFFICIENT_RESOURCES;
     OBJECT_ATTRIBUTES ObjectAttributes;
     InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
     HANDLE Handle;
     NTSTATUS Status =
         PsCreateSystemThread(&Handle, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, NewThreadSpawner, WorkQueue);
     if (!NT_SUCCESS(Status))
+    {
+        MemFree(WorkQueue->ThreadsByIndex);
         return Status;
+    }
     ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &WorkQueue->WorkerSpawnerThread, NULL);
     ZwClose(Handle);
     WorkQueue->NewCpuNotifier =
@@ -105,6 +119,52 @@ MulticoreWorkQueueBump(MULTICORE_WORKQUEUE *WorkQueue)
     return KeSetEvent(&WorkQueue->NewWork, IO_NETWORK_INCREMENT, FALSE) == 0;
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+_Post_maybenull_
+static MULTICORE_WORKTHREAD *
+ThreadForCpu(_In_ MULTICORE_WORKQUEUE *WorkQueue, _In_ ULONG ProcessorIndex)
+{
+    if (ProcessorIndex >= WorkQueue->MaxProcessors)
+        return NULL;
+    MULTICORE_WORKTHREAD *WorkThread = ReadPointerAcquire(&WorkQueue->ThreadsByIndex[ProcessorIndex]);
+    if (!WorkThread || !ReadPointerNoFence(&WorkThread->Thread))
+        return NULL;
+    return WorkThread;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+MulticoreWorkQueueHasCpu(MULTICORE_WORKQUEUE *WorkQueue, ULONG ProcessorIndex)
+{
+    return ThreadForCpu(WorkQueue, ProcessorIndex) != NULL;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+MulticoreWorkQueueBumpCpu(MULTICORE_WORKQUEUE *WorkQueue, ULONG ProcessorIndex)
+{
+    MULTICORE_WORKTHREAD *WorkThread = ThreadForCpu(WorkQueue, ProcessorIndex);
+    if (!WorkThread)
+        return MulticoreWorkQueueBump(WorkQueue);
+    return KeSetEvent(&WorkThread->NewLocalWork, IO_NETWORK_INCREMENT, FALSE) == 0;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+MulticoreWorkQueueLinger(MULTICORE_WORKQUEUE *WorkQueue, UINT64 Deadline)
+{
+    LONG64 Remaining = (LONG64)(Deadline - KeQueryInterruptTime());
+    if (Remaining <= 0)
+        return FALSE;
+    LARGE_INTEGER Timeout = { .QuadPart = -Remaining };
+    MULTICORE_WORKTHREAD *WorkThread = ThreadForCpu(WorkQueue, KeGetCurrentProcessorIndex());
+    PVOID Handles[] = { &WorkQueue->Dead, &WorkQueue->NewWork, WorkThread ? &WorkThread->NewLocalWork : NULL };
+    NTSTATUS Status = KeWaitForMultipleObjects(
+        ARRAYSIZE(Handles) - !WorkThread, Handles, WaitAny, Executive, KernelMode, FALSE, &Timeout, NULL);
+    return Status == STATUS_WAIT_1 || Status == STATUS_WAIT_2;
+}
+
 _Use_decl_annotations_
 VOID
 MulticoreWorkQueueDestroy(MULTICORE_WORKQUEUE *WorkQueue)
@@ -141,8 +201,287 @@ MulticoreWorkQueueDestroy(MULTICORE_WORKQUEUE *WorkQueue)
         MemFree(Thread);
     }
     MemFree(WaitBlock);
+    MemFree(WorkQueue->ThreadsByIndex);
+}
+
+_Use_decl_annotations_
+VOID
+QueueLimitsInit(QUEUE_LIMITS *Limits)
+{
+    RtlZeroMemory(Limits, sizeof(*Limits));
+    Limits->Limit[QUEUE_PACKETS] = MAX_QUEUED_PACKETS;
+    Limits->Limit[QUEUE_STAGED] = MAX_STAGED_PACKETS;
+    Limits->Limit[QUEUE_HANDSHAKES] = MAX_QUEUED_INCOMING_HANDSHAKES;
+    Limits->XmitPacketsPerRound = PEER_XMIT_PACKETS_PER_ROUND;
+    MuInitializePushLock(&Limits->Lock);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Requires_lock_held_(Wg->QueueLimits.Lock)
+static NTSTATUS
+QueueLimitsResize(_Inout_ WG_DEVICE *Wg, _In_ QUEUE_KIND Kind, _In_ ULONG Limit)
+{
+    ULONG OldLimit = Wg->QueueLimits.Limit[Kind];
+    NTSTATUS Status = STATUS_SUCCESS;
+    if (Limit == OldLimit)
+        return STATUS_SUCCESS;
+    switch (Kind)
+    {
+    case QUEUE_PACKETS:
+        Status = PtrRingResize(&Wg->EncryptQueue, Limit);
+        if (!NT_SUCCESS(Status))
+            break;
+        for (ULONG i = 0; i < Wg->NumDecryptQueues; ++i)
+        {
+            Status = PtrRingResize(&Wg->DecryptQueues[i], QueueLimitsDecryptRingSize(Wg, Limit));
+            if (NT_SUCCESS(Status))
+                continue;
+            /* Should putting a ring back fail too, it just stays at the new size. */
+            NTSTATUS Ignored = PtrRingResize(&Wg->EncryptQueue, OldLimit);
+            while (i--)
+                Ignored = PtrRingResize(&Wg->DecryptQueues[i], QueueLimitsDecryptRingSize(Wg, OldLimit));
+            UNREFERENCED_PARAMETER(Ignored);
+            break;
+        }
+        break;
+    case QUEUE_HANDSHAKES:
+        Status = PtrRingResize(&Wg->HandshakeRxQueue, Limit);
+        break;
+    default: /* The staged queues are lists, so there's nothing to resize. */
+        break;
+    }
+    if (NT_SUCCESS(Status))
+        WriteULongNoFence(&Wg->QueueLimits.Limit[Kind], Limit);
+    return Status;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+QueueLimitsSet(WG_DEVICE *Wg, CONST ULONG Limit[QUEUE_KIND_COUNT], ULONG XmitPacketsPerRound, BOOLEAN AutoTune)
+{
+    for (ULONG Kind = 0; Kind < QUEUE_KIND_COUNT; ++Kind)
+    {
+        if (Limit[Kind] && (Limit[Kind] < QUEUE_LIMIT_MIN || Limit[Kind] > QUEUE_LIMIT_MAX))
+            return STATUS_INVALID_PARAMETER;
+    }
+    if (XmitPacketsPerRound && (XmitPacketsPerRound < QUEUE_LIMIT_MIN || XmitPacketsPerRound > QUEUE_LIMIT_MAX))
+        return STATUS_INVALID_PARAMETER;
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    MuAcquirePushLockExclusive(&Wg->QueueLimits.Lock);
+    for (ULONG Kind = 0; Kind < QUEUE_KIND_COUNT; ++Kind)
+    {
+        if (!Limit[Kind])
+            continue;
+        Status = QueueLimitsResize(Wg, Kind, Limit[Kind]);
+        if (!NT_SUCCESS(Status))
+            goto cleanupLock;
+        Wg->QueueLimits.QuietRounds[Kind] = 0;
+    }
+    if (XmitPacketsPerRound)
+    {
+        WriteULongNoFence(&Wg->QueueLimits.XmitPacketsPerRound, XmitPacketsPerRound);
+        Wg->QueueLimits.XmitPacketsPerRoundSet = TRUE;
+    }
+    WriteBooleanNoFence(&Wg->QueueLimits.AutoTune, AutoTune);
+cleanupLock:
+    MuReleasePushLockExclusive(&Wg->QueueLimits.Lock);
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+QueueLimitsMaybeTune(WG_DEVICE *Wg)
+{
+    /* Shrinking the handshake ring much lowers the point at which we consider ourselves under load. */
+    static CONST ULONG TuneFloor[QUEUE_KIND_COUNT] = { [QUEUE_PACKETS] = PEER_XMIT_PACKETS_PER_ROUND / 2,
+                                                       [QUEUE_STAGED] = QUEUE_LIMIT_MIN,
+                                                       [QUEUE_HANDSHAKES] = MAX_QUEUED_INCOMING_HANDSHAKES / 8 };
+    QUEUE_LIMITS *Limits = &Wg->QueueLimits;
+
+    if (!ReadBooleanNoFence(&Limits->AutoTune))
+        return;
+    LONG64 Now = (LONG64)KeQueryInterruptTime(), LastTune = ReadNoFence64(&Limits->LastTune);
+    if (Now - LastTune < QUEUE_TUNE_INTERVAL_SYS_TIME_UNITS ||
+        InterlockedCompareExchange64(&Limits->LastTune, Now, LastTune) != LastTune)
+        return;
+
+    MuAcquirePushLockExclusive(&Limits->Lock);
+    for (ULONG Kind = 0; Kind < QUEUE_KIND_COUNT; ++Kind)
+    {
+        LONG64 Drops = ReadNoFence64(&Limits->Drops[Kind]);
+        BOOLEAN Dropped = Drops != Limits->LastDrops[Kind], HighWater = ReadBooleanNoFence(&Limits->HighWater[Kind]);
+        ULONG Limit = Limits->Limit[Kind], NewLimit = Limit;
+        Limits->LastDrops[Kind] = Drops;
+        if (HighWater)
+            WriteBooleanNoFence(&Limits->HighWater[Kind], FALSE);
+        if (Dropped)
+            NewLimit = min(Limit * 2, QUEUE_LIMIT_MAX);
+        else if (!HighWater && ++Limits->QuietRounds[Kind] >= QUEUE_TUNE_QUIET_ROUNDS)
+            NewLimit = max(Limit / 2, TuneFloor[Kind]);
+        if (Dropped || HighWater || NewLimit != Limit)
+            Limits->QuietRounds[Kind] = 0;
+        if (NewLimit != Limit && NT_SUCCESS(QueueLimitsResize(Wg, Kind, NewLimit)))
+            LogInfo(Wg, "Queue %u limit tuned from %u to %u", Kind, Limit, NewLimit);
+    }
+    /* Let a peer's turn on a worker scale with how much it may have queued, unless the user chose how long it is. */
+    if (!Limits->XmitPacketsPerRoundSet)
+        WriteULongNoFence(&Limits->XmitPacketsPerRound, max(Limits->Limit[QUEUE_PACKETS] / 4, QUEUE_LIMIT_MIN));
+    MuReleasePushLockExclusive(&Limits->Lock);
+}
+
+typedef enum
+{
+    PEER_SERIAL_IDLE,
+    PEER_SERIAL_BUSY,
+    PEER_SERIAL_BUSY_REQUEUE
+} PEER_SERIAL_STATE;
+
+typedef enum
+{
+    PEER_SERIAL_UNCONSUMED,
+    PEER_SERIAL_CONSUMING,
+    PEER_SERIAL_CONSUMING_CONTENDED
+} PEER_SERIAL_CONSUMING_STATE;
+
+#define STUB(Serial) (&(Serial)->Stub)
+
+_Use_decl_annotations_
+VOID
+PeerSerialInit(PEER_SERIAL *Serial)
+{
+    STUB(Serial)->Next = NULL;
+    Serial->Head = Serial->Tail = STUB(Serial);
+    Serial->Consuming = PEER_SERIAL_UNCONSUMED;
+}
+
+/* This is the same intrusive MPSC queue as PREV_QUEUE. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+PeerSerialPush(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item)
+{
+    /* Consumers wait for a half linked entry, so don't get descheduled in the middle. */
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    WritePointerNoFence(&Item->Next, NULL);
+    WritePointerRelease(&((PEER_SERIAL_ENTRY *)InterlockedExchangePointer(&Serial->Head, Item))->Next, Item);
+    KeLowerIrql(Irql);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+PeerSerialIsEmpty(_In_ PEER_SERIAL *Serial)
+{
+    return ReadPointerAcquire(&Serial->Head) == STUB(Serial) && ReadPointerNoFence(&Serial->Tail) == STUB(Serial);
+}
+
+/* Called with Serial->Consuming held. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static PEER_SERIAL_ENTRY *
+PeerSerialPop(_Inout_ PEER_SERIAL *Serial)
+{
+    PEER_SERIAL_ENTRY *Tail = Serial->Tail, *Next = ReadPointerAcquire(&Tail->Next);
+
+    if (Tail == STUB(Serial))
+    {
+        if (!Next)
+            return NULL;
+        WritePointerNoFence(&Serial->Tail, Next);
+        Tail = Next;
+        Next = ReadPointerAcquire(&Next->Next);
+    }
+    if (Next)
+    {
+        WritePointerNoFence(&Serial->Tail, Next);
+        return Tail;
+    }
+    if (Tail != ReadPointerNoFence(&Serial->Head))
+        return NULL;
+    PeerSerialPush(Serial, STUB(Serial));
+    Next = ReadPointerAcquire(&Tail->Next);
+    if (Next)
+    {
+        WritePointerNoFence(&Serial->Tail, Next);
+        return Tail;
+    }
+    return NULL;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PeerSerialEnqueueIfNotBusy(PEER_SERIAL *Serial, PEER_SERIAL_ENTRY *Item, BOOLEAN MaybeRequeue)
+{
+    for (LONG State = ReadNoFence(&Item->State), Old;; State = Old)
+    {
+        if (State == PEER_SERIAL_IDLE)
+        {
+            Old = InterlockedCompareExchange(&Item->State, PEER_SERIAL_BUSY, PEER_SERIAL_IDLE);
+            if (Old == PEER_SERIAL_IDLE)
+            {
+                PeerSerialPush(Serial, Item);
+                return TRUE;
+            }
+        }
+        else
+        {
+            if (!MaybeRequeue || State == PEER_SERIAL_BUSY_REQUEUE)
+                return FALSE;
+            Old = InterlockedCompareExchange(&Item->State, PEER_SERIAL_BUSY_REQUEUE, PEER_SERIAL_BUSY);
+            if (Old == PEER_SERIAL_BUSY)
+                return FALSE;
+        }
+    }
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PeerSerialMaybeRetire(PEER_SERIAL *Serial, PEER_SERIAL_ENTRY *Item, BOOLEAN ForceMore)
+{
+    /* Only the worker holding Item can take it out of busy, so all that might change under us is the requeue bit. */
+    if (!ForceMore && InterlockedCompareExchange(&Item->State, PEER_SERIAL_IDLE, PEER_SERIAL_BUSY) == PEER_SERIAL_BUSY)
+        return FALSE;
+    InterlockedExchange(&Item->State, PEER_SERIAL_BUSY);
+    PeerSerialPush(Serial, Item);
+    return TRUE;
+}
+
+_Use_decl_annotations_
+PEER_SERIAL_ENTRY *
+PeerSerialDequeue(PEER_SERIAL *Serial, MULTICORE_WORKQUEUE *Workers)
+{
+    PEER_SERIAL_ENTRY *First;
+    BOOLEAN Contended = FALSE;
+
+    /* Only one worker pops at a time, and one that finds another already popping leaves, saying so. The other one
+     * then checks again once it's done popping, and, rather than leave what's left until it's through with its own
+     * entry, wakes another worker for it.
+     */
+    while (!PeerSerialIsEmpty(Serial))
+    {
+        if (InterlockedCompareExchange(&Serial->Consuming, PEER_SERIAL_CONSUMING, PEER_SERIAL_UNCONSUMED) !=
+            PEER_SERIAL_UNCONSUMED)
+        {
+            if (InterlockedCompareExchange(
+                    &Serial->Consuming, PEER_SERIAL_CONSUMING_CONTENDED, PEER_SERIAL_CONSUMING) ==
+                PEER_SERIAL_UNCONSUMED)
+                continue;
+            return NULL;
+        }
+        First = PeerSerialPop(Serial);
+        if (InterlockedExchange(&Serial->Consuming, PEER_SERIAL_UNCONSUMED) == PEER_SERIAL_CONSUMING_CONTENDED)
+            Contended = TRUE;
+        if (First)
+        {
+            if (Contended && Workers && !PeerSerialIsEmpty(Serial))
+                MulticoreWorkQueueBump(Workers);
+            return First;
+        }
+        YieldProcessor();
+    }
+    return NULL;
+}
+
+#undef STUB
+
 #define NEXT(Nbl) NET_BUFFER_LIST_PER_PEER_LIST_LINK(Nbl)
 #define STUB(Queue) (&(Queue)->Empty)
 
@@ -165,10 +504,17 @@ __PrevQueueEnqueue(_Inout_ PREV_QUEUE *Queue, _In_ __drv_aliasesMem NET_BUFFER_L
 
 _Use_decl_annotations_
 BOOLEAN
-PrevQueueEnqueue(PREV_QUEUE *Queue, NET_BUFFER_LIST *Nbl)
+PrevQueueEnqueue(PREV_QUEUE *Queue, NET_BUFFER_LIST *Nbl, LONG Limit)
 {
-    if (!InterlockedIncrementUnless(&Queue->Count, MAX_QUEUED_PACKETS))
-        return FALSE;
+    /* Not InterlockedIncrementUnless, because the limit may have been lowered below the count. */
+    for (LONG C = ReadNoFence(&Queue->Count), X;; C = X)
+    {
+        if (C >= Limit)
+            return FALSE;
+        X = InterlockedCompareExchange(&Queue->Count, C + 1, C);
+        if (X == C)
+            break;
+    }
     __PrevQueueEnqueue(Queue, Nbl);
     return TRUE;
 }
@@ -208,3 +554,7 @@ PrevQueueDequeue(PREV_QUEUE *Queue)
 
 #undef NEXT
 #undef STUB
+
+#ifdef DBG
+#    include "selftest/serial.c"
+#endif
@@ -7,10 +7,28 @@
 
 #include "peer.h"
 
+/* Defaults of the per-adapter QUEUE_LIMITS, and the range that they may be set or tuned to. */
 #define MAX_QUEUED_INCOMING_HANDSHAKES 4096
 #define MAX_STAGED_PACKETS 128
 #define MAX_QUEUED_PACKETS 1024
+#define MAX_DECRYPT_QUEUES 16
 #define PEER_XMIT_PACKETS_PER_ROUND 256
+#define QUEUE_LIMIT_MIN 16
+#define QUEUE_LIMIT_MAX 16384
+#define QUEUE_TUNE_INTERVAL_SYS_TIME_UNITS SYS_TIME_UNITS_PER_SEC
+#define QUEUE_TUNE_QUIET_ROUNDS 30
+#define PEER_TX_BYTES_MIN (64 * 1024)
+#define PEER_TX_BYTES_INITIAL (256 * 1024)
+#define PEER_TX_BYTES_MAX (8 * 1024 * 1024)
+#define PEER_TX_SLACK_HOLD_SYS_TIME_UNITS SYS_TIME_UNITS_PER_SEC
+#define PEER_TX_QUANTUM_BYTES (16 * 1024)
+#define PEER_TX_WEIGHT_DEFAULT 1
+#define PEER_TX_WEIGHT_MAX 256
+#define PEER_TX_RATE_MAX (1ULL << 40)
+#define PEER_TX_RATE_BURST_SYS_TIME_UNITS (SYS_TIME_UNITS_PER_SEC / 50)
+#define PEER_TX_RATE_BURST_MIN (16 * 1024)
+#define SIMD_HOLD_MAX_PACKETS 2048
+#define SIMD_HOLD_MAX_SYS_TIME_UNITS (SYS_TIME_UNITS_PER_SEC / 1000)
 
 typedef struct _WG_DEVICE WG_DEVICE;
 typedef struct _WG_PEER WG_PEER;
@@ -26,87 +44,63 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 BOOLEAN
 MulticoreWorkQueueBump(_Inout_ MULTICORE_WORKQUEUE *WorkQueue);
 
+/* Returns TRUE if the processor with this index has a running worker. Workers are never torn down before
+ * MulticoreWorkQueueDestroy, so once this is TRUE it stays so.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+MulticoreWorkQueueHasCpu(_In_ MULTICORE_WORKQUEUE *WorkQueue, _In_ ULONG ProcessorIndex);
+
+/* Wakes only the worker of the processor with this index, or any worker if it doesn't have one. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+MulticoreWorkQueueBumpCpu(_Inout_ MULTICORE_WORKQUEUE *WorkQueue, _In_ ULONG ProcessorIndex);
+
+/* Called by a worker that has run out of work, to wait for more until Deadline, so that it can keep what it has
+ * set up, such as its SIMD state. Returns TRUE if there's new work.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+MulticoreWorkQueueLinger(_Inout_ MULTICORE_WORKQUEUE *WorkQueue, _In_ UINT64 Deadline);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 VOID
 MulticoreWorkQueueDestroy(_Inout_ MULTICORE_WORKQUEUE *WorkQueue);
 
-#define BUSY_LINK ((PEER_SERIAL_ENTRY *)~(ULONG_PTR)0)
-
-static inline VOID
-PeerSerialInit(_Out_ PEER_SERIAL *Serial)
-{
-    Serial->Last = &Serial->First;
-    Serial->First = BUSY_LINK;
-    KeInitializeSpinLock(&Serial->Lock);
-}
+/* The PEER_SERIAL functions schedule peers that have work onto whichever worker gets to them first, making sure that
+ * each peer is only ever in the queue or being worked on once, and without any lock for the producers.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PeerSerialInit(_Out_ PEER_SERIAL *Serial);
 
-_Requires_lock_not_held_(Serial->Lock)
+/* Queues Item unless it's already queued or being worked on, in which case MaybeRequeue asks for it to be queued
+ * again once the current work is done. Returns TRUE if Item was queued.
+ */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-static inline BOOLEAN
-PeerSerialEnqueueIfNotBusy(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item, _In_ BOOLEAN MaybeRequeue)
-{
-    BOOLEAN Added = FALSE;
-    KIRQL Irql;
-    KeAcquireSpinLock(&Serial->Lock, &Irql);
-    if (ReadPointerNoFence(&Item->Next))
-    {
-        if (MaybeRequeue)
-            WriteNoFence16(&Item->Requeue, TRUE);
-        goto out;
-    }
-    WritePointerNoFence(&Item->Next, BUSY_LINK);
-    *Serial->Last = Item;
-    Serial->Last = &Item->Next;
-    Added = TRUE;
-out:
-    KeReleaseSpinLock(&Serial->Lock, Irql);
-    return Added;
-}
+BOOLEAN
+PeerSerialEnqueueIfNotBusy(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item, _In_ BOOLEAN MaybeRequeue);
 
-_Requires_lock_not_held_(Serial->Lock)
+/* Called when done working on Item, which is queued again if that was asked for meanwhile or if ForceMore. Returns
+ * TRUE if Item was queued again.
+ */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-static inline BOOLEAN
-PeerSerialMaybeRetire(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item, _In_ BOOLEAN ForceMore)
-{
-    BOOLEAN Ret = FALSE;
-    KIRQL Irql;
-    KeAcquireSpinLock(&Serial->Lock, &Irql);
-    WritePointerNoFence(&Item->Next, NULL);
-    if (InterlockedCompareExchange16(&Item->Requeue, FALSE, TRUE) || ForceMore)
-    {
-        WritePointerNoFence(&Item->Next, BUSY_LINK);
-        *Serial->Last = Item;
-        Serial->Last = &Item->Next;
-        Ret = TRUE;
-    }
-    KeReleaseSpinLock(&Serial->Lock, Irql);
-    return Ret;
-}
+BOOLEAN
+PeerSerialMaybeRetire(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item, _In_ BOOLEAN ForceMore);
 
-_Requires_lock_not_held_(Serial->Lock)
+/* Callers must keep calling this until it returns NULL, because a concurrent caller may have left work for them.
+ * Should that caller have left while more was queued, another of the Workers, if given, is woken for it.
+ */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_
 _Post_maybenull_
-static inline PEER_SERIAL_ENTRY *
-PeerSerialDequeue(_Inout_ PEER_SERIAL *Serial)
-{
-    if (ReadPointerNoFence(&Serial->First) == BUSY_LINK)
-        return NULL;
-    PEER_SERIAL_ENTRY *First = NULL;
-    KIRQL Irql;
-    KeAcquireSpinLock(&Serial->Lock, &Irql);
-    First = Serial->First;
-    if (First != BUSY_LINK && (Serial->First = First->Next) == BUSY_LINK)
-        Serial->Last = &Serial->First;
-    KeReleaseSpinLock(&Serial->Lock, Irql);
-    return First == BUSY_LINK ? NULL : First;
-}
-
-#undef BUSY_LINK
+PEER_SERIAL_ENTRY *
+PeerSerialDequeue(_Inout_ PEER_SERIAL *Serial, _Inout_opt_ MULTICORE_WORKQUEUE *Workers);
 
 /*
  * NBL[0] = crypt state
  * NBL[1] = prev queue link
+ * NBL scratch = endpoint fingerprint (rx only, until indicated up)
  * NB[0-1] = nonce
  * NB[2] = keypair
  * NB[3] = wsk datagram indication (rx only)
@@ -168,6 +162,45 @@ _Requires_lock_not_held_(Peer->StagedPacketQueue.Lock)
 VOID
 PacketSendStagedPackets(_Inout_ WG_PEER *Peer);
 
+/* Stages a packet for PacketSendStagedPackets, which the caller must call afterwards. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+PacketStage(_Inout_ WG_PEER *Peer, __drv_aliasesMem _In_ NET_BUFFER_LIST *Nbl)
+{
+    NetBufferListInterlockedPush(&Peer->StagedPacketsIncoming, Nbl);
+}
+
+/* Moves the packets staged since the last call onto the end of StagedPacketQueue, dropping the oldest ones if that
+ * makes it longer than the staged queue limit.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(Peer->StagedPacketQueue.Lock)
+VOID
+PacketStagedCollect(_Inout_ WG_PEER *Peer);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PacketTxLimitInit(_Out_ PEER_TX_LIMIT *TxLimit);
+
+/* Returns what was charged to the peer's PEER_TX_LIMIT for these packets when they left the staged queue. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline LONG64
+PacketTxCharged(_In_opt_ CONST NET_BUFFER_LIST *First)
+{
+    LONG64 Bytes = 0;
+    for (CONST NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+        Bytes += (ULONG_PTR)Nbl->Scratch;
+    return Bytes;
+}
+
+/* Called once packets charged to the peer are done with, whether sent or dropped, with the result of PacketTxCharged.
+ * Grows the limit when the peer ran dry while packets were held back, shrinks it when it has had headroom to spare
+ * for PEER_TX_SLACK_HOLD_SYS_TIME_UNITS, and lets held back packets go when there's room for them.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+PacketTxCompleted(_Inout_ WG_PEER *Peer, _In_ LONG64 Bytes);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
 FreeSendNetBufferList(_In_ WG_DEVICE *Wg, __drv_freesMem(Mem) _In_ NET_BUFFER_LIST *Nbl, _In_ ULONG SendCompleteFlags);
@@ -209,10 +242,10 @@ CheckPacketProtocol(_In_ CONST NET_BUFFER_LIST *Nbl)
 VOID
 PrevQueueInit(_Out_ PREV_QUEUE *Queue);
 
-/* Multi producer */
+/* Multi producer. Fails if there are already Limit packets queued. */
 _Return_type_success_(return != FALSE)
 BOOLEAN
-PrevQueueEnqueue(_Inout_ PREV_QUEUE *Queue, _In_ __drv_aliasesMem NET_BUFFER_LIST *Nbl);
+PrevQueueEnqueue(_Inout_ PREV_QUEUE *Queue, _In_ __drv_aliasesMem NET_BUFFER_LIST *Nbl, _In_ LONG Limit);
 
 /* Single consumer */
 _Must_inspect_result_
@@ -239,6 +272,50 @@ PrevQueueDropPeeked(_Out_ PREV_QUEUE *Queue)
     Queue->Peeked = NULL;
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+QueueLimitsInit(_Out_ QUEUE_LIMITS *Limits);
+
+/* The decrypt rings share the packet limit between them, rather than each getting all of it. */
+static inline ULONG
+QueueLimitsDecryptRingSize(_In_ CONST WG_DEVICE *Wg, _In_ ULONG Limit)
+{
+    return max((Limit + Wg->NumDecryptQueues - 1) / Wg->NumDecryptQueues, QUEUE_LIMIT_MIN);
+}
+
+/* Applies new limits, resizing the device rings. Zero leaves a limit as it is. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+QueueLimitsSet(
+    _Inout_ WG_DEVICE *Wg,
+    _In_reads_(QUEUE_KIND_COUNT) CONST ULONG Limit[QUEUE_KIND_COUNT],
+    _In_ ULONG XmitPacketsPerRound,
+    _In_ BOOLEAN AutoTune);
+
+/* With AutoTune set, at most once per QUEUE_TUNE_INTERVAL_SYS_TIME_UNITS, doubles the limit of each kind of queue
+ * that dropped since the last time, and halves the limit of those that didn't get past half full for
+ * QUEUE_TUNE_QUIET_ROUNDS intervals in a row.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+QueueLimitsMaybeTune(_Inout_ WG_DEVICE *Wg);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+QueueLimitsDropped(_Inout_ WG_DEVICE *Wg, _In_ QUEUE_KIND Kind)
+{
+    InterlockedIncrement64(&Wg->QueueLimits.Drops[Kind]);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+QueueLimitsSawDepth(_Inout_ WG_DEVICE *Wg, _In_ QUEUE_KIND Kind, _In_ ULONG Depth)
+{
+    if (Depth > ReadULongNoFence(&Wg->QueueLimits.Limit[Kind]) / 2 &&
+        !ReadBooleanNoFence(&Wg->QueueLimits.HighWater[Kind]))
+        WriteBooleanNoFence(&Wg->QueueLimits.HighWater[Kind], TRUE);
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static inline BOOLEAN
 QueueEnqueuePerDevice(
@@ -247,7 +324,10 @@ QueueEnqueuePerDevice(
     _Inout_ NET_BUFFER_LIST *Nbl)
 {
     if (!NT_SUCCESS(PtrRingProduce(DeviceQueue, Nbl)))
+    {
+        QueueLimitsDropped(NET_BUFFER_LIST_PEER(Nbl)->Device, QUEUE_PACKETS);
         return FALSE;
+    }
     MulticoreWorkQueueBump(DeviceThreads);
     return TRUE;
 }
@@ -256,11 +336,18 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 static inline BOOLEAN
 QueueInsertPerPeer(_Inout_ PREV_QUEUE *PeerQueue, _Inout_ NET_BUFFER_LIST *Nbl)
 {
+    WG_DEVICE *Wg = NET_BUFFER_LIST_PEER(Nbl)->Device;
     WriteRelease(NET_BUFFER_LIST_CRYPT_STATE(Nbl), PACKET_STATE_UNCRYPTED);
     /* We first queue this up for the peer ingestion, but the consumer
      * will wait for the state to change to CRYPTED or DEAD before.
      */
-    return PrevQueueEnqueue(PeerQueue, Nbl);
+    if (!PrevQueueEnqueue(PeerQueue, Nbl, (LONG)ReadULongNoFence(&Wg->QueueLimits.Limit[QUEUE_PACKETS])))
+    {
+        QueueLimitsDropped(Wg, QUEUE_PACKETS);
+        return FALSE;
+    }
+    QueueLimitsSawDepth(Wg, QUEUE_PACKETS, (ULONG)ReadNoFence(&PeerQueue->Count));
+    return TRUE;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -282,9 +369,8 @@ QueueEnqueuePerDeviceAndPeer(
     return STATUS_SUCCESS;
 }
 
-_Requires_lock_not_held_(PeerQueue->Lock)
 _IRQL_requires_max_(DISPATCH_LEVEL)
-static inline VOID
+static inline BOOLEAN
 QueueEnqueuePerPeer(
     _Inout_ PEER_SERIAL *PeerQueue,
     _Inout_ PEER_SERIAL_ENTRY *PeerSerialEntry,
@@ -296,12 +382,78 @@ QueueEnqueuePerPeer(
      */
     WG_PEER *Peer = PeerGet(NET_BUFFER_LIST_PEER(Nbl));
     WriteRelease(NET_BUFFER_LIST_CRYPT_STATE(Nbl), State);
-    PeerSerialEnqueueIfNotBusy(PeerQueue, PeerSerialEntry, TRUE);
+    BOOLEAN Scheduled = PeerSerialEnqueueIfNotBusy(PeerQueue, PeerSerialEntry, TRUE);
     PeerPut(Peer);
+    return Scheduled;
+}
+
+/* Like QueueEnqueuePerPeer, but when the adapter pins peers to home CPUs, the peer is scheduled on the queue of the
+ * CPU that its id hashes to, and only that CPU's worker is woken, so that the peer's queues, endpoint and counters
+ * stay in one cache. A peer's entry is only ever in one queue at a time, so its packets stay in order even when it
+ * moves between the device-wide queue and its home one. Peers whose home CPU has no worker use the device-wide queue.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+QueueEnqueuePerPeerHome(
+    _In_ WG_PEER *Peer,
+    _Inout_ PEER_SERIAL *DeviceQueue,
+    _Inout_ PEER_SERIAL *HomeQueues,
+    _Inout_ MULTICORE_WORKQUEUE *DeviceThreads,
+    _Inout_ PEER_SERIAL_ENTRY *PeerSerialEntry,
+    _Inout_ __drv_aliasesMem NET_BUFFER_LIST *Nbl,
+    _In_ PACKET_STATE State)
+{
+    /* Read before enqueueing, after which the peer may go away. */
+    ULONG HomeCpu = Peer->HomeCpu;
+    if (!ReadBooleanNoFence(&Peer->Device->PeerHomeCpus) || !MulticoreWorkQueueHasCpu(DeviceThreads, HomeCpu))
+    {
+        QueueEnqueuePerPeer(DeviceQueue, PeerSerialEntry, Nbl, State);
+        return;
+    }
+    if (QueueEnqueuePerPeer(&HomeQueues[HomeCpu], PeerSerialEntry, Nbl, State))
+        MulticoreWorkQueueBumpCpu(DeviceThreads, HomeCpu);
+}
+
+/* A crypto worker's SIMD state, which it keeps across batches, but gives back while it sends or indicates packets, so
+ * as not to keep the extended state saved through calls into the network stack.
+ */
+typedef struct _WORKER_SIMD
+{
+    SIMD_STATE State;
+    ULONG Packets; /* Processed since the state was taken. */
+    BOOLEAN Held;
+} WORKER_SIMD;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline SIMD_STATE *
+WorkerSimdGet(_Inout_ WORKER_SIMD *Simd)
+{
+    if (!Simd->Held)
+    {
+        SimdGet(&Simd->State);
+        Simd->Held = TRUE;
+    }
+    return &Simd->State;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+WorkerSimdPut(_Inout_ WORKER_SIMD *Simd)
+{
+    if (!Simd->Held)
+        return;
+    SimdAccountPackets(&Simd->State, Simd->Packets);
+    SimdPut(&Simd->State);
+    Simd->Packets = 0;
+    Simd->Held = FALSE;
 }
 
 #ifdef DBG
 _IRQL_requires_max_(PASSIVE_LEVEL)
 BOOLEAN
 PacketCounterSelftest(VOID);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PeerSerialSelftest(VOID);
 #endif
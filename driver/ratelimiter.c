@@ -96,28 +96,13 @@ RatelimiterGcEntries(_In_opt_ PVOID StartContext)
     }
 }
 
-_Use_decl_annotations_
-BOOLEAN
-RatelimiterAllow(CONST SOCKADDR *Src)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+BucketAllow(_Inout_ HLIST_HEAD *Bucket, _In_ UINT64 Ip)
 {
     RATELIMITER_ENTRY *Entry;
-    HLIST_HEAD *Bucket;
-    UINT64 Ip;
     KIRQL Irql;
 
-    if (Src->sa_family == AF_INET)
-    {
-        Ip = (UINT64)((SOCKADDR_IN *)Src)->sin_addr.s_addr;
-        Bucket = &TableV4[Hsiphash1u32((UINT32)Ip, &Key) & (TABLE_SIZE - 1)];
-    }
-    else if (Src->sa_family == AF_INET6)
-    {
-        /* Only use 64 bits, so as to ratelimit the whole /64. */
-        RtlCopyMemory(&Ip, &((SOCKADDR_IN6 *)Src)->sin6_addr, sizeof(Ip));
-        Bucket = &TableV6[Hsiphash2u32((UINT32)(Ip >> 32), (UINT32)Ip, &Key) & (TABLE_SIZE - 1)];
-    }
-    else
-        return FALSE;
     Irql = RcuReadLock();
     HLIST_FOR_EACH_ENTRY_RCU (Entry, Bucket, RATELIMITER_ENTRY, Hash)
     {
@@ -165,6 +150,74 @@ cleanupOom:
     return FALSE;
 }
 
+_Use_decl_annotations_
+BOOLEAN
+RatelimiterAllow(CONST SOCKADDR *Src)
+{
+    UINT64 Ip;
+
+    if (Src->sa_family == AF_INET)
+    {
+        Ip = (UINT64)((SOCKADDR_IN *)Src)->sin_addr.s_addr;
+        return BucketAllow(&TableV4[Hsiphash1u32((UINT32)Ip, &Key) & (TABLE_SIZE - 1)], Ip);
+    }
+    else if (Src->sa_family == AF_INET6)
+    {
+        /* Only use 64 bits, so as to ratelimit the whole /64. */
+        RtlCopyMemory(&Ip, &((SOCKADDR_IN6 *)Src)->sin6_addr, sizeof(Ip));
+        return BucketAllow(&TableV6[Hsiphash2u32((UINT32)(Ip >> 32), (UINT32)Ip, &Key) & (TABLE_SIZE - 1)], Ip);
+    }
+    return FALSE;
+}
+
+_Use_decl_annotations_
+VOID
+RatelimiterAllowBatch(CONST SOCKADDR *CONST *Srcs, BOOLEAN *Allowed, ULONG Count, CONST SIMD_STATE *Simd)
+{
+    enum
+    {
+        CHUNK = 2 * HSIPHASH_MAX_LANES
+    };
+    UINT32 Words4[CHUNK], Hi6[CHUNK], Lo6[CHUNK], Hashes4[CHUNK], Hashes6[CHUNK];
+    ULONG Index4[CHUNK], Index6[CHUNK];
+    UINT64 Ip[CHUNK];
+    ULONG i, j, Len, Len4, Len6;
+
+    /* Same as calling RatelimiterAllow on each of them in order, except that the addresses of each family are hashed
+     * together first. The families have separate tables, so only the order within a family matters.
+     */
+    for (i = 0; i < Count; i += Len)
+    {
+        Len = min(Count - i, CHUNK);
+        for (j = 0, Len4 = 0, Len6 = 0; j < Len; ++j)
+        {
+            CONST SOCKADDR *Src = Srcs[i + j];
+
+            Allowed[i + j] = FALSE;
+            if (Src->sa_family == AF_INET)
+            {
+                Ip[j] = (UINT64)((SOCKADDR_IN *)Src)->sin_addr.s_addr;
+                Words4[Len4] = (UINT32)Ip[j];
+                Index4[Len4++] = j;
+            }
+            else if (Src->sa_family == AF_INET6)
+            {
+                /* Only use 64 bits, so as to ratelimit the whole /64. */
+                RtlCopyMemory(&Ip[j], &((SOCKADDR_IN6 *)Src)->sin6_addr, sizeof(Ip[j]));
+                Hi6[Len6] = (UINT32)(Ip[j] >> 32);
+                Lo6[Len6] = (UINT32)Ip[j];
+                Index6[Len6++] = j;
+            }
+        }
+        Hsiphash1u32Multi(Hashes4, Words4, &Key, Len4, Simd);
+        Hsiphash2u32Multi(Hashes6, Hi6, Lo6, &Key, Len6, Simd);
+        for (j = 0; j < Len4; ++j)
+            Allowed[i + Index4[j]] = BucketAllow(&TableV4[Hashes4[j] & (TABLE_SIZE - 1)], Ip[Index4[j]]);
+        for (j = 0; j < Len6; ++j)
+            Allowed[i + Index6[j]] = BucketAllow(&TableV6[Hashes6[j] & (TABLE_SIZE - 1)], Ip[Index6[j]]);
+    }
+}
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, RatelimiterDriverEntry)
 #endif
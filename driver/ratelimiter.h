@@ -5,10 +5,20 @@
 
 #pragma once
 
+#include "crypto.h"
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 BOOLEAN
 RatelimiterAllow(_In_ CONST SOCKADDR *Src);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+RatelimiterAllowBatch(
+    _In_reads_(Count) CONST SOCKADDR *CONST *Srcs,
+    _Out_writes_all_(Count) BOOLEAN *Allowed,
+    _In_ ULONG Count,
+    _In_opt_ CONST SIMD_STATE *Simd);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS
 RatelimiterDriverEntry(VOID);
@@ -9,6 +9,7 @@
 #include "messages.h"
 #include "peer.h"
 #include "queueing.h"
+#include "ratelimiter.h"
 #include "rcu.h"
 #include "socket.h"
 #include "timers.h"
@@ -18,7 +19,7 @@
 static VOID
 UpdateRxStats(_Inout_ WG_PEER *Peer, _In_ CONST ULONG Len)
 {
-    Peer->RxBytes += Len;
+    PeerAddRxBytes(Peer, Len);
     Peer->Device->Statistics.ifHCInOctets += Len;
     Peer->Device->Statistics.ifHCInUcastOctets += Len;
     ++Peer->Device->Statistics.ifHCInUcastPkts;
@@ -26,30 +27,24 @@ UpdateRxStats(_Inout_ WG_PEER *Peer, _In_ CONST ULONG Len)
 
 #define NBL_TYPE_LE32(Nbl) (((MESSAGE_HEADER *)MemGetValidatedNetBufferListData(Nbl))->Type)
 
+#define HANDSHAKE_RX_BATCH 8
+static_assert(
+    HANDSHAKE_RX_BATCH <= BLAKE2S_MAX_LANES && HANDSHAKE_RX_BATCH <= CURVE25519_MAX_BATCH,
+    "Handshake batch is larger than what the crypto can batch");
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
-static VOID
-ReceiveHandshakePacket(_Inout_ WG_DEVICE *Wg, _In_ NET_BUFFER_LIST *Nbl)
+_Must_inspect_result_
+static BOOLEAN
+ReceiveHandshakeUnderLoad(_In_ CONST WG_DEVICE *Wg)
 {
-    COOKIE_MAC_STATE MacState;
-    WG_PEER *Peer = NULL;
     /* This is global, so that our load calculation applies to the whole
      * system. We don't care about races with it at all.
      */
     static UINT64 LastUnderLoad;
-    BOOLEAN PacketNeedsCookie;
     BOOLEAN UnderLoad;
-    UINT32_LE NblType = NBL_TYPE_LE32(Nbl);
-    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
-    CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-
-    if (NblType == CpuToLe32(MESSAGE_TYPE_HANDSHAKE_COOKIE))
-    {
-        LogInfoNblRatelimited(Wg, "Receiving cookie response from %s", Nbl);
-        CookieMessageConsume(MemGetValidatedNetBufferListData(Nbl), Wg);
-        return;
-    }
 
-    UnderLoad = ReadULongNoFence(&Wg->HandshakeRxQueueLen) >= MAX_QUEUED_INCOMING_HANDSHAKES / 8;
+    UnderLoad = ReadULongNoFence(&Wg->HandshakeRxQueueLen) >=
+                ReadULongNoFence(&Wg->QueueLimits.Limit[QUEUE_HANDSHAKES]) / 8;
     if (UnderLoad)
     {
         LastUnderLoad = KeQueryInterruptTime();
@@ -60,39 +55,71 @@ ReceiveHandshakePacket(_Inout_ WG_DEVICE *Wg, _In_ NET_BUFFER_LIST *Nbl)
         if (!UnderLoad)
             LastUnderLoad = 0;
     }
-    MacState = CookieValidatePacket(&Wg->CookieChecker, Nbl, UnderLoad);
-    if ((UnderLoad && MacState == VALID_MAC_WITH_COOKIE) || (!UnderLoad && MacState == VALID_MAC_BUT_NO_COOKIE))
-    {
-        PacketNeedsCookie = FALSE;
-    }
-    else if (UnderLoad && MacState == VALID_MAC_BUT_NO_COOKIE)
+    return UnderLoad;
+}
+
+/* Decides whether a handshake packet gets to the expensive part: consumes cookie replies, answers with a cookie
+ * when under load, and drops anything with bad MACs or over the ratelimit.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+ReceiveHandshakeCheckMacs(
+    _Inout_ WG_DEVICE *Wg,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_ COOKIE_MAC_STATE MacState,
+    _In_ BOOLEAN UnderLoad)
+{
+    UINT32_LE NblType = NBL_TYPE_LE32(Nbl);
+
+    if (NblType == CpuToLe32(MESSAGE_TYPE_HANDSHAKE_COOKIE))
     {
-        PacketNeedsCookie = TRUE;
+        LogInfoNblRatelimited(Wg, "Receiving cookie response from %s", Nbl);
+        CookieMessageConsume(MemGetValidatedNetBufferListData(Nbl), Wg);
+        return FALSE;
     }
-    else
+
+    if ((UnderLoad && MacState == VALID_MAC_WITH_COOKIE) || (!UnderLoad && MacState == VALID_MAC_BUT_NO_COOKIE))
+        return TRUE;
+    if (UnderLoad && MacState == VALID_MAC_BUT_NO_COOKIE)
     {
-        LogInfoNblRatelimited(Wg, "Invalid MAC of handshake, dropping packet from %s", Nbl);
-        return;
+        if (NblType == CpuToLe32(MESSAGE_TYPE_HANDSHAKE_INITIATION))
+            PacketSendHandshakeCookie(
+                Wg, Nbl, ((MESSAGE_HANDSHAKE_INITIATION *)MemGetValidatedNetBufferListData(Nbl))->SenderIndex);
+        else
+            PacketSendHandshakeCookie(
+                Wg, Nbl, ((MESSAGE_HANDSHAKE_RESPONSE *)MemGetValidatedNetBufferListData(Nbl))->SenderIndex);
+        return FALSE;
     }
+    LogInfoNblRatelimited(Wg, "Invalid MAC of handshake, dropping packet from %s", Nbl);
+    return FALSE;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+ReceiveHandshakePacket(
+    _Inout_ WG_DEVICE *Wg,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_reads_bytes_opt_(NOISE_PUBLIC_KEY_LEN) CONST UINT8 *PrecomputedEs)
+{
+    WG_PEER *Peer = NULL;
+    UINT32_LE NblType = NBL_TYPE_LE32(Nbl);
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
 
     switch (NblType)
     {
     case CpuToLe32(MESSAGE_TYPE_HANDSHAKE_INITIATION): {
         MESSAGE_HANDSHAKE_INITIATION *Message = MemGetValidatedNetBufferListData(Nbl);
 
-        if (PacketNeedsCookie)
-        {
-            PacketSendHandshakeCookie(Wg, Nbl, Message->SenderIndex);
-            return;
-        }
-        Peer = NoiseHandshakeConsumeInitiation(Message, Wg);
+        Peer = NoiseHandshakeConsumeInitiation(Message, Wg, PrecomputedEs);
         if (!Peer)
         {
             LogInfoNblRatelimited(Wg, "Invalid handshake initiation from %s", Nbl);
             return;
         }
         SocketSetPeerEndpointFromNbl(Peer, Nbl);
-        SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+        SocketPeerEndpointToString(EndpointName, Peer);
         LogInfoRatelimited(Wg, "Receiving handshake initiation from peer %llu (%s)", Peer->InternalId, EndpointName);
         PacketSendHandshakeResponse(Peer);
         break;
@@ -100,11 +127,6 @@ ReceiveHandshakePacket(_Inout_ WG_DEVICE *Wg, _In_ NET_BUFFER_LIST *Nbl)
     case CpuToLe32(MESSAGE_TYPE_HANDSHAKE_RESPONSE): {
         MESSAGE_HANDSHAKE_RESPONSE *Message = MemGetValidatedNetBufferListData(Nbl);
 
-        if (PacketNeedsCookie)
-        {
-            PacketSendHandshakeCookie(Wg, Nbl, Message->SenderIndex);
-            return;
-        }
         Peer = NoiseHandshakeConsumeResponse(Message, Wg);
         if (!Peer)
         {
@@ -112,7 +134,7 @@ ReceiveHandshakePacket(_Inout_ WG_DEVICE *Wg, _In_ NET_BUFFER_LIST *Nbl)
             return;
         }
         SocketSetPeerEndpointFromNbl(Peer, Nbl);
-        SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+        SocketPeerEndpointToString(EndpointName, Peer);
         LogInfoRatelimited(Wg, "Receiving handshake response from peer %llu (%s)", Peer->InternalId, EndpointName);
         if (NoiseHandshakeBeginSession(&Peer->Handshake, &Peer->Keypairs))
         {
@@ -148,14 +170,76 @@ VOID
 PacketHandshakeRxWorker(MULTICORE_WORKQUEUE *WorkQueue)
 {
     WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, HandshakeRxThreads);
-    NET_BUFFER_LIST *Nbl;
+    NET_BUFFER_LIST *Nbls[HANDSHAKE_RX_BATCH];
+    BOOLEAN Mac1Valid[HANDSHAKE_RX_BATCH];
+    COOKIE_MAC_STATE MacState[HANDSHAKE_RX_BATCH];
+    CONST SOCKADDR *Srcs[HANDSHAKE_RX_BATCH];
+    ULONG Ratelimited[HANDSHAKE_RX_BATCH];
+    BOOLEAN Allowed[HANDSHAKE_RX_BATCH];
+    BOOLEAN Consume[HANDSHAKE_RX_BATCH];
+    CONST MESSAGE_HANDSHAKE_INITIATION *Initiations[HANDSHAKE_RX_BATCH];
+    UINT8 Es[HANDSHAKE_RX_BATCH][NOISE_PUBLIC_KEY_LEN];
+    CONST UINT8 *PrecomputedEs[HANDSHAKE_RX_BATCH];
+    ULONG Count, NumRatelimited, NumInitiations, i;
+    BOOLEAN UnderLoad;
+    SIMD_STATE Simd;
 
-    while ((Nbl = PtrRingConsume(&Wg->HandshakeRxQueue)) != NULL)
+    /* Work on a batch at a time: MAC1 for all of them at once using all the lanes, then the cookie checks, then the
+     * ratelimiter for everything that had a valid cookie with the source addresses hashed together, and only then the
+     * es DH for the initiations that made it that far, which share their field inversions. The SIMD state is held
+     * for the whole drain rather than saved again for each batch.
+     */
+    SimdGet(&Simd);
+    while ((Count = PtrRingConsumeBatched(&Wg->HandshakeRxQueue, (VOID **)Nbls, ARRAYSIZE(Nbls))) != 0)
     {
-        ReceiveHandshakePacket(Wg, Nbl);
-        FreeReceiveNetBufferList(Nbl);
-        InterlockedDecrement((LONG *)&Wg->HandshakeRxQueueLen);
+        SimdAccountPackets(&Simd, Count);
+        CookieCheckMac1Batch(&Wg->CookieChecker, Nbls, Count, Mac1Valid, &Simd);
+        UnderLoad = ReceiveHandshakeUnderLoad(Wg);
+        for (i = 0, NumRatelimited = 0; i < Count; ++i)
+        {
+            MacState[i] = INVALID_MAC;
+            if (NBL_TYPE_LE32(Nbls[i]) == CpuToLe32(MESSAGE_TYPE_HANDSHAKE_COOKIE))
+                continue;
+            MacState[i] = CookieValidatePacket(&Wg->CookieChecker, Nbls[i], Mac1Valid[i], UnderLoad);
+            if (MacState[i] == VALID_MAC_WITH_COOKIE)
+            {
+                Srcs[NumRatelimited] = NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbls[i])->RemoteAddress;
+                Ratelimited[NumRatelimited++] = i;
+            }
+        }
+        if (NumRatelimited)
+        {
+            RatelimiterAllowBatch(Srcs, Allowed, NumRatelimited, &Simd);
+            for (i = 0; i < NumRatelimited; ++i)
+            {
+                if (!Allowed[i])
+                    MacState[Ratelimited[i]] = VALID_MAC_WITH_COOKIE_BUT_RATELIMITED;
+            }
+        }
+
+        for (i = 0, NumInitiations = 0; i < Count; ++i)
+        {
+            Consume[i] = ReceiveHandshakeCheckMacs(Wg, Nbls[i], MacState[i], UnderLoad);
+            PrecomputedEs[i] = NULL;
+            if (Consume[i] && NBL_TYPE_LE32(Nbls[i]) == CpuToLe32(MESSAGE_TYPE_HANDSHAKE_INITIATION))
+            {
+                PrecomputedEs[i] = Es[NumInitiations];
+                Initiations[NumInitiations++] = MemGetValidatedNetBufferListData(Nbls[i]);
+            }
+        }
+        if (NumInitiations)
+            NoiseHandshakePrecomputeInitiations(Wg, Initiations, NumInitiations, Es);
+
+        for (i = 0; i < Count; ++i)
+        {
+            if (Consume[i])
+                ReceiveHandshakePacket(Wg, Nbls[i], PrecomputedEs[i]);
+            FreeReceiveNetBufferList(Nbls[i]);
+            InterlockedDecrement((LONG *)&Wg->HandshakeRxQueueLen);
+        }
+        RtlSecureZeroMemory(Es, sizeof(Es));
     }
+    SimdPut(&Simd);
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -292,7 +376,7 @@ PacketConsumeDataDone(_Inout_ WG_PEER *Peer, _Inout_ NET_BUFFER_LIST *Nbl)
     if (!NbLength)
     {
         UpdateRxStats(Peer, MessageDataLen(0));
-        SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+        SocketPeerEndpointToString(EndpointName, Peer);
         LogInfoRatelimited(
             Peer->Device, "Receiving keepalive packet from peer %llu (%s)", Peer->InternalId, EndpointName);
         goto packetProcessed;
@@ -372,7 +456,7 @@ PacketConsumeDataDone(_Inout_ WG_PEER *Peer, _Inout_ NET_BUFFER_LIST *Nbl)
     return TRUE;
 
 dishonestPacketPeer:
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     if (Proto == Htons(NDIS_ETH_TYPE_IPV4))
         RtlIpv4AddressToStringA((IN_ADDR *)&((IPV4HDR *)Hdr)->Saddr, SrcStr);
     else if (Proto == Htons(NDIS_ETH_TYPE_IPV6))
@@ -381,12 +465,12 @@ dishonestPacketPeer:
         Peer->Device, "Packet has unallowed src IP (%s) from peer %llu (%s)", SrcStr, Peer->InternalId, EndpointName);
     goto falsePacket;
 dishonestPacketType:
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     LogInfoRatelimited(
         Peer->Device, "Packet is neither ipv4 nor ipv6 from peer %llu (%s)", Peer->InternalId, EndpointName);
     goto falsePacket;
 dishonestPacketSize:
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     LogInfoRatelimited(Peer->Device, "Packet has incorrect size from peer %llu (%s)", Peer->InternalId, EndpointName);
     goto falsePacket;
 falsePacket:
@@ -452,14 +536,17 @@ PacketPeerRxWork(_Inout_ WG_PEER *Peer, _In_ ULONG Budget)
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static VOID
-ProcessPerPeerWork(PEER_SERIAL *WorkQueue)
+ProcessPerPeerWork(PEER_SERIAL *WorkQueue, MULTICORE_WORKQUEUE *Workers, WORKER_SIMD *Simd)
 {
     PEER_SERIAL_ENTRY *Entry;
-    while ((Entry = PeerSerialDequeue(WorkQueue)) != NULL)
-        PeerSerialMaybeRetire(
-            WorkQueue,
-            Entry,
-            PacketPeerRxWork(CONTAINING_RECORD(Entry, WG_PEER, RxSerialEntry), PEER_XMIT_PACKETS_PER_ROUND));
+    while ((Entry = PeerSerialDequeue(WorkQueue, Workers)) != NULL)
+    {
+        /* This indicates packets up the stack, so the next batch to decrypt takes the SIMD state again. */
+        WorkerSimdPut(Simd);
+        WG_PEER *Peer = CONTAINING_RECORD(Entry, WG_PEER, RxSerialEntry);
+        ULONG Budget = ReadULongNoFence(&Peer->Device->QueueLimits.XmitPacketsPerRound);
+        PeerSerialMaybeRetire(WorkQueue, Entry, PacketPeerRxWork(Peer, Budget));
+    }
 }
 
 _Use_decl_annotations_
@@ -467,26 +554,46 @@ VOID
 PacketDecryptWorker(MULTICORE_WORKQUEUE *WorkQueue)
 {
     WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, DecryptThreads);
-    PTR_RING *Ring = &Wg->DecryptQueue;
+    ULONG Cpu = KeGetCurrentProcessorIndex();
+    PEER_SERIAL *HomeQueue = &Wg->RxHomeQueues[Cpu];
     NET_BUFFER_LIST *First;
-    SIMD_STATE Simd;
-
-    SimdGet(&Simd);
-    while ((First = PtrRingConsume(Ring)) != NULL)
+    WORKER_SIMD Simd = { 0 };
+    ULONG Packets = 0;
+
+    /* Like PacketEncryptWorker, keep the extended state across drains of a bursty ring, other than while indicating. */
+    UINT64 Deadline = KeQueryInterruptTime() + SIMD_HOLD_MAX_SYS_TIME_UNITS;
+drainAgain:
+    /* Start with the ring fed from this processor's group, whose packets are likeliest to be in cache, then help out
+     * with the others.
+     */
+    for (ULONG i = 0; i < Wg->NumDecryptQueues; ++i)
     {
-        for (NET_BUFFER_LIST *Nbl = First, *NextNbl; Nbl; Nbl = NextNbl)
+        PTR_RING *Ring = &Wg->DecryptQueues[(Cpu + i) % Wg->NumDecryptQueues];
+        while ((First = PtrRingConsume(Ring)) != NULL)
         {
-            WG_PEER *Peer = NET_BUFFER_LIST_PEER(Nbl);
-            NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
-            NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
-            PACKET_STATE State =
-                DecryptPacket(&Simd, Nbl, NET_BUFFER_LIST_KEYPAIR(Nbl)) ? PACKET_STATE_CRYPTED : PACKET_STATE_DEAD;
-            QueueEnqueuePerPeer(&Wg->RxQueue, &Peer->RxSerialEntry, Nbl, State);
+            SIMD_STATE *SimdState = WorkerSimdGet(&Simd);
+            for (NET_BUFFER_LIST *Nbl = First, *NextNbl; Nbl; Nbl = NextNbl)
+            {
+                WG_PEER *Peer = NET_BUFFER_LIST_PEER(Nbl);
+                NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+                NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+                PACKET_STATE State = DecryptPacket(SimdState, Nbl, NET_BUFFER_LIST_KEYPAIR(Nbl)) ? PACKET_STATE_CRYPTED
+                                                                                                : PACKET_STATE_DEAD;
+                QueueEnqueuePerPeerHome(
+                    Peer, &Wg->RxQueue, Wg->RxHomeQueues, &Wg->DecryptThreads, &Peer->RxSerialEntry, Nbl, State);
+                ++Packets;
+                ++Simd.Packets;
+            }
+            ProcessPerPeerWork(&Wg->RxQueue, WorkQueue, &Simd);
+            ProcessPerPeerWork(HomeQueue, WorkQueue, &Simd);
         }
-        ProcessPerPeerWork(&Wg->RxQueue);
     }
-    SimdPut(&Simd);
-    ProcessPerPeerWork(&Wg->RxQueue);
+    ProcessPerPeerWork(&Wg->RxQueue, WorkQueue, &Simd);
+    ProcessPerPeerWork(HomeQueue, WorkQueue, &Simd);
+    if (Packets < SIMD_HOLD_MAX_PACKETS && MulticoreWorkQueueLinger(WorkQueue, Deadline))
+        goto drainAgain;
+    WorkerSimdPut(&Simd);
+    QueueLimitsMaybeTune(Wg);
 }
 
 #pragma warning(suppress : 28194) /* `Nbl` is aliased in QueueEnqueuePerDeviceAndPeer, or QueueEnqueuePerPeer or freed \
@@ -528,7 +635,8 @@ PacketConsumeData(_Inout_ WG_DEVICE *Wg, _Inout_ __drv_aliasesMem NET_BUFFER_LIS
         FreeReceiveNetBufferList(Nbl);
         PeerPut(Peer);
     }
-    if (FirstForDevice && !QueueEnqueuePerDevice(&Wg->DecryptQueue, &Wg->DecryptThreads, FirstForDevice))
+    PTR_RING *Ring = &Wg->DecryptQueues[KeGetCurrentProcessorIndex() % Wg->NumDecryptQueues];
+    if (FirstForDevice && !QueueEnqueuePerDevice(Ring, &Wg->DecryptThreads, FirstForDevice))
     {
         for (NET_BUFFER_LIST *Nbl = FirstForDevice, *NextNbl; Nbl; Nbl = NextNbl)
         {
@@ -603,15 +711,18 @@ PacketReceive(WG_DEVICE *Wg, NET_BUFFER_LIST *First)
         case CpuToLe32(MESSAGE_TYPE_HANDSHAKE_INITIATION):
         case CpuToLe32(MESSAGE_TYPE_HANDSHAKE_RESPONSE):
         case CpuToLe32(MESSAGE_TYPE_HANDSHAKE_COOKIE): {
-            NTSTATUS Ret = ReadULongNoFence(&Wg->HandshakeRxQueueLen) >= MAX_QUEUED_INCOMING_HANDSHAKES / 2
+            ULONG QueueLen = ReadULongNoFence(&Wg->HandshakeRxQueueLen);
+            NTSTATUS Ret = QueueLen >= ReadULongNoFence(&Wg->QueueLimits.Limit[QUEUE_HANDSHAKES]) / 2
                                ? PtrRingTryProduce(&Wg->HandshakeRxQueue, Nbl)
                                : PtrRingProduce(&Wg->HandshakeRxQueue, Nbl);
             if (!NT_SUCCESS(Ret))
             {
+                if (Ret == STATUS_BUFFER_TOO_SMALL)
+                    QueueLimitsDropped(Wg, QUEUE_HANDSHAKES);
                 LogInfoNblRatelimited(Wg, "Dropping handshake packet from %s", Nbl);
                 goto cleanup;
             }
-            InterlockedIncrement((LONG *)&Wg->HandshakeRxQueueLen);
+            QueueLimitsSawDepth(Wg, QUEUE_HANDSHAKES, InterlockedIncrement((LONG *)&Wg->HandshakeRxQueueLen));
             MulticoreWorkQueueBump(&Wg->HandshakeRxThreads);
             break;
         }
@@ -641,11 +752,8 @@ ReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST First,
         NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
         NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
         WSK_DATAGRAM_INDICATION *DatagramIndication = NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl);
-        SOCKET *Socket = (SOCKET *)DatagramIndication->Next;
-        DatagramIndication->Next = NULL;
-        ((WSK_PROVIDER_DATAGRAM_DISPATCH *)Socket->Sock->Dispatch)->WskRelease(Socket->Sock, DatagramIndication);
-        MemFreeNetBufferList(Nbl);
-        ExReleaseRundownProtection(&Socket->ItemsInFlight);
+        MemFreeReceiveNetBufferList(Nbl);
+        SocketReleaseDatagramIndication(DatagramIndication);
     }
 }
 
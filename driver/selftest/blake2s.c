@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+static CONST UINT8 Blake2sTestAbc[BLAKE2S_HASH_SIZE] = {
+    0x50, 0x8c, 0x5e, 0x8c, 0x32, 0x7c, 0x14, 0xe2, 0xe1, 0xa7, 0x2b, 0xa3, 0x4e, 0xeb, 0x45, 0x2f,
+    0x37, 0x45, 0x8b, 0x20, 0x9e, 0xd6, 0x3a, 0x29, 0x4d, 0x99, 0x9b, 0x4c, 0x86, 0x67, 0x59, 0x82
+};
+
+static BOOLEAN
+Blake2sSelftest(CONST SIMD_STATE *Simd);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, Blake2sSelftest)
+#endif
+static BOOLEAN
+Blake2sSelftest(CONST SIMD_STATE *Simd)
+{
+    UINT8 Input[BLAKE2S_MAX_LANES][BLAKE2S_BLOCK_SIZE * 4 + 1];
+    UINT8 Key[BLAKE2S_KEY_SIZE];
+    UINT8 Expected[BLAKE2S_MAX_LANES][BLAKE2S_HASH_SIZE];
+    UINT8 Computed[BLAKE2S_MAX_LANES][BLAKE2S_HASH_SIZE];
+    UINT8 *Out[BLAKE2S_MAX_LANES];
+    CONST UINT8 *In[BLAKE2S_MAX_LANES];
+    BOOLEAN Success = TRUE;
+    SIZE_T InLen, KeyLen, i;
+    ULONG Lanes;
+
+    Blake2s(Computed[0], (CONST UINT8 *)"abc", NULL, BLAKE2S_HASH_SIZE, 3, 0);
+    if (!RtlEqualMemory(Computed[0], Blake2sTestAbc, BLAKE2S_HASH_SIZE))
+    {
+        LogDebug("blake2s self-test abc: FAIL");
+        Success = FALSE;
+    }
+
+    for (i = 0; i < sizeof(Key); ++i)
+        Key[i] = (UINT8)i;
+    for (Lanes = 0; Lanes < BLAKE2S_MAX_LANES; ++Lanes)
+    {
+        for (i = 0; i < sizeof(Input[Lanes]); ++i)
+            Input[Lanes][i] = (UINT8)(i * 7 + Lanes);
+        In[Lanes] = Input[Lanes];
+        Out[Lanes] = Computed[Lanes];
+    }
+
+    /* The multi-lane version must agree with the one-at-a-time version, for every lane count, across block edges. */
+    for (KeyLen = 0; KeyLen <= BLAKE2S_KEY_SIZE; KeyLen += BLAKE2S_KEY_SIZE / 2)
+    {
+        for (InLen = 1; InLen < sizeof(Input[0]); ++InLen)
+        {
+            Lanes = 1 + InLen % BLAKE2S_MAX_LANES;
+            for (i = 0; i < Lanes; ++i)
+                Blake2s(Expected[i], Input[i], Key, BLAKE2S_HASH_SIZE, InLen, KeyLen);
+            RtlZeroMemory(Computed, sizeof(Computed));
+            Blake2sMulti(Out, In, Key, BLAKE2S_HASH_SIZE, InLen, KeyLen, Lanes, Simd);
+            if (!RtlEqualMemory(Computed, Expected, Lanes * BLAKE2S_HASH_SIZE))
+            {
+                LogDebug("blake2s multi-lane self-test %zu/%zu/%lu: FAIL", InLen, KeyLen, Lanes);
+                Success = FALSE;
+            }
+        }
+    }
+    return Success;
+}
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+/* Like the other self-tests, these run in the driver at load on DBG builds rather than on the host, since the tree
+ * has no host test harness. Each backend the CPU can run is called directly and checked against the portable one.
+ */
+struct Curve25519TestVector
+{
+    UINT8 Private[CURVE25519_KEY_SIZE];
+    UINT8 Public[CURVE25519_KEY_SIZE];
+    UINT8 Result[CURVE25519_KEY_SIZE];
+};
+
+static CONST struct Curve25519TestVector Curve25519TestVectors[] = {
+    { .Private = { 0x77, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d, 0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+                   0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a, 0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x2a },
+      .Public = { 0xde, 0x9e, 0xdb, 0x7d, 0x7b, 0x7d, 0xc1, 0xb4, 0xd3, 0x5b, 0x61, 0xc2, 0xec, 0xe4, 0x35, 0x37,
+                  0x3f, 0x83, 0x43, 0xc8, 0x5b, 0x78, 0x67, 0x4d, 0xad, 0xfc, 0x7e, 0x14, 0x6f, 0x88, 0x2b, 0x4f },
+      .Result = { 0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1, 0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+                  0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33, 0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42 } },
+    { .Private = { 0x5d, 0xab, 0x08, 0x7e, 0x62, 0x4a, 0x8a, 0x4b, 0x79, 0xe1, 0x7f, 0x8b, 0x83, 0x80, 0x0e, 0xe6,
+                   0x6f, 0x3b, 0xb1, 0x29, 0x26, 0x18, 0xb6, 0xfd, 0x1c, 0x2f, 0x8b, 0x27, 0xff, 0x88, 0xe0, 0xeb },
+      .Public = { 0x85, 0x20, 0xf0, 0x09, 0x89, 0x30, 0xa7, 0x54, 0x74, 0x8b, 0x7d, 0xdc, 0xb4, 0x3e, 0xf7, 0x5a,
+                  0x0d, 0xbf, 0x3a, 0x0d, 0x26, 0x38, 0x1a, 0xf4, 0xeb, 0xa4, 0xa9, 0x8e, 0xaa, 0x9b, 0x4e, 0x6a },
+      .Result = { 0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1, 0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+                  0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33, 0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42 } },
+    { .Private = { 0xa5, 0x46, 0xe3, 0x6b, 0xf0, 0x52, 0x7c, 0x9d, 0x3b, 0x16, 0x15, 0x4b, 0x82, 0x46, 0x5e, 0xdd,
+                   0x62, 0x14, 0x4c, 0x0a, 0xc1, 0xfc, 0x5a, 0x18, 0x50, 0x6a, 0x22, 0x44, 0xba, 0x44, 0x9a, 0xc4 },
+      .Public = { 0xe6, 0xdb, 0x68, 0x67, 0x58, 0x30, 0x30, 0xdb, 0x35, 0x94, 0xc1, 0xa4, 0x24, 0xb1, 0x5f, 0x7c,
+                  0x72, 0x66, 0x24, 0xec, 0x26, 0xb3, 0x35, 0x3b, 0x10, 0xa9, 0x03, 0xa6, 0xd0, 0xab, 0x1c, 0x4c },
+      .Result = { 0xc3, 0xda, 0x55, 0x37, 0x9d, 0xe9, 0xc6, 0x90, 0x8e, 0x94, 0xea, 0x4d, 0xf2, 0x8d, 0x08, 0x4f,
+                  0x32, 0xec, 0xcf, 0x03, 0x49, 0x1c, 0x71, 0xf7, 0x54, 0xb4, 0x07, 0x55, 0x77, 0xa2, 0x85, 0x52 } },
+    /* Points with the top bit set must have it ignored. */
+    { .Private = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+                   0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20 },
+      .Public = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } },
+};
+
+/* Points of small order, which leave the ladder with a zero Z, for the batch to substitute and still reject. */
+static CONST UINT8 Curve25519LowOrderPoints[][CURVE25519_KEY_SIZE] = {
+    { 0x00 },
+    { 0x01 },
+    { 0xe0, 0xeb, 0x7a, 0x7c, 0x3b, 0x41, 0xb8, 0xae, 0x16, 0x56, 0xe3, 0xfa, 0xf1, 0x9f, 0xc4, 0x6a,
+      0xda, 0x09, 0x8d, 0xeb, 0x9c, 0x32, 0xb1, 0xfd, 0x86, 0x62, 0x05, 0x16, 0x5f, 0x49, 0xb8, 0x00 },
+    { 0x5f, 0x9c, 0x95, 0xbc, 0xa3, 0x50, 0x8c, 0x24, 0xb1, 0xd0, 0xb1, 0x55, 0x9c, 0x83, 0xef, 0x5b,
+      0x04, 0x44, 0x5c, 0xc4, 0x58, 0x1c, 0x8e, 0x86, 0xd8, 0x22, 0x4e, 0xdd, 0xd0, 0x9f, 0x11, 0x57 },
+    { 0xec, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f },
+    { 0xed, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f },
+    { 0xee, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f },
+};
+
+#define CURVE25519_BATCH_TEST_POINTS (ARRAYSIZE(Curve25519TestVectors) + ARRAYSIZE(Curve25519LowOrderPoints))
+
+/* Every batch size, over runs of points that wrap around from the vectors into the low order ones and back, checked
+ * against doing each item on its own.
+ */
+static BOOLEAN
+Curve25519BatchSelftest(VOID);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, Curve25519BatchSelftest)
+#endif
+static BOOLEAN
+Curve25519BatchSelftest(VOID)
+{
+    UINT8 Out[CURVE25519_MAX_BATCH][CURVE25519_KEY_SIZE], Expected[CURVE25519_KEY_SIZE];
+    UINT8 *OutPtrs[CURVE25519_MAX_BATCH];
+    CONST UINT8 *Scalars[CURVE25519_MAX_BATCH], *Points[CURVE25519_MAX_BATCH];
+    BOOLEAN Ret[CURVE25519_MAX_BATCH], ExpectedRet, Success = TRUE;
+
+    for (ULONG Count = 1; Count <= CURVE25519_MAX_BATCH; ++Count)
+    {
+        for (ULONG Start = 0; Start < CURVE25519_BATCH_TEST_POINTS; ++Start)
+        {
+            for (ULONG i = 0; i < Count; ++i)
+            {
+                ULONG Point = (Start + i) % CURVE25519_BATCH_TEST_POINTS;
+                OutPtrs[i] = Out[i];
+                Scalars[i] = Curve25519TestVectors[(Start + 2 * i) % ARRAYSIZE(Curve25519TestVectors)].Private;
+                Points[i] = Point < ARRAYSIZE(Curve25519TestVectors)
+                                ? Curve25519TestVectors[Point].Public
+                                : Curve25519LowOrderPoints[Point - ARRAYSIZE(Curve25519TestVectors)];
+            }
+            Curve25519Batch(OutPtrs, Scalars, Points, Ret, Count);
+            for (ULONG i = 0; i < Count; ++i)
+            {
+                ExpectedRet = Curve25519(Expected, Scalars[i], Points[i]);
+                if (Ret[i] != ExpectedRet || !RtlEqualMemory(Out[i], Expected, CURVE25519_KEY_SIZE))
+                {
+                    LogDebug("curve25519 batch self-test %lu/%lu, item %lu: FAIL", Count, Start + 1, i);
+                    Success = FALSE;
+                }
+            }
+        }
+    }
+    return Success;
+}
+
+static BOOLEAN
+Curve25519Selftest(VOID);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, Curve25519Selftest)
+#endif
+static BOOLEAN
+Curve25519Selftest(VOID)
+{
+    CURVE25519_FN *CONST Impls[] = {
+        Curve25519Generic,
+#if defined(_M_AMD64)
+        Curve25519Fe51Mul,
+        Curve25519Fe51Mulx,
+#endif
+    };
+    UINT8 Expected[CURVE25519_KEY_SIZE], Out[CURVE25519_KEY_SIZE];
+    BOOLEAN Success = TRUE, ExpectedRet, Ret;
+    ULONG i, j;
+
+    for (i = 0; i < ARRAYSIZE(Curve25519TestVectors); ++i)
+    {
+        CONST struct Curve25519TestVector *Vector = &Curve25519TestVectors[i];
+
+        /* Vectors without a known result just need every implementation to agree with the reference. */
+        ExpectedRet = Curve25519Generic(Expected, Vector->Private, Vector->Public);
+        if (!CryptoIsZero32(Vector->Result) && !RtlEqualMemory(Expected, Vector->Result, CURVE25519_KEY_SIZE))
+        {
+            LogDebug("curve25519 self-test %lu: FAIL", i + 1);
+            Success = FALSE;
+        }
+        for (j = 0; j < ARRAYSIZE(Impls); ++j)
+        {
+#if defined(_M_AMD64)
+            if (Impls[j] == Curve25519Fe51Mulx && !(CpuFeatures & CPU_FEATURE_BMI2))
+                continue;
+#endif
+            Ret = Impls[j](Out, Vector->Private, Vector->Public);
+            if (Ret != ExpectedRet || !RtlEqualMemory(Out, Expected, CURVE25519_KEY_SIZE))
+            {
+                LogDebug("curve25519 self-test %lu, implementation %lu: FAIL", i + 1, j);
+                Success = FALSE;
+            }
+        }
+    }
+    if (!Curve25519BatchSelftest())
+        Success = FALSE;
+    return Success;
+}
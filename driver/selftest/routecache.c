@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#define ROUTE_CACHE_TEST_ROUTES 256
+#define ROUTE_CACHE_TEST_LOOKUPS 20000
+
+typedef struct _ROUTE_CACHE_TEST
+{
+    ROUTE_CACHE Cache;
+    ROUTE_CACHE_ENTRY Reference[ROUTE_CACHE_TEST_ROUTES];
+} ROUTE_CACHE_TEST;
+
+/* Picks addresses out of a small pool, so that random routes nest and overlap, and random lookups hit them. */
+static VOID
+RouteCacheSelftestAddr(_In_ ADDRESS_FAMILY Family, _Out_writes_bytes_all_(16) UCHAR *Addr, _Inout_ ULONG *Seed)
+{
+    ULONG Len = Family == AF_INET ? 4 : 16;
+    RtlZeroMemory(Addr, 16);
+    for (ULONG i = 0; i < Len; ++i)
+        Addr[i] = (UCHAR)(RtlRandomEx(Seed) % 4 == 0 ? RtlRandomEx(Seed) : 0xa0 | (RtlRandomEx(Seed) & 0x3));
+}
+
+/* Longest prefix, then lowest metric, found the way SocketResolvePeerEndpoint used to: by scanning every route. */
+static CONST ROUTE_CACHE_ENTRY *
+RouteCacheSelftestReference(
+    _In_ CONST ROUTE_CACHE_TEST *Test,
+    _In_ ADDRESS_FAMILY Family,
+    _In_ ULONG Count,
+    _In_ CONST UCHAR *Addr)
+{
+    CONST ROUTE_CACHE_ENTRY *Best = NULL;
+    IP_ADDRESS_PREFIX Prefix = { 0 };
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        CONST ROUTE_CACHE_ENTRY *Entry = &Test->Reference[i];
+        Prefix.PrefixLength = Entry->Cidr;
+        if (Family == AF_INET)
+        {
+            Prefix.Prefix.Ipv4.sin_addr = Entry->Prefix.V4;
+            if (!CidrMaskMatchV4((CONST IN_ADDR *)Addr, &Prefix))
+                continue;
+        }
+        else
+        {
+            Prefix.Prefix.Ipv6.sin6_addr = Entry->Prefix.V6;
+            if (!CidrMaskMatchV6((CONST IN6_ADDR *)Addr, &Prefix))
+                continue;
+        }
+        if (Best && (Entry->Cidr < Best->Cidr || (Entry->Cidr == Best->Cidr && Entry->Metric >= Best->Metric)))
+            continue;
+        Best = Entry;
+    }
+    return Best;
+}
+
+static BOOLEAN
+RouteCacheSelftestFamily(_Inout_ ROUTE_CACHE_TEST *Test, _In_ ADDRESS_FAMILY Family, _Inout_ ULONG *Seed)
+{
+    DECLSPEC_ALIGN(4) UCHAR Addr[16];
+    ULONG MaxCidr = Family == AF_INET ? 32 : 128;
+    BOOLEAN Success = TRUE;
+
+    /* Publish a few tables of different sizes into the same cache, as successive routing generations would. */
+    for (ULONG Count = 0;; Count = min(Count * 4 + 1, ROUTE_CACHE_TEST_ROUTES))
+    {
+        ROUTE_CACHE_ENTRY *Entries = NULL;
+        if (Count)
+        {
+            Entries = MemAllocateArray(Count, sizeof(*Entries));
+            if (!Entries)
+            {
+                LogDebug("route cache self-test malloc: FAIL");
+                return FALSE;
+            }
+        }
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            RouteCacheSelftestAddr(Family, Addr, Seed);
+            UCHAR Cidr = (UCHAR)(RtlRandomEx(Seed) % (MaxCidr + 1));
+            if (RtlRandomEx(Seed) % 16 == 0)
+                Cidr = 0;
+            RouteCacheMaskPrefix(&Test->Reference[i], Family, Addr, Cidr);
+            Test->Reference[i].Metric = RtlRandomEx(Seed) % 8;
+            Test->Reference[i].InterfaceIndex = i + 1;
+            Test->Reference[i].InterfaceLuid.Value = i + 1;
+            Entries[i] = Test->Reference[i];
+        }
+        MuAcquirePushLockExclusive(&Test->Cache.Lock);
+        RouteCachePublish(&Test->Cache, Family, Entries, Count, (LONG)Count + 1);
+        MuReleasePushLockExclusive(&Test->Cache.Lock);
+
+        MuAcquirePushLockShared(&Test->Cache.Lock);
+        if (Test->Cache.Count != Count || Test->Cache.Generation != (LONG)Count + 1)
+        {
+            LogDebug("route cache self-test publish %u: FAIL", Count);
+            Success = FALSE;
+        }
+        for (ULONG i = 0; i < ROUTE_CACHE_TEST_LOOKUPS; ++i)
+        {
+            RouteCacheSelftestAddr(Family, Addr, Seed);
+            CONST ROUTE_CACHE_ENTRY *Want = RouteCacheSelftestReference(Test, Family, Count, Addr);
+            CONST ROUTE_CACHE_ENTRY *Got = RouteCacheLookup(&Test->Cache, Family, Addr);
+            /* Routes with the same prefix and metric are interchangeable, so only compare what was matched. */
+            if (!Want != !Got || (Want && (Want->Cidr != Got->Cidr || Want->Metric != Got->Metric ||
+                                           RouteCachePrefixCompare(Family, Want, Got))))
+            {
+                LogDebug("route cache self-test lookup %u/%u: FAIL", Count, i);
+                Success = FALSE;
+                break;
+            }
+        }
+        MuReleasePushLockShared(&Test->Cache.Lock);
+        if (Count == ROUTE_CACHE_TEST_ROUTES)
+            break;
+    }
+    return Success;
+}
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, RouteCacheSelftest)
+#endif
+_Use_decl_annotations_
+BOOLEAN
+RouteCacheSelftest(VOID)
+{
+    ULONG Seed = (ULONG)KeQueryInterruptTime();
+    BOOLEAN Success = TRUE;
+
+    ROUTE_CACHE_TEST *Test = MemAllocateAndZero(sizeof(*Test));
+    if (!Test)
+    {
+        LogDebug("route cache self-test malloc: FAIL");
+        return FALSE;
+    }
+    MuInitializePushLock(&Test->Cache.Lock);
+    if (!RouteCacheSelftestFamily(Test, AF_INET, &Seed))
+        Success = FALSE;
+    MemFree(Test->Cache.Entries);
+    RtlZeroMemory(&Test->Cache, sizeof(Test->Cache));
+    MuInitializePushLock(&Test->Cache.Lock);
+    if (!RouteCacheSelftestFamily(Test, AF_INET6, &Seed))
+        Success = FALSE;
+    MemFree(Test->Cache.Entries);
+
+    if (Success)
+        LogDebug("route cache self-tests: pass");
+    MemFree(Test);
+    return Success;
+}
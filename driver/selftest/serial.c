@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#define SERIAL_TEST_ENTRIES 64
+#define SERIAL_TEST_THREADS 4
+#define SERIAL_TEST_ITERATIONS 50000
+
+typedef struct _SERIAL_TEST
+{
+    PEER_SERIAL Serial;
+    PEER_SERIAL_ENTRY Entries[SERIAL_TEST_ENTRIES];
+    LONG Wanted[SERIAL_TEST_ENTRIES];
+    LONG Running[SERIAL_TEST_ENTRIES];
+    LONG DoubleScheduled;
+} SERIAL_TEST;
+
+static VOID
+PeerSerialSelftestDrain(_Inout_ SERIAL_TEST *Test, _Inout_ ULONG *Seed)
+{
+    PEER_SERIAL_ENTRY *Entry;
+    while ((Entry = PeerSerialDequeue(&Test->Serial, NULL)) != NULL)
+    {
+        ULONG i = (ULONG)(Entry - Test->Entries);
+        if (InterlockedIncrement(&Test->Running[i]) != 1)
+            InterlockedIncrement(&Test->DoubleScheduled);
+        InterlockedExchange(&Test->Wanted[i], FALSE);
+        InterlockedDecrement(&Test->Running[i]);
+        PeerSerialMaybeRetire(&Test->Serial, Entry, RtlRandomEx(Seed) % 8 == 0);
+    }
+}
+
+static KSTART_ROUTINE PeerSerialSelftestThread;
+_Use_decl_annotations_
+static VOID
+PeerSerialSelftestThread(PVOID StartContext)
+{
+    SERIAL_TEST *Test = StartContext;
+    ULONG Seed = (ULONG)(ULONG_PTR)PsGetCurrentThreadId();
+
+    /* Like the workers, ask for work to be done on a random entry, and sometimes do some of the work. */
+    for (ULONG Iteration = 0; Iteration < SERIAL_TEST_ITERATIONS; ++Iteration)
+    {
+        ULONG i = RtlRandomEx(&Seed) % SERIAL_TEST_ENTRIES;
+        InterlockedExchange(&Test->Wanted[i], TRUE);
+        PeerSerialEnqueueIfNotBusy(&Test->Serial, &Test->Entries[i], TRUE);
+        if (RtlRandomEx(&Seed) % 4 == 0)
+            PeerSerialSelftestDrain(Test, &Seed);
+    }
+    PeerSerialSelftestDrain(Test, &Seed);
+}
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, PeerSerialSelftest)
+#endif
+_Use_decl_annotations_
+BOOLEAN
+PeerSerialSelftest(VOID)
+{
+    PKTHREAD Threads[SERIAL_TEST_THREADS];
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    ULONG NumThreads = 0, i;
+    BOOLEAN Success = TRUE;
+    HANDLE Handle;
+
+    SERIAL_TEST *Test = MemAllocateAndZero(sizeof(*Test));
+    if (!Test)
+    {
+        LogDebug("peer serial self-test malloc: FAIL");
+        return FALSE;
+    }
+    PeerSerialInit(&Test->Serial);
+
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    for (i = 0; i < SERIAL_TEST_THREADS; ++i)
+    {
+        if (!NT_SUCCESS(PsCreateSystemThread(
+                &Handle, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, PeerSerialSelftestThread, Test)))
+            break;
+        ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &Threads[NumThreads++], NULL);
+        ZwClose(Handle);
+    }
+    for (i = 0; i < NumThreads; ++i)
+    {
+        KeWaitForSingleObject(Threads[i], Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Threads[i]);
+    }
+    if (NumThreads != SERIAL_TEST_THREADS)
+    {
+        LogDebug("peer serial self-test threads: FAIL");
+        Success = FALSE;
+    }
+
+    if (Test->DoubleScheduled)
+    {
+        LogDebug("peer serial self-test double scheduling: FAIL");
+        Success = FALSE;
+    }
+    /* Every thread drained the queue before exiting, so nothing may be left queued or waiting to be worked on. */
+    if (!PeerSerialIsEmpty(&Test->Serial))
+    {
+        LogDebug("peer serial self-test empty: FAIL");
+        Success = FALSE;
+    }
+    for (i = 0; i < SERIAL_TEST_ENTRIES; ++i)
+    {
+        if (Test->Wanted[i] || Test->Entries[i].State != PEER_SERIAL_IDLE)
+        {
+            LogDebug("peer serial self-test lost entry %u: FAIL", i);
+            Success = FALSE;
+        }
+    }
+
+    if (Success)
+        LogDebug("peer serial self-tests: pass");
+    MemFree(Test);
+    return Success;
+}
+
+#undef SERIAL_TEST_ITERATIONS
+#undef SERIAL_TEST_THREADS
+#undef SERIAL_TEST_ENTRIES
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+static BOOLEAN
+HsiphashSelftest(CONST SIMD_STATE *Simd);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, HsiphashSelftest)
+#endif
+static BOOLEAN
+HsiphashSelftest(CONST SIMD_STATE *Simd)
+{
+    enum
+    {
+        MAX_LANES = 3 * HSIPHASH_MAX_LANES + 1
+    };
+    HSIPHASH_KEY Key;
+    UINT32 First[MAX_LANES], Second[MAX_LANES], Expected[MAX_LANES], Computed[MAX_LANES];
+    BOOLEAN Success = TRUE;
+    ULONG Lanes, i;
+
+    for (i = 0; i < sizeof(Key); ++i)
+        ((UINT8 *)&Key)[i] = (UINT8)i;
+    for (i = 0; i < MAX_LANES; ++i)
+    {
+        First[i] = 0x9e3779b9U * (i + 1);
+        Second[i] = 0x7f4a7c15U ^ (i << 17);
+    }
+
+    for (i = 0; i < MAX_LANES; ++i)
+    {
+        UINT32 Words[2] = { CpuToLe32(First[i]), CpuToLe32(Second[i]) };
+        if (Hsiphash1u32(First[i], &Key) != Hsiphash(Words, sizeof(Words[0]), &Key) ||
+            Hsiphash2u32(First[i], Second[i], &Key) != Hsiphash(Words, sizeof(Words), &Key))
+        {
+            LogDebug("hsiphash self-test %lu: FAIL", i);
+            Success = FALSE;
+        }
+    }
+
+    /* The multi-lane versions must agree with the one-at-a-time versions, for every lane count. */
+    for (Lanes = 1; Lanes <= MAX_LANES; ++Lanes)
+    {
+        for (i = 0; i < Lanes; ++i)
+            Expected[i] = Hsiphash1u32(First[i], &Key);
+        RtlZeroMemory(Computed, sizeof(Computed));
+        Hsiphash1u32Multi(Computed, First, &Key, Lanes, Simd);
+        if (!RtlEqualMemory(Computed, Expected, Lanes * sizeof(Computed[0])))
+        {
+            LogDebug("hsiphash1u32 multi-lane self-test %lu: FAIL", Lanes);
+            Success = FALSE;
+        }
+
+        for (i = 0; i < Lanes; ++i)
+            Expected[i] = Hsiphash2u32(First[i], Second[i], &Key);
+        RtlZeroMemory(Computed, sizeof(Computed));
+        Hsiphash2u32Multi(Computed, First, Second, &Key, Lanes, Simd);
+        if (!RtlEqualMemory(Computed, Expected, Lanes * sizeof(Computed[0])))
+        {
+            LogDebug("hsiphash2u32 multi-lane self-test %lu: FAIL", Lanes);
+            Success = FALSE;
+        }
+    }
+    return Success;
+}
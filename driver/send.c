@@ -27,7 +27,7 @@ PacketSendHandshakeInitiation(_Inout_ WG_PEER *Peer)
 
     WriteNoFence64(&Peer->LastSentHandshake, KeQueryInterruptTime());
     CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     LogInfoRatelimited(Peer->Device, "Sending handshake initiation to peer %llu (%s)", Peer->InternalId, EndpointName);
 
     if (NoiseHandshakeCreateInitiation(&Packet, &Peer->Handshake))
@@ -48,7 +48,7 @@ PacketHandshakeTxWorker(MULTICORE_WORKQUEUE *WorkQueue)
     WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, HandshakeTxThreads);
     PEER_SERIAL_ENTRY *Entry;
 
-    while ((Entry = PeerSerialDequeue(&Wg->HandshakeTxQueue)) != NULL)
+    while ((Entry = PeerSerialDequeue(&Wg->HandshakeTxQueue, WorkQueue)) != NULL)
     {
         WG_PEER *Peer = CONTAINING_RECORD(Entry, WG_PEER, HandshakeTxSerialEntry);
         HANDSHAKE_TX_ACTION Action = InterlockedExchange16(&Peer->HandshakeTxAction, HANDSHAKE_TX_NONE);
@@ -106,7 +106,7 @@ PacketSendHandshakeResponse(WG_PEER *Peer)
 
     WriteNoFence64(&Peer->LastSentHandshake, KeQueryInterruptTime());
     CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     LogInfoRatelimited(Peer->Device, "Sending handshake response to peer %llu (%s)", Peer->InternalId, EndpointName);
 
     if (NoiseHandshakeCreateResponse(&Packet, &Peer->Handshake))
@@ -267,11 +267,11 @@ PacketSendKeepalive(WG_PEER *Peer)
 {
     NET_BUFFER_LIST *Nbl;
 
-    if (NetBufferListIsQueueEmpty(&Peer->StagedPacketQueue))
+    if (NetBufferListIsQueueEmpty(&Peer->StagedPacketQueue) && !ReadPointerNoFence(&Peer->StagedPacketsIncoming))
     {
         if (Peer->ConstantPacketSize)
         {
-            ADDRESS_FAMILY Family = ReadUShortNoFence(&Peer->Endpoint.Addr.si_family);
+            ADDRESS_FAMILY Family = SocketGetPeerEndpointFamily(Peer);
             ULONG Mtu = Family == AF_INET ? Peer->Device->Mtu4 : Peer->Device->Mtu6;
             Nbl = MemAllocateNetBufferList(0, 0, sizeof(MESSAGE_DATA) + NoiseEncryptedLen(Mtu));
         }
@@ -283,9 +283,9 @@ PacketSendKeepalive(WG_PEER *Peer)
         if (!Nbl)
             return;
         Nbl->ParentNetBufferList = Nbl;
-        NetBufferListInterlockedEnqueue(&Peer->StagedPacketQueue, Nbl);
+        PacketStage(Peer, Nbl);
         CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-        SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+        SocketPeerEndpointToString(EndpointName, Peer);
         LogInfoRatelimited(Peer->Device, "Sending keepalive packet to peer %llu (%s)", Peer->InternalId, EndpointName);
     }
 
@@ -294,7 +294,7 @@ PacketSendKeepalive(WG_PEER *Peer)
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static VOID
-PacketCreateDataDone(_Inout_ WG_PEER *Peer, _Inout_ NET_BUFFER_LIST *First)
+PacketCreateDataDone(_Inout_ WG_PEER *Peer, _Inout_ NET_BUFFER_LIST *First, _In_ ULONG Batches)
 {
     BOOLEAN IsKeepalive;
 
@@ -305,8 +305,23 @@ PacketCreateDataDone(_Inout_ WG_PEER *Peer, _Inout_ NET_BUFFER_LIST *First)
         TimersDataSent(Peer);
 
     KeepKeyFresh(Peer);
+
+    /* Each batch held the peer until it was sent. */
+    ExReleaseRundownProtectionEx(&Peer->InUse, Batches);
+    while (Batches--)
+        PeerPut(Peer);
 }
 
+/* Deficit round robin: each time around the scheduler, the peer gets its weight in quanta of bytes to send, and
+ * goes to the back of the line once the next batch doesn't fit, keeping what it didn't use so that big batches get
+ * through eventually. A peer that runs out of work forfeits its deficit, so an idle peer can't save up for a burst.
+ * Budget still caps the batches per turn, so that a peer sending tiny batches can't hold on for too long either.
+ * The batches sent in a turn are chained and handed to the socket together, so that a peer sending a packet at a time
+ * takes one WskSendMessages call per turn rather than one per packet.
+ *
+ * The weight is only applied here, once packets are encrypted. The encryption ring is shared by every peer and drained
+ * in order, so a bulk peer can still take most of the encryption workers, limited only by its bytes in flight.
+ */
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static BOOLEAN
 PacketPeerTxWork(_Inout_ WG_PEER *Peer, _In_ ULONG Budget)
@@ -314,37 +329,68 @@ PacketPeerTxWork(_Inout_ WG_PEER *Peer, _In_ ULONG Budget)
     NOISE_KEYPAIR *Keypair;
     PACKET_STATE State;
     NET_BUFFER_LIST *First;
+    LONG64 Quantum = (LONG64)ReadULongNoFence(&Peer->TxWeight) * PEER_TX_QUANTUM_BYTES;
+    LONG64 Deficit = Peer->TxSerialEntry.Deficit + Quantum;
+    NET_BUFFER_LIST *Ready = NULL, **ReadyLink = &Ready;
+    ULONG ReadyBatches = 0;
+    BOOLEAN More = FALSE;
 
     while ((First = PrevQueuePeek(&Peer->TxQueue)) != NULL &&
            (State = ReadAcquire(NET_BUFFER_LIST_CRYPT_STATE(First))) != PACKET_STATE_UNCRYPTED)
     {
+        LONG64 Bytes = PacketTxCharged(First);
+        if (Bytes > Deficit)
+        {
+            Peer->TxSerialEntry.Deficit = Deficit;
+            More = TRUE;
+            break;
+        }
         if (!Budget--)
-            return TRUE;
+        {
+            Peer->TxSerialEntry.Deficit = min(Deficit, Quantum);
+            More = TRUE;
+            break;
+        }
+        Deficit -= Bytes;
         PrevQueueDropPeeked(&Peer->TxQueue);
         Keypair = NET_BUFFER_LIST_KEYPAIR(First);
 
         if (State == PACKET_STATE_CRYPTED)
-            PacketCreateDataDone(Peer, First);
+        {
+            for (*ReadyLink = First; *ReadyLink; ReadyLink = &NET_BUFFER_LIST_NEXT_NBL(*ReadyLink))
+                ;
+            ++ReadyBatches;
+        }
         else
+        {
             FreeSendNetBufferList(Peer->Device, First, 0);
+            PacketTxCompleted(Peer, Bytes);
+            ExReleaseRundownProtection(&Peer->InUse);
+            PeerPut(Peer);
+        }
 
         NoiseKeypairPut(Keypair, FALSE);
-        ExReleaseRundownProtection(&Peer->InUse);
-        PeerPut(Peer);
     }
-    return FALSE;
+    if (!More)
+        Peer->TxSerialEntry.Deficit = 0;
+    if (Ready)
+        PacketCreateDataDone(Peer, Ready, ReadyBatches);
+    return More;
 }
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static VOID
-ProcessPerPeerWork(PEER_SERIAL *WorkQueue)
+ProcessPerPeerWork(PEER_SERIAL *WorkQueue, MULTICORE_WORKQUEUE *Workers, WORKER_SIMD *Simd)
 {
     PEER_SERIAL_ENTRY *Entry;
-    while ((Entry = PeerSerialDequeue(WorkQueue)) != NULL)
-        PeerSerialMaybeRetire(
-            WorkQueue,
-            Entry,
-            PacketPeerTxWork(CONTAINING_RECORD(Entry, WG_PEER, TxSerialEntry), PEER_XMIT_PACKETS_PER_ROUND));
+    while ((Entry = PeerSerialDequeue(WorkQueue, Workers)) != NULL)
+    {
+        /* This sends, so the next batch to encrypt takes the SIMD state again. */
+        WorkerSimdPut(Simd);
+        WG_PEER *Peer = CONTAINING_RECORD(Entry, WG_PEER, TxSerialEntry);
+        ULONG Budget = ReadULongNoFence(&Peer->Device->QueueLimits.XmitPacketsPerRound);
+        PeerSerialMaybeRetire(WorkQueue, Entry, PacketPeerTxWork(Peer, Budget));
+    }
 }
 
 _Use_decl_annotations_
@@ -353,16 +399,24 @@ PacketEncryptWorker(MULTICORE_WORKQUEUE *WorkQueue)
 {
     WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, EncryptThreads);
     PTR_RING *Ring = &Wg->EncryptQueue;
+    /* Workers are bound to their CPU, so this is the home queue of the peers hashed to it. */
+    PEER_SERIAL *HomeQueue = &Wg->TxHomeQueues[KeGetCurrentProcessorIndex()];
     NET_BUFFER_LIST *First;
-    SIMD_STATE Simd;
+    WORKER_SIMD Simd = { 0 };
+    ULONG Packets = 0;
 
-    SimdGet(&Simd);
+    /* Saving the extended state isn't cheap, so rather than doing it on each wakeup, keep it across several drains of
+     * the ring when traffic is bursty, up to a limit on time and packets, other than while sending.
+     */
+    UINT64 Deadline = KeQueryInterruptTime() + SIMD_HOLD_MAX_SYS_TIME_UNITS;
+drainAgain:
     while ((First = PtrRingConsume(Ring)) != NULL)
     {
         PACKET_STATE State = PACKET_STATE_CRYPTED;
+        SIMD_STATE *SimdState = WorkerSimdGet(&Simd);
         NOISE_KEYPAIR *Keypair = NET_BUFFER_LIST_KEYPAIR(First);
         WG_PEER *Peer = NET_BUFFER_LIST_PEER(First);
-        ULONG Mtu = Peer->Endpoint.Addr.si_family == AF_INET6 ? Wg->Mtu6 : Wg->Mtu4;
+        ULONG Mtu = SocketGetPeerEndpointFamily(Peer) == AF_INET6 ? Wg->Mtu6 : Wg->Mtu4;
         BOOLEAN ConstantPacketSize = Peer->ConstantPacketSize;
 
         for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
@@ -373,8 +427,10 @@ PacketEncryptWorker(MULTICORE_WORKQUEUE *WorkQueue)
                  NbIn = NET_BUFFER_NEXT_NB(NbIn), NbOut = NET_BUFFER_NEXT_NB(NbOut))
             {
 
-                if (!EncryptPacket(&Simd, NbOut, NbIn, Keypair, Mtu, ConstantPacketSize))
+                if (!EncryptPacket(SimdState, NbOut, NbIn, Keypair, Mtu, ConstantPacketSize))
                     State = PACKET_STATE_DEAD;
+                ++Packets;
+                ++Simd.Packets;
             }
             if (Nbl != Nbl->ParentNetBufferList)
             {
@@ -383,19 +439,91 @@ PacketEncryptWorker(MULTICORE_WORKQUEUE *WorkQueue)
             }
         }
         _Analysis_assume_(First != NULL);
-        QueueEnqueuePerPeer(&Peer->Device->TxQueue, &Peer->TxSerialEntry, First, State);
-        ProcessPerPeerWork(&Wg->TxQueue);
+        QueueEnqueuePerPeerHome(
+            Peer, &Wg->TxQueue, Wg->TxHomeQueues, &Wg->EncryptThreads, &Peer->TxSerialEntry, First, State);
+        ProcessPerPeerWork(&Wg->TxQueue, WorkQueue, &Simd);
+        ProcessPerPeerWork(HomeQueue, WorkQueue, &Simd);
     }
-    SimdPut(&Simd);
-    ProcessPerPeerWork(&Wg->TxQueue);
+    ProcessPerPeerWork(&Wg->TxQueue, WorkQueue, &Simd);
+    ProcessPerPeerWork(HomeQueue, WorkQueue, &Simd);
+    if (Packets < SIMD_HOLD_MAX_PACKETS && MulticoreWorkQueueLinger(WorkQueue, Deadline))
+        goto drainAgain;
+    WorkerSimdPut(&Simd);
+    QueueLimitsMaybeTune(Wg);
 }
 
+_Use_decl_annotations_
+VOID
+PacketTxLimitInit(PEER_TX_LIMIT *TxLimit)
+{
+    TxLimit->InFlight = 0;
+    TxLimit->Limit = PEER_TX_BYTES_INITIAL;
+    TxLimit->Throttled = FALSE;
+    KeInitializeSpinLock(&TxLimit->Lock);
+    TxLimit->MinSlack = MAXLONG64;
+    TxLimit->SlackStart = KeQueryInterruptTime();
+}
+
+/* Hands back bytes charged to the peer and adapts its limit, returning TRUE if held back packets should go now. */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-static VOID
+static BOOLEAN
+PacketTxUncharge(_Inout_ WG_PEER *Peer, _In_ LONG64 Bytes)
+{
+    PEER_TX_LIMIT *TxLimit = &Peer->TxLimit;
+    KIRQL Irql;
+
+    if (!Bytes)
+        return FALSE;
+    LONG64 InFlight = InterlockedAdd64(&TxLimit->InFlight, -Bytes);
+    UINT64 Now = KeQueryInterruptTime();
+
+    KeAcquireSpinLock(&TxLimit->Lock, &Irql);
+    LONG Limit = TxLimit->Limit;
+    if (ReadBooleanNoFence(&TxLimit->Throttled) && InFlight <= 0)
+    {
+        /* Packets were held back, yet everything we let through has drained: the limit is starving the pipe. */
+        Limit = (LONG)min((LONG64)Limit * 2, PEER_TX_BYTES_MAX);
+        TxLimit->MinSlack = MAXLONG64;
+        TxLimit->SlackStart = Now;
+    }
+    else
+    {
+        /* Otherwise remember how much of the limit we didn't need, and give back the least of it once it has gone
+         * unused for a while.
+         */
+        TxLimit->MinSlack = min(TxLimit->MinSlack, max(Limit - (InFlight + Bytes), 0));
+        if (Now - TxLimit->SlackStart >= PEER_TX_SLACK_HOLD_SYS_TIME_UNITS)
+        {
+            Limit = (LONG)max(Limit - TxLimit->MinSlack, PEER_TX_BYTES_MIN);
+            TxLimit->MinSlack = MAXLONG64;
+            TxLimit->SlackStart = Now;
+        }
+    }
+    WriteNoFence(&TxLimit->Limit, Limit);
+    KeReleaseSpinLock(&TxLimit->Lock, Irql);
+
+    return InFlight < Limit && InterlockedExchange8((CHAR *)&TxLimit->Throttled, FALSE);
+}
+
+_Use_decl_annotations_
+VOID
+PacketTxCompleted(WG_PEER *Peer, LONG64 Bytes)
+{
+    if (PacketTxUncharge(Peer, Bytes))
+        PacketSendStagedPackets(Peer);
+}
+
+/* Returns TRUE if the packets were dropped and that made room for held back ones, which the caller sends then, rather
+ * than us recursing into PacketSendStagedPackets.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
 PacketCreateData(_Inout_ WG_PEER *Peer, _In_ NET_BUFFER_LIST *First)
 {
     WG_DEVICE *Wg = Peer->Device;
     NTSTATUS Ret = STATUS_INVALID_PARAMETER;
+    BOOLEAN Resume;
 
     if (!ExAcquireRundownProtection(&Peer->InUse))
         goto cleanup;
@@ -407,13 +535,40 @@ PacketCreateData(_Inout_ WG_PEER *Peer, _In_ NET_BUFFER_LIST *First)
         MulticoreWorkQueueBump(&Wg->EncryptThreads);
     }
     if (NT_SUCCESS(Ret) || Ret == STATUS_PIPE_BROKEN)
-        return;
+        return FALSE;
     ExReleaseRundownProtection(&Peer->InUse);
 
 cleanup:
+    /* Either the peer is going away or the encryption queue is full. Both count as completions for the limit. */
     NoiseKeypairPut(NET_BUFFER_LIST_KEYPAIR(First), FALSE);
+    LONG64 Charged = PacketTxCharged(First);
     FreeSendNetBufferList(Peer->Device, First, 0);
+    Resume = PacketTxUncharge(Peer, Charged);
     PeerPut(Peer);
+    return Resume;
+}
+
+_Use_decl_annotations_
+VOID
+PacketStagedCollect(WG_PEER *Peer)
+{
+    WG_DEVICE *Wg = Peer->Device;
+
+    if (!NetBufferListSpliceStack(&Peer->StagedPacketsIncoming, &Peer->StagedPacketQueue))
+        return;
+    /* If the queue is getting too big, we remove the oldest packets until it's small again. */
+    ULONG StagedLimit = ReadULongNoFence(&Wg->QueueLimits.Limit[QUEUE_STAGED]);
+    QueueLimitsSawDepth(Wg, QUEUE_STAGED, NetBufferListQueueLength(&Peer->StagedPacketQueue));
+    while (NetBufferListQueueLength(&Peer->StagedPacketQueue) > StagedLimit)
+    {
+        NET_BUFFER_LIST *NblToDiscard = NetBufferListDequeue(&Peer->StagedPacketQueue);
+        _Analysis_assume_(NblToDiscard); /* NetBufferListQueueLength() > StagedLimit implies
+                                            NetBufferListDequeue() returns a NBL. */
+        NET_BUFFER_LIST_STATUS(NblToDiscard) = NDIS_STATUS_FAILURE;
+        ++Wg->Statistics.ifOutDiscards;
+        QueueLimitsDropped(Wg, QUEUE_STAGED);
+        FreeSendNetBufferList(Wg, NblToDiscard, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+    }
 }
 
 _Use_decl_annotations_
@@ -423,6 +578,7 @@ PacketPurgeStagedPackets(WG_PEER *Peer)
     KIRQL Irql;
 
     KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
+    NetBufferListSpliceStack(&Peer->StagedPacketsIncoming, &Peer->StagedPacketQueue);
     Peer->Device->Statistics.ifOutDiscards += NetBufferListQueueLength(&Peer->StagedPacketQueue);
     if (Peer->StagedPacketQueue.Head)
         FreeSendNetBufferList(Peer->Device, Peer->StagedPacketQueue.Head, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
@@ -431,29 +587,97 @@ PacketPurgeStagedPackets(WG_PEER *Peer)
     KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
 }
 
-_Use_decl_annotations_
-VOID
-PacketSendStagedPackets(WG_PEER *Peer)
+/* Tops up the peer's token bucket for the time gone by, and returns whether the peer may send now. */
+_Requires_lock_held_(Peer->StagedPacketQueue.Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static BOOLEAN
+PacketTxRateRefill(_Inout_ WG_PEER *Peer, _In_ UINT64 Rate)
+{
+    PEER_TX_RATE *TxRate = &Peer->TxRate;
+    if (!Rate)
+        return TRUE;
+    /* Debt from packets let through on credit is paid off however long ago it was run up, or else bursts spaced out
+     * by more than the bucket takes to fill would go through at their own rate. Elapsed is capped only so that the
+     * multiplication can't overflow, which at the highest rate is still well over a second.
+     */
+    UINT64 Now = KeQueryInterruptTime(), Elapsed = min(Now - TxRate->LastRefill, MAXUINT64 / Rate);
+    LONG64 Burst =
+        max((LONG64)(Rate * PEER_TX_RATE_BURST_SYS_TIME_UNITS / SYS_TIME_UNITS_PER_SEC), PEER_TX_RATE_BURST_MIN);
+    TxRate->Tokens = min(TxRate->Tokens + (LONG64)(Rate * Elapsed / SYS_TIME_UNITS_PER_SEC), Burst);
+    TxRate->LastRefill = Now;
+    return TxRate->Tokens > 0;
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_not_held_(Peer->StagedPacketQueue.Lock)
+static VOID
+SendStagedPackets(_Inout_ WG_PEER *Peer)
 {
     NOISE_KEYPAIR *Keypair;
     NET_BUFFER_LIST_QUEUE Packets;
     PNET_BUFFER_LIST Nbl;
-    KIRQL Irql;
-
-    /* Steal the current queue into our local one. */
+    LONG64 Budget, Charged, RateDelay, Nonces;
+    UINT64 Rate, Nonce;
+    BOOLEAN Again, Tokens;
+
+retry:
+    /* Steal as much of the current queue into our local one as fits in the peer's byte limit and, if it has one, its
+     * rate. We let the last packet overshoot both, so that something always goes out when nothing is in flight and so
+     * that packets bigger than the bucket still make it through, paying for it with a longer wait for the next ones.
+     */
     NetBufferListInitQueue(&Packets);
-    KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
+    Budget = ReadNoFence(&Peer->TxLimit.Limit) - ReadNoFence64(&Peer->TxLimit.InFlight);
+    Charged = 0;
+    Nonces = 0;
+    RateDelay = 0;
+    KeAcquireSpinLockAtDpcLevel(&Peer->StagedPacketQueue.Lock);
     _Analysis_suppress_lock_checking_(Packets.Lock); /* `Packets` is private, lock is not required. */
-    NetBufferListSpliceAndReinitQueue(&Peer->StagedPacketQueue, &Packets);
-    KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
+    PacketStagedCollect(Peer);
+    Rate = Peer->TxRate.BytesPerSecond;
+    Tokens = PacketTxRateRefill(Peer, Rate);
+    while (Charged < Budget && Tokens && (Nbl = NetBufferListDequeue(&Peer->StagedPacketQueue)) != NULL)
+    {
+        ULONG_PTR Bytes = 0;
+        for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb), ++Nonces)
+            Bytes += NET_BUFFER_DATA_LENGTH(Nb);
+        Nbl->Scratch = (VOID *)Bytes;
+        Charged += Bytes;
+        NetBufferListEnqueue(&Packets, Nbl);
+        if (Rate)
+            Tokens = (Peer->TxRate.Tokens -= Bytes) > 0;
+    }
+    Again = !NetBufferListIsQueueEmpty(&Peer->StagedPacketQueue);
+    if (Again && !Tokens)
+        RateDelay = max((1 - Peer->TxRate.Tokens) * SYS_TIME_UNITS_PER_SEC / (LONG64)Rate, 1);
+    KeReleaseSpinLockFromDpcLevel(&Peer->StagedPacketQueue.Lock);
+
+    /* Whatever is left waits for tokens, in which case a timer will send it, or for completions to make room. Since a
+     * completion might have made room between our read of the budget and marking ourselves throttled, check again,
+     * and whoever clears the flag first goes again.
+     */
+    if (RateDelay)
+    {
+        TimersTxRateLimited(Peer, RateDelay);
+        Again = FALSE;
+    }
+    else if (Again)
+    {
+        InterlockedExchange8((CHAR *)&Peer->TxLimit.Throttled, TRUE);
+        Again = ReadNoFence64(&Peer->TxLimit.InFlight) + Charged < ReadNoFence(&Peer->TxLimit.Limit) &&
+                InterlockedExchange8((CHAR *)&Peer->TxLimit.Throttled, FALSE);
+    }
     if (NetBufferListIsQueueEmpty(&Packets))
+    {
+        if (Again)
+            goto retry;
         return;
+    }
     _Analysis_assume_(Packets.Head != NULL);
 
     /* First we make sure we have a valid reference to a valid key. */
-    Irql = RcuReadLock();
+    RcuReadLockAtDpcLevel();
     Keypair = NoiseKeypairGet(RcuDereference(NOISE_KEYPAIR, Peer->Keypairs.CurrentKeypair));
-    RcuReadUnlock(Irql);
+    RcuReadUnlockFromDpcLevel();
     if (!Keypair)
         goto outNokey;
     if (!ReadBooleanNoFence(&Keypair->Sending.IsValid))
@@ -462,24 +686,27 @@ PacketSendStagedPackets(WG_PEER *Peer)
         goto outInvalid;
 
     /* After we know we have a somewhat valid key, we now try to assign
-     * nonces to all of the packets in the queue. If we can't assign nonces
-     * for all of them, we just consider it a failure and wait for the next
-     * handshake.
+     * nonces to all of the packets in the queue, reserving them all at once.
+     * If we can't assign nonces for all of them, we just consider it a
+     * failure and wait for the next handshake.
      */
+    Nonce = (UINT64)InterlockedExchangeAdd64(&Keypair->SendingCounter, Nonces);
+    if (Nonce + (UINT64)Nonces > REJECT_AFTER_MESSAGES)
+        goto outInvalid;
     for (Nbl = Packets.Head; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
-        {
-            NET_BUFFER_NONCE(Nb) = InterlockedIncrement64(&Keypair->SendingCounter) - 1;
-            if (NET_BUFFER_NONCE(Nb) >= REJECT_AFTER_MESSAGES)
-                goto outInvalid;
-        }
+            NET_BUFFER_NONCE(Nb) = Nonce++;
     }
 
     PeerGet(Keypair->Entry.Peer);
     _Analysis_assume_(NET_BUFFER_LIST_FIRST_NB(Packets.Head)); /* Checked in SendNetBufferLists(). */
     NET_BUFFER_LIST_KEYPAIR(Packets.Head) = Keypair;
-    PacketCreateData(Peer, Packets.Head);
+    InterlockedAdd64(&Peer->TxLimit.InFlight, Charged);
+    if (PacketCreateData(Peer, Packets.Head))
+        Again = TRUE;
+    if (Again)
+        goto retry;
     return;
 
 outInvalid:
@@ -516,7 +743,7 @@ outNokey:
         FreeSendNetBufferList(Peer->Device, Nbl->ParentNetBufferList, 0);
         Nbl->ParentNetBufferList = Nbl;
     requeueOrphan:
-        NetBufferListInterlockedEnqueue(&Peer->StagedPacketQueue, Nbl);
+        PacketStage(Peer, Nbl);
     }
 
     /* If we're exiting because there's something wrong with the key, it
@@ -525,12 +752,35 @@ outNokey:
     PacketSendQueuedHandshakeInitiation(Peer, FALSE);
 }
 
+_Use_decl_annotations_
+VOID
+PacketSendStagedPackets(WG_PEER *Peer)
+{
+    /* Only one CPU sends at a time. The rest just count themselves in, which has the one sending go around again
+     * after it's done, so that whatever they staged or made room for is seen without them waiting on the lock.
+     */
+    if (InterlockedIncrement(&Peer->StagedSendRequests) != 1)
+        return;
+    KIRQL Irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    LONG Requests;
+    do
+    {
+        Requests = ReadNoFence(&Peer->StagedSendRequests);
+        SendStagedPackets(Peer);
+    } while (InterlockedAdd(&Peer->StagedSendRequests, -Requests));
+    KeLowerIrql(Irql);
+}
+
 #pragma warning( \
     suppress : 6014) /* `Nbl` is returned in NdisMSendNetBufferListsComplete or freed in MemFreeNetBufferList. */
 _Use_decl_annotations_
 VOID
 FreeSendNetBufferList(WG_DEVICE *Wg, NET_BUFFER_LIST *FirstNbl, ULONG SendCompleteFlags)
 {
+    /* The NBLs that NDIS gave us are handed back all in one chain, rather than one call each. */
+    NET_BUFFER_LIST *FirstComplete = NULL, **Link = &FirstComplete;
+    ULONG NumComplete = 0;
     for (NET_BUFFER_LIST *Nbl = FirstNbl, *NextNbl; Nbl; Nbl = NextNbl)
     {
         NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
@@ -540,16 +790,22 @@ FreeSendNetBufferList(WG_DEVICE *Wg, NET_BUFFER_LIST *FirstNbl, ULONG SendComple
             if (Nbl->ParentNetBufferList != Nbl)
             {
                 NET_BUFFER_LIST_STATUS(Nbl->ParentNetBufferList) = NET_BUFFER_LIST_STATUS(Nbl);
-                NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, Nbl->ParentNetBufferList, SendCompleteFlags);
-                ExReleaseRundownProtection(&Wg->ItemsInFlight);
+                *Link = Nbl->ParentNetBufferList;
+                Link = &NET_BUFFER_LIST_NEXT_NBL(Nbl->ParentNetBufferList);
+                ++NumComplete;
                 Nbl->ParentNetBufferList = NULL;
             }
             MemFreeNetBufferList(Nbl);
         }
         else
         {
-            NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, Nbl, SendCompleteFlags);
-            ExReleaseRundownProtection(&Wg->ItemsInFlight);
+            *Link = Nbl;
+            Link = &NET_BUFFER_LIST_NEXT_NBL(Nbl);
+            ++NumComplete;
         }
     }
+    if (!FirstComplete)
+        return;
+    NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, FirstComplete, SendCompleteFlags);
+    ExReleaseRundownProtectionEx(&Wg->ItemsInFlight, NumComplete);
 }
@@ -24,7 +24,27 @@
 #include <wsk.h>
 #include <netioapi.h>
 
-static LONG RoutingGenerationV4 = 1, RoutingGenerationV6 = 1;
+/* Routes changed in each of the last ROUTE_CHANGE_LOG_SIZE routing generations, so that a peer's endpoint is only
+ * resolved again when a route that could carry packets to it has changed. Generations step by two, staying odd, so
+ * that an endpoint's generation is zero only when it has never been resolved.
+ */
+#define ROUTE_CHANGE_LOG_SIZE 64
+typedef struct _ROUTE_CHANGE
+{
+    UINT32 Generation;
+    NET_LUID InterfaceLuid;
+    IP_ADDRESS_PREFIX Prefix;
+} ROUTE_CHANGE;
+
+typedef struct _ROUTE_CHANGE_LOG
+{
+    EX_SPIN_LOCK Lock;
+    LONG Generation;
+    ROUTE_CHANGE Changes[ROUTE_CHANGE_LOG_SIZE];
+} ROUTE_CHANGE_LOG;
+#define ROUTE_CHANGE_OF(Log, Generation) (&(Log)->Changes[((Generation) / 2) % ROUTE_CHANGE_LOG_SIZE])
+
+static ROUTE_CHANGE_LOG RouteChangesV4 = { .Generation = 1 }, RouteChangesV6 = { .Generation = 1 };
 static HANDLE RouteNotifierV4, RouteNotifierV6;
 static CONST WSK_CLIENT_DISPATCH WskAppDispatchV1 = { .Version = MAKE_WSK_VERSION(1, 0) };
 static WSK_REGISTRATION WskRegistration;
@@ -45,17 +65,140 @@ typedef union _WSK_IRP
     UCHAR IrpBuffer[sizeof(IRP) + sizeof(IO_STACK_LOCATION)];
 } WSK_IRP;
 
+#ifndef UDP_SEND_MSG_SIZE
+#    define UDP_SEND_MSG_SIZE 2
+#endif
+/* Most that's handed to the stack in one buffer for it to cut into datagrams. */
+#define SOCKET_SEGMENTATION_MAX_BYTES 0xffff
+#define SOCKET_SEGMENTATION_CONTROL_MAX \
+    (WSA_CMSG_SPACE(sizeof(IN6_PKTINFO)) + WSA_CMSG_SPACE(sizeof(DWORD)) + WSA_CMSG_SPACE(0))
+
+#ifndef UDP_RECV_MAX_COALESCED_SIZE
+#    define UDP_RECV_MAX_COALESCED_SIZE 3
+#endif
+#ifndef UDP_COALESCED_INFO
+#    define UDP_COALESCED_INFO 3
+#endif
+/* Most that the stack is asked to hand us in one indication of same-sized datagrams. */
+#define SOCKET_COALESCING_MAX_BYTES 0xffff
+
+/* A run of datagrams that the stack coalesced into one indication, split into an indication per datagram, each of
+ * which describes its slice of the original's MDL. The original goes back to the stack once the last slice does.
+ */
+typedef struct _SOCKET_COALESCED_INDICATION
+{
+    WSK_DATAGRAM_INDICATION *Indication;
+    SOCKET *Socket;
+    LONG Refs;
+    WSK_DATAGRAM_INDICATION Segments[];
+} SOCKET_COALESCED_INDICATION;
+
+/* Segments point back at their SOCKET_COALESCED_INDICATION rather than at the SOCKET, tagged to tell them apart. */
+#define SOCKET_INDICATION_SEGMENT_TAG ((ULONG_PTR)1)
+static_assert(
+    TYPE_ALIGNMENT(SOCKET_COALESCED_INDICATION) > SOCKET_INDICATION_SEGMENT_TAG &&
+        TYPE_ALIGNMENT(SOCKET) > SOCKET_INDICATION_SEGMENT_TAG,
+    "segment tag does not fit in pointer alignment");
+
+typedef struct _SOCKET_SEND_CTX_SLAB SOCKET_SEND_CTX_SLAB;
+
 typedef struct _SOCKET_SEND_CTX
 {
     WSK_IRP;
+    SLIST_ENTRY Entry;          /* Links it into its slab's free list. */
+    SOCKET_SEND_CTX_SLAB *Slab; /* NULL when it came from SocketSendCtxCache. */
     WG_DEVICE *Wg;
+    WG_PEER *Peer; /* Only for NBLs, which are charged to its PEER_TX_LIMIT. */
+    LONG64 Charged;
     union
     {
         NET_BUFFER_LIST *FirstNbl;
         WSK_BUF Buffer;
     };
+    MDL *Coalesced; /* Only for NBLs, when their datagrams were chained together to have the stack segment them. */
+    union
+    {
+        WSACMSGHDR Cmsg;
+        UCHAR Bytes[SOCKET_SEGMENTATION_CONTROL_MAX];
+    } Control;
 } SOCKET_SEND_CTX;
 
+/* Send contexts come from a slab per processor, so that the encryption worker bound to it, which does nearly all of the
+ * sending, doesn't contend with the others for SocketSendCtxCache. Only once its slab runs dry does a processor fall
+ * back to the lookaside list. Contexts go back to the slab they came from, whichever processor completes them.
+ */
+#define SOCKET_SEND_CTXS_PER_SLAB 32
+
+struct _SOCKET_SEND_CTX_SLAB
+{
+    DECLSPEC_CACHEALIGN SLIST_HEADER Free;
+    SOCKET_SEND_CTX Ctxs[SOCKET_SEND_CTXS_PER_SLAB];
+};
+static SOCKET_SEND_CTX_SLAB *SocketSendCtxSlabs;
+static ULONG NumSocketSendCtxSlabs;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+_Post_maybenull_
+static SOCKET_SEND_CTX *
+AllocateSendCtx(VOID)
+{
+    SOCKET_SEND_CTX_SLAB *Slab = &SocketSendCtxSlabs[KeGetCurrentProcessorIndex() % NumSocketSendCtxSlabs];
+    SLIST_ENTRY *Entry = InterlockedPopEntrySList(&Slab->Free);
+    if (Entry)
+        return CONTAINING_RECORD(Entry, SOCKET_SEND_CTX, Entry);
+    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    if (Ctx)
+        Ctx->Slab = NULL;
+    return Ctx;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+FreeSendCtx(_In_ SOCKET_SEND_CTX *Ctx)
+{
+    if (Ctx->Slab)
+        InterlockedPushEntrySList(&Ctx->Slab->Free, &Ctx->Entry);
+    else
+        ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NTSTATUS
+AllocateSendCtxSlabs(VOID)
+{
+    NumSocketSendCtxSlabs = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    SocketSendCtxSlabs = MemAllocateCacheAlignedArrayAndZero(NumSocketSendCtxSlabs, sizeof(*SocketSendCtxSlabs));
+    if (!SocketSendCtxSlabs)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    for (ULONG i = 0; i < NumSocketSendCtxSlabs; ++i)
+    {
+        SOCKET_SEND_CTX_SLAB *Slab = &SocketSendCtxSlabs[i];
+        InitializeSListHead(&Slab->Free);
+        for (ULONG j = 0; j < SOCKET_SEND_CTXS_PER_SLAB; ++j)
+        {
+            Slab->Ctxs[j].Slab = Slab;
+            InterlockedPushEntrySList(&Slab->Free, &Slab->Ctxs[j].Entry);
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+/* Frees what CoalesceForSegmentation chained, which only describes the datagrams, leaving them to their NBLs. */
+#pragma warning(suppress : 6014) /* IoFreeMdl frees, even if missing the SAL annotation. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+FreeCoalescedMdlChain(_In_opt_ MDL *Mdl)
+{
+    while (Mdl)
+    {
+        MDL *Next = Mdl->Next;
+        MmPrepareMdlForReuse(Mdl);
+        IoFreeMdl(Mdl);
+        Mdl = Next;
+    }
+}
+
 static IO_COMPLETION_ROUTINE NblSendComplete;
 _Use_decl_annotations_
 static NTSTATUS
@@ -64,7 +207,10 @@ NblSendComplete(DEVICE_OBJECT *DeviceObject, IRP *Irp, VOID *VoidCtx)
     SOCKET_SEND_CTX *Ctx = VoidCtx;
     _Analysis_assume_(Ctx);
     FreeSendNetBufferList(Ctx->Wg, Ctx->FirstNbl, 0);
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    FreeCoalescedMdlChain(Ctx->Coalesced);
+    PacketTxCompleted(Ctx->Peer, Ctx->Charged);
+    PeerPut(Ctx->Peer);
+    FreeSendCtx(Ctx);
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
@@ -76,7 +222,7 @@ BufferSendComplete(DEVICE_OBJECT *DeviceObject, IRP *Irp, VOID *VoidCtx)
     SOCKET_SEND_CTX *Ctx = VoidCtx;
     _Analysis_assume_(Ctx);
     MemFreeDataAndMdlChain(Ctx->Buffer.Mdl);
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    FreeSendCtx(Ctx);
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
@@ -147,14 +293,14 @@ PolyfilledWskSendMessages(
 }
 #endif
 
-static BOOLEAN
+static inline BOOLEAN
 CidrMaskMatchV4(_In_ CONST IN_ADDR *Addr, _In_ CONST IP_ADDRESS_PREFIX *Prefix)
 {
     return Prefix->PrefixLength == 0 ||
            (Addr->s_addr & (Htonl(~0U << (32 - Prefix->PrefixLength)))) == Prefix->Prefix.Ipv4.sin_addr.s_addr;
 }
 
-static BOOLEAN
+static inline BOOLEAN
 CidrMaskMatchV6(_In_ CONST IN6_ADDR *Addr, _In_ CONST IP_ADDRESS_PREFIX *Prefix)
 {
     if (Prefix->PrefixLength == 0)
@@ -169,32 +315,147 @@ CidrMaskMatchV6(_In_ CONST IN6_ADDR *Addr, _In_ CONST IP_ADDRESS_PREFIX *Prefix)
            ((UINT32 *)&Prefix->Prefix.Ipv6.sin6_addr)[WholeParts];
 }
 
+static VOID
+RouteCacheMaskPrefix(
+    _Out_ ROUTE_CACHE_ENTRY *Entry,
+    _In_ ADDRESS_FAMILY Family,
+    _In_ CONST VOID *Addr,
+    _In_ UCHAR Cidr)
+{
+    Entry->Cidr = Cidr;
+    if (Family == AF_INET)
+    {
+        Entry->Prefix.V4.s_addr = Cidr ? ((CONST IN_ADDR *)Addr)->s_addr & Htonl(~0U << (32 - Cidr)) : 0;
+        return;
+    }
+    for (ULONG i = 0; i < 4; ++i)
+    {
+        ULONG Bits = Cidr > i * 32 ? min(Cidr - i * 32, 32) : 0;
+        ((UINT32 *)&Entry->Prefix.V6)[i] = Bits ? ((CONST UINT32 *)Addr)[i] & Htonl(~0U << (32 - Bits)) : 0;
+    }
+}
+
+static INT
+RouteCachePrefixCompare(_In_ ADDRESS_FAMILY Family, _In_ CONST ROUTE_CACHE_ENTRY *A, _In_ CONST ROUTE_CACHE_ENTRY *B)
+{
+    return memcmp(&A->Prefix, &B->Prefix, Family == AF_INET ? sizeof(A->Prefix.V4) : sizeof(A->Prefix.V6));
+}
+
+static INT
+RouteCacheEntryCompare(_In_ ADDRESS_FAMILY Family, _In_ CONST ROUTE_CACHE_ENTRY *A, _In_ CONST ROUTE_CACHE_ENTRY *B)
+{
+    if (A->Cidr != B->Cidr)
+        return A->Cidr > B->Cidr ? -1 : 1;
+    INT Ret = RouteCachePrefixCompare(Family, A, B);
+    if (Ret)
+        return Ret;
+    if (A->Metric != B->Metric)
+        return A->Metric < B->Metric ? -1 : 1;
+    return 0;
+}
+
+static VOID
+RouteCacheSiftDown(
+    _In_ ADDRESS_FAMILY Family,
+    _Inout_updates_(Count) ROUTE_CACHE_ENTRY *Entries,
+    _In_ ULONG Root,
+    _In_ ULONG Count)
+{
+    for (;;)
+    {
+        ULONG Child = Root * 2 + 1;
+        if (Child >= Count)
+            return;
+        if (Child + 1 < Count && RouteCacheEntryCompare(Family, &Entries[Child], &Entries[Child + 1]) < 0)
+            ++Child;
+        if (RouteCacheEntryCompare(Family, &Entries[Root], &Entries[Child]) >= 0)
+            return;
+        ROUTE_CACHE_ENTRY Temp = Entries[Root];
+        Entries[Root] = Entries[Child];
+        Entries[Child] = Temp;
+        Root = Child;
+    }
+}
+
+/* Heap sort, so that sorting a large routing table needs neither recursion nor scratch memory. */
+static VOID
+RouteCacheSort(_In_ ADDRESS_FAMILY Family, _Inout_updates_(Count) ROUTE_CACHE_ENTRY *Entries, _In_ ULONG Count)
+{
+    for (ULONG i = Count / 2; i-- > 0;)
+        RouteCacheSiftDown(Family, Entries, i, Count);
+    for (ULONG i = Count; i-- > 1;)
+    {
+        ROUTE_CACHE_ENTRY Temp = Entries[0];
+        Entries[0] = Entries[i];
+        Entries[i] = Temp;
+        RouteCacheSiftDown(Family, Entries, 0, i);
+    }
+}
+
+_Requires_exclusive_lock_held_(Cache->Lock)
+static VOID
+RouteCachePublish(
+    _Inout_ ROUTE_CACHE *Cache,
+    _In_ ADDRESS_FAMILY Family,
+    _In_opt_ __drv_aliasesMem ROUTE_CACHE_ENTRY *Entries,
+    _In_ ULONG Count,
+    _In_ LONG Generation)
+{
+    RouteCacheSort(Family, Entries, Count);
+    Cache->NumGroups = 0;
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        if (!Cache->NumGroups || Cache->Groups[Cache->NumGroups - 1].Cidr != Entries[i].Cidr)
+        {
+            Cache->Groups[Cache->NumGroups].Cidr = Entries[i].Cidr;
+            Cache->Groups[Cache->NumGroups].Start = i;
+            Cache->Groups[Cache->NumGroups++].Count = 0;
+        }
+        ++Cache->Groups[Cache->NumGroups - 1].Count;
+    }
+    MemFree(Cache->Entries);
+    Cache->Entries = Entries;
+    Cache->Count = Count;
+    Cache->Generation = Generation;
+}
+
+_Requires_lock_held_(Cache->Lock)
+static CONST ROUTE_CACHE_ENTRY *
+RouteCacheLookup(_In_ CONST ROUTE_CACHE *Cache, _In_ ADDRESS_FAMILY Family, _In_ CONST VOID *Addr)
+{
+    ROUTE_CACHE_ENTRY Key;
+    for (ULONG i = 0; i < Cache->NumGroups; ++i)
+    {
+        ULONG Low = Cache->Groups[i].Start, High = Low + Cache->Groups[i].Count, End = High;
+        RouteCacheMaskPrefix(&Key, Family, Addr, Cache->Groups[i].Cidr);
+        /* The first entry with this prefix, if there is one, is the one with the lowest metric. */
+        while (Low < High)
+        {
+            ULONG Mid = Low + (High - Low) / 2;
+            if (RouteCachePrefixCompare(Family, &Cache->Entries[Mid], &Key) < 0)
+                Low = Mid + 1;
+            else
+                High = Mid;
+        }
+        if (Low < End && !RouteCachePrefixCompare(Family, &Cache->Entries[Low], &Key))
+            return &Cache->Entries[Low];
+    }
+    return NULL;
+}
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
-_IRQL_raises_(DISPATCH_LEVEL)
-_Acquires_shared_lock_(Peer->EndpointLock)
-_Requires_lock_not_held_(Peer->EndpointLock)
+_Requires_exclusive_lock_held_(Cache->Lock)
 static NTSTATUS
-SocketResolvePeerEndpoint(_Inout_ WG_PEER *Peer, _Out_ _At_(*Irql, _IRQL_saves_) KIRQL *Irql)
+RouteCacheRebuild(
+    _In_ CONST WG_DEVICE *Wg,
+    _Inout_ ROUTE_CACHE *Cache,
+    _In_ ADDRESS_FAMILY Family,
+    _In_ LONG Generation)
 {
-    *Irql = ExAcquireSpinLockShared(&Peer->EndpointLock);
-retryWhileHoldingSharedLock:
-    if ((Peer->Endpoint.Addr.si_family == AF_INET &&
-         Peer->Endpoint.RoutingGeneration == (UINT32)ReadNoFence(&RoutingGenerationV4) &&
-         Peer->Endpoint.Src4.ipi_ifindex) ||
-        (Peer->Endpoint.Addr.si_family == AF_INET6 &&
-         Peer->Endpoint.RoutingGeneration == (UINT32)ReadNoFence(&RoutingGenerationV6) &&
-         Peer->Endpoint.Src6.ipi6_ifindex))
-        return STATUS_SUCCESS;
-
-    SOCKADDR_INET Addr;
-    UINT32 UpdateGeneration = Peer->Endpoint.UpdateGeneration;
-    RtlCopyMemory(&Addr, &Peer->Endpoint.Addr, sizeof(Addr));
-    ExReleaseSpinLockShared(&Peer->EndpointLock, *Irql);
-    SOCKADDR_INET SrcAddr = { 0 };
-    ULONG BestIndex = 0, BestCidr = 0, BestMetric = ~0UL;
-    NET_LUID BestLuid = { 0 };
+    ROUTE_CACHE_ENTRY *Entries = NULL;
+    ULONG Count = 0;
     MIB_IPFORWARD_TABLE2 *Table;
-    NTSTATUS Status = GetIpForwardTable2(Addr.si_family, &Table);
+    NTSTATUS Status = GetIpForwardTable2(Family, &Table);
     if (!NT_SUCCESS(Status))
         return Status;
     union
@@ -202,85 +463,363 @@ retryWhileHoldingSharedLock:
         MIB_IF_ROW2 Interface;
         MIB_IPINTERFACE_ROW IpInterface;
     } *If = MemAllocate(sizeof(*If));
+    Status = STATUS_INSUFFICIENT_RESOURCES;
     if (!If)
-        return STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanupTable;
+    if (Table->NumEntries)
+    {
+        Entries = MemAllocateArray(Table->NumEntries, sizeof(*Entries));
+        if (!Entries)
+            goto cleanupIf;
+    }
     for (ULONG i = 0; i < Table->NumEntries; ++i)
     {
-        if (Table->Table[i].InterfaceLuid.Value == Peer->Device->InterfaceLuid.Value &&
+        if (Table->Table[i].InterfaceLuid.Value == Wg->InterfaceLuid.Value &&
             Table->Table[i].DestinationPrefix.PrefixLength == 0)
             continue;
-        if (Table->Table[i].DestinationPrefix.PrefixLength < BestCidr)
-            continue;
-        if (Addr.si_family == AF_INET && !CidrMaskMatchV4(&Addr.Ipv4.sin_addr, &Table->Table[i].DestinationPrefix))
-            continue;
-        if (Addr.si_family == AF_INET6 && !CidrMaskMatchV6(&Addr.Ipv6.sin6_addr, &Table->Table[i].DestinationPrefix))
+        if (Table->Table[i].DestinationPrefix.PrefixLength > (Family == AF_INET ? 32 : 128))
             continue;
         If->Interface = (MIB_IF_ROW2){ .InterfaceLuid = Table->Table[i].InterfaceLuid };
         if (!NT_SUCCESS(GetIfEntry2(&If->Interface)) || If->Interface.OperStatus != IfOperStatusUp)
             continue;
-        If->IpInterface =
-            (MIB_IPINTERFACE_ROW){ .Family = Addr.si_family, .InterfaceLuid = Table->Table[i].InterfaceLuid };
+        If->IpInterface = (MIB_IPINTERFACE_ROW){ .Family = Family, .InterfaceLuid = Table->Table[i].InterfaceLuid };
         if (!NT_SUCCESS(GetIpInterfaceEntry(&If->IpInterface)))
             continue;
-        ULONG Metric = Table->Table[i].Metric + If->IpInterface.Metric;
-        if (Table->Table[i].DestinationPrefix.PrefixLength == BestCidr && Metric > BestMetric)
-            continue;
-        BestCidr = Table->Table[i].DestinationPrefix.PrefixLength;
-        BestMetric = Metric;
-        BestIndex = Table->Table[i].InterfaceIndex;
-        BestLuid = Table->Table[i].InterfaceLuid;
+        RouteCacheMaskPrefix(
+            &Entries[Count],
+            Family,
+            Family == AF_INET ? (CONST VOID *)&Table->Table[i].DestinationPrefix.Prefix.Ipv4.sin_addr
+                              : (CONST VOID *)&Table->Table[i].DestinationPrefix.Prefix.Ipv6.sin6_addr,
+            Table->Table[i].DestinationPrefix.PrefixLength);
+        Entries[Count].Metric = Table->Table[i].Metric + If->IpInterface.Metric;
+        Entries[Count].InterfaceIndex = Table->Table[i].InterfaceIndex;
+        Entries[Count].InterfaceLuid = Table->Table[i].InterfaceLuid;
+        ++Count;
     }
+    RouteCachePublish(Cache, Family, Entries, Count, Generation);
+    Status = STATUS_SUCCESS;
+cleanupIf:
     MemFree(If);
-    if (Table->NumEntries && BestIndex)
-        Status = GetBestRoute2(&BestLuid, 0, NULL, &Addr, 0, &Table->Table[0], &SrcAddr);
+cleanupTable:
     FreeMibTable(Table);
+    return Status;
+}
+
+/* Whether a route that changed since the endpoint was resolved could carry packets to it, which is only so if the
+ * endpoint falls inside the route's prefix. Either way, *Generation is set to the routing generation that was checked.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+static BOOLEAN
+RouteChangesAffectEndpoint(
+    _Inout_ ROUTE_CHANGE_LOG *Log,
+    _In_ CONST WG_DEVICE *Wg,
+    _In_ CONST ENDPOINT *Endpoint,
+    _Out_ UINT32 *Generation)
+{
+    UINT32 Since = Endpoint->RoutingGeneration;
+    *Generation = Since;
+    /* Routes rarely change, so most of the time there's nothing to look at, and no need for every sender on every
+     * processor to touch the lock's cache line just to find that out.
+     */
+    if (Since == (UINT32)ReadNoFence(&Log->Generation))
+        return FALSE;
+    ExAcquireSpinLockSharedAtDpcLevel(&Log->Lock);
+    UINT32 Now = (UINT32)Log->Generation;
+    BOOLEAN Affected = !(Since & 1) || (Now - Since) / 2 > ROUTE_CHANGE_LOG_SIZE;
+    for (UINT32 Next = Since + 2; !Affected && Next != Now + 2; Next += 2)
+    {
+        CONST ROUTE_CHANGE *Change = ROUTE_CHANGE_OF(Log, Next);
+        if (Change->Generation != Next)
+            Affected = TRUE;
+        /* Our own default routes are never used to reach peers, so they cannot change how they are reached. */
+        else if (Change->InterfaceLuid.Value == Wg->InterfaceLuid.Value && Change->Prefix.PrefixLength == 0)
+            continue;
+        else if (Endpoint->Addr.si_family == AF_INET)
+            Affected = CidrMaskMatchV4(&Endpoint->Addr.Ipv4.sin_addr, &Change->Prefix);
+        else
+            Affected = CidrMaskMatchV6(&Endpoint->Addr.Ipv6.sin6_addr, &Change->Prefix);
+    }
+    ExReleaseSpinLockSharedFromDpcLevel(&Log->Lock);
+    *Generation = Now;
+    return Affected;
+}
+
+/* Replaces the peer's endpoint with New, whose UpdateGeneration is set to follow the one it replaces, and frees the
+ * old one once no reader can still be looking at it.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(Peer->EndpointLock)
+static VOID
+PublishPeerEndpoint(_Inout_ WG_PEER *Peer, _In_ __drv_aliasesMem ENDPOINT *New)
+{
+    ENDPOINT *Old = RcuDereferenceProtected(ENDPOINT, Peer->Endpoint, &Peer->EndpointLock);
+    New->UpdateGeneration = Old ? Old->UpdateGeneration + 1 : 1;
+    RcuAssignPointer(Peer->Endpoint, New);
+    if (Old)
+        RcuFree(ENDPOINT, Old, Rcu);
+}
+
+/* Publishes a copy of *Endpoint, the peer's current endpoint, whose routes were found not to have changed up to
+ * Generation, so that the routing change log isn't gone through again for it. Published endpoints are never written
+ * to, as senders on other processors may be reading them. Should this fail, or the endpoint have been replaced in the
+ * meantime, *Endpoint is left as it is, still fine to send to, and brought forward the next time around instead.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_rcu_held_
+static VOID
+BringPeerEndpointForward(_Inout_ WG_PEER *Peer, _Inout_ ENDPOINT **Endpoint, _In_ UINT32 Generation)
+{
+    ENDPOINT *New = MemAllocate(sizeof(*New));
+    if (!New)
+        return;
+    ExAcquireSpinLockExclusiveAtDpcLevel(&Peer->EndpointLock);
+    if (RcuDereferenceProtected(ENDPOINT, Peer->Endpoint, &Peer->EndpointLock) != *Endpoint)
+    {
+        ExReleaseSpinLockExclusiveFromDpcLevel(&Peer->EndpointLock);
+        MemFree(New);
+        return;
+    }
+    *New = **Endpoint;
+    New->RoutingGeneration = Generation;
+    PublishPeerEndpoint(Peer, New);
+    ExReleaseSpinLockExclusiveFromDpcLevel(&Peer->EndpointLock);
+    *Endpoint = New;
+}
+
+/* On success, returns with the RCU read lock held, and *Endpoint pointing at the peer's endpoint, with a source
+ * address up to date with routing.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_IRQL_raises_(DISPATCH_LEVEL)
+_Acquires_rcu_
+static NTSTATUS
+SocketResolvePeerEndpoint(
+    _Inout_ WG_PEER *Peer,
+    _Outptr_ ENDPOINT **Endpoint,
+    _Out_ _At_(*Irql, _IRQL_saves_) KIRQL *Irql)
+{
+    *Irql = RcuReadLock();
+retryWhileHoldingRcu:
+    *Endpoint = RcuDereference(ENDPOINT, Peer->Endpoint);
+    UINT32 Checked = 0;
+    if (*Endpoint &&
+        (((*Endpoint)->Addr.si_family == AF_INET && (*Endpoint)->Src4.ipi_ifindex &&
+          !RouteChangesAffectEndpoint(&RouteChangesV4, Peer->Device, *Endpoint, &Checked)) ||
+         ((*Endpoint)->Addr.si_family == AF_INET6 && (*Endpoint)->Src6.ipi6_ifindex &&
+          !RouteChangesAffectEndpoint(&RouteChangesV6, Peer->Device, *Endpoint, &Checked))))
+    {
+        if (Checked != (*Endpoint)->RoutingGeneration)
+            BringPeerEndpointForward(Peer, Endpoint, Checked);
+        return STATUS_SUCCESS;
+    }
+
+    SOCKADDR_INET Addr = { 0 };
+    UINT32 UpdateGeneration = 0;
+    if (*Endpoint)
+    {
+        UpdateGeneration = (*Endpoint)->UpdateGeneration;
+        RtlCopyMemory(&Addr, &(*Endpoint)->Addr, sizeof(Addr));
+    }
+    RcuReadUnlock(*Irql);
+    if (Addr.si_family != AF_INET && Addr.si_family != AF_INET6)
+        return STATUS_BAD_NETWORK_PATH;
+
+    /* The routing table is scanned once per routing generation for the whole device, rather than once per peer. */
+    ROUTE_CACHE *Cache = Addr.si_family == AF_INET ? &Peer->Device->RouteCache4 : &Peer->Device->RouteCache6;
+    LONG *RoutingGeneration = Addr.si_family == AF_INET ? &RouteChangesV4.Generation : &RouteChangesV6.Generation;
+    NTSTATUS Status;
+    MuAcquirePushLockShared(&Cache->Lock);
+    if (Cache->Generation != ReadNoFence(RoutingGeneration))
+    {
+        MuReleasePushLockShared(&Cache->Lock);
+        MuAcquirePushLockExclusive(&Cache->Lock);
+        LONG Generation = ReadNoFence(RoutingGeneration);
+        Status = Cache->Generation == Generation
+                     ? STATUS_SUCCESS
+                     : RouteCacheRebuild(Peer->Device, Cache, Addr.si_family, Generation);
+        MuReleasePushLockExclusive(&Cache->Lock);
+        if (!NT_SUCCESS(Status))
+            return Status;
+        MuAcquirePushLockShared(&Cache->Lock);
+    }
+    ULONG BestIndex = 0;
+    NET_LUID BestLuid = { 0 };
+    CONST ROUTE_CACHE_ENTRY *Route = RouteCacheLookup(
+        Cache,
+        Addr.si_family,
+        Addr.si_family == AF_INET ? (CONST VOID *)&Addr.Ipv4.sin_addr : (CONST VOID *)&Addr.Ipv6.sin6_addr);
+    if (Route)
+    {
+        BestIndex = Route->InterfaceIndex;
+        BestLuid = Route->InterfaceLuid;
+    }
+    LONG RouteGeneration = Cache->Generation;
+    MuReleasePushLockShared(&Cache->Lock);
     if (!BestIndex)
         return STATUS_BAD_NETWORK_PATH;
+
+    SOCKADDR_INET SrcAddr = { 0 };
+    MIB_IPFORWARD_ROW2 BestRoute;
+    Status = GetBestRoute2(&BestLuid, 0, NULL, &Addr, 0, &BestRoute, &SrcAddr);
     if (!NT_SUCCESS(Status))
         return Status;
 
+    ENDPOINT *New = MemAllocate(sizeof(*New));
+    if (!New)
+        return STATUS_INSUFFICIENT_RESOURCES;
     *Irql = ExAcquireSpinLockExclusive(&Peer->EndpointLock);
-    if (UpdateGeneration != Peer->Endpoint.UpdateGeneration)
+    ENDPOINT *Old = RcuDereferenceProtected(ENDPOINT, Peer->Endpoint, &Peer->EndpointLock);
+    if (!Old || UpdateGeneration != Old->UpdateGeneration)
     {
         ExReleaseSpinLockExclusiveFromDpcLevel(&Peer->EndpointLock);
-        ExAcquireSpinLockSharedAtDpcLevel(&Peer->EndpointLock);
-        goto retryWhileHoldingSharedLock;
+        MemFree(New);
+        RcuReadLockAtDpcLevel();
+        goto retryWhileHoldingRcu;
     }
-    if (Peer->Endpoint.Addr.si_family == AF_INET)
+    *New = *Old;
+    if (New->Addr.si_family == AF_INET)
     {
-        Peer->Endpoint.Cmsg.cmsg_len = WSA_CMSG_LEN(sizeof(Peer->Endpoint.Src4));
-        Peer->Endpoint.Cmsg.cmsg_level = IPPROTO_IP;
-        Peer->Endpoint.Cmsg.cmsg_type = IP_PKTINFO;
-        Peer->Endpoint.Src4.ipi_addr = SrcAddr.Ipv4.sin_addr;
-        Peer->Endpoint.Src4.ipi_ifindex = BestIndex;
-        Peer->Endpoint.CmsgHack4.cmsg_len = WSA_CMSG_LEN(0);
-        Peer->Endpoint.CmsgHack4.cmsg_level = IPPROTO_IP;
-        Peer->Endpoint.CmsgHack4.cmsg_type = IP_OPTIONS;
-        Peer->Endpoint.RoutingGeneration = ReadNoFence(&RoutingGenerationV4);
+        New->Cmsg.cmsg_len = WSA_CMSG_LEN(sizeof(New->Src4));
+        New->Cmsg.cmsg_level = IPPROTO_IP;
+        New->Cmsg.cmsg_type = IP_PKTINFO;
+        New->Src4.ipi_addr = SrcAddr.Ipv4.sin_addr;
+        New->Src4.ipi_ifindex = BestIndex;
+        New->CmsgHack4.cmsg_len = WSA_CMSG_LEN(0);
+        New->CmsgHack4.cmsg_level = IPPROTO_IP;
+        New->CmsgHack4.cmsg_type = IP_OPTIONS;
     }
-    else if (Peer->Endpoint.Addr.si_family == AF_INET6)
+    else
     {
-        Peer->Endpoint.Cmsg.cmsg_len = WSA_CMSG_LEN(sizeof(Peer->Endpoint.Src6));
-        Peer->Endpoint.Cmsg.cmsg_level = IPPROTO_IPV6;
-        Peer->Endpoint.Cmsg.cmsg_type = IPV6_PKTINFO;
-        Peer->Endpoint.Src6.ipi6_addr = SrcAddr.Ipv6.sin6_addr;
-        Peer->Endpoint.Src6.ipi6_ifindex = BestIndex;
-        Peer->Endpoint.CmsgHack6.cmsg_len = WSA_CMSG_LEN(0);
-        Peer->Endpoint.CmsgHack6.cmsg_level = IPPROTO_IPV6;
-        Peer->Endpoint.CmsgHack6.cmsg_type = IPV6_RTHDR;
-        Peer->Endpoint.RoutingGeneration = ReadNoFence(&RoutingGenerationV6);
+        New->Cmsg.cmsg_len = WSA_CMSG_LEN(sizeof(New->Src6));
+        New->Cmsg.cmsg_level = IPPROTO_IPV6;
+        New->Cmsg.cmsg_type = IPV6_PKTINFO;
+        New->Src6.ipi6_addr = SrcAddr.Ipv6.sin6_addr;
+        New->Src6.ipi6_ifindex = BestIndex;
+        New->CmsgHack6.cmsg_len = WSA_CMSG_LEN(0);
+        New->CmsgHack6.cmsg_level = IPPROTO_IPV6;
+        New->CmsgHack6.cmsg_type = IPV6_RTHDR;
     }
-    ++Peer->Endpoint.UpdateGeneration, ++UpdateGeneration;
+    New->RoutingGeneration = RouteGeneration;
+    PublishPeerEndpoint(Peer, New);
     ExReleaseSpinLockExclusiveFromDpcLevel(&Peer->EndpointLock);
-    ExAcquireSpinLockSharedAtDpcLevel(&Peer->EndpointLock);
-    if (Peer->Endpoint.UpdateGeneration != UpdateGeneration)
-        goto retryWhileHoldingSharedLock;
-    return STATUS_SUCCESS;
+    RcuReadLockAtDpcLevel();
+    goto retryWhileHoldingRcu;
+}
+
+/* For UDP segmentation offload, chains a partial MDL describing each datagram where it already is, and points the
+ * WSK_BUF_LIST at runs of them in that chain, so nothing is copied. Every datagram is at most Segment long, so a run of
+ * datagrams Segment long, ended by one that may be shorter, comes out of the stack the way it went in. Segmenting only
+ * pays off when runs are long, so this leaves the list as it is and returns FALSE unless they average at least two
+ * datagrams.
+ */
+#pragma warning(suppress : 6014) /* `Partial` is aliased in *Coalesced. */
+#pragma warning(suppress : 28195) /* IoAllocateMdl allocates, even if missing the SAL annotation. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+CoalesceForSegmentation(
+    _In_ NET_BUFFER_LIST *First,
+    _In_ ULONG64 Packets,
+    _In_ ULONG Segment,
+    _Out_ MDL **Coalesced,
+    _Out_ WSK_BUF_LIST **FirstWskBuf)
+{
+    ULONG Runs = 0, RunLength = 0;
+    BOOLEAN RunOpen = FALSE;
+    *Coalesced = NULL;
+    for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
+        {
+            ULONG Length = NET_BUFFER_DATA_LENGTH(Nb);
+            /* Each datagram has to be within one MDL, as ours always are, for a single partial MDL to describe it. */
+            if (NET_BUFFER_CURRENT_MDL_OFFSET(Nb) + Length > MmGetMdlByteCount(NET_BUFFER_CURRENT_MDL(Nb)))
+                return FALSE;
+            if (!RunOpen || RunLength + Length > SOCKET_SEGMENTATION_MAX_BYTES)
+            {
+                ++Runs;
+                RunLength = 0;
+            }
+            RunLength += Length;
+            RunOpen = Length == Segment;
+        }
+    }
+    if (Packets < 2ULL * Runs)
+        return FALSE;
+
+    MDL **MdlLink = Coalesced;
+    for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
+        {
+            MDL *Source = NET_BUFFER_CURRENT_MDL(Nb);
+            VOID *Datagram = (UCHAR *)MmGetMdlVirtualAddress(Source) + NET_BUFFER_CURRENT_MDL_OFFSET(Nb);
+            MDL *Partial = IoAllocateMdl(Datagram, NET_BUFFER_DATA_LENGTH(Nb), FALSE, FALSE, NULL);
+            if (!Partial)
+            {
+                FreeCoalescedMdlChain(*Coalesced);
+                *Coalesced = NULL;
+                return FALSE;
+            }
+            IoBuildPartialMdl(Source, Partial, Datagram, NET_BUFFER_DATA_LENGTH(Nb));
+            *MdlLink = Partial;
+            MdlLink = &Partial->Next;
+        }
+    }
+
+    /* Each run reuses the WSK_BUF_LIST of its first datagram, and starts at that datagram's partial MDL, from which the
+     * stack follows the chain for the length of the run.
+     */
+    WSK_BUF_LIST *Run = NULL, **Link = FirstWskBuf;
+    MDL *Partial = *Coalesced;
+    RunOpen = FALSE;
+    for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb), Partial = Partial->Next)
+        {
+            ULONG Length = NET_BUFFER_DATA_LENGTH(Nb);
+            _Analysis_assume_(Partial != NULL);
+            if (!RunOpen || Run->Buffer.Length + Length > SOCKET_SEGMENTATION_MAX_BYTES)
+            {
+                Run = NET_BUFFER_WSK_BUF(Nb);
+                Run->Buffer.Mdl = Partial;
+                Run->Buffer.Offset = 0;
+                Run->Buffer.Length = 0;
+                Run->Next = NULL;
+                *Link = Run;
+                Link = &Run->Next;
+            }
+            _Analysis_assume_(Run != NULL);
+            Run->Buffer.Length += Length;
+            RunOpen = Length == Segment;
+        }
+    }
+    return TRUE;
+}
+
+/* The endpoint's control messages with UDP_SEND_MSG_SIZE slipped in ahead of the trailing hack. */
+static ULONG
+SegmentationControl(
+    _Out_writes_bytes_(SOCKET_SEGMENTATION_CONTROL_MAX) UCHAR *Control,
+    _In_ CONST ENDPOINT *Endpoint,
+    _In_ ULONG Segment)
+{
+    ULONG PktinfoSpace = (ULONG)WSA_CMSGDATA_ALIGN(Endpoint->Cmsg.cmsg_len);
+    RtlCopyMemory(Control, &Endpoint->Cmsg, PktinfoSpace);
+    WSACMSGHDR *Cmsg = (WSACMSGHDR *)(Control + PktinfoSpace);
+    Cmsg->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
+    Cmsg->cmsg_level = IPPROTO_UDP;
+    Cmsg->cmsg_type = UDP_SEND_MSG_SIZE;
+    *(DWORD *)WSA_CMSG_DATA(Cmsg) = Segment;
+    RtlCopyMemory(
+        Control + PktinfoSpace + WSA_CMSG_SPACE(sizeof(DWORD)),
+        (CONST UCHAR *)&Endpoint->Cmsg + PktinfoSpace,
+        WSA_CMSG_SPACE(0));
+    return PktinfoSpace + (ULONG)WSA_CMSG_SPACE(sizeof(DWORD)) + (ULONG)WSA_CMSG_SPACE(0);
 }
 
 #pragma warning(suppress : 28194) /* `Nbl` is aliased in Ctx->Nbl or freed on failure. */
 #pragma warning(suppress : 28167) /* IRQL is either not raised on SocketResolvePeerEndpoint failure, or \
-                                     restored by ExReleaseSpinLockShared */
+                                     restored by RcuReadUnlock */
 _Use_decl_annotations_
 NTSTATUS
 SocketSendNblsToPeer(WG_PEER *Peer, NET_BUFFER_LIST *First, BOOLEAN *AllKeepalive)
@@ -291,8 +830,11 @@ SocketSendNblsToPeer(WG_PEER *Peer, NET_BUFFER_LIST *First, BOOLEAN *AllKeepaliv
     *AllKeepalive = TRUE;
     WSK_BUF_LIST *FirstWskBuf = NULL, *LastWskBuf = NULL;
     ULONG64 DataLength = 0, Packets = 0;
+    ULONG Segment = 0;
+    LONG64 Charged = 0;
     for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
+        Charged += (ULONG_PTR)Nbl->Scratch;
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
         {
             NET_BUFFER_WSK_BUF(Nb)->Buffer.Mdl = NET_BUFFER_CURRENT_MDL(Nb);
@@ -302,6 +844,7 @@ SocketSendNblsToPeer(WG_PEER *Peer, NET_BUFFER_LIST *First, BOOLEAN *AllKeepaliv
             *(LastWskBuf ? &LastWskBuf->Next : &FirstWskBuf) = NET_BUFFER_WSK_BUF(Nb);
             LastWskBuf = NET_BUFFER_WSK_BUF(Nb);
             DataLength += NET_BUFFER_DATA_LENGTH(Nb);
+            Segment = max(Segment, NET_BUFFER_DATA_LENGTH(Nb));
             ++Packets;
             if (NET_BUFFER_DATA_LENGTH(Nb) != MessageDataLen(0))
                 *AllKeepalive = FALSE;
@@ -310,22 +853,25 @@ SocketSendNblsToPeer(WG_PEER *Peer, NET_BUFFER_LIST *First, BOOLEAN *AllKeepaliv
     _Analysis_assume_(FirstWskBuf != NULL);
 
     NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
-    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    SOCKET_SEND_CTX *Ctx = AllocateSendCtx();
     if (!Ctx)
         goto cleanupNbls;
     Ctx->FirstNbl = First;
     Ctx->Wg = Peer->Device;
+    Ctx->Peer = PeerGet(Peer);
+    Ctx->Charged = Charged;
+    Ctx->Coalesced = NULL;
     IoInitializeIrp(&Ctx->Irp, sizeof(Ctx->IrpBuffer), 1);
     IoSetCompletionRoutine(&Ctx->Irp, NblSendComplete, Ctx, TRUE, TRUE, TRUE);
     KIRQL Irql;
-    Status = SocketResolvePeerEndpoint(Peer, &Irql);
+    ENDPOINT *Endpoint;
+    Status = SocketResolvePeerEndpoint(Peer, &Endpoint, &Irql);
     if (!NT_SUCCESS(Status))
         goto cleanupCtx;
     SOCKET *Socket = NULL;
-    RcuReadLockAtDpcLevel();
-    if (Peer->Endpoint.Addr.si_family == AF_INET)
+    if (Endpoint->Addr.si_family == AF_INET)
         Socket = RcuDereference(SOCKET, Peer->Device->Sock4);
-    else if (Peer->Endpoint.Addr.si_family == AF_INET6)
+    else if (Endpoint->Addr.si_family == AF_INET6)
         Socket = RcuDereference(SOCKET, Peer->Device->Sock6);
     if (!Socket)
     {
@@ -337,45 +883,51 @@ SocketSendNblsToPeer(WG_PEER *Peer, NET_BUFFER_LIST *First, BOOLEAN *AllKeepaliv
     if (NoWskSendMessages)
         WskSendMessages = PolyfilledWskSendMessages;
 #endif
+    WSACMSGHDR *Control = &Endpoint->Cmsg;
+    ULONG ControlLength = (ULONG)WSA_CMSGDATA_ALIGN(Endpoint->Cmsg.cmsg_len) + WSA_CMSG_SPACE(0);
+    /* Otherwise, or should chaining them fail, the datagrams go one by one as they are. */
+    if (Socket->CanSegment && Packets > 1 &&
+        CoalesceForSegmentation(First, Packets, Segment, &Ctx->Coalesced, &FirstWskBuf))
+    {
+        Control = &Ctx->Control.Cmsg;
+        ControlLength = SegmentationControl(Ctx->Control.Bytes, Endpoint, Segment);
+    }
     Status = WskSendMessages(
-        Socket->Sock,
-        FirstWskBuf,
-        0,
-        (PSOCKADDR)&Peer->Endpoint.Addr,
-        (ULONG)WSA_CMSGDATA_ALIGN(Peer->Endpoint.Cmsg.cmsg_len) + WSA_CMSG_SPACE(0),
-        &Peer->Endpoint.Cmsg,
-        &Ctx->Irp);
-    RcuReadUnlockFromDpcLevel();
-    ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
+        Socket->Sock, FirstWskBuf, 0, (PSOCKADDR)&Endpoint->Addr, ControlLength, Control, &Ctx->Irp);
+    RcuReadUnlock(Irql);
     if (NT_SUCCESS(Status))
     {
-        Peer->TxBytes += DataLength;
+        PeerAddTxBytes(Peer, DataLength);
         Peer->Device->Statistics.ifHCOutOctets += DataLength;
         Peer->Device->Statistics.ifHCOutUcastOctets += DataLength;
         Peer->Device->Statistics.ifHCOutUcastPkts += Packets;
+        ++Peer->Device->SendStats.Sends;
+        Peer->Device->SendStats.Datagrams += Packets;
     }
     else
         Peer->Device->Statistics.ifOutErrors += Packets;
     return Status;
 
 cleanupRcuLock:
-    RcuReadUnlockFromDpcLevel();
-    ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
+    RcuReadUnlock(Irql);
 cleanupCtx:
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    FreeCoalescedMdlChain(Ctx->Coalesced);
+    PeerPut(Ctx->Peer);
+    FreeSendCtx(Ctx);
 cleanupNbls:
     FreeSendNetBufferList(Peer->Device, First, 0);
+    PacketTxCompleted(Peer, Charged);
     return Status;
 }
 
 #pragma warning(suppress : 28167) /* IRQL is either not raised on SocketResolvePeerEndpoint failure, or \
-                                     restored by ExReleaseSpinLockShared */
+                                     restored by RcuReadUnlock */
 _Use_decl_annotations_
 NTSTATUS
 SocketSendBufferToPeer(WG_PEER *Peer, CONST VOID *Buffer, ULONG Len)
 {
     NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
-    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    SOCKET_SEND_CTX *Ctx = AllocateSendCtx();
     if (!Ctx)
         return Status;
     Ctx->Buffer.Length = Len;
@@ -388,14 +940,14 @@ SocketSendBufferToPeer(WG_PEER *Peer, CONST VOID *Buffer, ULONG Len)
     IoInitializeIrp(&Ctx->Irp, sizeof(Ctx->IrpBuffer), 1);
     IoSetCompletionRoutine(&Ctx->Irp, BufferSendComplete, Ctx, TRUE, TRUE, TRUE);
     KIRQL Irql;
-    Status = SocketResolvePeerEndpoint(Peer, &Irql);
+    ENDPOINT *Endpoint;
+    Status = SocketResolvePeerEndpoint(Peer, &Endpoint, &Irql);
     if (!NT_SUCCESS(Status))
         goto cleanupMdl;
     SOCKET *Socket = NULL;
-    RcuReadLockAtDpcLevel();
-    if (Peer->Endpoint.Addr.si_family == AF_INET)
+    if (Endpoint->Addr.si_family == AF_INET)
         Socket = RcuDereference(SOCKET, Peer->Device->Sock4);
-    else if (Peer->Endpoint.Addr.si_family == AF_INET6)
+    else if (Endpoint->Addr.si_family == AF_INET6)
         Socket = RcuDereference(SOCKET, Peer->Device->Sock6);
     if (!Socket)
     {
@@ -407,23 +959,21 @@ SocketSendBufferToPeer(WG_PEER *Peer, CONST VOID *Buffer, ULONG Len)
                      Socket->Sock,
                      &Ctx->Buffer,
                      0,
-                     (PSOCKADDR)&Peer->Endpoint.Addr,
-                     (ULONG)WSA_CMSGDATA_ALIGN(Peer->Endpoint.Cmsg.cmsg_len) + WSA_CMSG_SPACE(0),
-                     &Peer->Endpoint.Cmsg,
+                     (PSOCKADDR)&Endpoint->Addr,
+                     (ULONG)WSA_CMSGDATA_ALIGN(Endpoint->Cmsg.cmsg_len) + WSA_CMSG_SPACE(0),
+                     &Endpoint->Cmsg,
                      &Ctx->Irp);
-    RcuReadUnlockFromDpcLevel();
-    ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
+    RcuReadUnlock(Irql);
     if (NT_SUCCESS(Status))
-        Peer->TxBytes += Len;
+        PeerAddTxBytes(Peer, Len);
     return Status;
 
 cleanupRcuLock:
-    RcuReadUnlockFromDpcLevel();
-    ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
+    RcuReadUnlock(Irql);
 cleanupMdl:
     MemFreeDataAndMdlChain(Ctx->Buffer.Mdl);
 cleanupCtx:
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    FreeSendCtx(Ctx);
     return Status;
 }
 
@@ -432,7 +982,7 @@ NTSTATUS
 SocketSendBufferAsReplyToNbl(WG_DEVICE *Wg, CONST NET_BUFFER_LIST *InNbl, CONST VOID *Buffer, ULONG Len)
 {
     NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
-    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    SOCKET_SEND_CTX *Ctx = AllocateSendCtx();
     if (!Ctx)
         return Status;
     Ctx->Buffer.Length = Len;
@@ -477,7 +1027,7 @@ cleanupRcuLock:
 cleanupMdl:
     MemFreeDataAndMdlChain(Ctx->Buffer.Mdl);
 cleanupCtx:
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    FreeSendCtx(Ctx);
     return Status;
 }
 
@@ -536,7 +1086,7 @@ SocketEndpointFromNbl(ENDPOINT *Endpoint, CONST NET_BUFFER_LIST *Nbl)
         Endpoint->CmsgHack4.cmsg_len = WSA_CMSG_LEN(0);
         Endpoint->CmsgHack4.cmsg_level = IPPROTO_IP;
         Endpoint->CmsgHack4.cmsg_type = IP_OPTIONS;
-        Endpoint->RoutingGeneration = ReadNoFence(&RoutingGenerationV4);
+        Endpoint->RoutingGeneration = ReadNoFence(&RouteChangesV4.Generation);
     }
     else if (Addr->sa_family == AF_INET6 && (Pktinfo = FindInCmsgHdr(Data, IPPROTO_IPV6, IPV6_PKTINFO)) != NULL)
     {
@@ -548,7 +1098,7 @@ SocketEndpointFromNbl(ENDPOINT *Endpoint, CONST NET_BUFFER_LIST *Nbl)
         Endpoint->CmsgHack6.cmsg_len = WSA_CMSG_LEN(0);
         Endpoint->CmsgHack6.cmsg_level = IPPROTO_IPV6;
         Endpoint->CmsgHack6.cmsg_type = IPV6_RTHDR;
-        Endpoint->RoutingGeneration = ReadNoFence(&RoutingGenerationV6);
+        Endpoint->RoutingGeneration = ReadNoFence(&RouteChangesV6.Generation);
     }
     else
         return STATUS_INVALID_ADDRESS;
@@ -577,43 +1127,61 @@ EndpointEq(_In_ CONST ENDPOINT *A, _In_ CONST ENDPOINT *B)
            !A->Addr.si_family && !B->Addr.si_family;
 }
 
+/* Compares the parts of Endpoint that EndpointEq does with the addresses a datagram came from and to. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+EndpointEqDatagram(_In_ CONST ENDPOINT *Endpoint, _In_ WSK_DATAGRAM_INDICATION *Data)
+{
+    CONST SOCKADDR *Addr = Data->RemoteAddress;
+    CONST VOID *Pktinfo;
+    if (!Addr || Addr->sa_family != Endpoint->Addr.si_family)
+        return FALSE;
+    if (Addr->sa_family == AF_INET)
+    {
+        CONST SOCKADDR_IN *Addr4 = (CONST SOCKADDR_IN *)Addr;
+        return Addr4->sin_port == Endpoint->Addr.Ipv4.sin_port &&
+               Addr4->sin_addr.s_addr == Endpoint->Addr.Ipv4.sin_addr.s_addr &&
+               (Pktinfo = FindInCmsgHdr(Data, IPPROTO_IP, IP_PKTINFO)) != NULL &&
+               ((CONST IN_PKTINFO *)Pktinfo)->ipi_addr.s_addr == Endpoint->Src4.ipi_addr.s_addr &&
+               ((CONST IN_PKTINFO *)Pktinfo)->ipi_ifindex == Endpoint->Src4.ipi_ifindex;
+    }
+    if (Addr->sa_family == AF_INET6)
+    {
+        CONST SOCKADDR_IN6 *Addr6 = (CONST SOCKADDR_IN6 *)Addr;
+        return Addr6->sin6_port == Endpoint->Addr.Ipv6.sin6_port &&
+               Ipv6AddrEq(&Addr6->sin6_addr, &Endpoint->Addr.Ipv6.sin6_addr) &&
+               Addr6->sin6_scope_id == Endpoint->Addr.Ipv6.sin6_scope_id &&
+               (Pktinfo = FindInCmsgHdr(Data, IPPROTO_IPV6, IPV6_PKTINFO)) != NULL &&
+               Ipv6AddrEq(&((CONST IN6_PKTINFO *)Pktinfo)->ipi6_addr, &Endpoint->Src6.ipi6_addr) &&
+               ((CONST IN6_PKTINFO *)Pktinfo)->ipi6_ifindex == Endpoint->Src6.ipi6_ifindex;
+    }
+    return FALSE;
+}
+
 _Use_decl_annotations_
 VOID
 SocketSetPeerEndpoint(WG_PEER *Peer, CONST ENDPOINT *Endpoint)
 {
-    KIRQL Irql;
-
-    /* First we check unlocked, in order to optimize, since it's pretty rare
-     * that an endpoint will change. If we happen to be mid-write, and two
-     * CPUs wind up writing the same thing or something slightly different,
-     * it doesn't really matter much either.
+    /* It's pretty rare that an endpoint will change, so the published one is compared against without a lock, and
+     * only a different one is copied and published in its place.
      */
-    if (EndpointEq(Endpoint, &Peer->Endpoint))
+    if (Endpoint->Addr.si_family != AF_INET && Endpoint->Addr.si_family != AF_INET6)
         return;
+    KIRQL Irql = RcuReadLock();
+    ENDPOINT *Old = RcuDereference(ENDPOINT, Peer->Endpoint);
+    BOOLEAN Unchanged = Old && EndpointEq(Endpoint, Old);
+    RcuReadUnlock(Irql);
+    if (Unchanged)
+        return;
+    ENDPOINT *New = MemAllocate(sizeof(*New));
+    if (!New)
+        return;
+    *New = *Endpoint;
     Irql = ExAcquireSpinLockExclusive(&Peer->EndpointLock);
-    if (Endpoint->Addr.si_family == AF_INET)
-    {
-        Peer->Endpoint.Addr.Ipv4 = Endpoint->Addr.Ipv4;
-        {
-            Peer->Endpoint.Cmsg = Endpoint->Cmsg;
-            Peer->Endpoint.Src4 = Endpoint->Src4;
-            Peer->Endpoint.CmsgHack4 = Endpoint->CmsgHack4;
-        }
-    }
-    else if (Endpoint->Addr.si_family == AF_INET6)
-    {
-        Peer->Endpoint.Addr.Ipv6 = Endpoint->Addr.Ipv6;
-        {
-            Peer->Endpoint.Cmsg = Endpoint->Cmsg;
-            Peer->Endpoint.Src6 = Endpoint->Src6;
-            Peer->Endpoint.CmsgHack6 = Endpoint->CmsgHack6;
-        }
-    }
-    else
-        goto out;
-    Peer->Endpoint.RoutingGeneration = Endpoint->RoutingGeneration;
-    ++Peer->Endpoint.UpdateGeneration;
-out:
+    Old = RcuDereferenceProtected(ENDPOINT, Peer->Endpoint, &Peer->EndpointLock);
+    if (!Old || !EndpointEq(New, Old))
+        ++Peer->EndpointChanges;
+    PublishPeerEndpoint(Peer, New);
     ExReleaseSpinLockExclusive(&Peer->EndpointLock, Irql);
 }
 
@@ -621,8 +1189,17 @@ _Use_decl_annotations_
 VOID
 SocketSetPeerEndpointFromNbl(WG_PEER *Peer, CONST NET_BUFFER_LIST *Nbl)
 {
-    ENDPOINT Endpoint;
+    /* Nearly every packet comes from where the last one did, which is checked against the datagram's addresses in
+     * place, without building an endpoint from the control messages.
+     */
+    KIRQL Irql = RcuReadLock();
+    ENDPOINT *Current = RcuDereference(ENDPOINT, Peer->Endpoint);
+    BOOLEAN Unchanged = Current && EndpointEqDatagram(Current, NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl));
+    RcuReadUnlock(Irql);
+    if (Unchanged)
+        return;
 
+    ENDPOINT Endpoint;
     if (NT_SUCCESS(SocketEndpointFromNbl(&Endpoint, Nbl)))
         SocketSetPeerEndpoint(Peer, &Endpoint);
 }
@@ -631,15 +1208,150 @@ _Use_decl_annotations_
 VOID
 SocketClearPeerEndpointSrc(WG_PEER *Peer)
 {
-    KIRQL Irql;
-
-    Irql = ExAcquireSpinLockExclusive(&Peer->EndpointLock);
-    Peer->Endpoint.RoutingGeneration = 0;
-    ++Peer->Endpoint.UpdateGeneration;
-    RtlZeroMemory(&Peer->Endpoint.Src6, sizeof(Peer->Endpoint.Src6));
+    /* Should this fail, the source is cleared the next time around instead. */
+    ENDPOINT *New = MemAllocate(sizeof(*New));
+    if (!New)
+        return;
+    KIRQL Irql = ExAcquireSpinLockExclusive(&Peer->EndpointLock);
+    ENDPOINT *Old = RcuDereferenceProtected(ENDPOINT, Peer->Endpoint, &Peer->EndpointLock);
+    if (!Old)
+    {
+        ExReleaseSpinLockExclusive(&Peer->EndpointLock, Irql);
+        MemFree(New);
+        return;
+    }
+    *New = *Old;
+    New->RoutingGeneration = 0;
+    RtlZeroMemory(&New->Src6, sizeof(New->Src6));
+    PublishPeerEndpoint(Peer, New);
     ExReleaseSpinLockExclusive(&Peer->EndpointLock, Irql);
 }
 
+_Use_decl_annotations_
+VOID
+SocketGetPeerEndpointAddr(WG_PEER *Peer, SOCKADDR_INET *Addr)
+{
+    KIRQL Irql = RcuReadLock();
+    ENDPOINT *Endpoint = RcuDereference(ENDPOINT, Peer->Endpoint);
+    if (Endpoint)
+        RtlCopyMemory(Addr, &Endpoint->Addr, sizeof(*Addr));
+    else
+        RtlZeroMemory(Addr, sizeof(*Addr));
+    RcuReadUnlock(Irql);
+}
+
+_Use_decl_annotations_
+ADDRESS_FAMILY
+SocketGetPeerEndpointFamily(WG_PEER *Peer)
+{
+    KIRQL Irql = RcuReadLock();
+    ENDPOINT *Endpoint = RcuDereference(ENDPOINT, Peer->Endpoint);
+    ADDRESS_FAMILY Family = Endpoint ? Endpoint->Addr.si_family : AF_UNSPEC;
+    RcuReadUnlock(Irql);
+    return Family;
+}
+
+_Use_decl_annotations_
+VOID
+SocketPeerEndpointToString(CHAR *Buffer, WG_PEER *Peer)
+{
+    SOCKADDR_INET Addr;
+    SocketGetPeerEndpointAddr(Peer, &Addr);
+    SockaddrToString(Buffer, &Addr);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+ReleaseCoalescedIndication(_In_ SOCKET_COALESCED_INDICATION *Coalesced)
+{
+    if (InterlockedDecrement(&Coalesced->Refs))
+        return;
+    SOCKET *Socket = Coalesced->Socket;
+    ((WSK_PROVIDER_DATAGRAM_DISPATCH *)Socket->Sock->Dispatch)->WskRelease(Socket->Sock, Coalesced->Indication);
+    MemFree(Coalesced);
+}
+
+_Use_decl_annotations_
+VOID
+SocketReleaseDatagramIndication(WSK_DATAGRAM_INDICATION *DataIndication)
+{
+    ULONG_PTR Owner = (ULONG_PTR)DataIndication->Next;
+    DataIndication->Next = NULL;
+    if (Owner & SOCKET_INDICATION_SEGMENT_TAG)
+    {
+        SOCKET_COALESCED_INDICATION *Coalesced =
+            (SOCKET_COALESCED_INDICATION *)(Owner & ~SOCKET_INDICATION_SEGMENT_TAG);
+        SOCKET *Socket = Coalesced->Socket;
+        ReleaseCoalescedIndication(Coalesced);
+        ExReleaseRundownProtection(&Socket->ItemsInFlight);
+        return;
+    }
+    SOCKET *Socket = (SOCKET *)Owner;
+    ((WSK_PROVIDER_DATAGRAM_DISPATCH *)Socket->Sock->Dispatch)->WskRelease(Socket->Sock, DataIndication);
+    ExReleaseRundownProtection(&Socket->ItemsInFlight);
+}
+
+/* Splits an indication that the stack coalesced from datagrams of SegmentSize bytes, the last perhaps shorter, into an
+ * NBL per datagram, linked in order at *Link so that they reach decryption together. Nothing is copied: each segment's
+ * indication points into the original's MDL chain.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static NET_BUFFER_LIST **
+ReceiveCoalesced(
+    _In_ SOCKET *Socket,
+    _In_ WSK_DATAGRAM_INDICATION *DataIndication,
+    _In_ ULONG SegmentSize,
+    _Inout_ NET_BUFFER_LIST **Link)
+{
+    WG_DEVICE *Wg = Socket->Device;
+    SIZE_T Length = DataIndication->Buffer.Length;
+    ULONG NumSegments = (ULONG)((Length + SegmentSize - 1) / SegmentSize);
+    SOCKET_COALESCED_INDICATION *Coalesced = NULL;
+    if (Length > SOCKET_COALESCING_MAX_BYTES || !ReadBooleanNoFence(&Wg->IsUp) ||
+        (Coalesced = MemAllocate(sizeof(*Coalesced) + NumSegments * sizeof(Coalesced->Segments[0]))) == NULL)
+    {
+        ((WSK_PROVIDER_DATAGRAM_DISPATCH *)Socket->Sock->Dispatch)->WskRelease(Socket->Sock, DataIndication);
+        Wg->Statistics.ifInDiscards += NumSegments;
+        return Link;
+    }
+    Coalesced->Indication = DataIndication;
+    Coalesced->Socket = Socket;
+    Coalesced->Refs = 1; /* Dropped below, after the segments have taken theirs. */
+    MDL *Mdl = DataIndication->Buffer.Mdl;
+    ULONG Offset = DataIndication->Buffer.Offset;
+    for (ULONG i = 0; i < NumSegments; ++i, Offset += SegmentSize, Length -= SegmentSize)
+    {
+        /* PrepareNetBufferListHeader wants the header in the first MDL, so start each segment in the MDL it's in. */
+        while (Mdl && Offset >= MmGetMdlByteCount(Mdl))
+        {
+            Offset -= MmGetMdlByteCount(Mdl);
+            Mdl = Mdl->Next;
+        }
+        ULONG SegmentLength = (ULONG)min(Length, SegmentSize);
+        NET_BUFFER_LIST *Nbl = NULL;
+        if (!Mdl || (Nbl = MemAllocateReceiveNetBufferList(SegmentLength)) == NULL ||
+            !ExAcquireRundownProtection(&Socket->ItemsInFlight))
+        {
+            if (Nbl)
+                MemFreeReceiveNetBufferList(Nbl);
+            ++Wg->Statistics.ifInDiscards;
+            continue;
+        }
+        WSK_DATAGRAM_INDICATION *Segment = &Coalesced->Segments[i];
+        *Segment = *DataIndication;
+        Segment->Next = (VOID *)((ULONG_PTR)Coalesced | SOCKET_INDICATION_SEGMENT_TAG);
+        Segment->Buffer.Mdl = Mdl;
+        Segment->Buffer.Offset = Offset;
+        Segment->Buffer.Length = SegmentLength;
+        InterlockedIncrement(&Coalesced->Refs);
+        NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl) = Segment;
+        *Link = Nbl;
+        Link = &NET_BUFFER_LIST_NEXT_NBL(Nbl);
+    }
+    ReleaseCoalescedIndication(Coalesced);
+    return Link;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_
 static NTSTATUS WSKAPI
@@ -654,11 +1366,17 @@ Receive(_In_opt_ PVOID SocketContext, _In_ ULONG Flags, _In_opt_ WSK_DATAGRAM_IN
     {
         DataIndicationNext = DataIndication->Next;
         DataIndication->Next = NULL;
+        DWORD *SegmentSize = FindInCmsgHdr(DataIndication, IPPROTO_UDP, UDP_COALESCED_INFO);
+        if (SegmentSize && *SegmentSize && *SegmentSize < DataIndication->Buffer.Length)
+        {
+            Link = ReceiveCoalesced(Socket, DataIndication, *SegmentSize, Link);
+            continue;
+        }
         NET_BUFFER_LIST *Nbl = NULL;
         ULONG Length;
         if (!NT_SUCCESS(RtlSIZETToULong(DataIndication->Buffer.Length, &Length)))
             goto skipDatagramIndication;
-        Nbl = MemAllocateNetBufferList(0, Length, 0);
+        Nbl = MemAllocateReceiveNetBufferList(Length);
         if (!Nbl || !ReadBooleanNoFence(&Wg->IsUp) || !ExAcquireRundownProtection(&Socket->ItemsInFlight))
             goto skipDatagramIndication;
         NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl) = DataIndication;
@@ -670,7 +1388,7 @@ Receive(_In_opt_ PVOID SocketContext, _In_ ULONG Flags, _In_opt_ WSK_DATAGRAM_IN
     skipDatagramIndication:
         ((WSK_PROVIDER_DATAGRAM_DISPATCH *)Socket->Sock->Dispatch)->WskRelease(Socket->Sock, DataIndication);
         if (Nbl)
-            MemFreeNetBufferList(Nbl);
+            MemFreeReceiveNetBufferList(Nbl);
         ++Wg->Statistics.ifInDiscards;
     }
     if (First)
@@ -743,6 +1461,7 @@ CreateAndBindSocket(_In_ WG_DEVICE *Wg, _Inout_ SOCKADDR *Sa, _Out_ SOCKET **Ret
         return Status;
     Socket->Device = Wg;
     Socket->Sock = NULL;
+    Socket->CanSegment = FALSE;
     ExInitializeRundownProtection(&Socket->ItemsInFlight);
     KEVENT Done;
     WSK_IRP I;
@@ -788,6 +1507,15 @@ CreateAndBindSocket(_In_ WG_DEVICE *Wg, _Inout_ SOCKADDR *Sa, _Out_ SOCKET **Ret
         if (!NT_SUCCESS(Status))
             goto cleanupSocket;
     }
+    /* A segment size of zero leaves sends without UDP_SEND_MSG_SIZE as they are, and only stacks that support
+     * segmentation offload take the option.
+     */
+    DWORD NoSegmentSize = 0;
+    Socket->CanSegment =
+        NT_SUCCESS(SetSockOpt(Sock, IPPROTO_UDP, UDP_SEND_MSG_SIZE, &NoSegmentSize, sizeof(NoSegmentSize)));
+    /* Stacks without receive coalescing refuse this, and then every indication holds just one datagram. */
+    DWORD MaxCoalescedSize = SOCKET_COALESCING_MAX_BYTES;
+    SetSockOpt(Sock, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, &MaxCoalescedSize, sizeof(MaxCoalescedSize));
 
     IoInitializeIrp(&I.Irp, sizeof(I.IrpBuffer), 1);
     IoSetCompletionRoutine(&I.Irp, RaiseEventOnComplete, &Done, TRUE, TRUE, TRUE);
@@ -830,7 +1558,24 @@ RouteNotification(
     _In_opt_ MIB_IPFORWARD_ROW2 *Row,
     _In_ MIB_NOTIFICATION_TYPE NotificationType)
 {
-    InterlockedAdd((LONG *)CallerContext, 2);
+    ROUTE_CHANGE_LOG *Log = CallerContext;
+    KIRQL Irql = ExAcquireSpinLockExclusive(&Log->Lock);
+    UINT32 Generation = (UINT32)Log->Generation + 2;
+    ROUTE_CHANGE *Change = ROUTE_CHANGE_OF(Log, Generation);
+    Change->Generation = Generation;
+    /* Without a row, such as for the initial notification, anything could have changed, which a /0 stands for. */
+    if (Row && NotificationType != MibInitialNotification)
+    {
+        Change->InterfaceLuid = Row->InterfaceLuid;
+        Change->Prefix = Row->DestinationPrefix;
+    }
+    else
+    {
+        Change->InterfaceLuid.Value = 0;
+        RtlZeroMemory(&Change->Prefix, sizeof(Change->Prefix));
+    }
+    InterlockedExchange(&Log->Generation, (LONG)Generation);
+    ExReleaseSpinLockExclusive(&Log->Lock, Irql);
 }
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -855,10 +1600,13 @@ static NTSTATUS WskInit(VOID)
         &SocketSendCtxCache, NULL, NULL, NonPagedPool, 0, sizeof(SOCKET_SEND_CTX), MEMORY_TAG, 0);
     if (!NT_SUCCESS(Status))
         goto cleanupIniting;
+    Status = AllocateSendCtxSlabs();
+    if (!NT_SUCCESS(Status))
+        goto cleanupLookaside;
     WSK_CLIENT_NPI WskClientNpi = { .Dispatch = &WskAppDispatchV1 };
     Status = WskRegister(&WskClientNpi, &WskRegistration);
     if (!NT_SUCCESS(Status))
-        goto cleanupLookaside;
+        goto cleanupSlabs;
     Status = WskCaptureProviderNPI(&WskRegistration, WSK_INFINITE_WAIT, &WskProviderNpi);
     if (!NT_SUCCESS(Status))
         goto cleanupWskRegister;
@@ -923,10 +1671,10 @@ static NTSTATUS WskInit(VOID)
     WskProviderNpi.Dispatch->WskControlClient(
         WskProviderNpi.Client, WSK_TDI_BEHAVIOR, sizeof(NoTdi), &NoTdi, 0, NULL, NULL, NULL);
 
-    Status = NotifyRouteChange2(AF_INET, RouteNotification, &RoutingGenerationV4, FALSE, &RouteNotifierV4);
+    Status = NotifyRouteChange2(AF_INET, RouteNotification, &RouteChangesV4, FALSE, &RouteNotifierV4);
     if (!NT_SUCCESS(Status))
         goto cleanupWskProviderNPI;
-    Status = NotifyRouteChange2(AF_INET6, RouteNotification, &RoutingGenerationV6, FALSE, &RouteNotifierV6);
+    Status = NotifyRouteChange2(AF_INET6, RouteNotification, &RouteChangesV6, FALSE, &RouteNotifierV6);
     if (!NT_SUCCESS(Status))
         goto cleanupRouteNotifierV4;
 
@@ -940,6 +1688,8 @@ cleanupWskProviderNPI:
     WskReleaseProviderNPI(&WskRegistration);
 cleanupWskRegister:
     WskDeregister(&WskRegistration);
+cleanupSlabs:
+    MemFree(SocketSendCtxSlabs);
 cleanupLookaside:
     ExDeleteLookasideListEx(&SocketSendCtxCache);
 cleanupIniting:
@@ -958,6 +1708,7 @@ VOID WskUnload(VOID)
     CancelMibChangeNotify2(RouteNotifierV4);
     WskReleaseProviderNPI(&WskRegistration);
     WskDeregister(&WskRegistration);
+    MemFree(SocketSendCtxSlabs);
     ExDeleteLookasideListEx(&SocketSendCtxCache);
 out:
     MuReleasePushLockExclusive(&WskIsIniting);
@@ -1027,3 +1778,7 @@ SocketReinit(WG_DEVICE *Wg, SOCKET *New4, SOCKET *New6, UINT16 Port)
     CloseSocket(Old4);
     CloseSocket(Old6);
 }
+
+#ifdef DBG
+#    include "selftest/routecache.c"
+#endif
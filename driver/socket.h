@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include "logging.h"
 #include <wsk.h>
 
 typedef struct _SOCKET
@@ -12,6 +13,7 @@ typedef struct _SOCKET
     WSK_SOCKET *Sock;
     WG_DEVICE *Device;
     EX_RUNDOWN_REF ItemsInFlight;
+    BOOLEAN CanSegment; /* The stack takes UDP_SEND_MSG_SIZE, so does segmentation offload for us. */
 } SOCKET;
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -30,6 +32,11 @@ SocketSendBufferAsReplyToNbl(
     _In_reads_bytes_(Len) CONST VOID *Buffer,
     _In_ ULONG Len);
 
+/* Gives a received datagram back to the stack, once the NBL that carried it is done with. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SocketReleaseDatagramIndication(_In_ WSK_DATAGRAM_INDICATION *DataIndication);
+
 NTSTATUS
 SocketEndpointFromNbl(_Out_ ENDPOINT *Endpoint, _In_ CONST NET_BUFFER_LIST *Nbl);
 
@@ -45,6 +52,19 @@ _Requires_lock_not_held_(Peer->EndpointLock)
 VOID
 SocketClearPeerEndpointSrc(_Inout_ WG_PEER *Peer);
 
+/* Copies out the address of the peer's endpoint, all zero when it has none. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SocketGetPeerEndpointAddr(_In_ WG_PEER *Peer, _Out_ SOCKADDR_INET *Addr);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ADDRESS_FAMILY
+SocketGetPeerEndpointFamily(_In_ WG_PEER *Peer);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SocketPeerEndpointToString(_Out_z_cap_c_(SOCKADDR_STR_MAX_LEN) PSTR Buffer, _In_ WG_PEER *Peer);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 _Requires_lock_not_held_(Wg->SocketUpdateLock)
 NTSTATUS
@@ -61,3 +81,9 @@ SocketReinit(
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 VOID WskUnload(VOID);
+
+#ifdef DBG
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+RouteCacheSelftest(VOID);
+#endif
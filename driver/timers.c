@@ -88,6 +88,9 @@ GenerateJitter(_In_ ULONG Range)
  *
  * - Timer for, if enabled, sending an empty authenticated packet every user-
  * specified seconds.
+ *
+ * - Timer for, if the peer's egress rate is capped, sending the staged packets
+ * once enough tokens have accumulated for them.
  */
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -110,7 +113,7 @@ ExpiredRetransmitHandshake(TIMER *Timer)
     if (Peer->TimerHandshakeAttempts > MAX_TIMER_HANDSHAKES)
     {
         CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-        SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+        SocketPeerEndpointToString(EndpointName, Peer);
         LogInfo(
             Peer->Device,
             "Handshake for peer %llu (%s) did not complete after %d attempts, giving up",
@@ -134,7 +137,7 @@ ExpiredRetransmitHandshake(TIMER *Timer)
     {
         ++Peer->TimerHandshakeAttempts;
         CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-        SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+        SocketPeerEndpointToString(EndpointName, Peer);
         LogInfo(
             Peer->Device,
             "Handshake for peer %llu (%s) did not complete after %d seconds, retrying (try %u)",
@@ -175,7 +178,7 @@ ExpiredNewHandshake(TIMER *Timer)
     WG_PEER *Peer = CONTAINING_RECORD(Timer, WG_PEER, TimerNewHandshake);
 
     CHAR EndpointStr[SOCKADDR_STR_MAX_LEN];
-    SockaddrToString(EndpointStr, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointStr, Peer);
     LogInfo(
         Peer->Device,
         "Retrying handshake with peer %llu (%s) because we stopped hearing back after %d seconds",
@@ -200,7 +203,7 @@ ExpiredZeroKeyMaterial(TIMER *Timer)
         return;
 
     CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
-    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    SocketPeerEndpointToString(EndpointName, Peer);
     LogInfo(
         Peer->Device,
         "Zeroing out all keys for peer %llu (%s), since we haven't received a new one in %d seconds",
@@ -221,6 +224,16 @@ ExpiredZeroKeyMaterial(TIMER *Timer)
     }
 }
 
+static TIMER_CALLBACK ExpiredTxRate;
+_Use_decl_annotations_
+static VOID
+ExpiredTxRate(TIMER *Timer)
+{
+    WG_PEER *Peer = CONTAINING_RECORD(Timer, WG_PEER, TimerTxRate);
+
+    PacketSendStagedPackets(Peer);
+}
+
 static TIMER_CALLBACK ExpiredSendPersistentKeepalive;
 _Use_decl_annotations_
 static VOID
@@ -324,6 +337,20 @@ TimersAnyAuthenticatedPacketTraversal(WG_PEER *Peer)
         ModPeerTimer(Peer, &Peer->TimerPersistentKeepalive, -SEC_TO_SYS_TIME_UNITS(Peer->PersistentKeepaliveInterval));
 }
 
+/* Should be called when staged packets are held back for lack of tokens, with how long until there are enough. */
+_Use_decl_annotations_
+VOID
+TimersTxRateLimited(WG_PEER *Peer, LONG64 Delay)
+{
+    if (!ReadBooleanNoFence(&Peer->Device->IsUp) || !ExAcquireRundownProtection(&Peer->InUse))
+        return;
+    /* Unlike the others, this one can't be coalesced by much without giving away the rate. */
+    WriteBooleanNoFence(&Peer->TimerTxRate.Pending, TRUE);
+    KeSetCoalescableTimer(
+        &Peer->TimerTxRate.Timer, (LARGE_INTEGER){ .QuadPart = -Delay }, 0, 1, &Peer->TimerTxRate.Dpc);
+    ExReleaseRundownProtection(&Peer->InUse);
+}
+
 _Use_decl_annotations_
 VOID
 TimersInit(WG_PEER *Peer)
@@ -333,6 +360,7 @@ TimersInit(WG_PEER *Peer)
     TimerInit(&Peer->TimerNewHandshake, ExpiredNewHandshake);
     TimerInit(&Peer->TimerZeroKeyMaterial, ExpiredZeroKeyMaterial);
     TimerInit(&Peer->TimerPersistentKeepalive, ExpiredSendPersistentKeepalive);
+    TimerInit(&Peer->TimerTxRate, ExpiredTxRate);
     Peer->TimerHandshakeAttempts = 0;
     Peer->SentLastminuteHandshake = FALSE;
     Peer->TimerNeedAnotherKeepalive = FALSE;
@@ -348,5 +376,6 @@ TimersStop(WG_PEER *Peer)
     TimerDelete(&Peer->TimerNewHandshake);
     TimerDelete(&Peer->TimerZeroKeyMaterial);
     TimerDelete(&Peer->TimerPersistentKeepalive);
+    TimerDelete(&Peer->TimerTxRate);
     KeFlushQueuedDpcs();
 }
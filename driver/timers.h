@@ -49,6 +49,10 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
 TimersAnyAuthenticatedPacketTraversal(_Inout_ WG_PEER *Peer);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+TimersTxRateLimited(_Inout_ WG_PEER *Peer, _In_ LONG64 Delay);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
 TimersInit(_Inout_ WG_PEER *Peer);